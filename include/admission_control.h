@@ -0,0 +1,356 @@
+/**
+ * @file admission_control.h  Overload control for AppServers.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef ADMISSION_CONTROL_H__
+#define ADMISSION_CONTROL_H__
+
+extern "C" {
+#include <pjsip.h>
+}
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <mutex>
+
+#include "appserver_stats.h"
+
+/// The AdmissionControl class decides whether an AppServer should be given
+/// a new request, so that an overloaded service sheds load rather than
+/// slowing down every request that passes through it.  The infrastructure
+/// calls AppServer::admit before get_app_tsx for each initial request, and
+/// acts on the result.
+///
+/// Requests are throttled when either
+///
+/// -  they arrive faster than the configured rate, allowing for bursts, as
+///    measured by a token bucket, or
+/// -  the number of transactions in flight reaches a limit.  The limit is
+///    either fixed, or, if a target latency is configured, adapted to the
+///    measured latency of the service's callbacks: it is cut while the
+///    latency is above the target and raised again while it is below.
+///
+/// The latency and in-flight count are taken from the service's
+/// AppServerStats at most once per update interval, by whichever thread
+/// first calls admit after the interval has passed, so the callbacks pay
+/// nothing extra for them.  Admitting a request costs one atomic
+/// compare-and-swap if a rate is configured, and otherwise just a load.
+///
+/// What happens to a throttled request is set by the policy: it can be sent
+/// on to an alternative next hop, rejected with a 503 Service Unavailable
+/// and a Retry-After header, or passed on down the chain as though the
+/// service had not been triggered.  By default nothing is throttled.
+///
+class AdmissionControl
+{
+public:
+  /// The outcome of admission control for a request.
+  enum Action
+  {
+    /// Pass the request to get_app_tsx.
+    ADMIT,
+
+    /// Do not invoke the service, but route the request to the configured
+    /// shed_next_hop.
+    SHED_TO_NEXT_HOP,
+
+    /// Reject the request with a 503 Service Unavailable, with a
+    /// Retry-After header if retry_after_s is set.
+    REJECT_503,
+
+    /// Do not invoke the service, and continue processing the request as
+    /// though the service had not been triggered.
+    BYPASS
+  };
+
+  /// The admission control settings.
+  struct Config
+  {
+    Config() :
+      rate(0),
+      burst(1),
+      max_in_flight(0),
+      target_latency_us(0),
+      policy(REJECT_503),
+      retry_after_s(0),
+      shed_next_hop(NULL),
+      update_interval_ms(10)
+    {
+    }
+
+    /// The sustained rate of requests to admit, per second, or 0 for no
+    /// limit.
+    double rate;
+
+    /// The number of requests that may be admitted at once above the rate.
+    double burst;
+
+    /// The maximum number of transactions in flight, or 0 for no limit.
+    int64_t max_in_flight;
+
+    /// The mean callback latency to aim for, in microseconds, or 0 to not
+    /// adapt to latency.
+    uint64_t target_latency_us;
+
+    /// What to do with throttled requests.  Must not be ADMIT.
+    Action policy;
+
+    /// The value of the Retry-After header for REJECT_503, or 0 for none.
+    int retry_after_s;
+
+    /// The next hop for SHED_TO_NEXT_HOP.  This is not copied, so must
+    /// outlive the configuration.
+    pjsip_sip_uri* shed_next_hop;
+
+    /// How often to sample the statistics, in milliseconds.
+    uint64_t update_interval_ms;
+  };
+
+  /// Constructor.
+  ///
+  /// @param  stats        - The statistics of the AppServer to control.
+  AdmissionControl(AppServerStats& stats) :
+    _stats(stats),
+    _config(),
+    _enabled(false),
+    _interval_ns(0),
+    _tolerance_ns(0),
+    _tat(0),
+    _overloaded(false),
+    _update_lock(),
+    _next_update_ns(0),
+    _last_calls(0),
+    _last_latency_us(0),
+    _latency_ewma_us(0),
+    _limit(UNLIMITED)
+  {
+  }
+
+  /// Sets the configuration.  This must not be called while other threads
+  /// may be calling admit, so should be called before the service is
+  /// registered.
+  ///
+  /// @param  config       - The configuration.
+  void configure(const Config& config)
+  {
+    _config = config;
+    _enabled = ((config.rate > 0) ||
+                (config.max_in_flight > 0) ||
+                (config.target_latency_us > 0));
+    _interval_ns = (config.rate > 0) ? (uint64_t)(1e9 / config.rate) : 0;
+    _tolerance_ns = (uint64_t)(std::max(config.burst - 1, 0.0) * _interval_ns);
+    _tat.store(0, std::memory_order_relaxed);
+    _overloaded.store(false, std::memory_order_relaxed);
+    _next_update_ns = 0;
+    _latency_ewma_us.store(0, std::memory_order_relaxed);
+    _limit.store((config.max_in_flight > 0) ? config.max_in_flight : UNLIMITED,
+                 std::memory_order_relaxed);
+  }
+
+  /// Returns the configuration.
+  const Config& config() const { return _config; }
+
+  /// Decides whether to admit a request.  This may be called from any
+  /// thread.
+  ///
+  /// @returns             - ADMIT, or the configured policy if the request
+  ///                        is throttled.
+  Action admit()
+  {
+    return _enabled ? admit(now_ns()) : ADMIT;
+  }
+
+  /// As above, at the specified time.
+  ///
+  /// @param  now_ns       - The current time in nanoseconds, from a
+  ///                        monotonic clock.
+  Action admit(uint64_t now_ns)
+  {
+    if (!_enabled)
+    {
+      return ADMIT;
+    }
+
+    if ((_limit.load(std::memory_order_relaxed) != UNLIMITED) ||
+        (_config.target_latency_us > 0))
+    {
+      update(now_ns);
+      if (_overloaded.load(std::memory_order_relaxed))
+      {
+        return throttle();
+      }
+    }
+
+    if ((_interval_ns > 0) && (!take_token(now_ns)))
+    {
+      return throttle();
+    }
+
+    return ADMIT;
+  }
+
+  /// Returns the current limit on transactions in flight, or -1 if there is
+  /// none.  This may be called from any thread.
+  int64_t limit() const
+  {
+    int64_t limit = _limit.load(std::memory_order_relaxed);
+    return (limit != UNLIMITED) ? limit : -1;
+  }
+
+  /// Returns the smoothed mean callback latency, in microseconds, as of the
+  /// last update.  This may be called from any thread.
+  uint64_t latency_us() const
+    {return (uint64_t)_latency_ewma_us.load(std::memory_order_relaxed);}
+
+  /// Returns the time from a monotonic clock, in nanoseconds.
+  static uint64_t now_ns()
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+private:
+  static constexpr int64_t UNLIMITED = std::numeric_limits<int64_t>::max();
+
+  /// The weight of each new latency sample in the moving average.
+  static constexpr double LATENCY_WEIGHT = 0.3;
+
+  /// The factor the in-flight limit is cut by while latency is too high.
+  static constexpr double DECREASE_FACTOR = 0.8;
+
+  Action throttle()
+  {
+    _stats.increment(AppServerStats::THROTTLED);
+    return _config.policy;
+  }
+
+  /// Takes a token from the bucket, which is kept as the theoretical arrival
+  /// time of the next request (the generic cell rate algorithm).
+  bool take_token(uint64_t now_ns)
+  {
+    uint64_t tat = _tat.load(std::memory_order_relaxed);
+
+    while (true)
+    {
+      uint64_t base = std::max(tat, now_ns);
+      if (base - now_ns > _tolerance_ns)
+      {
+        return false;
+      }
+
+      if (_tat.compare_exchange_weak(tat,
+                                     base + _interval_ns,
+                                     std::memory_order_relaxed))
+      {
+        return true;
+      }
+    }
+  }
+
+  /// Samples the statistics, if the update interval has passed and no
+  /// other thread is already doing so, and updates whether the service is
+  /// overloaded.
+  void update(uint64_t now_ns)
+  {
+    std::unique_lock<std::mutex> lock(_update_lock, std::try_to_lock);
+    if ((!lock.owns_lock()) || (now_ns < _next_update_ns))
+    {
+      return;
+    }
+
+    _next_update_ns = now_ns + _config.update_interval_ms * 1000000;
+    AppServerStats::Snapshot snap = _stats.snapshot();
+
+    if (_config.target_latency_us > 0)
+    {
+      uint64_t calls = 0;
+      uint64_t latency_us = 0;
+      for (int ii = 0; ii < AppServerStats::NUM_CALLBACKS; ++ii)
+      {
+        calls += snap.calls[ii];
+        latency_us += snap.total_latency_us[ii];
+      }
+
+      if (calls > _last_calls)
+      {
+        double sample = (double)(latency_us - _last_latency_us) / (calls - _last_calls);
+        double ewma = _latency_ewma_us.load(std::memory_order_relaxed);
+        ewma = (ewma == 0) ?
+                 sample :
+                 ((1 - LATENCY_WEIGHT) * ewma) + (LATENCY_WEIGHT * sample);
+        _latency_ewma_us.store(ewma, std::memory_order_relaxed);
+      }
+      _last_calls = calls;
+      _last_latency_us = latency_us;
+
+      adapt_limit(snap.live_tsxs);
+    }
+
+    _overloaded.store((snap.live_tsxs >= _limit.load(std::memory_order_relaxed)),
+                      std::memory_order_relaxed);
+  }
+
+  /// Cuts the in-flight limit while the latency is above the target, and
+  /// raises it again, by a step proportional to its size, while the latency
+  /// is below the target, up to any configured maximum.
+  void adapt_limit(int64_t in_flight)
+  {
+    int64_t limit = _limit.load(std::memory_order_relaxed);
+
+    if (_latency_ewma_us.load(std::memory_order_relaxed) > _config.target_latency_us)
+    {
+      int64_t current = std::min(limit, std::max(in_flight, (int64_t)1));
+      limit = std::max((int64_t)(current * DECREASE_FACTOR), (int64_t)1);
+    }
+    else if (limit != UNLIMITED)
+    {
+      limit += 1 + (limit / 16);
+      if ((_config.max_in_flight > 0) && (limit >= _config.max_in_flight))
+      {
+        limit = _config.max_in_flight;
+      }
+      else if ((_config.max_in_flight == 0) && (limit > in_flight * 2 + 16))
+      {
+        // The limit is well clear of the load, so lift it altogether.
+        limit = UNLIMITED;
+      }
+    }
+
+    _limit.store(limit, std::memory_order_relaxed);
+  }
+
+  AppServerStats& _stats;
+  Config _config;
+  bool _enabled;
+
+  /// The token bucket.
+  uint64_t _interval_ns;
+  uint64_t _tolerance_ns;
+  std::atomic<uint64_t> _tat;
+
+  /// Set by update, and read by every call to admit.
+  std::atomic<bool> _overloaded;
+
+  /// The state of the sampling, which is only used with the lock held.
+  std::mutex _update_lock;
+  uint64_t _next_update_ns;
+  uint64_t _last_calls;
+  uint64_t _last_latency_us;
+
+  /// The results of the sampling, which are only written with the lock
+  /// held, but are read by admit and the diagnostics on any thread.
+  std::atomic<double> _latency_ewma_us;
+  std::atomic<int64_t> _limit;
+};
+
+#endif
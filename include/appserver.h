@@ -19,19 +19,266 @@ extern "C" {
 #include <stdint.h>
 }
 
+#include <atomic>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
 #include "sas.h"
+#include "appserver_stats.h"
+#include "admission_control.h"
+#include "sas_event_buffer.h"
+#include "body_view.h"
+#include "dialog_id.h"
+#include "request_template.h"
+#include "tsx_scratch.h"
 
 class ServiceTsxHelper;
 class AppServerTsxHelper;
 class AppServer;
 class AppServerTsx;
 class SproutletHelper;
+class AppServerWorkerContext;
 
 
 /// Typedefs for AppServer-specific elements
 typedef intptr_t TimerID;
 
 
+/// The LazyMsgClone class implements copy-on-write cloning of SIP messages.
+///
+/// A lazy clone is a new pjsip_msg whose header list is built from shallow
+/// copies of the source headers.  Each header structure belongs to the clone,
+/// so headers can be added, removed, reordered or have fields reassigned
+/// without affecting the source.  Everything the headers point at (URIs,
+/// strings, parameter values) and the message body are shared with the source
+/// until explicitly made writable through one of the writable_* methods, which
+/// deep-copy only the object being modified into the clone's pool.
+///
+/// This makes forking cheap: a fork that only changes the Request-URI costs
+/// one message structure plus one small structure per header, rather than a
+/// full copy of every header, URI and body.
+///
+/// The source message must not be modified in place, and its memory must
+/// not be released, while any lazy clone of it is still in use.  A helper
+/// that implements AppServerTsxHelper::lazy_clone_request with this class
+/// must therefore keep the source's memory alive when the service frees the
+/// source, until every clone of it has been freed.
+///
+class LazyMsgClone
+{
+public:
+  /// Creates a lazy clone of a message.
+  ///
+  /// @returns             - The cloned message.
+  /// @param  pool         - The pool to allocate the clone from.
+  /// @param  src          - The message to clone.
+  static pjsip_msg* clone(pj_pool_t* pool, const pjsip_msg* src)
+  {
+    pjsip_msg* dst = pjsip_msg_create(pool, src->type);
+    dst->line = src->line;
+
+    for (const pjsip_hdr* hdr = src->hdr.next;
+         hdr != &src->hdr;
+         hdr = hdr->next)
+    {
+      pjsip_msg_add_hdr(dst, (pjsip_hdr*)pjsip_hdr_shallow_clone(pool, hdr));
+    }
+
+    dst->body = src->body;
+    return dst;
+  }
+
+  /// Replaces a (possibly shared) header in a message with a deep copy which
+  /// can safely be modified in place.
+  ///
+  /// @returns             - The writable copy of the header, which has taken
+  ///                        the place of the original in the header list.
+  /// @param  pool         - The pool of the message containing the header.
+  /// @param  hdr          - The header to make writable.
+  template <class H>
+  static H* writable_hdr(pj_pool_t* pool, H* hdr)
+  {
+    H* copy = (H*)pjsip_hdr_clone(pool, hdr);
+    pj_list_insert_before(hdr, copy);
+    pj_list_erase(hdr);
+    return copy;
+  }
+
+  /// Replaces the (possibly shared) Request-URI of a request with a deep copy
+  /// which can safely be modified in place.  Services that simply assign a
+  /// new URI to the request line do not need to call this.
+  ///
+  /// @returns             - The writable Request-URI.
+  /// @param  pool         - The pool of the message.
+  /// @param  msg          - The request.
+  static pjsip_uri* writable_req_uri(pj_pool_t* pool, pjsip_msg* msg)
+  {
+    msg->line.req.uri = (pjsip_uri*)pjsip_uri_clone(pool, msg->line.req.uri);
+    return msg->line.req.uri;
+  }
+
+  /// Replaces the (possibly shared) body of a message with a deep copy which
+  /// can safely be modified in place.
+  ///
+  /// @returns             - The writable body, or NULL if the message has no
+  ///                        body.
+  /// @param  pool         - The pool of the message.
+  /// @param  msg          - The message.
+  static pjsip_msg_body* writable_body(pj_pool_t* pool, pjsip_msg* msg)
+  {
+    if (msg->body != NULL)
+    {
+      pjsip_msg_body* body = PJ_POOL_ZALLOC_T(pool, pjsip_msg_body);
+      pjsip_msg_body_clone(pool, body, msg->body);
+      msg->body = body;
+    }
+    return msg->body;
+  }
+};
+
+
+/// Describes one downstream fork of a request sent with send_requests.
+struct ForkTarget
+{
+  ForkTarget(pjsip_uri* req_uri = NULL) : req_uri(req_uri), hdrs() {}
+
+  /// The Request-URI for this fork, or NULL to keep the Request-URI of the
+  /// base request.
+  pjsip_uri* req_uri;
+
+  /// Additional headers to add to this fork.  These are not consumed, so the
+  /// same header may be listed for several forks.
+  std::vector<pjsip_hdr*> hdrs;
+};
+
+
+/// The AsyncResumer class is implemented by the service infrastructure to
+/// resume a suspended transaction.  See AppServerTsxHelper::suspend.
+class AsyncResumer
+{
+public:
+  /// Virtual destructor.
+  virtual ~AsyncResumer() {}
+
+  /// Arranges for AppServerTsx::on_resume to be called with the specified
+  /// context on the transaction's thread.  This may be called from any
+  /// thread, but only the first call for each suspension has any effect.
+  ///
+  /// @returns             - false if the transaction has already been
+  ///                        resumed, or has been cancelled or destroyed.
+  /// @param  context      - Context parameter passed to on_resume.
+  virtual bool resume(void* context) = 0;
+};
+
+
+/// The AsyncHandle class is the handle for a suspended transaction, returned
+/// by AppServerTsxHelper::suspend.  It can be copied and passed to other
+/// threads, for example into the completion callback of a lookup, and stays
+/// safe to use after the transaction ends.
+class AsyncHandle
+{
+public:
+  AsyncHandle() : _resumer() {}
+  explicit AsyncHandle(const std::shared_ptr<AsyncResumer>& resumer) :
+    _resumer(resumer) {}
+
+  /// Returns true if the transaction was suspended.
+  bool valid() const { return (bool)_resumer; }
+
+  /// Resumes the transaction.  See AsyncResumer::resume.
+  bool resume(void* context = NULL)
+    {return valid() && _resumer->resume(context);}
+
+private:
+  std::shared_ptr<AsyncResumer> _resumer;
+};
+
+
+/// The MsgHandle class owns a message belonging to an AppServerTsx.  It is
+/// move-only, so ownership is transferred explicitly, for example
+///
+///   MsgHandle req = own(raw_req);
+///   MsgHandle fork = lazy_clone_request(req);
+///   ...
+///   send_request(std::move(fork));
+///
+/// and a message can only be sent or freed through the one handle that owns
+/// it.  A handle that still owns a message when it is destroyed frees it, so
+/// services need not remember to free the original request after forking.
+/// Messages freed this way are counted as FREE_MSG calls in the statistics
+/// of handles created by an AppServerTsx, in the same way as explicit calls
+/// to free_msg.  Handles must not outlive the transaction.
+///
+class MsgHandle
+{
+public:
+  MsgHandle() : _helper(NULL), _msg(NULL), _stats(NULL) {}
+
+  /// Takes ownership of a message.
+  ///
+  /// @param  helper       - The helper of the transaction owning the message.
+  /// @param  msg          - The message.
+  /// @param  stats        - The statistics to count the message being freed
+  ///                        in, or NULL.
+  MsgHandle(AppServerTsxHelper* helper,
+            pjsip_msg* msg,
+            AppServerStats* stats = NULL) :
+    _helper(helper), _msg(msg), _stats(stats) {}
+
+  MsgHandle(MsgHandle&& other) noexcept :
+    _helper(other._helper), _msg(other._msg), _stats(other._stats)
+  {
+    other._msg = NULL;
+  }
+
+  MsgHandle& operator=(MsgHandle&& other) noexcept
+  {
+    if (this != &other)
+    {
+      reset();
+      _helper = other._helper;
+      _msg = other._msg;
+      _stats = other._stats;
+      other._msg = NULL;
+    }
+    return *this;
+  }
+
+  ~MsgHandle() { reset(); }
+
+  /// Returns the message, which is still owned by the handle.
+  pjsip_msg* get() const { return _msg; }
+  pjsip_msg* operator->() const { return _msg; }
+
+  /// Returns true if the handle owns a message.
+  explicit operator bool() const { return (_msg != NULL); }
+
+  /// Gives up ownership of the message without freeing it.
+  ///
+  /// @returns             - The message, which the caller now owns.
+  pjsip_msg* release()
+  {
+    pjsip_msg* msg = _msg;
+    _msg = NULL;
+    return msg;
+  }
+
+  /// Frees the message, if the handle owns one.
+  inline void reset();
+
+private:
+  MsgHandle(const MsgHandle&) = delete;
+  MsgHandle& operator=(const MsgHandle&) = delete;
+
+  AppServerTsxHelper* _helper;
+  pjsip_msg* _msg;
+  AppServerStats* _stats;
+};
+
+
 /// The AppServerTsxHelper class handles the underlying service-related
 /// processing of a single transaction for an AppServer.  Once a service has
 /// been triggered as part of handling a transaction, the related
@@ -45,8 +292,15 @@ typedef intptr_t TimerID;
 class AppServerTsxHelper
 {
 public:
-  /// Virtual destructor.
-  virtual ~AppServerTsxHelper() {}
+  /// Virtual destructor.  Drops the reference to any dialog identifier
+  /// cached by the default dialog_handle.
+  virtual ~AppServerTsxHelper()
+  {
+    if (_interned_dialog.valid())
+    {
+      DialogIdTable::instance().release(_interned_dialog);
+    }
+  }
 
   /// Returns a mutable clone of the original request.  This can be modified
   /// and sent by the application using the send_request call.
@@ -55,6 +309,21 @@ public:
   ///
   virtual pjsip_msg* original_request() = 0;
 
+  /// Creates a new request from a template, for services that originate
+  /// requests, without parsing any text (see RequestTemplate).  The request
+  /// can be modified and sent with send_request, or freed with free_msg.
+  ///
+  /// Implementations should create an empty message in a new pool, as they
+  /// do for create_response, and fill it in with RequestTemplate::instantiate,
+  /// so that no headers are copied that the template then replaces.
+  ///
+  /// @returns             - The new request message.
+  /// @param  tmpl         - The template.  This must outlive the request.
+  /// @param  values       - The values of the template's slots.
+  ///
+  virtual pjsip_msg* create_request(const RequestTemplate& tmpl,
+                                    const RequestTemplate::Values& values) = 0;
+
   /// Returns the top Route header from the original incoming request.  This
   /// can be inpsected by the app server, but should not be modified.  Note that
   /// this Route header is removed from the request passed to the app server on
@@ -81,6 +350,62 @@ public:
   ///                        or by an earlier transaction in the same dialog.
   virtual const std::string& dialog_id() const = 0;
 
+  /// Adds the service to the underlying SIP dialog with an interned dialog
+  /// identifier (see DialogIdTable).  The caller keeps its reference to the
+  /// identifier.  This has a distinct name, rather than overloading
+  /// add_to_dialog, so that implementations overriding one do not hide the
+  /// other.
+  ///
+  /// The default implementation calls add_to_dialog with the identifier's
+  /// string, and caches the handle for dialog_handle.
+  ///
+  /// @param  dialog_id    - The interned dialog identifier.
+  ///
+  virtual void add_to_dialog_handle(DialogId dialog_id)
+  {
+    DialogIdTable& table = DialogIdTable::instance();
+    add_to_dialog(table.str(dialog_id));
+
+    if ((dialog_id != _interned_dialog) && (table.add_ref(dialog_id)))
+    {
+      if (_interned_dialog.valid())
+      {
+        table.release(_interned_dialog);
+      }
+      _interned_dialog = dialog_id;
+    }
+  }
+
+  /// Returns the interned dialog identifier for this service.  Comparing and
+  /// hashing the returned handle is O(1), so services should prefer it to
+  /// dialog_id for keying per-dialog state.
+  ///
+  /// The default implementation returns the handle cached by
+  /// add_to_dialog_handle.  If there is none, for example because the
+  /// service joined the dialog with add_to_dialog or in an earlier
+  /// transaction, it interns dialog_id the first time that is set, and
+  /// caches the result for the life of the helper.  A service only joins
+  /// one dialog, so the cached handle is not checked against dialog_id
+  /// again.  Implementations that intern identifiers themselves when the
+  /// service joins the dialog should override it.
+  ///
+  /// @returns             - The interned dialog identifier, or an invalid
+  ///                        DialogId if the service has not been added to a
+  ///                        dialog.
+  virtual DialogId dialog_handle() const
+  {
+    if (!_interned_dialog.valid())
+    {
+      const std::string& id = dialog_id();
+      if (!id.empty())
+      {
+        _interned_dialog = DialogIdTable::instance().intern(id);
+      }
+    }
+
+    return _interned_dialog;
+  }
+
   /// Clones the request.  This is typically used when forking a request if
   /// different request modifications are required on each fork or for storing
   /// off to handle late forking.
@@ -89,6 +414,25 @@ public:
   /// @param  req          - The request message to clone.
   virtual pjsip_msg* clone_request(pjsip_msg* req) = 0;
 
+  /// Clones the request lazily, sharing headers and body with the original
+  /// request on a copy-on-write basis (see LazyMsgClone).  This is the
+  /// preferred way to fork a request when each fork only differs in its
+  /// Request-URI or a small number of headers.  The service may free the
+  /// original request as usual once all forks have been sent, so an
+  /// implementation that shares memory with the original must keep that
+  /// memory alive until all the clones have been freed.  The service must
+  /// not modify the original request once it has been cloned.
+  ///
+  /// The default implementation falls back to a full clone_request, so
+  /// implementations that cannot track shared memory remain correct.
+  /// clone_request itself still makes a full copy, as existing services may
+  /// modify shared parts of the clone in place.
+  ///
+  /// @returns             - The cloned request message.
+  /// @param  req          - The request message to clone.
+  virtual pjsip_msg* lazy_clone_request(pjsip_msg* req)
+    {return clone_request(req);}
+
   /// Clones the message.  This is typically used when we want to keep a
   /// message after calling a mutative method on it.
   ///
@@ -116,6 +460,28 @@ public:
   /// @param reason        - Human-readable reason string.  For diagnostics only.
   virtual void cancel_fork(int fork_id, int st_code = 0, std::string reason = "") = 0;
 
+  /// Cancels a set of forked INVITE requests in a single call, for example
+  /// all the forks that lost to a 2xx response.  This allows the
+  /// infrastructure to send all the CANCEL requests together.
+  ///
+  /// The default implementation calls cancel_fork for each fork in turn.
+  ///
+  /// @param fork_ids      - The identifiers of the forks to CANCEL.
+  /// @param st_code       - SIP status code added in Reason header to the
+  ///                        CANCEL requests (0 means no Reason header is added).
+  /// @param reason        - Human-readable reason string.  For diagnostics only.
+  virtual void cancel_forks(const std::vector<int>& fork_ids,
+                            int st_code = 0,
+                            const std::string& reason = "")
+  {
+    for (std::vector<int>::const_iterator ii = fork_ids.begin();
+         ii != fork_ids.end();
+         ++ii)
+    {
+      cancel_fork(*ii, st_code, reason);
+    }
+  }
+
   /// Indicate that the request should be forwarded following standard routing
   /// rules.  Note that, even if other Route headers are added by this AS, the
   /// request will be routed back to the S-CSCF that sent the request in the
@@ -133,6 +499,68 @@ public:
   /// @param  req          - The request message to use for forwarding.
   virtual int send_request(pjsip_msg*& req) = 0;
 
+  /// As send_request, but consuming the request through a MsgHandle.  The
+  /// default implementation calls send_request; implementations may override
+  /// it, for example to reuse the consumed message's memory.  It has a
+  /// distinct name so that overriding one does not hide the other.
+  ///
+  /// @returns             - The ID of this forwarded request
+  /// @param  req          - The request message to use for forwarding.
+  virtual int send_request_handle(MsgHandle&& req)
+  {
+    pjsip_msg* msg = req.release();
+    return send_request(msg);
+  }
+
+  /// Forks a request to a set of targets in a single call.  Each fork is a
+  /// lazy clone of the base request with the target's Request-URI and
+  /// additional headers applied.  The base request is consumed.  This allows
+  /// the infrastructure to set up all the downstream legs together rather
+  /// than one at a time.
+  ///
+  /// URIs and headers in the targets should be allocated from the pool of
+  /// the base request.
+  ///
+  /// This function may be called wherever send_request may be called.
+  ///
+  /// The default implementation clones, modifies and sends each fork in turn
+  /// using lazy_clone_request and send_request, then frees the base request.
+  ///
+  /// @param  req          - The base request message.
+  /// @param  targets      - The targets to fork the request to.
+  /// @param  fork_ids     - The IDs of the forked requests are appended to
+  ///                        this vector, in the same order as the targets.
+  virtual void send_requests(pjsip_msg*& req,
+                             const std::vector<ForkTarget>& targets,
+                             std::vector<int>& fork_ids)
+  {
+    fork_ids.reserve(fork_ids.size() + targets.size());
+
+    for (std::vector<ForkTarget>::const_iterator target = targets.begin();
+         target != targets.end();
+         ++target)
+    {
+      pjsip_msg* fork = lazy_clone_request(req);
+      pj_pool_t* pool = get_pool(fork);
+
+      if (target->req_uri != NULL)
+      {
+        fork->line.req.uri = (pjsip_uri*)pjsip_uri_clone(pool, target->req_uri);
+      }
+
+      for (std::vector<pjsip_hdr*>::const_iterator hdr = target->hdrs.begin();
+           hdr != target->hdrs.end();
+           ++hdr)
+      {
+        pjsip_msg_add_hdr(fork, (pjsip_hdr*)pjsip_hdr_clone(pool, *hdr));
+      }
+
+      fork_ids.push_back(send_request(fork));
+    }
+
+    free_msg(req);
+  }
+
   /// Indicate that the response should be forwarded following standard routing
   /// rules.  Note that, if this service created multiple forks, the responses
   /// will be aggregated before being sent downstream.
@@ -142,6 +570,72 @@ public:
   /// @param  rsp          - The response message to use for forwarding.
   virtual void send_response(pjsip_msg*& rsp) = 0;
 
+  /// As send_response, but consuming the response through a MsgHandle.  The
+  /// default implementation calls send_response.
+  ///
+  /// @param  rsp          - The response message to use for forwarding.
+  virtual void send_response_handle(MsgHandle&& rsp)
+  {
+    pjsip_msg* msg = rsp.release();
+    send_response(msg);
+  }
+
+  /// Rejects a request with a final response, consuming the request.  This
+  /// is equivalent to create_response, send_response and free_msg, but lets
+  /// the infrastructure build the response directly from the request's
+  /// headers as it sends it, without creating a response message.
+  ///
+  /// This function may be called wherever send_response may be called with
+  /// a final response to the request.
+  ///
+  /// The default implementation calls create_response, send_response and
+  /// free_msg.
+  ///
+  /// @param  req          - The request to reject.
+  /// @param  status_code  - The SIP status code for the response.
+  /// @param  status_text  - The text part of the status line.
+  virtual void reject(pjsip_msg*& req,
+                      pjsip_status_code status_code,
+                      const std::string& status_text="")
+  {
+    pjsip_msg* rsp = create_response(req, status_code, status_text);
+    send_response(rsp);
+    free_msg(req);
+  }
+
+  /// Redirects a request with a 3xx response listing the specified
+  /// contacts, consuming the request.  As for reject, the infrastructure may
+  /// build the response directly from the request's headers.
+  ///
+  /// The default implementation calls create_response, adds a Contact header
+  /// for each contact, then calls send_response and free_msg.
+  ///
+  /// @param  req          - The request to redirect.
+  /// @param  status_code  - The SIP status code for the response, normally
+  ///                        302 Moved Temporarily.
+  /// @param  contacts     - The URIs to redirect to, in order of preference.
+  /// @param  status_text  - The text part of the status line.
+  virtual void redirect(pjsip_msg*& req,
+                        pjsip_status_code status_code,
+                        const std::vector<pjsip_uri*>& contacts,
+                        const std::string& status_text="")
+  {
+    pjsip_msg* rsp = create_response(req, status_code, status_text);
+    pj_pool_t* pool = get_pool(rsp);
+
+    for (std::vector<pjsip_uri*>::const_iterator uri = contacts.begin();
+         uri != contacts.end();
+         ++uri)
+    {
+      pjsip_contact_hdr* contact = pjsip_contact_hdr_create(pool);
+      contact->uri = (pjsip_uri*)pjsip_uri_clone(pool, *uri);
+      pjsip_msg_add_hdr(rsp, (pjsip_hdr*)contact);
+    }
+
+    send_response(rsp);
+    free_msg(req);
+  }
+
   /// Frees the specified message.  Received responses or messages that have
   /// been cloned with add_target are owned by the AppServerTsx.  It must
   /// call into ServiceTsx either to send them on or to free them (via this
@@ -150,6 +644,19 @@ public:
   /// @param  msg          - The message to free.
   virtual void free_msg(pjsip_msg*& msg) = 0;
 
+  /// As free_msg, but consuming the message through a MsgHandle.  The
+  /// default implementation calls free_msg.
+  ///
+  /// @param  msg          - The message to free.
+  virtual void free_msg_handle(MsgHandle&& msg)
+  {
+    pjsip_msg* raw = msg.release();
+    if (raw != NULL)
+    {
+      free_msg(raw);
+    }
+  }
+
   /// Returns the pool corresponding to a message.  This pool can then be used
   /// to allocate further headers or bodies to add to the message.
   ///
@@ -185,9 +692,82 @@ public:
   /// related to this service invocation.
   virtual SAS::TrailId trail() const = 0;
 
+  /// Suspends the transaction so that the AppServerTsx can finish handling
+  /// the current callback asynchronously, for example after a lookup in a
+  /// remote database, without blocking the worker thread.
+  ///
+  /// Once suspended, the AppServerTsx may return from the callback without
+  /// sending a request or response.  When the asynchronous work completes,
+  /// it calls resume on the returned handle, and the infrastructure then
+  /// calls on_resume on the transaction's thread, which must do whatever the
+  /// original callback would have had to.  If the transaction is cancelled
+  /// while suspended, on_cancel is called instead and resume has no effect.
+  ///
+  /// The default implementation does not support suspending transactions.
+  ///
+  /// @returns             - A handle to resume the transaction, or an
+  ///                        invalid handle if the transaction cannot be
+  ///                        suspended, in which case the AppServerTsx must
+  ///                        finish handling the callback synchronously.
+  virtual AsyncHandle suspend()
+    {return AsyncHandle();}
+
 protected:
   /// Constructor
-  AppServerTsxHelper() {};
+  AppServerTsxHelper() : _interned_dialog() {};
+
+private:
+  /// The dialog identifier cached by the default add_to_dialog_handle and
+  /// dialog_handle, on which the helper holds a reference.
+  mutable DialogId _interned_dialog;
+};
+
+
+inline void MsgHandle::reset()
+{
+  if (_msg != NULL)
+  {
+    pjsip_msg* msg = _msg;
+    _msg = NULL;
+    if (_stats != NULL)
+    {
+      _stats->increment(AppServerStats::FREE_MSG);
+    }
+    _helper->free_msg(msg);
+  }
+}
+
+
+/// The AppServerInstrumentation struct holds the hot path statistics,
+/// overload control and SAS settings of an AppServer.  Each AppServer
+/// creates one the first time any of them is used (see AppServer::stats), so
+/// services that never use them do not pay for the statistics' shards.
+/// AppServers that make up one service can share one instance (see
+/// AppServer::share_instrumentation).
+///
+struct AppServerInstrumentation
+{
+  AppServerInstrumentation() :
+    stats(), admission(stats), sas_config(), _users(1) {}
+
+  /// Hot path statistics for the service.
+  AppServerStats stats;
+
+  /// Overload control for the service, fed by stats.
+  AdmissionControl admission;
+
+  /// Settings for the service's transactions' SAS event buffers.
+  SasEventBuffer::Config sas_config;
+
+private:
+  AppServerInstrumentation(const AppServerInstrumentation&);
+  AppServerInstrumentation& operator=(const AppServerInstrumentation&);
+
+  friend class AppServer;
+
+  /// The number of AppServers using this instance.  The last to be
+  /// destroyed deletes it.
+  std::atomic<int> _users;
 };
 
 
@@ -202,11 +782,24 @@ protected:
 /// -  a request is received for a dialog where the service previously called
 ///    add_to_dialog.
 ///
+/// Threading: get_app_tsx may be called on any worker thread, concurrently
+/// with other calls to get_app_tsx and with the callbacks of any
+/// transactions.  Any state in the AppServer that get_app_tsx or the
+/// transactions use must therefore either be read-only once the AppServer
+/// is constructed, or be per-worker, held in an AppServerLocal and found
+/// through the AppServerWorkerContext of the calling thread, or else be
+/// protected by the service's own locks.  Per-worker state needs no locks
+/// and does not bounce cache lines between cores, so is preferred for
+/// anything updated on every request, such as counters and caches.
+///
 class AppServer
 {
 public:
   /// Virtual destructor.
-  virtual ~AppServer() {}
+  virtual ~AppServer()
+  {
+    release_instrumentation(_instrumentation.load(std::memory_order_acquire));
+  }
 
   /// Called when the system determines the service should be invoked for a
   /// received request.  The AppServer can either return NULL indicating it
@@ -225,18 +818,132 @@ public:
                                     pj_pool_t* pool,
                                     SAS::TrailId trail) = 0;
 
+  /// As get_app_tsx, but also passed the context of the worker thread
+  /// making the call.  The infrastructure always calls this version, which
+  /// by default calls get_app_tsx.  Services that keep per-worker state
+  /// should override this version, and implement get_app_tsx by calling it
+  /// with AppServerWorkerContext::current().  It has a distinct name, rather
+  /// than overloading get_app_tsx, so that services overriding one do not
+  /// hide the other.
+  ///
+  /// @param  worker        - The context of the calling worker thread.  This
+  ///                         must only be used during the call, as the
+  ///                         transaction's callbacks may run on other
+  ///                         workers.
+  virtual AppServerTsx* get_app_tsx_on_worker(SproutletHelper* helper,
+                                              pjsip_msg* req,
+                                              pjsip_sip_uri*& next_hop,
+                                              pj_pool_t* pool,
+                                              SAS::TrailId trail,
+                                              AppServerWorkerContext& worker)
+  {
+    return get_app_tsx(helper, req, next_hop, pool, trail);
+  }
+
   /// Returns the name of this service.
   const std::string service_name() { return _service_name; }
 
+  /// Returns the hot path statistics for this service.  The infrastructure
+  /// passes these to each AppServerTsx the service creates (see
+  /// AppServerTsx::set_stats) and times its callbacks into them.
+  AppServerStats& stats() { return instrumentation().stats; }
+
+  /// Returns the admission control for this service, for example to
+  /// configure it when the service is created.
+  AdmissionControl& admission() { return instrumentation().admission; }
+
+  /// Decides whether the service should be given an initial request.  The
+  /// infrastructure calls this before get_app_tsx, which it only calls if
+  /// this returns ADMIT.  Otherwise, as set by the admission control's
+  /// policy, it
+  ///
+  /// -  SHED_TO_NEXT_HOP: routes the request to the configured shed_next_hop,
+  ///    as though get_app_tsx had returned NULL with that next hop,
+  /// -  REJECT_503: rejects the request with a 503 Service Unavailable, with
+  ///    a Retry-After header if retry_after_s is set, or
+  /// -  BYPASS: continues as though get_app_tsx had returned NULL.
+  ///
+  /// In-dialog requests are always admitted, so that calls in progress are
+  /// not broken by overload.
+  ///
+  /// @returns             - The action to take.
+  AdmissionControl::Action admit() { return admission().admit(); }
+
+  /// Returns the settings for the SAS event buffers of this service's
+  /// transactions, for example to sample DETAIL events.  The infrastructure
+  /// passes these to each AppServerTsx the service creates (see
+  /// AppServerTsx::set_sas_config).  They must not be changed while
+  /// transactions may be using them.
+  SasEventBuffer::Config& sas_config() { return instrumentation().sas_config; }
+
+  /// Returns the statistics, admission control and SAS settings of this
+  /// service, creating them on first use.  This may be called from any
+  /// thread.
+  AppServerInstrumentation& instrumentation()
+  {
+    AppServerInstrumentation* inst =
+                              _instrumentation.load(std::memory_order_acquire);
+    if (inst == NULL)
+    {
+      // Another thread may get here at the same time, in which case only one
+      // of the new instances is kept.
+      AppServerInstrumentation* created = new AppServerInstrumentation();
+      if (_instrumentation.compare_exchange_strong(inst,
+                                                   created,
+                                                   std::memory_order_acq_rel,
+                                                   std::memory_order_acquire))
+      {
+        inst = created;
+      }
+      else
+      {
+        delete created;
+      }
+    }
+    return *inst;
+  }
+
+  /// Makes this service use the statistics, admission control and SAS
+  /// settings of another, so that both are counted and controlled together,
+  /// for example for replicas of one service (see ShardedAppServer).  Any
+  /// this service had before are discarded.  This must be called before the
+  /// service is given any requests.
+  ///
+  /// @param  owner        - The service whose instrumentation to use.  The
+  ///                        instrumentation lasts until both services are
+  ///                        destroyed.
+  void share_instrumentation(AppServer& owner)
+  {
+    AppServerInstrumentation* inst = &owner.instrumentation();
+    inst->_users.fetch_add(1, std::memory_order_relaxed);
+    release_instrumentation(_instrumentation.exchange(inst,
+                                                      std::memory_order_acq_rel));
+  }
+
 protected:
   /// Constructor.
   AppServer(const std::string& service_name) :
-    _service_name(service_name) {}
+    _service_name(service_name),
+    _instrumentation(NULL) {}
 
 private:
+  /// Drops a reference to some instrumentation, deleting it if it was the
+  /// last.
+  static void release_instrumentation(AppServerInstrumentation* inst)
+  {
+    if ((inst != NULL) &&
+        (inst->_users.fetch_sub(1, std::memory_order_acq_rel) == 1))
+    {
+      delete inst;
+    }
+  }
+
   /// The name of this service.
   const std::string _service_name;
 
+  /// Statistics, admission control and SAS settings, created on first use.
+  std::atomic<AppServerInstrumentation*> _instrumentation;
+
 };
 
 
@@ -245,20 +952,71 @@ private:
 /// encapsulates an AppServerTsxHelper, which it calls through to to perform
 /// the underlying service-related processing.
 ///
+/// Threading: the callbacks of a transaction are serialized.  The
+/// infrastructure never calls into an AppServerTsx from two threads at once,
+/// and each callback sees everything done by the ones before, so its members
+/// need no locks.  Successive callbacks may run on different worker threads,
+/// so per-worker state must be looked up afresh in each callback (see
+/// AppServerLocal::get) rather than kept in the transaction.  The helper may
+/// only be used from within the transaction's callbacks; the only part of
+/// the interface that may be used from other threads is the AsyncHandle
+/// returned by suspend.
+///
 class AppServerTsx
 {
 public:
   /// Constructor.
-  AppServerTsx() : _helper(NULL) {}
+  AppServerTsx() :
+    _helper(NULL),
+    _resources()
+  {
+  }
 
-  /// Virtual destructor.
-  virtual ~AppServerTsx() {}
+  /// Virtual destructor.  Reports any SAS events the transaction has logged.
+  virtual ~AppServerTsx()
+  {
+    if (_resources != NULL)
+    {
+      _resources->sas_events.reset();
+
+      AppServerStats* stats = _resources->stats;
+      if (stats != NULL)
+      {
+        size_t high_water = _resources->scratch.high_water();
+        if (high_water > 0)
+        {
+          stats->record_scratch(high_water);
+        }
+        stats->tsx_destroyed();
+      }
+    }
+  }
 
   /// Set the AppServerTsxHelper on the AppServerTsx.
   ///
   /// @param  helper       - The app server helper.
   void set_helper(AppServerTsxHelper* helper) { _helper = helper; }
 
+  /// Set the statistics that this transaction's calls into the helper are
+  /// counted in, and counts the transaction as live until it is destroyed.
+  /// This may only be called once.
+  ///
+  /// @param  stats        - The statistics of the AppServer that created the
+  ///                        transaction.
+  void set_stats(AppServerStats* stats)
+  {
+    resources().stats = stats;
+    stats->tsx_created();
+  }
+
+  /// Set the settings for this transaction's SAS event buffer.  If this is
+  /// not called, the defaults are used.
+  ///
+  /// @param  config       - The settings of the AppServer that created the
+  ///                        transaction.
+  void set_sas_config(const SasEventBuffer::Config* config)
+    { resources().sas_config = config; }
+
   /// Called for an initial request (dialog-initiating or out-of-dialog) with
   /// the original received request for the transaction.
   ///
@@ -317,6 +1075,17 @@ public:
   ///                        was scheduled.
   virtual void on_timer_expiry(void* context) {}
 
+  /// Called on the transaction's thread when a transaction suspended with
+  /// suspend is resumed.
+  ///
+  /// During this function, the implementation must do whatever the callback
+  /// that suspended the transaction would have had to, for example send a
+  /// request or final response for a suspended on_initial_request.  It may
+  /// also suspend the transaction again.
+  ///
+  /// @param  context      - The context parameter passed to resume.
+  virtual void on_resume(void* context) {}
+
 protected:
   /// Returns a mutable clone of the original request.  This can be modified
   /// and sent by the application using the send_request call.
@@ -326,6 +1095,15 @@ protected:
   pjsip_msg* original_request()
     {return _helper->original_request();}
 
+  /// Creates a new request from a template.
+  ///
+  /// @returns             - The new request message.
+  /// @param  tmpl         - The template.  This must outlive the request.
+  /// @param  values       - The values of the template's slots.
+  pjsip_msg* create_request(const RequestTemplate& tmpl,
+                            const RequestTemplate::Values& values)
+    {return _helper->create_request(tmpl, values);}
+
   /// Returns the top Route header from the original incoming request.  This
   /// can be inpsected by the app server, but should not be modified.  Note that
   /// this Route header is removed from the request passed to the app server on
@@ -355,6 +1133,21 @@ protected:
   const std::string& dialog_id() const
     {return _helper->dialog_id();}
 
+  /// Adds the service to the underlying SIP dialog with an interned dialog
+  /// identifier.
+  ///
+  /// @param  dialog_id    - The interned dialog identifier.
+  ///
+  void add_to_dialog(DialogId dialog_id)
+    {_helper->add_to_dialog_handle(dialog_id);}
+
+  /// Returns the interned dialog identifier for this service.
+  ///
+  /// @returns             - The interned dialog identifier, or an invalid
+  ///                        DialogId.
+  DialogId dialog_handle() const
+    {return _helper->dialog_handle();}
+
   /// Clones the request.  This is typically used when forking a request if
   /// different request modifications are required on each fork.
   ///
@@ -366,6 +1159,54 @@ protected:
   pjsip_msg* clone_request(pjsip_msg* req)
     {return _helper->clone_request(req);}
 
+  /// Clones the request lazily, sharing headers and body with the original
+  /// request on a copy-on-write basis.  Headers that are to be modified in
+  /// place must first be made writable with writable_hdr.
+  ///
+  /// @returns             - The cloned request message.
+  /// @param  req          - The request message to clone.
+  pjsip_msg* lazy_clone_request(pjsip_msg* req)
+    {return _helper->lazy_clone_request(req);}
+
+  /// Takes ownership of a message passed to the AppServerTsx, such as the
+  /// received request, in a MsgHandle.
+  ///
+  /// @returns             - The handle owning the message.
+  /// @param  msg          - The message.
+  MsgHandle own(pjsip_msg* msg)
+    {return MsgHandle(_helper, msg, stats());}
+
+  /// Versions of clone_request, lazy_clone_request and create_response
+  /// taking and returning MsgHandles.
+  MsgHandle clone_request(const MsgHandle& req)
+    {return own(_helper->clone_request(req.get()));}
+
+  MsgHandle lazy_clone_request(const MsgHandle& req)
+    {return own(_helper->lazy_clone_request(req.get()));}
+
+  MsgHandle create_response(const MsgHandle& req,
+                            pjsip_status_code status_code,
+                            const std::string& status_text="")
+    {return own(create_response(req.get(), status_code, status_text));}
+
+  /// Makes a header of a lazily cloned message safe to modify in place.
+  ///
+  /// @returns             - The writable copy of the header.
+  /// @param  msg          - The message containing the header.
+  /// @param  hdr          - The header to make writable.
+  template <class H>
+  H* writable_hdr(pjsip_msg* msg, H* hdr)
+    {return LazyMsgClone::writable_hdr(get_pool(msg), hdr);}
+
+  /// Returns an editor for the body of a message, for splicing in edits
+  /// found using SdpReader or MultipartReader without copying the rest of
+  /// the body (see BodyEditor).
+  ///
+  /// @returns             - The editor.
+  /// @param  msg          - The message whose body to edit.
+  BodyEditor edit_body(pjsip_msg* msg)
+    {return BodyEditor(get_pool(msg), msg);}
+
   /// Clones the message.  This is typically used when we want to keep a
   /// message after calling a destructive method on it.
   ///
@@ -403,7 +1244,38 @@ protected:
   /// @returns             - The ID of this forwarded request
   /// @param  req          - The request message to use for forwarding.
   int send_request(pjsip_msg*& req)
-    {return _helper->send_request(req);}
+  {
+    count_call(AppServerStats::SEND_REQUEST);
+    report_sas_events();
+    return _helper->send_request(req);
+  }
+
+  /// As above, but consuming the request through a MsgHandle.
+  int send_request(MsgHandle&& req)
+  {
+    count_call(AppServerStats::SEND_REQUEST);
+    report_sas_events();
+    return _helper->send_request_handle(std::move(req));
+  }
+
+  /// Forks a request to a set of targets in a single call.  The base request
+  /// is consumed.
+  ///
+  /// @param  req          - The base request message.
+  /// @param  targets      - The targets to fork the request to.  URIs and
+  ///                        headers should be allocated from the pool of the
+  ///                        base request.
+  /// @param  fork_ids     - The IDs of the forked requests are appended to
+  ///                        this vector, in the same order as the targets.
+  void send_requests(pjsip_msg*& req,
+                     const std::vector<ForkTarget>& targets,
+                     std::vector<int>& fork_ids)
+  {
+    count_call(AppServerStats::SEND_REQUEST, targets.size());
+    count_call(AppServerStats::FREE_MSG);
+    report_sas_events();
+    _helper->send_requests(req, targets, fork_ids);
+  }
 
   /// Indicate that the response should be forwarded following standard routing
   /// rules.  Note that, if this service created multiple forks, the responses
@@ -413,7 +1285,54 @@ protected:
   ///
   /// @param  rsp          - The response message to use for forwarding.
   void send_response(pjsip_msg*& rsp)
-    {_helper->send_response(rsp);}
+  {
+    count_call(AppServerStats::SEND_RESPONSE);
+    report_sas_events();
+    _helper->send_response(rsp);
+  }
+
+  /// As above, but consuming the response through a MsgHandle.
+  void send_response(MsgHandle&& rsp)
+  {
+    count_call(AppServerStats::SEND_RESPONSE);
+    report_sas_events();
+    _helper->send_response_handle(std::move(rsp));
+  }
+
+  /// Rejects the request with a final response, consuming the request.
+  /// This is the fastest way to reject a request, as no response message
+  /// need be built.
+  ///
+  /// @param  req          - The request to reject.
+  /// @param  status_code  - The SIP status code for the response.
+  /// @param  status_text  - The text part of the status line.
+  void reject(pjsip_msg*& req,
+              pjsip_status_code status_code,
+              const std::string& status_text="")
+  {
+    count_call(AppServerStats::SEND_RESPONSE);
+    count_call(AppServerStats::FREE_MSG);
+    report_sas_events();
+    _helper->reject(req, status_code, status_text);
+  }
+
+  /// Redirects the request with a 3xx response listing the specified
+  /// contacts, consuming the request.
+  ///
+  /// @param  req          - The request to redirect.
+  /// @param  status_code  - The SIP status code for the response.
+  /// @param  contacts     - The URIs to redirect to, in order of preference.
+  /// @param  status_text  - The text part of the status line.
+  void redirect(pjsip_msg*& req,
+                pjsip_status_code status_code,
+                const std::vector<pjsip_uri*>& contacts,
+                const std::string& status_text="")
+  {
+    count_call(AppServerStats::SEND_RESPONSE);
+    count_call(AppServerStats::FREE_MSG);
+    report_sas_events();
+    _helper->redirect(req, status_code, contacts, status_text);
+  }
 
   /// Cancels a forked INVITE request by sending a CANCEL request.
   ///
@@ -422,7 +1341,21 @@ protected:
   ///                        CANCEL request (0 means no Reason header is added).
   /// @param reason        - Human-readable reason string.  For diagnostics only.
   void cancel_fork(int fork_id, int st_code = 0, std::string reason = "")
-    {_helper->cancel_fork(fork_id, st_code, reason);}
+    {count_call(AppServerStats::CANCEL_FORK); _helper->cancel_fork(fork_id, st_code, reason);}
+
+  /// Cancels a set of forked INVITE requests in a single call.
+  ///
+  /// @param fork_ids      - The identifiers of the forks to CANCEL.
+  /// @param st_code       - SIP status code added in Reason header to the
+  ///                        CANCEL requests (0 means no Reason header is added).
+  /// @param reason        - Human-readable reason string.  For diagnostics only.
+  void cancel_forks(const std::vector<int>& fork_ids,
+                    int st_code = 0,
+                    const std::string& reason = "")
+  {
+    count_call(AppServerStats::CANCEL_FORK, fork_ids.size());
+    _helper->cancel_forks(fork_ids, st_code, reason);
+  }
 
   /// Frees the specified message.  Received responses or messages that have
   /// been cloned with add_target are owned by the AppServerTsx.  It must
@@ -431,7 +1364,19 @@ protected:
   ///
   /// @param  msg          - The message to free.
   void free_msg(pjsip_msg*& msg)
-    {return _helper->free_msg(msg);}
+    {count_call(AppServerStats::FREE_MSG); return _helper->free_msg(msg);}
+
+  /// As above, but consuming the message through a MsgHandle.  Messages
+  /// owned by a MsgHandle are also freed when the handle is destroyed.  An
+  /// empty handle is ignored.
+  void free_msg(MsgHandle&& msg)
+  {
+    if (msg)
+    {
+      count_call(AppServerStats::FREE_MSG);
+      _helper->free_msg_handle(std::move(msg));
+    }
+  }
 
   /// Returns the pool corresponding to a message.  This pool can then be used
   /// to allocate further headers or bodies to add to the message.
@@ -452,7 +1397,7 @@ protected:
   /// @param  id           - A unique identifier for the timer.
   /// @param  duration     - Timer duration in milliseconds.
   bool schedule_timer(void* context, TimerID& id,int duration)
-    {return _helper->schedule_timer(context, id, duration);}
+    {count_call(AppServerStats::SCHEDULE_TIMER); return _helper->schedule_timer(context, id, duration);}
 
   /// Cancels the timer with the specified identifier.  This is a no-op if
   /// there is no timer with this identifier running.
@@ -473,10 +1418,353 @@ protected:
   SAS::TrailId trail() const
     {return _helper->trail();}
 
+  /// Suspends the transaction so that the current callback can be finished
+  /// asynchronously in on_resume.
+  ///
+  /// @returns             - A handle to resume the transaction, or an
+  ///                        invalid handle if the transaction cannot be
+  ///                        suspended.
+  AsyncHandle suspend()
+    {return _helper->suspend();}
+
+  /// Logs a SAS event on the transaction's trail.  By default each event is
+  /// reported to SAS once it is complete, when the next event is logged or
+  /// the transaction sends a message.  If the AppServer's SAS settings name
+  /// a sink that batches events, they are instead reported in batches, at
+  /// the latest when the transaction is destroyed (see SasEventBuffer).
+  ///
+  /// @returns             - The event, to add parameters to, or NULL if the
+  ///                        event is not sampled.  The event is only valid
+  ///                        until the next call to sas_event.
+  /// @param  id           - The event ID.
+  /// @param  instance     - The instance ID.
+  /// @param  severity     - The severity of the event.  DETAIL events are
+  ///                        only logged on sampled trails.
+  SAS::Event* sas_event(uint32_t id,
+                        uint32_t instance = 0,
+                        SasEventBuffer::Severity severity = SasEventBuffer::NORMAL)
+    {return sas_events().event(id, instance, severity);}
+
+  /// Reports a SAS event that the service has built on the transaction's
+  /// trail.  By default the event is passed straight to SAS.  If the
+  /// AppServer's SAS settings name a sink that batches events, it is copied
+  /// into the batch instead.
+  ///
+  /// @param  event        - The event.
+  /// @param  severity     - The severity of the event.  DETAIL events are
+  ///                        only reported on sampled trails.
+  void report_sas_event(SAS::Event& event,
+                        SasEventBuffer::Severity severity = SasEventBuffer::NORMAL)
+    {sas_events().report(event, severity);}
+
+  /// Returns the SAS event buffer for this transaction, creating it on first
+  /// use.
+  SasEventBuffer& sas_events()
+  {
+    Resources& res = resources();
+    if (res.sas_events == NULL)
+    {
+      res.sas_events.reset(new SasEventBuffer(trail(), res.sas_config));
+    }
+    return *res.sas_events;
+  }
+
+  /// Returns the scratch memory arena for this transaction.  Memory
+  /// allocated from it, directly or through a ScratchAllocator, lasts until
+  /// the AppServerTsx is destroyed, and is then released in one go.
+  ///
+  /// @returns             - The scratch arena.
+  TsxScratch& scratch()
+    {return resources().scratch;}
+
+  /// Returns the AppServerTsxHelper for this transaction.
+  AppServerTsxHelper* helper() const
+    {return _helper;}
+
+  /// Counts a call into the helper in the statistics, if there are any.
+  void count_call(AppServerStats::Counter counter, uint64_t num = 1)
+  {
+    AppServerStats* stats = this->stats();
+    if (stats != NULL)
+    {
+      stats->increment(counter, num);
+    }
+  }
+
+  /// Reports any complete SAS events before a message is sent, unless they
+  /// are being batched.
+  void report_sas_events()
+  {
+    if ((_resources != NULL) && (_resources->sas_events != NULL))
+    {
+      _resources->sas_events->flush_unbatched();
+    }
+  }
+
 private:
+  /// The statistics, scratch memory and SAS events of a transaction, which
+  /// are kept out of line so that they do not change the layout of
+  /// AppServerTsx as they evolve.
+  struct Resources
+  {
+    Resources() : stats(NULL), scratch(), sas_config(NULL), sas_events() {}
+
+    /// Statistics to count calls into the helper in.
+    AppServerStats* stats;
+
+    /// Scratch memory for the transaction.
+    TsxScratch scratch;
+
+    /// Settings for the SAS event buffer, or NULL for the defaults.
+    const SasEventBuffer::Config* sas_config;
+
+    /// SAS events logged by the transaction, created on first use.
+    std::unique_ptr<SasEventBuffer> sas_events;
+  };
+
+  /// Returns the transaction's resources, creating them on first use.
+  Resources& resources()
+  {
+    if (_resources == NULL)
+    {
+      _resources.reset(new Resources());
+    }
+    return *_resources;
+  }
+
+  /// Returns the statistics to count calls into the helper in, or NULL.
+  AppServerStats* stats() const
+    {return (_resources != NULL) ? _resources->stats : NULL;}
+
   /// Transaction context to use for underlying service-related processing.
   AppServerTsxHelper* _helper;
 
+  /// Statistics, scratch memory and SAS events, created on first use.
+  std::unique_ptr<Resources> _resources;
+
+};
+
+
+/// The StaticAppServerTsx class template is an alternative base class for
+/// services that are built into the same binary as the AppServerTsxHelper
+/// implementation, so the concrete types of both the service and the helper
+/// are known at compile time.  Derive from it using the curiously recurring
+/// template pattern, for example
+///
+///   class MyASTsx : public StaticAppServerTsx<MyASTsx, SproutletAppServerTsxHelper>
+///
+/// Calls from the service into the helper are then made directly to Helper's
+/// implementation, rather than through the AppServerTsxHelper vtable, so the
+/// compiler can inline them.  Infrastructure that knows the service type can
+/// also call the dispatch_* methods, which call the service's callbacks
+/// without virtual dispatch.
+///
+/// A StaticAppServerTsx is still an AppServerTsx, so it can be driven
+/// through the virtual interface like any dynamically loaded service.  The
+/// helper set on it must be of type Helper.
+///
+template <class Derived, class Helper>
+class StaticAppServerTsx : public AppServerTsx
+{
+  static_assert(std::is_base_of<AppServerTsxHelper, Helper>::value,
+                "Helper must derive from AppServerTsxHelper");
+
+public:
+  /// Constructor.
+  StaticAppServerTsx() : AppServerTsx() {}
+
+  /// Non-virtual entry points corresponding to the AppServerTsx callbacks.
+  void dispatch_initial_request(pjsip_msg* req)
+    {derived()->Derived::on_initial_request(req);}
+
+  void dispatch_in_dialog_request(pjsip_msg* req)
+    {derived()->Derived::on_in_dialog_request(req);}
+
+  void dispatch_response(pjsip_msg* rsp, int fork_id)
+    {derived()->Derived::on_response(rsp, fork_id);}
+
+  void dispatch_cancel(int status_code)
+    {derived()->Derived::on_cancel(status_code);}
+
+  void dispatch_timer_expiry(void* context)
+    {derived()->Derived::on_timer_expiry(context);}
+
+  void dispatch_resume(void* context)
+    {derived()->Derived::on_resume(context);}
+
+protected:
+  // The following methods hide those of AppServerTsx, and call the Helper
+  // implementation directly.  See AppServerTsx for their descriptions.
+
+  pjsip_msg* original_request()
+    {return static_helper()->Helper::original_request();}
+
+  pjsip_msg* create_request(const RequestTemplate& tmpl,
+                            const RequestTemplate::Values& values)
+    {return static_helper()->Helper::create_request(tmpl, values);}
+
+  const pjsip_route_hdr* route_hdr() const
+    {return static_helper()->Helper::route_hdr();}
+
+  void add_to_dialog(const std::string& dialog_id="")
+    {static_helper()->Helper::add_to_dialog(dialog_id);}
+
+  const std::string& dialog_id() const
+    {return static_helper()->Helper::dialog_id();}
+
+  void add_to_dialog(DialogId dialog_id)
+    {static_helper()->Helper::add_to_dialog_handle(dialog_id);}
+
+  DialogId dialog_handle() const
+    {return static_helper()->Helper::dialog_handle();}
+
+  pjsip_msg* clone_request(pjsip_msg* req)
+    {return static_helper()->Helper::clone_request(req);}
+
+  pjsip_msg* lazy_clone_request(pjsip_msg* req)
+    {return static_helper()->Helper::lazy_clone_request(req);}
+
+  MsgHandle own(pjsip_msg* msg)
+    {return AppServerTsx::own(msg);}
+
+  MsgHandle clone_request(const MsgHandle& req)
+    {return own(static_helper()->Helper::clone_request(req.get()));}
+
+  MsgHandle lazy_clone_request(const MsgHandle& req)
+    {return own(static_helper()->Helper::lazy_clone_request(req.get()));}
+
+  template <class H>
+  H* writable_hdr(pjsip_msg* msg, H* hdr)
+    {return LazyMsgClone::writable_hdr(get_pool(msg), hdr);}
+
+  pjsip_msg* clone_msg(pjsip_msg* msg)
+    {return static_helper()->Helper::clone_msg(msg);}
+
+  pjsip_msg* create_response(pjsip_msg* req,
+                             pjsip_status_code status_code,
+                             const std::string& status_text="")
+    {return static_helper()->Helper::create_response(req, status_code, status_text);}
+
+  MsgHandle create_response(const MsgHandle& req,
+                            pjsip_status_code status_code,
+                            const std::string& status_text="")
+    {return own(static_helper()->Helper::create_response(req.get(), status_code, status_text));}
+
+  int send_request(pjsip_msg*& req)
+  {
+    count_call(AppServerStats::SEND_REQUEST);
+    report_sas_events();
+    return static_helper()->Helper::send_request(req);
+  }
+
+  // The MsgHandle versions release the message and call the raw pointer
+  // versions, so that they are also bound statically to Helper.
+  int send_request(MsgHandle&& req)
+  {
+    pjsip_msg* msg = req.release();
+    return send_request(msg);
+  }
+
+  void send_requests(pjsip_msg*& req,
+                     const std::vector<ForkTarget>& targets,
+                     std::vector<int>& fork_ids)
+  {
+    count_call(AppServerStats::SEND_REQUEST, targets.size());
+    count_call(AppServerStats::FREE_MSG);
+    report_sas_events();
+    static_helper()->Helper::send_requests(req, targets, fork_ids);
+  }
+
+  void send_response(pjsip_msg*& rsp)
+  {
+    count_call(AppServerStats::SEND_RESPONSE);
+    report_sas_events();
+    static_helper()->Helper::send_response(rsp);
+  }
+
+  void send_response(MsgHandle&& rsp)
+  {
+    pjsip_msg* msg = rsp.release();
+    send_response(msg);
+  }
+
+  void reject(pjsip_msg*& req,
+              pjsip_status_code status_code,
+              const std::string& status_text="")
+  {
+    count_call(AppServerStats::SEND_RESPONSE);
+    count_call(AppServerStats::FREE_MSG);
+    report_sas_events();
+    static_helper()->Helper::reject(req, status_code, status_text);
+  }
+
+  void redirect(pjsip_msg*& req,
+                pjsip_status_code status_code,
+                const std::vector<pjsip_uri*>& contacts,
+                const std::string& status_text="")
+  {
+    count_call(AppServerStats::SEND_RESPONSE);
+    count_call(AppServerStats::FREE_MSG);
+    report_sas_events();
+    static_helper()->Helper::redirect(req, status_code, contacts, status_text);
+  }
+
+  void cancel_fork(int fork_id, int st_code = 0, std::string reason = "")
+  {
+    count_call(AppServerStats::CANCEL_FORK);
+    static_helper()->Helper::cancel_fork(fork_id, st_code, reason);
+  }
+
+  void cancel_forks(const std::vector<int>& fork_ids,
+                    int st_code = 0,
+                    const std::string& reason = "")
+  {
+    count_call(AppServerStats::CANCEL_FORK, fork_ids.size());
+    static_helper()->Helper::cancel_forks(fork_ids, st_code, reason);
+  }
+
+  void free_msg(pjsip_msg*& msg)
+  {
+    count_call(AppServerStats::FREE_MSG);
+    static_helper()->Helper::free_msg(msg);
+  }
+
+  void free_msg(MsgHandle&& msg)
+  {
+    pjsip_msg* raw = msg.release();
+    if (raw != NULL)
+    {
+      free_msg(raw);
+    }
+  }
+
+  pj_pool_t* get_pool(const pjsip_msg* msg)
+    {return static_helper()->Helper::get_pool(msg);}
+
+  bool schedule_timer(void* context, TimerID& id, int duration)
+  {
+    count_call(AppServerStats::SCHEDULE_TIMER);
+    return static_helper()->Helper::schedule_timer(context, id, duration);
+  }
+
+  void cancel_timer(TimerID id)
+    {static_helper()->Helper::cancel_timer(id);}
+
+  bool timer_running(TimerID id)
+    {return static_helper()->Helper::timer_running(id);}
+
+  SAS::TrailId trail() const
+    {return static_helper()->Helper::trail();}
+
+  AsyncHandle suspend()
+    {return static_helper()->Helper::suspend();}
+
+private:
+  Derived* derived()
+    {return static_cast<Derived*>(this);}
+
+  Helper* static_helper() const
+    {return static_cast<Helper*>(helper());}
 };
 
 #endif
@@ -0,0 +1,290 @@
+/**
+ * @file appserver_stats.h  Per-AppServer hot path instrumentation.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef APPSERVER_STATS_H__
+#define APPSERVER_STATS_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+
+#include "cache_aligned.h"
+
+/// The AppServerStats class collects hot path statistics for a single
+/// AppServer: latency histograms for each AppServerTsx callback, counts of
+/// the calls services make into the helper, a gauge of live transactions and
+/// a histogram of the scratch memory transactions use.
+///
+/// Statistics are kept in per-thread shards, each on its own cache lines, so
+/// updating them is a single uncontended atomic add and never takes a lock.
+/// The shards are allocated separately, so AppServerStats, and the AppServer
+/// holding it, have normal alignment and can be created with new.  Threads
+/// are assigned to shards round-robin, so shards are only shared if
+/// there are more threads than shards.  The snapshot method sums the shards
+/// and can be called from any thread, for example by a statistics exporter.
+///
+class AppServerStats
+{
+public:
+  /// The AppServerTsx callbacks that are timed.
+  enum Callback
+  {
+    INITIAL_REQUEST,
+    IN_DIALOG_REQUEST,
+    RESPONSE,
+    CANCEL,
+    TIMER_EXPIRY,
+    RESUME,
+    NUM_CALLBACKS
+  };
+
+  /// The helper calls that are counted, and requests throttled by
+  /// admission control.
+  enum Counter
+  {
+    SEND_REQUEST,
+    SEND_RESPONSE,
+    CANCEL_FORK,
+    FREE_MSG,
+    SCHEDULE_TIMER,
+    THROTTLED,
+    NUM_COUNTERS
+  };
+
+  /// Latency histograms have power-of-two buckets.  Bucket 0 counts
+  /// latencies below 1us, bucket N counts latencies of [2^(N-1), 2^N)us, and
+  /// the last bucket also counts anything longer.
+  static const int NUM_BUCKETS = 24;
+
+  /// A point-in-time copy of the statistics, summed across all threads.
+  struct Snapshot
+  {
+    uint64_t latency[NUM_CALLBACKS][NUM_BUCKETS];
+    uint64_t calls[NUM_CALLBACKS];
+    uint64_t total_latency_us[NUM_CALLBACKS];
+    uint64_t counters[NUM_COUNTERS];
+    int64_t live_tsxs;
+
+    /// Histogram of the scratch memory high-water marks of transactions
+    /// that used scratch memory, with the same power-of-two buckets as the
+    /// latency histograms but in bytes, and the largest seen.
+    uint64_t scratch_bytes[NUM_BUCKETS];
+    uint64_t max_scratch_bytes;
+
+    /// Estimates a latency percentile for a callback from the histogram.
+    ///
+    /// @returns             - The upper bound of the bucket containing the
+    ///                        percentile, in microseconds, or 0 if there have
+    ///                        been no calls.
+    /// @param  callback     - The callback.
+    /// @param  percentile   - The percentile, from 0 to 100.
+    uint64_t percentile_us(Callback callback, double percentile) const
+    {
+      uint64_t target = (uint64_t)(calls[callback] * percentile / 100.0);
+      uint64_t seen = 0;
+
+      for (int ii = 0; ii < NUM_BUCKETS; ++ii)
+      {
+        seen += latency[callback][ii];
+        if ((seen > target) || ((seen == calls[callback]) && (seen > 0)))
+        {
+          return 1ULL << ii;
+        }
+      }
+
+      return 0;
+    }
+  };
+
+  /// Times a callback for the lifetime of the object.  The infrastructure
+  /// wraps each call into an AppServerTsx in one of these.
+  class CallbackTimer
+  {
+  public:
+    CallbackTimer(AppServerStats* stats, Callback callback) :
+      _stats(stats),
+      _callback(callback),
+      _start((stats != NULL) ? std::chrono::steady_clock::now() :
+                               std::chrono::steady_clock::time_point())
+    {
+    }
+
+    ~CallbackTimer()
+    {
+      if (_stats != NULL)
+      {
+        std::chrono::microseconds elapsed =
+          std::chrono::duration_cast<std::chrono::microseconds>(
+                                  std::chrono::steady_clock::now() - _start);
+        _stats->record_latency(_callback, elapsed.count());
+      }
+    }
+
+  private:
+    AppServerStats* _stats;
+    Callback _callback;
+    std::chrono::steady_clock::time_point _start;
+  };
+
+  /// Constructor.
+  AppServerStats() : _shards(NUM_SHARDS) {}
+
+  /// Records the latency of a callback.
+  ///
+  /// @param  callback     - The callback.
+  /// @param  latency_us   - The latency in microseconds.
+  void record_latency(Callback callback, uint64_t latency_us)
+  {
+    Shard& shard = local_shard();
+    shard.latency[callback][bucket(latency_us)].fetch_add(1, std::memory_order_relaxed);
+    shard.calls[callback].fetch_add(1, std::memory_order_relaxed);
+    shard.total_latency_us[callback].fetch_add(latency_us, std::memory_order_relaxed);
+  }
+
+  /// Counts a helper call.
+  void increment(Counter counter, uint64_t count = 1)
+  {
+    local_shard().counters[counter].fetch_add(count, std::memory_order_relaxed);
+  }
+
+  /// Records the scratch memory high-water mark of a transaction.
+  ///
+  /// @param  bytes        - The high-water mark in bytes.
+  void record_scratch(uint64_t bytes)
+  {
+    Shard& shard = local_shard();
+    shard.scratch_bytes[bucket(bytes)].fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t max = shard.max_scratch_bytes.load(std::memory_order_relaxed);
+    while ((bytes > max) &&
+           (!shard.max_scratch_bytes.compare_exchange_weak(max,
+                                                           bytes,
+                                                           std::memory_order_relaxed)))
+    {
+    }
+  }
+
+  /// Updates the gauge of live transactions.
+  void tsx_created() { local_shard().live_tsxs.fetch_add(1, std::memory_order_relaxed); }
+  void tsx_destroyed() { local_shard().live_tsxs.fetch_sub(1, std::memory_order_relaxed); }
+
+  /// Returns the current statistics, summed across all threads.
+  Snapshot snapshot() const
+  {
+    Snapshot snap;
+    memset(&snap, 0, sizeof(snap));
+
+    for (int shard = 0; shard < NUM_SHARDS; ++shard)
+    {
+      const Shard& s = _shards[shard];
+
+      for (int cb = 0; cb < NUM_CALLBACKS; ++cb)
+      {
+        for (int ii = 0; ii < NUM_BUCKETS; ++ii)
+        {
+          snap.latency[cb][ii] += s.latency[cb][ii].load(std::memory_order_relaxed);
+        }
+        snap.calls[cb] += s.calls[cb].load(std::memory_order_relaxed);
+        snap.total_latency_us[cb] += s.total_latency_us[cb].load(std::memory_order_relaxed);
+      }
+
+      for (int ii = 0; ii < NUM_COUNTERS; ++ii)
+      {
+        snap.counters[ii] += s.counters[ii].load(std::memory_order_relaxed);
+      }
+
+      snap.live_tsxs += s.live_tsxs.load(std::memory_order_relaxed);
+
+      for (int ii = 0; ii < NUM_BUCKETS; ++ii)
+      {
+        snap.scratch_bytes[ii] += s.scratch_bytes[ii].load(std::memory_order_relaxed);
+      }
+
+      uint64_t max = s.max_scratch_bytes.load(std::memory_order_relaxed);
+      if (max > snap.max_scratch_bytes)
+      {
+        snap.max_scratch_bytes = max;
+      }
+    }
+
+    return snap;
+  }
+
+private:
+  static const int NUM_SHARDS = 32;
+
+  /// The statistics for one group of threads.  The shards are held in a
+  /// CacheAlignedArray so that no two shards share a cache line.
+  struct Shard
+  {
+    Shard()
+    {
+      for (int cb = 0; cb < NUM_CALLBACKS; ++cb)
+      {
+        for (int ii = 0; ii < NUM_BUCKETS; ++ii)
+        {
+          latency[cb][ii].store(0, std::memory_order_relaxed);
+        }
+        calls[cb].store(0, std::memory_order_relaxed);
+        total_latency_us[cb].store(0, std::memory_order_relaxed);
+      }
+
+      for (int ii = 0; ii < NUM_COUNTERS; ++ii)
+      {
+        counters[ii].store(0, std::memory_order_relaxed);
+      }
+
+      live_tsxs.store(0, std::memory_order_relaxed);
+
+      for (int ii = 0; ii < NUM_BUCKETS; ++ii)
+      {
+        scratch_bytes[ii].store(0, std::memory_order_relaxed);
+      }
+      max_scratch_bytes.store(0, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> latency[NUM_CALLBACKS][NUM_BUCKETS];
+    std::atomic<uint64_t> calls[NUM_CALLBACKS];
+    std::atomic<uint64_t> total_latency_us[NUM_CALLBACKS];
+    std::atomic<uint64_t> counters[NUM_COUNTERS];
+    std::atomic<int64_t> live_tsxs;
+    std::atomic<uint64_t> scratch_bytes[NUM_BUCKETS];
+    std::atomic<uint64_t> max_scratch_bytes;
+  };
+
+  static int bucket(uint64_t value)
+  {
+    int bucket = 0;
+
+    while ((value > 0) && (bucket < NUM_BUCKETS - 1))
+    {
+      value >>= 1;
+      ++bucket;
+    }
+
+    return bucket;
+  }
+
+  /// Returns the shard for the calling thread.  The same shard index is used
+  /// by a thread for every AppServerStats object.
+  Shard& local_shard()
+  {
+    static std::atomic<unsigned int> next_index(0);
+    static thread_local unsigned int index =
+                  next_index.fetch_add(1, std::memory_order_relaxed) % NUM_SHARDS;
+    return _shards[index];
+  }
+
+  CacheAlignedArray<Shard> _shards;
+};
+
+#endif
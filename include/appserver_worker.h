@@ -0,0 +1,241 @@
+/**
+ * @file appserver_worker.h  Per-worker context and state for AppServers.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef APPSERVER_WORKER_H__
+#define APPSERVER_WORKER_H__
+
+#include <stdlib.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+/// The AppServerWorkerContext class identifies the worker thread a service
+/// is running on.  Each thread has its own context, returned by current,
+/// which holds a small index that is unique among the threads running at the
+/// same time and is reused once a thread exits.  The infrastructure passes
+/// the context of the calling thread to AppServer::get_app_tsx_on_worker,
+/// and services use it to find their per-worker state (see AppServerLocal).
+///
+/// A context is only ever used by its own thread, so nothing in it needs
+/// locking.
+///
+class AppServerWorkerContext
+{
+public:
+  /// The maximum number of threads that can have a context at once.
+  static const int MAX_WORKERS = 256;
+
+  /// Returns the context of the calling thread, creating it on first use.
+  ///
+  /// @throws std::length_error if MAX_WORKERS threads already have contexts.
+  static AppServerWorkerContext& current()
+  {
+    static thread_local AppServerWorkerContext context;
+    return context;
+  }
+
+  /// Returns the index of the worker, from 0 to MAX_WORKERS - 1.
+  int index() const { return _index; }
+
+private:
+  AppServerWorkerContext() : _index(indexes().take()) {}
+  ~AppServerWorkerContext() { indexes().give(_index); }
+
+  AppServerWorkerContext(const AppServerWorkerContext&);
+  AppServerWorkerContext& operator=(const AppServerWorkerContext&);
+
+  /// Allocates worker indexes, lowest first.  This is only used when a
+  /// thread first uses a context and when it exits, so a lock is fine.
+  class IndexPool
+  {
+  public:
+    IndexPool() : _lock(), _free(), _next(0) {}
+
+    int take()
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      if (!_free.empty())
+      {
+        int index = _free.back();
+        _free.pop_back();
+        return index;
+      }
+
+      if (_next >= MAX_WORKERS)
+      {
+        throw std::length_error("Too many AppServer worker threads");
+      }
+
+      return _next++;
+    }
+
+    void give(int index)
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      _free.push_back(index);
+    }
+
+  private:
+    std::mutex _lock;
+    std::vector<int> _free;
+    int _next;
+  };
+
+  static IndexPool& indexes()
+  {
+    static IndexPool pool;
+    return pool;
+  }
+
+  int _index;
+};
+
+
+/// The AppServerLocal class template holds a separate instance of a
+/// service's mutable state for each worker thread, such as counters or
+/// caches, so that it can be used from get_app_tsx and AppServerTsx
+/// callbacks without locks.  Declare it as a member of the AppServer, and
+/// call get with the worker context passed to get_app_tsx_on_worker, or with
+/// no arguments from transaction callbacks, for example
+///
+///   AppServerLocal<MyCache> _caches;
+///   ...
+///   MyCache& cache = _caches.get(worker);
+///
+/// Each worker's instance is created the first time that worker calls get,
+/// on that worker's thread, and on its own cache lines, so workers never
+/// write to memory another worker reads.  The instances are destroyed with
+/// the AppServerLocal.
+///
+template <class T>
+class AppServerLocal
+{
+public:
+  /// Constructor.  Each worker's instance is default-constructed.
+  AppServerLocal() :
+    _prototype(),
+    _values(new std::atomic<T*>[AppServerWorkerContext::MAX_WORKERS])
+  {
+    init();
+  }
+
+  /// Constructor.  Each worker's instance is copied from a prototype, for
+  /// example one built from the service's configuration.
+  ///
+  /// @param  prototype    - The initial state of each instance.
+  AppServerLocal(const T& prototype) :
+    _prototype(new T(prototype)),
+    _values(new std::atomic<T*>[AppServerWorkerContext::MAX_WORKERS])
+  {
+    init();
+  }
+
+  ~AppServerLocal()
+  {
+    for (int ii = 0; ii < AppServerWorkerContext::MAX_WORKERS; ++ii)
+    {
+      T* value = _values[ii].load(std::memory_order_acquire);
+      if (value != NULL)
+      {
+        value->~T();
+        free(value);
+      }
+    }
+  }
+
+  /// Returns the instance for a worker.  This must only be called on the
+  /// worker's own thread.
+  ///
+  /// @param  worker       - The worker's context.
+  T& get(const AppServerWorkerContext& worker)
+  {
+    std::atomic<T*>& slot = _values[worker.index()];
+    T* value = slot.load(std::memory_order_relaxed);
+    if (value == NULL)
+    {
+      // Publish the instance only once it is fully constructed.
+      value = create();
+      slot.store(value, std::memory_order_release);
+    }
+    return *value;
+  }
+
+  /// Returns the instance for the calling thread.
+  T& get() { return get(AppServerWorkerContext::current()); }
+
+  /// Calls a function with each worker's instance, for example to total
+  /// counters for reporting.  This may be called from any thread, and sees
+  /// each instance only once it has been constructed.  The instances
+  /// themselves are not locked, so either T must be safe to read while its
+  /// worker updates it (for example by using atomics), or the workers must
+  /// be idle, as during a configuration reload.
+  ///
+  /// @param  fn           - The function, taking a const T&.
+  template <class Fn>
+  void for_each(Fn fn) const
+  {
+    for (int ii = 0; ii < AppServerWorkerContext::MAX_WORKERS; ++ii)
+    {
+      const T* value = _values[ii].load(std::memory_order_acquire);
+      if (value != NULL)
+      {
+        fn(*value);
+      }
+    }
+  }
+
+private:
+  static const size_t CACHE_LINE = 64;
+
+  AppServerLocal(const AppServerLocal&);
+  AppServerLocal& operator=(const AppServerLocal&);
+
+  void init()
+  {
+    for (int ii = 0; ii < AppServerWorkerContext::MAX_WORKERS; ++ii)
+    {
+      _values[ii].store(NULL, std::memory_order_relaxed);
+    }
+  }
+
+  /// Creates an instance on cache lines of its own.
+  T* create()
+  {
+    size_t size = (sizeof(T) + CACHE_LINE - 1) & ~(CACHE_LINE - 1);
+    void* mem;
+    if (posix_memalign(&mem, CACHE_LINE, size) != 0)
+    {
+      throw std::bad_alloc();
+    }
+
+    try
+    {
+      return (_prototype != NULL) ? new (mem) T(*_prototype) : new (mem) T();
+    }
+    catch (...)
+    {
+      free(mem);
+      throw;
+    }
+  }
+
+  std::unique_ptr<T> _prototype;
+
+  /// The pointers are only written when a worker first uses its instance,
+  /// so the cache lines holding them are shared read-only.  They are
+  /// atomic, as for_each may read them while a worker is storing its own.
+  std::unique_ptr<std::atomic<T*>[]> _values;
+};
+
+#endif
@@ -0,0 +1,564 @@
+/**
+ * @file body_view.h  Non-copying access to, and in-place editing of, SIP
+ * message bodies for AppServers.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef BODY_VIEW_H__
+#define BODY_VIEW_H__
+
+extern "C" {
+#include <pjsip.h>
+#include <pjlib.h>
+}
+
+#include <string.h>
+#include <strings.h>
+#include <algorithm>
+#include <vector>
+
+/// The BodyView class provides the string handling shared by the body
+/// readers.  Values are pj_str_t slices pointing into the body, so remain
+/// valid for as long as the body is not edited.
+///
+class BodyView
+{
+public:
+  /// Returns a slice over the whole of a message body.
+  ///
+  /// @returns             - The body, or an empty slice if there is none.
+  /// @param  msg          - The message.
+  static pj_str_t body(const pjsip_msg* msg)
+  {
+    return (msg->body != NULL) ?
+             slice((char*)msg->body->data, msg->body->len) :
+             slice(NULL, 0);
+  }
+
+  /// Splits the next space-separated token from the front of a slice, for
+  /// example a payload type from the format list of an SDP m= line.
+  ///
+  /// @returns             - false if there are no more tokens.
+  /// @param  rest         - The slice to split, which is left holding the
+  ///                        text after the token.
+  /// @param  token        - Set to the token.
+  static bool next_token(pj_str_t& rest, pj_str_t& token)
+  {
+    char* ptr = rest.ptr;
+    char* end = rest.ptr + rest.slen;
+    while ((ptr < end) && ((*ptr == ' ') || (*ptr == '\t')))
+    {
+      ++ptr;
+    }
+
+    char* start = ptr;
+    while ((ptr < end) && (*ptr != ' ') && (*ptr != '\t'))
+    {
+      ++ptr;
+    }
+
+    token = slice(start, ptr - start);
+    rest = slice(ptr, end - ptr);
+    return (token.slen > 0);
+  }
+
+  /// Finds a string within a slice.
+  ///
+  /// @returns             - The position of the string, or NULL if it is not
+  ///                        found.
+  static char* find(const pj_str_t& str, const char* needle, size_t len)
+  {
+    char* end = str.ptr + str.slen;
+    char* pos = std::search(str.ptr, end, needle, needle + len);
+    return (pos != end) ? pos : NULL;
+  }
+
+  /// Returns a slice of the specified text.
+  static pj_str_t slice(char* ptr, size_t len)
+  {
+    pj_str_t ret;
+    ret.ptr = ptr;
+    ret.slen = len;
+    return ret;
+  }
+};
+
+
+/// A line of an SDP body (see SdpReader).
+struct SdpLine
+{
+  /// The type of the line, such as 'm' or 'a'.
+  char type;
+
+  /// The value of the line, after the '='.
+  pj_str_t value;
+
+  /// The whole line, including its line ending, for example to erase it
+  /// with a BodyEditor.
+  pj_str_t raw;
+
+  /// Splits an attribute line (a=name:value or a=name) into its name and
+  /// value.
+  ///
+  /// @returns             - false if this is not an attribute line.
+  /// @param  name         - Set to the attribute name.
+  /// @param  attr_value   - Set to the attribute value, or an empty slice.
+  bool attribute(pj_str_t& name, pj_str_t& attr_value) const
+  {
+    if (type != 'a')
+    {
+      return false;
+    }
+
+    char* colon = (char*)memchr(value.ptr, ':', value.slen);
+    if (colon == NULL)
+    {
+      name = value;
+      attr_value = BodyView::slice(value.ptr + value.slen, 0);
+    }
+    else
+    {
+      name = BodyView::slice(value.ptr, colon - value.ptr);
+      attr_value = BodyView::slice(colon + 1, value.ptr + value.slen - colon - 1);
+    }
+    return true;
+  }
+};
+
+
+/// The SdpReader class tokenizes an SDP body into lines without copying it,
+/// for example
+///
+///   SdpReader sdp(BodyView::body(msg));
+///   SdpLine line;
+///   while (sdp.next(line))
+///   {
+///     if (line.type == 'm') ...
+///   }
+///
+/// Lines may end with CRLF or, leniently, a bare LF.  Lines that are not of
+/// the form x=value are skipped.
+///
+class SdpReader
+{
+public:
+  /// Constructor.
+  ///
+  /// @param  body         - The SDP.
+  SdpReader(const pj_str_t& body) :
+    _ptr(body.ptr),
+    _end(body.ptr + body.slen)
+  {
+  }
+
+  /// Reads the next line.
+  ///
+  /// @returns             - false at the end of the body.
+  /// @param  line         - Set to the line.
+  bool next(SdpLine& line)
+  {
+    while (_ptr < _end)
+    {
+      char* start = _ptr;
+      char* eol = (char*)memchr(start, '\n', _end - start);
+      char* next = (eol != NULL) ? eol + 1 : _end;
+      char* value_end = (eol != NULL) ? eol : _end;
+      if ((value_end > start) && (value_end[-1] == '\r'))
+      {
+        --value_end;
+      }
+      _ptr = next;
+
+      if ((value_end - start >= 2) && (start[1] == '='))
+      {
+        line.type = start[0];
+        line.value = BodyView::slice(start + 2, value_end - start - 2);
+        line.raw = BodyView::slice(start, next - start);
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+private:
+  char* _ptr;
+  char* _end;
+};
+
+
+/// A part of a multipart body (see MultipartReader).
+struct MultipartPart
+{
+  /// The part's headers, including the line ending of the last header, or
+  /// an empty slice if the part has none.
+  pj_str_t headers;
+
+  /// The part's body.
+  pj_str_t body;
+
+  /// The whole part, from its delimiter line up to the next delimiter, for
+  /// example to erase it with a BodyEditor.
+  pj_str_t raw;
+
+  /// Returns the value of one of the part's headers, such as Content-Type,
+  /// with surrounding whitespace removed.  Header names are compared ignoring
+  /// case, and folded headers are not supported.
+  ///
+  /// @returns             - false if the part has no such header.
+  /// @param  name         - The header name.
+  /// @param  value        - Set to the value.
+  bool header(const char* name, pj_str_t& value) const
+  {
+    size_t name_len = strlen(name);
+    char* ptr = headers.ptr;
+    char* end = headers.ptr + headers.slen;
+
+    while (ptr < end)
+    {
+      char* eol = (char*)memchr(ptr, '\n', end - ptr);
+      char* line_end = (eol != NULL) ? eol : end;
+      char* colon = (char*)memchr(ptr, ':', line_end - ptr);
+
+      if ((colon != NULL) &&
+          ((size_t)(colon - ptr) == name_len) &&
+          (strncasecmp(ptr, name, name_len) == 0))
+      {
+        char* start = colon + 1;
+        while ((start < line_end) && ((*start == ' ') || (*start == '\t')))
+        {
+          ++start;
+        }
+        while ((line_end > start) &&
+               ((line_end[-1] == '\r') || (line_end[-1] == ' ') || (line_end[-1] == '\t')))
+        {
+          --line_end;
+        }
+        value = BodyView::slice(start, line_end - start);
+        return true;
+      }
+
+      ptr = (eol != NULL) ? eol + 1 : end;
+    }
+
+    return false;
+  }
+};
+
+
+/// The MultipartReader class splits a multipart body, such as the SDP and
+/// PIDF-LO of an emergency call, into its parts without copying it, for
+/// example
+///
+///   MultipartReader parts(msg);
+///   MultipartPart part;
+///   while (parts.next(part)) ...
+///
+/// The boundary is taken from the Content-Type of the message body.
+///
+class MultipartReader
+{
+public:
+  /// The longest boundary allowed by RFC 2046.
+  static const size_t MAX_BOUNDARY = 70;
+
+  /// Constructor.
+  ///
+  /// @param  msg          - The message.  If its body is not multipart, the
+  ///                        reader returns no parts.
+  MultipartReader(const pjsip_msg* msg) :
+    _start(NULL),
+    _ptr(NULL),
+    _end(NULL),
+    _delimiter_len(0)
+  {
+    pj_str_t body = BodyView::body(msg);
+    pj_str_t boundary;
+    if ((msg->body != NULL) &&
+        (find_boundary(msg->body, boundary)) &&
+        (boundary.slen <= (pj_ssize_t)MAX_BOUNDARY))
+    {
+      memcpy(_delimiter, "--", 2);
+      memcpy(_delimiter + 2, boundary.ptr, boundary.slen);
+      _delimiter_len = boundary.slen + 2;
+      _start = body.ptr;
+      _end = body.ptr + body.slen;
+      _ptr = find_delimiter(body.ptr);
+    }
+  }
+
+  /// Reads the next part.
+  ///
+  /// @returns             - false after the last part.
+  /// @param  part         - Set to the part.
+  bool next(MultipartPart& part)
+  {
+    if (_ptr == NULL)
+    {
+      return false;
+    }
+
+    // _ptr is at a delimiter.  The close delimiter is followed by "--".
+    char* start = _ptr;
+    char* ptr = start + _delimiter_len;
+    if ((_end - ptr >= 2) && (ptr[0] == '-') && (ptr[1] == '-'))
+    {
+      _ptr = NULL;
+      return false;
+    }
+
+    // Skip the rest of the delimiter line.
+    char* eol = (char*)memchr(ptr, '\n', _end - ptr);
+    if (eol == NULL)
+    {
+      _ptr = NULL;
+      return false;
+    }
+    ptr = eol + 1;
+
+    // The part runs up to the line ending before the next delimiter.
+    char* next = find_delimiter(ptr);
+    char* content_end = (next != NULL) ? next : _end;
+    char* raw_end = content_end;
+    if ((content_end > ptr) && (content_end[-1] == '\n'))
+    {
+      --content_end;
+      if ((content_end > ptr) && (content_end[-1] == '\r'))
+      {
+        --content_end;
+      }
+    }
+
+    // The headers end at the first empty line.
+    char* body = ptr;
+    part.headers = BodyView::slice(ptr, 0);
+    while (body < content_end)
+    {
+      eol = (char*)memchr(body, '\n', content_end - body);
+      if (eol == NULL)
+      {
+        break;
+      }
+
+      bool empty = ((eol == body) || ((eol == body + 1) && (*body == '\r')));
+      body = eol + 1;
+      if (empty)
+      {
+        break;
+      }
+      part.headers.slen = body - ptr;
+    }
+
+    part.body = BodyView::slice(body, std::max(content_end - body, (pj_ssize_t)0));
+    part.raw = BodyView::slice(start, raw_end - start);
+    _ptr = next;
+    return true;
+  }
+
+private:
+  /// Finds the boundary parameter of the body's Content-Type.
+  static bool find_boundary(const pjsip_msg_body* body, pj_str_t& boundary)
+  {
+    const pjsip_param* param = body->content_type.param.next;
+    while (param != &body->content_type.param)
+    {
+      if ((param->name.slen == 8) &&
+          (strncasecmp(param->name.ptr, "boundary", 8) == 0))
+      {
+        boundary = param->value;
+        if ((boundary.slen >= 2) &&
+            (boundary.ptr[0] == '"') &&
+            (boundary.ptr[boundary.slen - 1] == '"'))
+        {
+          boundary = BodyView::slice(boundary.ptr + 1, boundary.slen - 2);
+        }
+        return (boundary.slen > 0);
+      }
+      param = param->next;
+    }
+
+    return false;
+  }
+
+  /// Finds the next delimiter at or after ptr, which must be at the start of
+  /// a line.
+  char* find_delimiter(char* ptr) const
+  {
+    while (ptr < _end)
+    {
+      char* pos = BodyView::find(BodyView::slice(ptr, _end - ptr), _delimiter, _delimiter_len);
+      if (pos == NULL)
+      {
+        return NULL;
+      }
+
+      if ((pos == _start) || (pos[-1] == '\n'))
+      {
+        return pos;
+      }
+      ptr = pos + 1;
+    }
+
+    return NULL;
+  }
+
+  char* _start;
+  char* _ptr;
+  char* _end;
+  char _delimiter[MAX_BOUNDARY + 2];
+  size_t _delimiter_len;
+};
+
+
+/// The BodyEditor class applies a set of edits to a message body, such as
+/// removing codecs from SDP or rewriting media addresses, found using the
+/// readers above.  Edits are recorded against slices of the body and then
+/// applied together, so the body is only rewritten once.
+///
+/// If the body may be edited in place and the edits do not make it grow, it
+/// is edited in place, with no allocation at all.  Otherwise the new body is
+/// built with a single allocation from the message's pool.  Only edit in
+/// place a body that nothing else shares: lazy clones share the body of the
+/// message they were cloned from (see LazyMsgClone), and requests
+/// instantiated from a RequestTemplate share the body text of the template,
+/// which other threads may be reading.
+///
+/// The replacement text is not copied until apply is called, so must remain
+/// valid until then, and must not point into the body.
+///
+class BodyEditor
+{
+public:
+  /// Constructor.
+  ///
+  /// @param  pool         - The pool of the message.
+  /// @param  msg          - The message whose body to edit.
+  BodyEditor(pj_pool_t* pool, pjsip_msg* msg) :
+    _pool(pool),
+    _msg(msg),
+    _edits()
+  {
+  }
+
+  /// Replaces a slice of the body.
+  ///
+  /// @param  range        - The slice to replace, which must be within the
+  ///                        body and not overlap any other edit.
+  /// @param  text         - The text to replace it with.
+  void replace(const pj_str_t& range, const pj_str_t& text)
+  {
+    Edit edit;
+    edit.start = range.ptr;
+    edit.end = range.ptr + range.slen;
+    edit.text = text;
+    _edits.push_back(edit);
+  }
+
+  /// Removes a slice of the body, such as an SdpLine's raw line.
+  void erase(const pj_str_t& range)
+    {replace(range, BodyView::slice(NULL, 0));}
+
+  /// Inserts text into the body before the specified position.
+  void insert(char* pos, const pj_str_t& text)
+    {replace(BodyView::slice(pos, 0), text);}
+
+  /// Returns the number of pending edits.
+  size_t size() const { return _edits.size(); }
+
+  /// Applies the pending edits to the body.
+  ///
+  /// @returns             - false if the edits are not within the body or
+  ///                        overlap, in which case the body is unchanged.
+  /// @param  in_place     - Whether the body may be edited in place.
+  bool apply(bool in_place)
+  {
+    pjsip_msg_body* body = _msg->body;
+    if (_edits.empty())
+    {
+      return true;
+    }
+    if (body == NULL)
+    {
+      return false;
+    }
+
+    char* data = (char*)body->data;
+    char* data_end = data + body->len;
+    std::stable_sort(_edits.begin(), _edits.end());
+
+    // Check the edits, and whether the body can be edited in place: that
+    // requires the text written never to catch up with the text still to be
+    // read, which holds if the body has shrunk by the end of each edit.
+    pj_ssize_t delta = 0;
+    bool fits = in_place;
+    char* prev_end = data;
+    for (size_t ii = 0; ii < _edits.size(); ++ii)
+    {
+      const Edit& edit = _edits[ii];
+      if ((edit.start < prev_end) || (edit.end < edit.start) || (edit.end > data_end))
+      {
+        _edits.clear();
+        return false;
+      }
+      prev_end = edit.end;
+      delta += edit.text.slen - (edit.end - edit.start);
+      fits = fits && (delta <= 0);
+    }
+
+    size_t len = body->len + delta;
+    char* out = fits ? data : (char*)pj_pool_alloc(_pool, len + 1);
+    char* write = out;
+    char* read = data;
+
+    for (size_t ii = 0; ii < _edits.size(); ++ii)
+    {
+      const Edit& edit = _edits[ii];
+      memmove(write, read, edit.start - read);
+      write += edit.start - read;
+      if (edit.text.slen > 0)
+      {
+        memcpy(write, edit.text.ptr, edit.text.slen);
+        write += edit.text.slen;
+      }
+      read = edit.end;
+    }
+    memmove(write, read, data_end - read);
+
+    if (!fits)
+    {
+      // The body structure may be shared too, so replace it.
+      out[len] = '\0';
+      pjsip_msg_body* new_body = PJ_POOL_ALLOC_T(_pool, pjsip_msg_body);
+      *new_body = *body;
+      new_body->data = out;
+      _msg->body = new_body;
+      body = new_body;
+    }
+    body->len = len;
+
+    _edits.clear();
+    return true;
+  }
+
+private:
+  struct Edit
+  {
+    char* start;
+    char* end;
+    pj_str_t text;
+
+    bool operator<(const Edit& other) const { return start < other.start; }
+  };
+
+  pj_pool_t* _pool;
+  pjsip_msg* _msg;
+  std::vector<Edit> _edits;
+};
+
+#endif
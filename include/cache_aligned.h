@@ -0,0 +1,98 @@
+/**
+ * @file cache_aligned.h  Arrays of objects on cache lines of their own.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef CACHE_ALIGNED_H__
+#define CACHE_ALIGNED_H__
+
+#include <stdlib.h>
+#include <memory>
+#include <new>
+
+/// The CacheAlignedArray class is a fixed-size array of default-constructed
+/// objects, each starting on a cache line of its own and padded to a whole
+/// number of cache lines, so that threads updating different elements never
+/// contend for the same line.  It is used for the per-thread shards of
+/// statistics and tables.
+///
+/// The elements are allocated separately from the array object, so the
+/// object itself has normal alignment and classes holding one by value can
+/// still be created with new.  (Before C++17, new does not honour alignments
+/// beyond that of std::max_align_t, so a class holding an alignas(64) member
+/// by value would be misaligned when created with new.)
+///
+template <class T>
+class CacheAlignedArray
+{
+public:
+  static const size_t CACHE_LINE = 64;
+
+  /// Constructor.
+  ///
+  /// @param  size         - The number of elements.
+  /// @throws std::bad_alloc if the elements cannot be allocated.
+  CacheAlignedArray(size_t size) : _mem(allocate(size)), _size(0)
+  {
+    for (; _size < size; ++_size)
+    {
+      new (address(_size)) T();
+    }
+  }
+
+  ~CacheAlignedArray()
+  {
+    while (_size > 0)
+    {
+      --_size;
+      (*this)[_size].~T();
+    }
+  }
+
+  T& operator[](size_t index) { return *reinterpret_cast<T*>(address(index)); }
+  const T& operator[](size_t index) const
+    {return *reinterpret_cast<const T*>(address(index));}
+
+  size_t size() const { return _size; }
+
+private:
+  CacheAlignedArray(const CacheAlignedArray&);
+  CacheAlignedArray& operator=(const CacheAlignedArray&);
+
+  struct Free
+  {
+    void operator()(char* mem) const { free(mem); }
+  };
+
+  /// The distance between elements, rounded up to whole cache lines.
+  static size_t stride()
+  {
+    return (sizeof(T) + CACHE_LINE - 1) & ~(CACHE_LINE - 1);
+  }
+
+  static char* allocate(size_t size)
+  {
+    void* mem;
+    if (posix_memalign(&mem, CACHE_LINE, stride() * size) != 0)
+    {
+      throw std::bad_alloc();
+    }
+    return (char*)mem;
+  }
+
+  char* address(size_t index) const { return _mem.get() + index * stride(); }
+
+  std::unique_ptr<char, Free> _mem;
+  size_t _size;
+};
+
+template <class T>
+const size_t CacheAlignedArray<T>::CACHE_LINE;
+
+#endif
@@ -0,0 +1,388 @@
+/**
+ * @file dialog_id.h  Interned dialog identifiers for AppServers.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef DIALOG_ID_H__
+#define DIALOG_ID_H__
+
+extern "C" {
+#include <pjsip.h>
+#include <pjlib.h>
+}
+
+#include <stdint.h>
+#include <string.h>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "cache_aligned.h"
+
+/// The DialogId class is a compact handle for an interned dialog identifier
+/// (see DialogIdTable).  Copying, comparing and hashing a DialogId are all
+/// O(1), however long the underlying identifier, which is typically built
+/// from a Call-ID of 70 bytes or more.
+///
+/// A default-constructed DialogId is invalid.  A DialogId for an identifier
+/// that has since been released from the table never compares equal to the
+/// handle of a new identifier, even if the table reuses its storage.
+///
+class DialogId
+{
+public:
+  DialogId() : _handle(0) {}
+  explicit DialogId(uint64_t handle) : _handle(handle) {}
+
+  /// Returns true if this is the handle of an interned identifier.
+  bool valid() const { return (_handle != 0); }
+
+  /// Returns the raw handle, for example to store in a timer context.
+  uint64_t handle() const { return _handle; }
+
+  bool operator==(const DialogId& other) const { return _handle == other._handle; }
+  bool operator!=(const DialogId& other) const { return _handle != other._handle; }
+  bool operator<(const DialogId& other) const { return _handle < other._handle; }
+
+private:
+  uint64_t _handle;
+};
+
+namespace std
+{
+  template <>
+  struct hash<DialogId>
+  {
+    size_t operator()(const DialogId& id) const
+    {
+      // Handles are mostly small slot indexes, so mix the bits.
+      uint64_t hash = id.handle() * 0x9e3779b97f4a7c15ULL;
+      return (size_t)(hash ^ (hash >> 32));
+    }
+  };
+}
+
+/// The DialogIdTable class interns dialog identifier strings, mapping each
+/// distinct identifier to a DialogId for as long as it is referenced.  Each
+/// call to intern takes a reference, which must be dropped with release when
+/// the dialog ends; find looks up an interned identifier without taking a
+/// reference.
+///
+/// Identifiers can be interned and found directly from the Call-ID and tag
+/// of a request, without building a std::string.  The process-wide table is
+/// returned by instance; the table is split into independently locked shards
+/// so that it can be used from all worker threads.
+///
+class DialogIdTable
+{
+public:
+  DialogIdTable() : _shards(NUM_SHARDS) {}
+
+  /// Returns the process-wide table.
+  static DialogIdTable& instance()
+  {
+    static DialogIdTable table;
+    return table;
+  }
+
+  /// Interns a dialog identifier, taking a reference to it.
+  ///
+  /// @returns             - The handle for the identifier.
+  /// @param  dialog_id    - The dialog identifier.
+  DialogId intern(const std::string& dialog_id)
+  {
+    Key key = {dialog_id.data(), dialog_id.size(), NULL, 0, false};
+    return lookup(key, true);
+  }
+
+  /// Interns the default dialog identifier for a request, formed from the
+  /// Call-ID and the specified tag (normally the From tag) as
+  /// "<call-id>;<tag>".
+  ///
+  /// @returns             - The handle for the identifier.
+  /// @param  call_id      - The Call-ID.
+  /// @param  tag          - The tag.
+  DialogId intern(const pj_str_t& call_id, const pj_str_t& tag)
+  {
+    Key key = {call_id.ptr, (size_t)call_id.slen, tag.ptr, (size_t)tag.slen, true};
+    return lookup(key, true);
+  }
+
+  /// Finds an interned dialog identifier, without taking a reference.
+  ///
+  /// @returns             - The handle, or an invalid DialogId if the
+  ///                        identifier is not interned.
+  /// @param  dialog_id    - The dialog identifier.
+  DialogId find(const std::string& dialog_id)
+  {
+    Key key = {dialog_id.data(), dialog_id.size(), NULL, 0, false};
+    return lookup(key, false);
+  }
+
+  /// Finds the default dialog identifier for a request, without taking a
+  /// reference.  See intern.
+  DialogId find(const pj_str_t& call_id, const pj_str_t& tag)
+  {
+    Key key = {call_id.ptr, (size_t)call_id.slen, tag.ptr, (size_t)tag.slen, true};
+    return lookup(key, false);
+  }
+
+  /// Takes an extra reference to an interned identifier.
+  ///
+  /// @returns             - false if the handle is no longer valid.
+  bool add_ref(DialogId id)
+  {
+    Shard* shard = shard_for(id);
+    if (shard == NULL)
+    {
+      return false;
+    }
+
+    std::lock_guard<std::mutex> lock(shard->lock);
+    Slot* slot = get_slot(*shard, id);
+    if (slot == NULL)
+    {
+      return false;
+    }
+
+    ++slot->refs;
+    return true;
+  }
+
+  /// Drops a reference to an interned identifier, removing it from the
+  /// table when the last reference is dropped.  Stale handles are ignored.
+  void release(DialogId id)
+  {
+    Shard* shard = shard_for(id);
+    if (shard == NULL)
+    {
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(shard->lock);
+    Slot* slot = get_slot(*shard, id);
+    if ((slot != NULL) && (--slot->refs == 0))
+    {
+      std::pair<Index::iterator, Index::iterator> range =
+                                          shard->index.equal_range(slot->hash);
+      for (Index::iterator ii = range.first; ii != range.second; ++ii)
+      {
+        if (ii->second == index(id))
+        {
+          shard->index.erase(ii);
+          break;
+        }
+      }
+
+      // Bump the generation so that the stale handle no longer matches.
+      if (++slot->generation == 0)
+      {
+        slot->generation = 1;
+      }
+      slot->str.clear();
+      shard->free.push_back(index(id));
+    }
+  }
+
+  /// Returns the string for an interned identifier.  The string is copied
+  /// while the shard is locked, as another thread may release the
+  /// identifier and reuse its slot as soon as the lock is dropped.
+  ///
+  /// @returns             - The dialog identifier, or an empty string if
+  ///                        the handle is no longer valid.
+  std::string str(DialogId id)
+  {
+    Shard* shard = shard_for(id);
+    if (shard == NULL)
+    {
+      return std::string();
+    }
+
+    std::lock_guard<std::mutex> lock(shard->lock);
+    Slot* slot = get_slot(*shard, id);
+    return (slot != NULL) ? slot->str : std::string();
+  }
+
+  /// Returns the number of interned identifiers.
+  size_t size()
+  {
+    size_t size = 0;
+
+    for (int ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      std::lock_guard<std::mutex> lock(_shards[ii].lock);
+      size += _shards[ii].index.size();
+    }
+
+    return size;
+  }
+
+private:
+  /// Handles hold the slot generation in the top 32 bits, and the slot
+  /// index and shard in the bottom 32 bits.  Generations start at 1, so a
+  /// valid handle is never 0.
+  static const int SHARD_BITS = 4;
+  static const int NUM_SHARDS = 1 << SHARD_BITS;
+
+  /// An identifier being looked up, made of one part, or of two parts to be
+  /// joined with a semi-colon.
+  struct Key
+  {
+    const char* part1;
+    size_t len1;
+    const char* part2;
+    size_t len2;
+    bool joined;
+
+    uint64_t hash() const
+    {
+      // FNV-1a over the identifier as it would be stored.
+      uint64_t hash = 0xcbf29ce484222325ULL;
+      hash = fnv(hash, part1, len1);
+      if (joined)
+      {
+        hash = fnv(hash, ";", 1);
+        hash = fnv(hash, part2, len2);
+      }
+      return hash;
+    }
+
+    bool equals(const std::string& str) const
+    {
+      if (!joined)
+      {
+        return (str.size() == len1) && (memcmp(str.data(), part1, len1) == 0);
+      }
+
+      return (str.size() == len1 + 1 + len2) &&
+             (memcmp(str.data(), part1, len1) == 0) &&
+             (str[len1] == ';') &&
+             (memcmp(str.data() + len1 + 1, part2, len2) == 0);
+    }
+
+    static uint64_t fnv(uint64_t hash, const char* data, size_t len)
+    {
+      for (size_t ii = 0; ii < len; ++ii)
+      {
+        hash ^= (unsigned char)data[ii];
+        hash *= 0x100000001b3ULL;
+      }
+      return hash;
+    }
+  };
+
+  struct Slot
+  {
+    Slot() : str(), hash(0), generation(1), refs(0) {}
+    std::string str;
+    uint64_t hash;
+    uint32_t generation;
+    uint32_t refs;
+  };
+
+  typedef std::unordered_multimap<uint64_t, uint32_t> Index;
+
+  /// One shard of the table.  Slots are held in a deque so that they do not
+  /// move as the shard grows.  The shards are held in a CacheAlignedArray so
+  /// that no two share a cache line.
+  struct Shard
+  {
+    std::mutex lock;
+    Index index;
+    std::deque<Slot> slots;
+    std::vector<uint32_t> free;
+  };
+
+  static uint32_t generation(DialogId id) { return (uint32_t)(id.handle() >> 32); }
+  static uint32_t index(DialogId id) { return (uint32_t)id.handle() >> SHARD_BITS; }
+  static int shard(DialogId id) { return (int)(id.handle() & (NUM_SHARDS - 1)); }
+
+  DialogId lookup(const Key& key, bool take_ref)
+  {
+    uint64_t hash = key.hash();
+    int shard_num = (int)(hash >> (64 - SHARD_BITS));
+    Shard& shard = _shards[shard_num];
+    std::lock_guard<std::mutex> lock(shard.lock);
+
+    std::pair<Index::iterator, Index::iterator> range = shard.index.equal_range(hash);
+    for (Index::iterator ii = range.first; ii != range.second; ++ii)
+    {
+      Slot& slot = shard.slots[ii->second];
+      if (key.equals(slot.str))
+      {
+        if (take_ref)
+        {
+          ++slot.refs;
+        }
+        return make_id(slot.generation, ii->second, shard_num);
+      }
+    }
+
+    if (!take_ref)
+    {
+      return DialogId();
+    }
+
+    uint32_t index;
+    if (!shard.free.empty())
+    {
+      index = shard.free.back();
+      shard.free.pop_back();
+    }
+    else
+    {
+      index = shard.slots.size();
+      shard.slots.push_back(Slot());
+    }
+
+    Slot& slot = shard.slots[index];
+    slot.str.assign(key.part1, key.len1);
+    if (key.joined)
+    {
+      slot.str.append(";").append(key.part2, key.len2);
+    }
+    slot.hash = hash;
+    slot.refs = 1;
+    shard.index.insert(Index::value_type(hash, index));
+    return make_id(slot.generation, index, shard_num);
+  }
+
+  static DialogId make_id(uint32_t generation, uint32_t index, int shard)
+  {
+    return DialogId(((uint64_t)generation << 32) |
+                    ((uint64_t)index << SHARD_BITS) |
+                    (uint64_t)shard);
+  }
+
+  /// Returns the shard for a handle, or NULL if the handle is invalid.
+  Shard* shard_for(DialogId id)
+  {
+    return id.valid() ? &_shards[shard(id)] : NULL;
+  }
+
+  /// Returns the slot for a handle, or NULL if the handle is stale.  The
+  /// shard must be locked.
+  static Slot* get_slot(Shard& shard, DialogId id)
+  {
+    if (index(id) >= shard.slots.size())
+    {
+      return NULL;
+    }
+
+    Slot* slot = &shard.slots[index(id)];
+    return (slot->generation == generation(id)) ? slot : NULL;
+  }
+
+  CacheAlignedArray<Shard> _shards;
+};
+
+#endif
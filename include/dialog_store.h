@@ -0,0 +1,417 @@
+/**
+ * @file dialog_store.h  Shared per-dialog state store for AppServers.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef DIALOG_STORE_H__
+#define DIALOG_STORE_H__
+
+#include <stdint.h>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "cache_aligned.h"
+
+/// The DialogStore class stores typed per-dialog state for a service, keyed
+/// by the dialog identifier the service joined the dialog with (see
+/// AppServerTsxHelper::add_to_dialog and dialog_id).  A service typically
+/// stores state while handling the initial request and looks it up again in
+/// on_in_dialog_request, for example
+///
+///   _store->put(dialog_id(), state, DialogStore<State>::now_ms());
+///
+/// The store is split into independently locked shards so that lookups
+/// from different worker threads rarely contend.  Each shard is an
+/// open-addressing hash table with linear probing: the probe sequence scans
+/// a compact array of hashes, and only touches an entry when the hash
+/// matches.
+///
+/// Memory is bounded: the store is sized for a maximum number of dialogs
+/// when it is created and never grows.  Each entry has an expiry time, and
+/// expired entries are treated as absent and reclaimed lazily, or all at
+/// once by calling expire periodically.  When a shard is full, an insert
+/// first reclaims expired entries along its own probe sequence, and only
+/// sweeps the whole shard if there are none, at most once per millisecond,
+/// so a store that is full of unexpired entries rejects new entries cheaply
+/// rather than scanning the shard under its lock for every one.
+///
+/// The store is keyed by the dialog identifier string by default, or can be
+/// keyed by interned DialogId handles (see dialog_id.h) to avoid hashing and
+/// comparing long strings on every lookup.
+///
+/// T must be default-constructible and copyable.  Lookups copy the state
+/// out, so that it remains consistent if another thread updates it; use
+/// update to modify state in place.
+///
+template <class T, class Key = std::string>
+class DialogStore
+{
+public:
+  /// Constructor.
+  ///
+  /// @param  capacity     - The maximum number of dialogs to store.
+  /// @param  ttl_ms       - The default time for entries to live, in
+  ///                        milliseconds.
+  DialogStore(size_t capacity, uint32_t ttl_ms) :
+    _ttl_ms(ttl_ms),
+    _shards(NUM_SHARDS)
+  {
+    // Size each shard so it is at most 3/4 full at capacity.
+    size_t shard_capacity = (capacity + NUM_SHARDS - 1) / NUM_SHARDS;
+    size_t slots = 8;
+    while (slots * 3 < shard_capacity * 4)
+    {
+      slots <<= 1;
+    }
+
+    for (int ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      _shards[ii].init(slots, shard_capacity);
+    }
+  }
+
+  /// Stores the state for a dialog, replacing any existing state and
+  /// restarting its expiry time.
+  ///
+  /// @returns             - false if the store is full.
+  /// @param  dialog_id    - The dialog identifier.
+  /// @param  state        - The state to store.
+  /// @param  now_ms       - The current time in milliseconds.
+  /// @param  ttl_ms       - The time for the entry to live, or 0 to use the
+  ///                        default.
+  bool put(const Key& dialog_id,
+           const T& state,
+           uint64_t now_ms,
+           uint32_t ttl_ms = 0)
+  {
+    uint64_t hash = hash_key(dialog_id);
+    Shard& shard = shard_for(hash);
+    std::lock_guard<std::mutex> lock(shard.lock);
+    size_t slot = shard.find(hash, dialog_id, now_ms);
+
+    if (slot == NOT_FOUND)
+    {
+      slot = shard.insert(hash, dialog_id, now_ms);
+
+      if (slot == NOT_FOUND)
+      {
+        return false;
+      }
+    }
+
+    Entry& entry = shard.entries[slot];
+    entry.state = state;
+    entry.expiry = now_ms + ((ttl_ms != 0) ? ttl_ms : _ttl_ms);
+    return true;
+  }
+
+  /// Looks up the state for a dialog.
+  ///
+  /// @returns             - true if the dialog has unexpired state.
+  /// @param  dialog_id    - The dialog identifier.
+  /// @param  state        - Set to a copy of the state if found.
+  /// @param  now_ms       - The current time in milliseconds.
+  bool get(const Key& dialog_id, T& state, uint64_t now_ms)
+  {
+    uint64_t hash = hash_key(dialog_id);
+    Shard& shard = shard_for(hash);
+    std::lock_guard<std::mutex> lock(shard.lock);
+    size_t slot = shard.find(hash, dialog_id, now_ms);
+
+    if (slot == NOT_FOUND)
+    {
+      return false;
+    }
+
+    state = shard.entries[slot].state;
+    return true;
+  }
+
+  /// Modifies the state for a dialog in place, and restarts its expiry time.
+  /// The function is called with the shard locked, so must be quick and must
+  /// not call back into the store.
+  ///
+  /// @returns             - true if the dialog has unexpired state.
+  /// @param  dialog_id    - The dialog identifier.
+  /// @param  now_ms       - The current time in milliseconds.
+  /// @param  fn           - The function to apply to the state.
+  /// @param  ttl_ms       - The time for the entry to live, or 0 to use the
+  ///                        default.
+  bool update(const Key& dialog_id,
+              uint64_t now_ms,
+              const std::function<void(T&)>& fn,
+              uint32_t ttl_ms = 0)
+  {
+    uint64_t hash = hash_key(dialog_id);
+    Shard& shard = shard_for(hash);
+    std::lock_guard<std::mutex> lock(shard.lock);
+    size_t slot = shard.find(hash, dialog_id, now_ms);
+
+    if (slot == NOT_FOUND)
+    {
+      return false;
+    }
+
+    Entry& entry = shard.entries[slot];
+    fn(entry.state);
+    entry.expiry = now_ms + ((ttl_ms != 0) ? ttl_ms : _ttl_ms);
+    return true;
+  }
+
+  /// Removes the state for a dialog, for example when the dialog ends.
+  ///
+  /// @returns             - true if there was state for the dialog.
+  /// @param  dialog_id    - The dialog identifier.
+  bool erase(const Key& dialog_id)
+  {
+    uint64_t hash = hash_key(dialog_id);
+    Shard& shard = shard_for(hash);
+    std::lock_guard<std::mutex> lock(shard.lock);
+    size_t slot = shard.find(hash, dialog_id, 0);
+
+    if (slot == NOT_FOUND)
+    {
+      return false;
+    }
+
+    shard.remove(slot);
+    return true;
+  }
+
+  /// Removes all expired entries.
+  ///
+  /// @returns             - The number of entries removed.
+  /// @param  now_ms       - The current time in milliseconds.
+  size_t expire(uint64_t now_ms)
+  {
+    size_t removed = 0;
+
+    for (int ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      std::lock_guard<std::mutex> lock(_shards[ii].lock);
+      removed += _shards[ii].expire(now_ms);
+    }
+
+    return removed;
+  }
+
+  /// Returns the number of entries stored, including any that have expired
+  /// but not yet been removed.
+  size_t size()
+  {
+    size_t size = 0;
+
+    for (int ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      std::lock_guard<std::mutex> lock(_shards[ii].lock);
+      size += _shards[ii].count;
+    }
+
+    return size;
+  }
+
+  /// Returns the current time in milliseconds from a monotonic clock.
+  static uint64_t now_ms()
+  {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+private:
+  static const int NUM_SHARDS = 64;
+  static const size_t NOT_FOUND = (size_t)-1;
+
+  struct Entry
+  {
+    Entry() : key(), state(), expiry(0) {}
+    Key key;
+    T state;
+    uint64_t expiry;
+  };
+
+  /// One shard of the store.  A hash of zero marks an empty slot.  The
+  /// shards are held in a CacheAlignedArray so that no two share a cache
+  /// line.
+  struct Shard
+  {
+    void init(size_t slots, size_t max_count)
+    {
+      mask = slots - 1;
+      max = max_count;
+      count = 0;
+      last_sweep_ms = 0;
+      hashes.assign(slots, 0);
+      entries.resize(slots);
+    }
+
+    /// Finds the slot holding a key, removing the entry if it has expired
+    /// (unless now_ms is 0, which skips the expiry check).
+    size_t find(uint64_t hash, const Key& key, uint64_t now_ms)
+    {
+      for (size_t slot = hash & mask; hashes[slot] != 0; slot = (slot + 1) & mask)
+      {
+        if ((hashes[slot] == hash) && (entries[slot].key == key))
+        {
+          if ((now_ms != 0) && (entries[slot].expiry <= now_ms))
+          {
+            remove(slot);
+            return NOT_FOUND;
+          }
+
+          return slot;
+        }
+      }
+
+      return NOT_FOUND;
+    }
+
+    /// Inserts a key known not to be present, returning its slot.
+    size_t insert(uint64_t hash, const Key& key, uint64_t now_ms)
+    {
+      if ((count >= max) && (!reclaim(hash, now_ms)))
+      {
+        return NOT_FOUND;
+      }
+
+      size_t slot = hash & mask;
+      while (hashes[slot] != 0)
+      {
+        slot = (slot + 1) & mask;
+      }
+
+      hashes[slot] = hash;
+      entries[slot].key = key;
+      ++count;
+      return slot;
+    }
+
+    /// Removes the entry in a slot, shifting back any later entries in the
+    /// same probe sequence so that no tombstones are needed.
+    void remove(size_t slot)
+    {
+      size_t next = slot;
+
+      while (true)
+      {
+        next = (next + 1) & mask;
+
+        if (hashes[next] == 0)
+        {
+          break;
+        }
+
+        // The entry at next can move into the gap unless its home slot lies
+        // cyclically in (slot, next].
+        size_t home = hashes[next] & mask;
+        bool stays = (slot <= next) ? ((slot < home) && (home <= next)) :
+                                      ((slot < home) || (home <= next));
+
+        if (!stays)
+        {
+          hashes[slot] = hashes[next];
+          std::swap(entries[slot], entries[next]);
+          slot = next;
+        }
+      }
+
+      hashes[slot] = 0;
+      entries[slot] = Entry();
+      --count;
+    }
+
+    /// Makes room in a full shard, returning true if any entries were
+    /// removed.  Expired entries along the probe sequence of the new key
+    /// are removed first, which only touches the slots the insert would
+    /// scan anyway.  If there are none, the whole shard is swept, but at
+    /// most once per millisecond.
+    bool reclaim(uint64_t hash, uint64_t now_ms)
+    {
+      size_t removed = 0;
+      size_t slot = hash & mask;
+
+      while (hashes[slot] != 0)
+      {
+        if (entries[slot].expiry <= now_ms)
+        {
+          // Removing shifts a later entry into this slot, so check it again.
+          remove(slot);
+          ++removed;
+        }
+        else
+        {
+          slot = (slot + 1) & mask;
+        }
+      }
+
+      if ((removed == 0) && (now_ms > last_sweep_ms))
+      {
+        last_sweep_ms = now_ms;
+        removed = expire(now_ms);
+      }
+
+      return (removed > 0);
+    }
+
+    size_t expire(uint64_t now_ms)
+    {
+      size_t removed = 0;
+      size_t slot = 0;
+
+      while (slot <= mask)
+      {
+        if ((hashes[slot] != 0) && (entries[slot].expiry <= now_ms))
+        {
+          // Removing shifts a later entry into this slot, so check it again.
+          remove(slot);
+          ++removed;
+        }
+        else
+        {
+          ++slot;
+        }
+      }
+
+      return removed;
+    }
+
+    std::mutex lock;
+    size_t mask;
+    size_t max;
+    size_t count;
+    uint64_t last_sweep_ms;
+    std::vector<uint64_t> hashes;
+    std::vector<Entry> entries;
+  };
+
+  static uint64_t hash_key(const Key& key)
+  {
+    // Mix the standard hash so that both the low bits (used for the slot)
+    // and the high bits (used for the shard) are well distributed.
+    uint64_t hash = std::hash<Key>()(key);
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return (hash != 0) ? hash : 1;
+  }
+
+  Shard& shard_for(uint64_t hash)
+  {
+    return _shards[hash >> 58];
+  }
+
+  uint32_t _ttl_ms;
+  CacheAlignedArray<Shard> _shards;
+};
+
+#endif
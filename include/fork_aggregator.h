@@ -0,0 +1,385 @@
+/**
+ * @file fork_aggregator.h  Fork tracking and response aggregation for
+ * AppServers.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef FORK_AGGREGATOR_H__
+#define FORK_AGGREGATOR_H__
+
+#include <algorithm>
+#include <vector>
+
+#include "appserver.h"
+
+/// The ResponseSelector class decides which of the final responses received
+/// on the forks of a transaction is forwarded upstream.
+///
+/// The default policy follows RFC 3261 section 16.7: a 2xx or 6xx response
+/// ends the transaction immediately, and otherwise the best response is the
+/// one of the lowest class, preferring lower status codes within a class.
+/// Derive from this class to change the policy.
+///
+class ResponseSelector
+{
+public:
+  /// Virtual destructor.
+  virtual ~ResponseSelector() {}
+
+  /// Returns true if a final response with this status code should be
+  /// forwarded immediately, cancelling any other forks.
+  ///
+  /// @param  status_code  - The status code of the response.
+  virtual bool terminates(int status_code) const
+  {
+    return (PJSIP_IS_STATUS_IN_CLASS(status_code, 200) ||
+            PJSIP_IS_STATUS_IN_CLASS(status_code, 600));
+  }
+
+  /// Returns true if a final response is better than the best seen so far.
+  ///
+  /// @param  status_code  - The status code of the new response.
+  /// @param  best_code    - The status code of the best response so far.
+  virtual bool better(int status_code, int best_code) const
+  {
+    return (rank(status_code) < rank(best_code));
+  }
+
+protected:
+  /// Ranks a status code, lower being better.  Classes are ranked 2xx, 6xx,
+  /// 3xx, 4xx then 5xx.
+  static int rank(int status_code)
+  {
+    int status_class = status_code / 100;
+    int class_rank = (status_class == 6) ? 1 : status_class;
+    return (class_rank * 1000) + status_code;
+  }
+};
+
+
+/// The PreferenceSelector class is a ResponseSelector that prefers a list of
+/// status codes, in order, over all others, for example to forward a 486
+/// Busy Here in preference to a 480 Temporarily Unavailable.  Responses that
+/// are not in the list are compared using the default policy.
+///
+class PreferenceSelector : public ResponseSelector
+{
+public:
+  /// Constructor.
+  ///
+  /// @param  preferred    - The preferred status codes, best first.
+  PreferenceSelector(const std::vector<int>& preferred) :
+    _preferred(preferred) {}
+
+  bool better(int status_code, int best_code) const
+  {
+    size_t pos = position(status_code);
+    size_t best_pos = position(best_code);
+
+    if (pos != best_pos)
+    {
+      return (pos < best_pos);
+    }
+
+    return ResponseSelector::better(status_code, best_code);
+  }
+
+private:
+  size_t position(int status_code) const
+  {
+    return std::find(_preferred.begin(), _preferred.end(), status_code) -
+           _preferred.begin();
+  }
+
+  std::vector<int> _preferred;
+};
+
+
+/// The ForkAggregatorTsx class is a base class for services that fork a
+/// request and want control over which final response is forwarded.
+///
+/// Services send forks using fork_request or fork_requests, which record the
+/// state of each fork.  As final responses arrive, only the best so far is
+/// kept, and the others are freed straight away, so no responses need to be
+/// cloned or buffered.  When a response arrives that terminates the
+/// transaction (see ResponseSelector), it is forwarded and all the forks
+/// still pending are cancelled in a single cancel_forks call.  Otherwise,
+/// once every fork has completed, on_forks_complete is called with the best
+/// response, which by default forwards it.  Provisional responses other than
+/// 100 Trying are forwarded as they arrive.
+///
+/// As RFC 3261 section 16.7 requires, every 2xx response to an INVITE is
+/// forwarded, even if it arrives on a fork that has been cancelled or after
+/// another fork has answered the transaction, and a 2xx to an INVITE always
+/// terminates the transaction whatever the selection policy.
+///
+/// Services can override on_forks_complete to act on the best response
+/// instead, for example to try further targets, which they can fork with
+/// fork_request as normal.
+///
+class ForkAggregatorTsx : public AppServerTsx
+{
+public:
+  /// Constructor.
+  ///
+  /// @param  selector     - The response selection policy.  This is not
+  ///                        copied, so must outlive the transaction.  If
+  ///                        NULL, the default policy is used.
+  ForkAggregatorTsx(const ResponseSelector* selector = NULL) :
+    AppServerTsx(),
+    _selector((selector != NULL) ? selector : &default_selector()),
+    _forks(),
+    _cancel_ids(),
+    _pending(0),
+    _best(NULL),
+    _best_fork(-1),
+    _terminated(false)
+  {
+  }
+
+  /// Frees any response still held, for example if the transaction is
+  /// cancelled.
+  virtual ~ForkAggregatorTsx()
+  {
+    if ((_best != NULL) && (helper() != NULL))
+    {
+      free_msg(_best);
+    }
+  }
+
+  /// Aggregates the responses received on the forks.  Services that
+  /// override this should call it for responses on aggregated forks.
+  virtual void on_response(pjsip_msg* rsp, int fork_id)
+  {
+    int status_code = rsp->line.status.code;
+
+    if (status_code < PJSIP_SC_OK)
+    {
+      if ((status_code != PJSIP_SC_TRYING) && (!_terminated))
+      {
+        send_response(rsp);
+      }
+      else
+      {
+        free_msg(rsp);
+      }
+      return;
+    }
+
+    bool was_pending = complete_fork(fork_id);
+    bool invite_2xx = ((PJSIP_IS_STATUS_IN_CLASS(status_code, 200)) &&
+                       (PJSIP_MSG_CSEQ_HDR(rsp) != NULL) &&
+                       (PJSIP_MSG_CSEQ_HDR(rsp)->method.id == PJSIP_INVITE_METHOD));
+
+    if ((_terminated) || (!was_pending))
+    {
+      if (!invite_2xx)
+      {
+        // The transaction has already been answered, or this is a response
+        // on a fork that was cancelled, so there is nothing to do with it.
+        free_msg(rsp);
+        return;
+      }
+      else if (_terminated)
+      {
+        // RFC 3261 section 16.7 requires every 2xx to an INVITE to be
+        // forwarded, even after the transaction has been answered, so that
+        // the UAC can ACK or BYE every callee that answered.
+        send_response(rsp);
+        return;
+      }
+
+      // Otherwise this is a 2xx on a fork that was cancelled before the
+      // transaction was answered, which answers the transaction.
+    }
+
+    if ((invite_2xx) || (_selector->terminates(status_code)))
+    {
+      _terminated = true;
+
+      if (_best != NULL)
+      {
+        free_msg(_best);
+      }
+
+      send_response(rsp);
+      cancel_pending_forks(status_code);
+      return;
+    }
+
+    if ((_best == NULL) || (_selector->better(status_code, _best->line.status.code)))
+    {
+      if (_best != NULL)
+      {
+        free_msg(_best);
+      }
+      _best = rsp;
+      _best_fork = fork_id;
+    }
+    else
+    {
+      free_msg(rsp);
+    }
+
+    if (_pending == 0)
+    {
+      pjsip_msg* best = _best;
+      int best_fork = _best_fork;
+      _best = NULL;
+      _best_fork = -1;
+      on_forks_complete(best, best_fork);
+    }
+  }
+
+protected:
+  /// Called when every fork has completed without a terminating response.
+  /// The implementation must either forward or free the best response, and
+  /// may also send further forks.
+  ///
+  /// @param  rsp          - The best final response.  This is owned by the
+  ///                        AppServerTsx.
+  /// @param  fork_id      - The fork the best response was received on.
+  virtual void on_forks_complete(pjsip_msg* rsp, int fork_id)
+  {
+    send_response(rsp);
+  }
+
+  /// Sends a request on a new aggregated fork.
+  ///
+  /// @returns             - The ID of the fork.
+  /// @param  req          - The request to send.
+  int fork_request(pjsip_msg*& req)
+  {
+    int fork_id = send_request(req);
+    start_fork(fork_id);
+    return fork_id;
+  }
+
+  /// Forks a request to a set of targets on new aggregated forks.  See
+  /// AppServerTsxHelper::send_requests.
+  ///
+  /// @param  req          - The base request message, which is consumed.
+  /// @param  targets      - The targets to fork the request to.
+  /// @param  fork_ids     - The IDs of the forks are appended to this vector.
+  void fork_requests(pjsip_msg*& req,
+                     const std::vector<ForkTarget>& targets,
+                     std::vector<int>& fork_ids)
+  {
+    size_t first = fork_ids.size();
+    send_requests(req, targets, fork_ids);
+
+    for (size_t ii = first; ii < fork_ids.size(); ++ii)
+    {
+      start_fork(fork_ids[ii]);
+    }
+  }
+
+  /// Cancels all pending forks in one batch.
+  ///
+  /// @param  st_code      - SIP status code for the Reason header of the
+  ///                        CANCEL requests, or 0 for none.
+  void cancel_pending_forks(int st_code = 0)
+  {
+    _cancel_ids.clear();
+
+    for (size_t ii = 0; ii < _forks.size(); ++ii)
+    {
+      if (_forks[ii] == PENDING)
+      {
+        _forks[ii] = CANCELLED;
+        _cancel_ids.push_back((int)ii);
+      }
+    }
+
+    _pending = 0;
+
+    if (!_cancel_ids.empty())
+    {
+      cancel_forks(_cancel_ids,
+                   st_code,
+                   PJSIP_IS_STATUS_IN_CLASS(st_code, 200) ?
+                     "Call completed elsewhere" : "");
+    }
+  }
+
+  /// Reserves space for the state of the forks with IDs below the specified
+  /// number, so that starting and cancelling those forks does not allocate.
+  ///
+  /// @param  num_forks    - The number of forks to reserve space for.
+  void reserve_forks(size_t num_forks)
+  {
+    _forks.reserve(num_forks);
+    _cancel_ids.reserve(num_forks);
+  }
+
+  /// Returns the number of forks still waiting for a final response.
+  int pending_forks() const { return _pending; }
+
+  /// Returns true if a terminating response has been forwarded.
+  bool terminated() const { return _terminated; }
+
+  /// Returns the response selection policy.
+  const ResponseSelector* selector() const { return _selector; }
+
+private:
+  enum ForkState
+  {
+    UNUSED,
+    PENDING,
+    COMPLETE,
+    CANCELLED
+  };
+
+  static const ResponseSelector& default_selector()
+  {
+    static const ResponseSelector selector;
+    return selector;
+  }
+
+  void start_fork(int fork_id)
+  {
+    if (fork_id < 0)
+    {
+      return;
+    }
+
+    if ((size_t)fork_id >= _forks.size())
+    {
+      _forks.resize(fork_id + 1, UNUSED);
+    }
+
+    _forks[fork_id] = PENDING;
+    ++_pending;
+  }
+
+  /// Marks a fork as complete, returning true if it was pending.
+  bool complete_fork(int fork_id)
+  {
+    if ((fork_id < 0) ||
+        ((size_t)fork_id >= _forks.size()) ||
+        (_forks[fork_id] != PENDING))
+    {
+      return false;
+    }
+
+    _forks[fork_id] = COMPLETE;
+    --_pending;
+    return true;
+  }
+
+  const ResponseSelector* _selector;
+  std::vector<ForkState> _forks;
+  std::vector<int> _cancel_ids;
+  int _pending;
+  pjsip_msg* _best;
+  int _best_fork;
+  bool _terminated;
+};
+
+#endif
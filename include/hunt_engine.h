@@ -0,0 +1,326 @@
+/**
+ * @file hunt_engine.h  Serial hunting for AppServers.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef HUNT_ENGINE_H__
+#define HUNT_ENGINE_H__
+
+#include <stdint.h>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include "fork_aggregator.h"
+
+/// One target of a serial hunt.
+struct HuntTarget
+{
+  HuntTarget(pjsip_uri* uri = NULL, int timeout_ms = 0, int weight = 1) :
+    uri(uri), timeout_ms(timeout_ms), weight(weight) {}
+
+  /// The Request-URI to send the request to.
+  pjsip_uri* uri;
+
+  /// How long to wait for a final response before moving on to the next
+  /// target, in milliseconds, or 0 to wait indefinitely.
+  int timeout_ms;
+
+  /// The relative weight of the target, for weighted plans.  Targets of
+  /// weight 0 are only tried once every target with a positive weight has
+  /// been.
+  int weight;
+};
+
+
+/// The HuntPlan class is the pre-computed list of targets for a serial hunt,
+/// typically built when the AppServer is created and shared by all its
+/// transactions.  It is read-only once built, so can be used from any
+/// thread.
+///
+/// The targets of an ordered plan are tried in the order they were added.
+/// The targets of a weighted plan are tried in a different random order on
+/// each transaction, where the chance of a target being tried before others
+/// is proportional to its weight, as for DNS SRV records.
+///
+class HuntPlan
+{
+public:
+  /// Constructor.
+  ///
+  /// @param  weighted     - Whether to order the targets by weight.
+  HuntPlan(bool weighted = false) : _targets(), _weighted(weighted) {}
+
+  /// Adds a target to the plan.
+  ///
+  /// @param  uri          - The target Request-URI.  This is not copied, so
+  ///                        must be allocated from a pool that outlives the
+  ///                        plan.
+  /// @param  timeout_ms   - The time to wait for a final response from the
+  ///                        target, in milliseconds, or 0 to wait
+  ///                        indefinitely.
+  /// @param  weight       - The weight of the target, for weighted plans.
+  ///                        Targets of weight 0 are tried last.
+  ///
+  /// @throws std::invalid_argument if the weight is negative.
+  void add_target(pjsip_uri* uri, int timeout_ms = 0, int weight = 1)
+  {
+    if (weight < 0)
+    {
+      throw std::invalid_argument("Hunt target weight must not be negative");
+    }
+    _targets.push_back(HuntTarget(uri, timeout_ms, weight));
+  }
+
+  const std::vector<HuntTarget>& targets() const { return _targets; }
+  size_t size() const { return _targets.size(); }
+  bool weighted() const { return _weighted; }
+
+private:
+  std::vector<HuntTarget> _targets;
+  bool _weighted;
+};
+
+
+/// The HuntAppServerTsx class tries the targets of a HuntPlan one at a time
+/// until one answers.
+///
+/// The request is sent to each target in turn as a lazy clone of the
+/// received request with only the Request-URI changed.  The hunt moves on to
+/// the next target when the current one returns a final response that does
+/// not terminate the transaction (see ResponseSelector), or when its timeout
+/// expires, in which case the fork is cancelled.  The hunt ends when a
+/// target returns a terminating response, which is forwarded, or when every
+/// target has been tried, in which case the best response received is
+/// forwarded, or a 480 Temporarily Unavailable if every target timed out.
+///
+/// A target that answers with a 2xx after its timeout has expired, and its
+/// fork been cancelled, still answers the call: the 2xx is forwarded and the
+/// target being tried at the time is cancelled (see ForkAggregatorTsx).
+///
+/// The state of the forks is reserved for the whole plan when the hunt
+/// starts, so no memory is allocated for each step beyond the forked request
+/// itself; weighted plans allocate the order of the targets from the
+/// transaction's scratch arena once.
+///
+/// Services can derive from this class to modify the request before the
+/// hunt starts, by overriding on_initial_request and calling
+/// start_hunt.
+///
+class HuntAppServerTsx : public ForkAggregatorTsx
+{
+public:
+  /// Constructor.
+  ///
+  /// @param  plan         - The targets to hunt.  This is not copied, so must
+  ///                        outlive the transaction.
+  /// @param  selector     - The response selection policy, or NULL to use
+  ///                        the default.
+  HuntAppServerTsx(const HuntPlan* plan, const ResponseSelector* selector = NULL) :
+    ForkAggregatorTsx(selector),
+    _plan(plan),
+    _order(NULL),
+    _next(0),
+    _base(NULL),
+    _hunt_best(NULL),
+    _current_fork(-1),
+    _timer(0)
+  {
+  }
+
+  virtual ~HuntAppServerTsx()
+  {
+    if (helper() != NULL)
+    {
+      if (_base != NULL)
+      {
+        free_msg(_base);
+      }
+
+      if (_hunt_best != NULL)
+      {
+        free_msg(_hunt_best);
+      }
+    }
+  }
+
+  virtual void on_initial_request(pjsip_msg* req)
+  {
+    start_hunt(req);
+  }
+
+  virtual void on_response(pjsip_msg* rsp, int fork_id)
+  {
+    if ((rsp->line.status.code >= PJSIP_SC_OK) && (fork_id == _current_fork))
+    {
+      cancel_timer(_timer);
+    }
+
+    ForkAggregatorTsx::on_response(rsp, fork_id);
+
+    if (terminated())
+    {
+      // This may be a 2xx from a target that answered just after its
+      // timeout, which has been forwarded and cancelled the current target,
+      // so stop its timer too.
+      cancel_timer(_timer);
+      end_hunt();
+    }
+  }
+
+  virtual void on_timer_expiry(void* context)
+  {
+    // The current target has not answered in time, so give up on it.
+    cancel_pending_forks();
+    try_next();
+  }
+
+  virtual void on_cancel(int status_code)
+  {
+    cancel_timer(_timer);
+    end_hunt();
+  }
+
+protected:
+  /// Starts the hunt.
+  ///
+  /// @param  req          - The request to send to each target, which is
+  ///                        owned by the hunt from now on.
+  void start_hunt(pjsip_msg* req)
+  {
+    _base = req;
+    reserve_forks(_plan->size());
+
+    if (_plan->weighted())
+    {
+      order_by_weight();
+    }
+
+    try_next();
+  }
+
+  /// Keeps the better of the response from the last target and the best so
+  /// far, and moves on to the next target.
+  virtual void on_forks_complete(pjsip_msg* rsp, int fork_id)
+  {
+    if ((_hunt_best == NULL) ||
+        (selector()->better(rsp->line.status.code, _hunt_best->line.status.code)))
+    {
+      if (_hunt_best != NULL)
+      {
+        free_msg(_hunt_best);
+      }
+      _hunt_best = rsp;
+    }
+    else
+    {
+      free_msg(rsp);
+    }
+
+    try_next();
+  }
+
+private:
+  /// Sends the request to the next target, or ends the hunt if there are
+  /// none left.
+  void try_next()
+  {
+    if (_next >= _plan->size())
+    {
+      pjsip_msg* rsp = _hunt_best;
+      _hunt_best = NULL;
+
+      if (rsp == NULL)
+      {
+        rsp = create_response(_base, PJSIP_SC_TEMPORARILY_UNAVAILABLE);
+      }
+
+      send_response(rsp);
+      end_hunt();
+      return;
+    }
+
+    size_t index = (_order != NULL) ? _order[_next] : _next;
+    const HuntTarget& target = _plan->targets()[index];
+    ++_next;
+
+    pjsip_msg* fork = lazy_clone_request(_base);
+    fork->line.req.uri = (pjsip_uri*)pjsip_uri_clone(get_pool(fork), target.uri);
+    _current_fork = fork_request(fork);
+
+    if (target.timeout_ms > 0)
+    {
+      schedule_timer(NULL, _timer, target.timeout_ms);
+    }
+  }
+
+  /// Frees the messages held by the hunt once it has finished.
+  void end_hunt()
+  {
+    _next = _plan->size();
+    _current_fork = -1;
+
+    if (_base != NULL)
+    {
+      free_msg(_base);
+    }
+
+    if (_hunt_best != NULL)
+    {
+      free_msg(_hunt_best);
+    }
+  }
+
+  /// Picks the order of the targets, weighted at random.
+  void order_by_weight()
+  {
+    static thread_local std::minstd_rand rng(std::random_device{}());
+
+    size_t num = _plan->size();
+    const std::vector<HuntTarget>& targets = _plan->targets();
+    _order = scratch().allocate_array<uint32_t>(num);
+
+    uint64_t total = 0;
+    for (size_t ii = 0; ii < num; ++ii)
+    {
+      _order[ii] = (uint32_t)ii;
+      total += targets[ii].weight;
+    }
+
+    for (size_t ii = 0; (ii + 1 < num) && (total > 0); ++ii)
+    {
+      // Pick one of the remaining targets in proportion to its weight, and
+      // move it into this position.
+      uint64_t pick = rng() % total;
+      size_t jj = ii;
+      while ((jj + 1 < num) && (pick >= (uint64_t)targets[_order[jj]].weight))
+      {
+        pick -= targets[_order[jj]].weight;
+        ++jj;
+      }
+
+      std::swap(_order[ii], _order[jj]);
+      total -= targets[_order[ii]].weight;
+    }
+  }
+
+  const HuntPlan* _plan;
+  uint32_t* _order;
+  size_t _next;
+  pjsip_msg* _base;
+
+  /// The best final response from the targets tried so far.  This is
+  /// distinct from the ForkAggregatorTsx's best response, which is only for
+  /// the current target.
+  pjsip_msg* _hunt_best;
+  int _current_fork;
+  TimerID _timer;
+};
+
+#endif
@@ -0,0 +1,209 @@
+/**
+ * @file request_template.h  Pre-parsed templates for requests that
+ * AppServers originate.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef REQUEST_TEMPLATE_H__
+#define REQUEST_TEMPLATE_H__
+
+extern "C" {
+#include <pjsip.h>
+#include <pjlib.h>
+}
+
+#include <string.h>
+#include <string>
+
+/// The RequestTemplate class holds the skeleton of a request that a service
+/// originates, such as the INVITEs of a click-to-dial service, parsed once
+/// when the service starts rather than for every request.
+///
+/// Each request is instantiated from the template by filling in its slots:
+/// the Request-URI, the From and To URIs and tags, the Call-ID and the CSeq
+/// number.  Everything else, including the method, the other headers and the
+/// body, comes from the template.  Like a lazy clone (see LazyMsgClone), the
+/// request gets its own shallow copy of each header and of the body
+/// structure, so headers can be added, removed or have fields reassigned,
+/// but shares everything the headers point at, and the body text, with the
+/// template until made writable with the LazyMsgClone::writable_* methods.
+/// The template is shared between threads, so these must never be modified
+/// in place, and a BodyEditor must not edit such a body in place.
+///
+/// A template is read-only once parsed, so may be shared by any number of
+/// threads, and must outlive every request instantiated from it.
+///
+class RequestTemplate
+{
+public:
+  /// The values of the slots for one request.  A slot that is not set keeps
+  /// the value in the template.  The values are copied into the request, so
+  /// need not outlive the call.
+  struct Values
+  {
+    Values() :
+      request_uri(NULL),
+      from_uri(NULL),
+      to_uri(NULL),
+      cseq(-1)
+    {
+      from_tag.ptr = NULL;
+      from_tag.slen = 0;
+      to_tag.ptr = NULL;
+      to_tag.slen = 0;
+      call_id.ptr = NULL;
+      call_id.slen = 0;
+    }
+
+    pjsip_uri* request_uri;
+    pjsip_uri* from_uri;
+    pj_str_t from_tag;
+    pjsip_uri* to_uri;
+    pj_str_t to_tag;
+    pj_str_t call_id;
+    int cseq;
+  };
+
+  /// Constructor.
+  ///
+  /// @param  factory      - The factory for the pool holding the template.
+  RequestTemplate(pj_pool_factory* factory) :
+    _pool(pj_pool_create(factory, "request-template", 1024, 1024, NULL)),
+    _msg(NULL),
+    _from(NULL),
+    _to(NULL),
+    _call_id(NULL),
+    _cseq(NULL)
+  {
+  }
+
+  ~RequestTemplate()
+  {
+    pj_pool_release(_pool);
+  }
+
+  /// Parses the template.  The text must be a complete SIP request with
+  /// From, To, Call-ID and CSeq headers, whose values are the defaults for
+  /// the slots.
+  ///
+  /// @returns             - true if the template was parsed.
+  /// @param  text         - The text of the request.
+  bool parse(const std::string& text)
+  {
+    char* buf = (char*)pj_pool_alloc(_pool, text.size() + 1);
+    memcpy(buf, text.data(), text.size());
+    buf[text.size()] = '\0';
+
+    pjsip_msg* msg = pjsip_parse_msg(_pool, buf, text.size(), NULL);
+
+    if ((msg == NULL) ||
+        (msg->type != PJSIP_REQUEST_MSG) ||
+        (PJSIP_MSG_FROM_HDR(msg) == NULL) ||
+        (PJSIP_MSG_TO_HDR(msg) == NULL) ||
+        (PJSIP_MSG_CID_HDR(msg) == NULL) ||
+        (PJSIP_MSG_CSEQ_HDR(msg) == NULL))
+    {
+      return false;
+    }
+
+    _msg = msg;
+    _from = PJSIP_MSG_FROM_HDR(msg);
+    _to = PJSIP_MSG_TO_HDR(msg);
+    _call_id = PJSIP_MSG_CID_HDR(msg);
+    _cseq = PJSIP_MSG_CSEQ_HDR(msg);
+    return true;
+  }
+
+  /// Returns the parsed template, or NULL if it has not been parsed.
+  const pjsip_msg* msg() const { return _msg; }
+
+  /// Fills a message with a request built from the template, replacing its
+  /// start line, headers and body.  The message should be one created for
+  /// the service to send, such as one returned by
+  /// AppServerTsxHelper::original_request, and is typically instantiated
+  /// through AppServerTsxHelper::create_request rather than directly.
+  ///
+  /// @param  pool         - The pool of the message.
+  /// @param  msg          - The message to fill in.
+  /// @param  values       - The values of the slots.
+  void instantiate(pj_pool_t* pool, pjsip_msg* msg, const Values& values) const
+  {
+    msg->type = PJSIP_REQUEST_MSG;
+    msg->line = _msg->line;
+    if (values.request_uri != NULL)
+    {
+      msg->line.req.uri = (pjsip_uri*)pjsip_uri_clone(pool, values.request_uri);
+    }
+
+    pj_list_init(&msg->hdr);
+    for (const pjsip_hdr* hdr = _msg->hdr.next;
+         hdr != &_msg->hdr;
+         hdr = hdr->next)
+    {
+      pjsip_hdr* copy = (pjsip_hdr*)pjsip_hdr_shallow_clone(pool, hdr);
+
+      if (hdr == (pjsip_hdr*)_from)
+      {
+        fill_fromto(pool, (pjsip_fromto_hdr*)copy, values.from_uri, values.from_tag);
+      }
+      else if (hdr == (pjsip_hdr*)_to)
+      {
+        fill_fromto(pool, (pjsip_fromto_hdr*)copy, values.to_uri, values.to_tag);
+      }
+      else if ((hdr == (pjsip_hdr*)_call_id) && (values.call_id.slen > 0))
+      {
+        pj_strdup(pool, &((pjsip_cid_hdr*)copy)->id, &values.call_id);
+      }
+      else if ((hdr == (pjsip_hdr*)_cseq) && (values.cseq >= 0))
+      {
+        ((pjsip_cseq_hdr*)copy)->cseq = values.cseq;
+      }
+
+      pjsip_msg_add_hdr(msg, copy);
+    }
+
+    msg->body = NULL;
+    if (_msg->body != NULL)
+    {
+      msg->body = PJ_POOL_ALLOC_T(pool, pjsip_msg_body);
+      *msg->body = *_msg->body;
+    }
+  }
+
+private:
+  RequestTemplate(const RequestTemplate&);
+  RequestTemplate& operator=(const RequestTemplate&);
+
+  static void fill_fromto(pj_pool_t* pool,
+                          pjsip_fromto_hdr* hdr,
+                          pjsip_uri* uri,
+                          const pj_str_t& tag)
+  {
+    if (uri != NULL)
+    {
+      hdr->uri = (pjsip_uri*)pjsip_uri_clone(pool, uri);
+    }
+
+    if (tag.slen > 0)
+    {
+      pj_strdup(pool, &hdr->tag, &tag);
+    }
+  }
+
+  pj_pool_t* _pool;
+  const pjsip_msg* _msg;
+
+  /// The headers holding the slots, in _msg.
+  const pjsip_from_hdr* _from;
+  const pjsip_to_hdr* _to;
+  const pjsip_cid_hdr* _call_id;
+  const pjsip_cseq_hdr* _cseq;
+};
+
+#endif
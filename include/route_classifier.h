@@ -0,0 +1,259 @@
+/**
+ * @file route_classifier.h  Compiled request routing rules for AppServers.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef ROUTE_CLASSIFIER_H__
+#define ROUTE_CLASSIFIER_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "sip_hdr_view.h"
+
+/// A routing rule.  A request matches the rule if its method matches and
+/// the user part of its Request-URI starts with the prefix.
+struct RouteRule
+{
+  RouteRule(const std::string& method, const std::string& user_prefix, int action) :
+    method(method), user_prefix(user_prefix), action(action) {}
+
+  /// The method, or an empty string to match any method.
+  std::string method;
+
+  /// The prefix of the Request-URI user part (or Tel URI number), or an
+  /// empty string to match any user.
+  std::string user_prefix;
+
+  /// The value returned when a request matches the rule.  This must not be
+  /// negative.
+  int action;
+};
+
+
+/// The RouteClassifier class compiles a set of RouteRules into a lookup
+/// structure, so AppServer::get_app_tsx can decide what to do with a request
+/// without chains of string comparisons, for example
+///
+///   int action = _classifier.classify(req);
+///   if (action == RouteClassifier::NO_MATCH) { ...return NULL... }
+///
+/// When several rules match, the one with the longest user prefix wins, and
+/// of rules with the same prefix, one for the specific method beats one for
+/// any method, and otherwise the first added wins.
+///
+/// The rules for each method are compiled into a trie over the alphabet of
+/// characters that appear in any prefix (for number ranges, just the
+/// digits and a few symbols), with all the nodes held in one contiguous
+/// array.  A lookup finds the method's trie and walks it one
+/// array access per character of the user, so its cost depends only on the
+/// length of the user and not on the number of rules.
+///
+/// A RouteClassifier is immutable once built, so can be shared by all
+/// threads.
+///
+class RouteClassifier
+{
+public:
+  /// Returned by classify if no rule matches.
+  enum { NO_MATCH = -1 };
+
+  /// Constructor.  Compiles the rules.
+  ///
+  /// @param  rules        - The routing rules.
+  RouteClassifier(const std::vector<RouteRule>& rules) :
+    _stride(1),
+    _nodes(),
+    _methods(),
+    _any_root(0)
+  {
+    memset(_char_map, NO_CHAR, sizeof(_char_map));
+
+    // Build the alphabet.
+    int alphabet = 0;
+    for (size_t ii = 0; ii < rules.size(); ++ii)
+    {
+      const std::string& prefix = rules[ii].user_prefix;
+      for (size_t jj = 0; jj < prefix.size(); ++jj)
+      {
+        unsigned char c = prefix[jj];
+        if (_char_map[c] == NO_CHAR)
+        {
+          _char_map[c] = (uint8_t)alphabet++;
+        }
+      }
+    }
+    _stride = 1 + alphabet;
+
+    // Create a trie for each method named in the rules, plus one for other
+    // methods.
+    for (size_t ii = 0; ii < rules.size(); ++ii)
+    {
+      if ((!rules[ii].method.empty()) && (find_method(rules[ii].method) == NULL))
+      {
+        Method method = {rules[ii].method, new_node()};
+        _methods.push_back(method);
+      }
+    }
+    _any_root = new_node();
+
+    // Add the rules for specific methods first, then the rules for any
+    // method to every trie, without overriding a rule already set on the
+    // same prefix.
+    for (size_t ii = 0; ii < rules.size(); ++ii)
+    {
+      if (!rules[ii].method.empty())
+      {
+        insert(find_method(rules[ii].method)->root, rules[ii]);
+      }
+    }
+
+    for (size_t ii = 0; ii < rules.size(); ++ii)
+    {
+      if (rules[ii].method.empty())
+      {
+        for (size_t jj = 0; jj < _methods.size(); ++jj)
+        {
+          insert(_methods[jj].root, rules[ii]);
+        }
+        insert(_any_root, rules[ii]);
+      }
+    }
+  }
+
+  /// Classifies a request.
+  ///
+  /// @returns             - The action of the best matching rule, or
+  ///                        NO_MATCH.
+  /// @param  req          - The request.
+  int classify(const pjsip_msg* req) const
+  {
+    return classify(req->line.req.method.name, SipMsgView::user(req->line.req.uri));
+  }
+
+  /// Classifies a method and user.
+  ///
+  /// @returns             - The action of the best matching rule, or
+  ///                        NO_MATCH.
+  /// @param  method       - The method name.
+  /// @param  user         - The Request-URI user.
+  int classify(const pj_str_t& method, const pj_str_t& user) const
+  {
+    const int32_t* nodes = _nodes.data();
+    uint32_t node = root(method);
+    int32_t best = nodes[node];
+
+    for (pj_ssize_t ii = 0; ii < user.slen; ++ii)
+    {
+      uint8_t index = _char_map[(unsigned char)user.ptr[ii]];
+      if (index == NO_CHAR)
+      {
+        break;
+      }
+
+      node = nodes[node + 1 + index];
+      if (node == 0)
+      {
+        break;
+      }
+
+      if (nodes[node] != NO_MATCH)
+      {
+        best = nodes[node];
+      }
+    }
+
+    return best;
+  }
+
+  /// Returns the memory used by the compiled rules, in bytes.
+  size_t memory_bytes() const { return _nodes.size() * sizeof(int32_t); }
+
+private:
+  static const uint8_t NO_CHAR = 0xFF;
+
+  struct Method
+  {
+    std::string name;
+    uint32_t root;
+  };
+
+  /// Allocates a node, returning its offset in the node array.  Each node
+  /// is its action followed by the offsets of its children, where 0 means
+  /// no child (as the first node is never a child).
+  uint32_t new_node()
+  {
+    uint32_t node = _nodes.size();
+    _nodes.resize(node + _stride, 0);
+    _nodes[node] = NO_MATCH;
+    return node;
+  }
+
+  void insert(uint32_t node, const RouteRule& rule)
+  {
+    const std::string& prefix = rule.user_prefix;
+
+    for (size_t ii = 0; ii < prefix.size(); ++ii)
+    {
+      size_t child = node + 1 + _char_map[(unsigned char)prefix[ii]];
+
+      if (_nodes[child] == 0)
+      {
+        // Take the new node before writing, as this may move the array.
+        uint32_t new_child = new_node();
+        _nodes[child] = new_child;
+      }
+
+      node = _nodes[child];
+    }
+
+    if (_nodes[node] == NO_MATCH)
+    {
+      _nodes[node] = rule.action;
+    }
+  }
+
+  const Method* find_method(const std::string& name) const
+  {
+    for (size_t ii = 0; ii < _methods.size(); ++ii)
+    {
+      if (_methods[ii].name == name)
+      {
+        return &_methods[ii];
+      }
+    }
+
+    return NULL;
+  }
+
+  uint32_t root(const pj_str_t& method) const
+  {
+    for (size_t ii = 0; ii < _methods.size(); ++ii)
+    {
+      const std::string& name = _methods[ii].name;
+      if ((name.size() == (size_t)method.slen) &&
+          (memcmp(name.data(), method.ptr, method.slen) == 0))
+      {
+        return _methods[ii].root;
+      }
+    }
+
+    return _any_root;
+  }
+
+  uint8_t _char_map[256];
+  uint32_t _stride;
+  std::vector<int32_t> _nodes;
+  std::vector<Method> _methods;
+  uint32_t _any_root;
+};
+
+#endif
@@ -0,0 +1,354 @@
+/**
+ * @file sas_event_buffer.h  Batched SAS event reporting for AppServers.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SAS_EVENT_BUFFER_H__
+#define SAS_EVENT_BUFFER_H__
+
+#include <stdint.h>
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+#include "sas.h"
+
+/// The SasSink class is where a SasEventBuffer sends its events.  Each call
+/// to report passes a batch of events from a single trail, so a sink can
+/// hand the whole batch to its queue at once rather than taking the queue's
+/// lock for each event.
+///
+class SasSink
+{
+public:
+  /// Virtual destructor.
+  virtual ~SasSink() {}
+
+  /// Reports a batch of events.  This may be called from any worker thread.
+  ///
+  /// @param  events       - The events, in the order they were logged.  The
+  ///                        sink may modify them, and they are discarded
+  ///                        once it returns.
+  virtual void report(std::vector<SAS::Event>& events) = 0;
+
+  /// Reports a single event, for sinks that do not batch.  The default
+  /// implementation passes it to report as a batch of one.
+  ///
+  /// @param  event        - The event.  The sink may modify it.
+  virtual void report_event(SAS::Event& event)
+  {
+    std::vector<SAS::Event> events(1, event);
+    report(events);
+  }
+
+  /// Returns whether events should be held and passed to report in batches.
+  /// Sinks that return false are passed each event as soon as it is
+  /// complete.
+  virtual bool batching() const { return true; }
+};
+
+
+/// The DefaultSasSink class reports events to SAS with SAS::report_event.
+/// SAS timestamps events as they are reported and has no batch API, so this
+/// sink does not batch, and events reach SAS in order with the other events
+/// on their trails.
+///
+class DefaultSasSink : public SasSink
+{
+public:
+  bool batching() const { return false; }
+
+  void report(std::vector<SAS::Event>& events)
+  {
+    for (size_t ii = 0; ii < events.size(); ++ii)
+    {
+      SAS::report_event(events[ii]);
+    }
+  }
+
+  void report_event(SAS::Event& event)
+  {
+    SAS::report_event(event);
+  }
+
+  /// Returns the shared instance.
+  static DefaultSasSink* instance()
+  {
+    static DefaultSasSink sink;
+    return &sink;
+  }
+};
+
+
+/// The LocalSasSink class keeps the events reported to it in memory rather
+/// than sending them to SAS, so that services' SAS logging can be checked in
+/// tests and offline tools.  It may be shared by any number of threads.
+///
+class LocalSasSink : public SasSink
+{
+public:
+  LocalSasSink() : _lock(), _events(), _batches() {}
+
+  void report(std::vector<SAS::Event>& events)
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    _events.insert(_events.end(), events.begin(), events.end());
+    _batches.push_back(events.size());
+  }
+
+  /// Returns a copy of the events reported so far, in the order they were
+  /// reported.
+  std::vector<SAS::Event> events() const
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    return _events;
+  }
+
+  /// Returns the number of events in each batch reported so far.
+  std::vector<size_t> batches() const
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    return _batches;
+  }
+
+  /// Discards the events and batches reported so far.
+  void clear()
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    _events.clear();
+    _batches.clear();
+  }
+
+private:
+  mutable std::mutex _lock;
+  std::vector<SAS::Event> _events;
+  std::vector<size_t> _batches;
+};
+
+
+/// The SasEventBuffer class gathers the SAS events a transaction logs and
+/// reports them to a SasSink in batches: when the buffer is full, when
+/// flush is called, and when the buffer is destroyed.  Each AppServerTsx
+/// has one for its trail (see AppServerTsx::sas_event).
+///
+/// If the sink does not batch events, as for the default sink, nothing is
+/// batched.  Events built by the caller and passed to report go straight to
+/// the sink without being copied, and the buffer only holds an event that
+/// is being built in place by event, which it reports when the next event is
+/// logged or flush_unbatched is called.  AppServerTsx does this before it
+/// sends any message, so events are reported before the messages that
+/// follow them.
+///
+/// Events returned by event are built in place in the buffer, whose storage
+/// is allocated once, when the buffer is created if the sink batches events
+/// or else when the first event is built in place.  Events are either NORMAL or DETAIL, and the
+/// DETAIL events of a trail can be sampled, so that only one trail in N
+/// logs them.  Whether a trail is sampled depends only on its ID, so a
+/// sampled trail has all its DETAIL events from every service, and the
+/// others have none, which is cheaper than building the events and
+/// discarding them.
+///
+/// A SasEventBuffer is not thread-safe, in the same way as the rest of a
+/// transaction's state.
+///
+class SasEventBuffer
+{
+public:
+  /// The severity of an event.
+  enum Severity
+  {
+    /// Detailed diagnostics, which may be sampled.
+    DETAIL,
+
+    /// Events that are always reported.
+    NORMAL
+  };
+
+  /// The default number of events to buffer before flushing.
+  static const size_t DEFAULT_CAPACITY = 32;
+
+  /// The settings for an AppServer's buffers.
+  struct Config
+  {
+    Config() :
+      sink(NULL),
+      capacity(DEFAULT_CAPACITY),
+      detail_sample_one_in(1)
+    {
+    }
+
+    /// Where to report events, or NULL to report them to SAS.
+    SasSink* sink;
+
+    /// The number of events to buffer before flushing.  This is ignored if
+    /// the sink does not batch events.
+    size_t capacity;
+
+    /// Report DETAIL events on one trail in this many, or on none if 0.
+    uint32_t detail_sample_one_in;
+  };
+
+  /// Constructor.
+  ///
+  /// @param  trail        - The trail to log events on.
+  /// @param  config       - The settings to use, or NULL for the defaults.
+  ///                        These must outlive the buffer.
+  SasEventBuffer(SAS::TrailId trail, const Config* config = NULL) :
+    _trail(trail),
+    _sink(DefaultSasSink::instance()),
+    _capacity(DEFAULT_CAPACITY),
+    _batching(true),
+    _detail(true),
+    _events()
+  {
+    if (config != NULL)
+    {
+      if (config->sink != NULL)
+      {
+        _sink = config->sink;
+      }
+      _capacity = std::max(config->capacity, (size_t)1);
+      _detail = sampled(trail, config->detail_sample_one_in);
+    }
+
+    _batching = _sink->batching();
+    if (!_batching)
+    {
+      _capacity = 1;
+    }
+    else
+    {
+      _events.reserve(_capacity);
+    }
+  }
+
+  /// Destructor.  Reports any buffered events.
+  ~SasEventBuffer()
+  {
+    flush();
+  }
+
+  /// Adds an event to the buffer, flushing the buffer first if it is full.
+  ///
+  /// @returns             - The event, to add parameters to, or NULL if the
+  ///                        event is not sampled, in which case it should
+  ///                        not be built.  The event is only valid until the
+  ///                        next call to event or flush.
+  /// @param  id           - The event ID.
+  /// @param  instance     - The instance ID.
+  /// @param  severity     - The severity of the event.
+  SAS::Event* event(uint32_t id,
+                    uint32_t instance = 0,
+                    Severity severity = NORMAL)
+  {
+    if ((severity == DETAIL) && (!_detail))
+    {
+      return NULL;
+    }
+
+    if (_events.size() >= _capacity)
+    {
+      flush();
+    }
+
+    _events.emplace_back(_trail, id, instance);
+    return &_events.back();
+  }
+
+  /// Reports an event built by the caller.  If the sink does not batch
+  /// events, the event is passed straight to it, after any event being built
+  /// in the buffer.  Otherwise it is copied into the buffer, which is
+  /// flushed first if it is full.
+  ///
+  /// @param  event        - The event, which must be on this buffer's
+  ///                        trail.  The sink may modify it.
+  /// @param  severity     - The severity of the event.  DETAIL events on
+  ///                        trails that are not sampled are discarded.
+  void report(SAS::Event& event, Severity severity = NORMAL)
+  {
+    if (!enabled(severity))
+    {
+      return;
+    }
+
+    if (!_batching)
+    {
+      flush();
+      _sink->report_event(event);
+      return;
+    }
+
+    if (_events.size() >= _capacity)
+    {
+      flush();
+    }
+
+    _events.push_back(event);
+  }
+
+  /// Returns whether events of a severity are reported on this trail, so
+  /// that work to build their parameters can be skipped.
+  bool enabled(Severity severity) const
+  {
+    return (severity != DETAIL) || (_detail);
+  }
+
+  /// Reports the buffered events now.
+  void flush()
+  {
+    if (!_events.empty())
+    {
+      _sink->report(_events);
+      _events.clear();
+    }
+  }
+
+  /// Reports the buffered events now if the sink does not batch them.
+  void flush_unbatched()
+  {
+    if (!_batching)
+    {
+      flush();
+    }
+  }
+
+  /// Returns the number of buffered events.
+  size_t size() const { return _events.size(); }
+
+  /// Returns the trail events are logged on.
+  SAS::TrailId trail() const { return _trail; }
+
+private:
+  SasEventBuffer(const SasEventBuffer&);
+  SasEventBuffer& operator=(const SasEventBuffer&);
+
+  /// Decides whether a trail is one of the one in N that reports DETAIL
+  /// events.  Trail IDs are allocated in sequence, so are mixed first.
+  static bool sampled(SAS::TrailId trail, uint32_t one_in)
+  {
+    if (one_in <= 1)
+    {
+      return (one_in == 1);
+    }
+
+    uint64_t hash = (uint64_t)trail * 0x9E3779B97F4A7C15ULL;
+    return (((hash >> 32) % one_in) == 0);
+  }
+
+  SAS::TrailId _trail;
+  SasSink* _sink;
+  size_t _capacity;
+  bool _batching;
+  bool _detail;
+
+  /// Reserved to the capacity, so never reallocated while it holds events.
+  std::vector<SAS::Event> _events;
+};
+
+#endif
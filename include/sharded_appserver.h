@@ -0,0 +1,238 @@
+/**
+ * @file sharded_appserver.h  Per-worker AppServer replicas.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SHARDED_APPSERVER_H__
+#define SHARDED_APPSERVER_H__
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "appserver.h"
+#include "appserver_worker.h"
+
+/// The ShardedAppServer class template registers a service as one replica
+/// of an AppServer of type T per worker thread, rather than as a single
+/// object shared by all workers.  It is itself the AppServer registered
+/// with the infrastructure for the service name, and passes each call to
+/// get_app_tsx to the replica of the calling worker, so any state a replica
+/// keeps for get_app_tsx, such as counters and caches, is only ever used by
+/// one thread and needs no locks.
+///
+/// Replicas are created by a factory the first time each worker calls
+/// get_app_tsx, on that worker's thread.  To change all the replicas, for
+/// example on a configuration reload, call broadcast: this queues a function
+/// for each replica, which its worker runs before its next request (or when
+/// the infrastructure calls process_broadcasts), so replicas are still only
+/// used by their own worker.  Broadcasts are expected to be rare, so are
+/// queued under locks; the only cost to each request is checking a flag.
+/// Broadcasts only reach replicas that already exist, so the factory should
+/// create replicas from the current configuration.
+///
+/// The replicas share the statistics, admission control and SAS settings of
+/// the ShardedAppServer (see AppServer::share_instrumentation), so the
+/// service is counted and controlled as a whole, whichever of them a caller
+/// asks.  Settings the factory makes on a replica's admission control or SAS
+/// settings are discarded; configure them on the ShardedAppServer instead.
+///
+/// Transactions created by a replica may have their callbacks run on other
+/// workers (see AppServerTsx), so must not use the replica's mutable state.
+///
+template <class T>
+class ShardedAppServer : public AppServer
+{
+public:
+  /// Creates the replica for a worker.  The replica is owned by the
+  /// ShardedAppServer.
+  typedef std::function<T*(int worker_index)> Factory;
+
+  /// A function applied to every replica by broadcast.
+  typedef std::function<void(T&)> Broadcast;
+
+  /// Constructor.
+  ///
+  /// @param  service_name - The name of the service.
+  /// @param  factory      - Creates the replica for each worker.
+  ShardedAppServer(const std::string& service_name, const Factory& factory) :
+    AppServer(service_name),
+    _factory(factory),
+    _lock()
+  {
+    for (int ii = 0; ii < AppServerWorkerContext::MAX_WORKERS; ++ii)
+    {
+      _shards[ii].store(NULL, std::memory_order_relaxed);
+    }
+  }
+
+  /// Destructor.  The workers must have stopped calling into the service.
+  virtual ~ShardedAppServer()
+  {
+    for (int ii = 0; ii < AppServerWorkerContext::MAX_WORKERS; ++ii)
+    {
+      delete _shards[ii].load(std::memory_order_relaxed);
+    }
+  }
+
+  AppServerTsx* get_app_tsx(SproutletHelper* helper,
+                            pjsip_msg* req,
+                            pjsip_sip_uri*& next_hop,
+                            pj_pool_t* pool,
+                            SAS::TrailId trail)
+  {
+    return get_app_tsx_on_worker(helper,
+                                 req,
+                                 next_hop,
+                                 pool,
+                                 trail,
+                                 AppServerWorkerContext::current());
+  }
+
+  AppServerTsx* get_app_tsx_on_worker(SproutletHelper* helper,
+                                      pjsip_msg* req,
+                                      pjsip_sip_uri*& next_hop,
+                                      pj_pool_t* pool,
+                                      SAS::TrailId trail,
+                                      AppServerWorkerContext& worker)
+  {
+    T& replica = local(worker);
+    return replica.get_app_tsx_on_worker(helper, req, next_hop, pool, trail, worker);
+  }
+
+  /// Returns the replica for a worker, creating it if necessary and running
+  /// any broadcasts queued for it.  This must only be called on the worker's
+  /// own thread.
+  ///
+  /// @param  worker       - The worker's context.
+  T& local(AppServerWorkerContext& worker)
+  {
+    Shard* shard = _shards[worker.index()].load(std::memory_order_acquire);
+    if (shard == NULL)
+    {
+      shard = create_shard(worker.index());
+    }
+
+    if (shard->pending.load(std::memory_order_acquire))
+    {
+      deliver(*shard);
+    }
+
+    return *shard->replica;
+  }
+
+  /// Runs any broadcasts queued for a worker's replica.  The infrastructure
+  /// may call this when the worker is idle, so that broadcasts do not wait
+  /// for the next request.  This must only be called on the worker's own
+  /// thread.
+  ///
+  /// @param  worker       - The worker's context.
+  void process_broadcasts(AppServerWorkerContext& worker)
+  {
+    Shard* shard = _shards[worker.index()].load(std::memory_order_acquire);
+    if ((shard != NULL) && (shard->pending.load(std::memory_order_acquire)))
+    {
+      deliver(*shard);
+    }
+  }
+
+  /// Queues a function to be run on every replica, on each replica's own
+  /// worker thread.  Functions are run in the order they were broadcast.
+  ///
+  /// @returns             - The number of replicas the function was queued
+  ///                        for.
+  /// @param  fn           - The function.  This is copied.
+  size_t broadcast(const Broadcast& fn)
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    size_t queued = 0;
+
+    for (int ii = 0; ii < AppServerWorkerContext::MAX_WORKERS; ++ii)
+    {
+      Shard* shard = _shards[ii].load(std::memory_order_relaxed);
+      if (shard != NULL)
+      {
+        std::lock_guard<std::mutex> shard_lock(shard->lock);
+        shard->mailbox.push_back(fn);
+        shard->pending.store(true, std::memory_order_release);
+        ++queued;
+      }
+    }
+
+    return queued;
+  }
+
+  /// Returns the number of replicas.
+  size_t replicas()
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    size_t replicas = 0;
+
+    for (int ii = 0; ii < AppServerWorkerContext::MAX_WORKERS; ++ii)
+    {
+      if (_shards[ii].load(std::memory_order_relaxed) != NULL)
+      {
+        ++replicas;
+      }
+    }
+
+    return replicas;
+  }
+
+private:
+  /// A replica and its queue of broadcasts.
+  struct Shard
+  {
+    Shard(T* replica) : replica(replica), lock(), mailbox(), pending(false) {}
+
+    std::unique_ptr<T> replica;
+    std::mutex lock;
+    std::vector<Broadcast> mailbox;
+    std::atomic<bool> pending;
+  };
+
+  Shard* create_shard(int index)
+  {
+    // Hold the lock while creating the replica so that a broadcast either
+    // happens before the replica is created, and so is reflected in the
+    // configuration the factory uses, or is queued for it.
+    std::lock_guard<std::mutex> lock(_lock);
+    Shard* shard = new Shard(_factory(index));
+    shard->replica->share_instrumentation(*this);
+    _shards[index].store(shard, std::memory_order_release);
+    return shard;
+  }
+
+  void deliver(Shard& shard)
+  {
+    std::vector<Broadcast> mailbox;
+    {
+      std::lock_guard<std::mutex> lock(shard.lock);
+      mailbox.swap(shard.mailbox);
+      shard.pending.store(false, std::memory_order_relaxed);
+    }
+
+    for (size_t ii = 0; ii < mailbox.size(); ++ii)
+    {
+      mailbox[ii](*shard.replica);
+    }
+  }
+
+  Factory _factory;
+
+  /// Serializes broadcasts with the creation of replicas.
+  std::mutex _lock;
+
+  std::atomic<Shard*> _shards[AppServerWorkerContext::MAX_WORKERS];
+};
+
+#endif
@@ -0,0 +1,345 @@
+/**
+ * @file sip_hdr_view.h  Non-allocating header and URI access for AppServers.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SIP_HDR_VIEW_H__
+#define SIP_HDR_VIEW_H__
+
+extern "C" {
+#include <pjsip.h>
+#include <pjlib.h>
+}
+
+/// The HdrRange class allows iteration over every header of a given type or
+/// name in a message, without copying the headers, for example
+///
+///   for (HdrRange<pjsip_route_hdr>::iterator ii = routes.begin();
+///        ii != routes.end();
+///        ++ii)
+///
+/// The message must not have headers removed while it is being iterated.
+///
+template <class H = pjsip_hdr>
+class HdrRange
+{
+public:
+  /// Constructs a range over all headers of the specified type.
+  HdrRange(const pjsip_msg* msg, pjsip_hdr_e type) :
+    _msg(msg), _type(type), _name(NULL), _sname(NULL) {}
+
+  /// Constructs a range over all headers with the specified name (and
+  /// optionally short name).  The names are not copied, so must remain valid
+  /// while the range is in use.
+  HdrRange(const pjsip_msg* msg, const pj_str_t* name, const pj_str_t* sname = NULL) :
+    _msg(msg), _type(PJSIP_H_OTHER), _name(name), _sname(sname) {}
+
+  class iterator
+  {
+  public:
+    iterator(const HdrRange* range, H* hdr) : _range(range), _hdr(hdr) {}
+
+    H* operator*() const { return _hdr; }
+    H* operator->() const { return _hdr; }
+
+    iterator& operator++()
+    {
+      _hdr = _range->find(((pjsip_hdr*)_hdr)->next);
+      return *this;
+    }
+
+    bool operator==(const iterator& other) const { return _hdr == other._hdr; }
+    bool operator!=(const iterator& other) const { return _hdr != other._hdr; }
+
+  private:
+    const HdrRange* _range;
+    H* _hdr;
+  };
+
+  iterator begin() const { return iterator(this, find(NULL)); }
+  iterator end() const { return iterator(this, NULL); }
+
+  /// Returns true if there are no matching headers.
+  bool empty() const { return (find(NULL) == NULL); }
+
+private:
+  /// Finds the first matching header at or after start (or from the top of
+  /// the message if start is NULL).
+  H* find(const void* start) const
+  {
+    if (_name == NULL)
+    {
+      return (H*)pjsip_msg_find_hdr(_msg, _type, start);
+    }
+    else if (_sname == NULL)
+    {
+      return (H*)pjsip_msg_find_hdr_by_name(_msg, _name, start);
+    }
+    else
+    {
+      return (H*)pjsip_msg_find_hdr_by_names(_msg, _name, _sname, start);
+    }
+  }
+
+  const pjsip_msg* _msg;
+  pjsip_hdr_e _type;
+  const pj_str_t* _name;
+  const pj_str_t* _sname;
+};
+
+
+/// The SipMsgView class provides typed, non-allocating access to the headers
+/// and URIs of a message.  Values are returned as pj_str_t slices pointing
+/// into the message, so remain valid for as long as the message does.
+///
+/// The mutators allocate only the new values, from the pool passed in, which
+/// should be the pool of the message (from get_pool).  When modifying a
+/// lazily cloned message, the header or URI must be made writable first (see
+/// LazyMsgClone).
+///
+class SipMsgView
+{
+public:
+  /// Finds the first header of the specified type.
+  ///
+  /// @returns             - The header, or NULL if there is none.
+  /// @param  msg          - The message to search.
+  /// @param  type         - The header type.
+  template <class H>
+  static H* find_hdr(const pjsip_msg* msg, pjsip_hdr_e type)
+    {return (H*)pjsip_msg_find_hdr(msg, type, NULL);}
+
+  /// Finds the first header with the specified name.
+  ///
+  /// @returns             - The header, or NULL if there is none.
+  /// @param  msg          - The message to search.
+  /// @param  name         - The header name.
+  template <class H>
+  static H* find_hdr(const pjsip_msg* msg, const char* name)
+  {
+    pj_str_t str = make_str(name);
+    return (H*)pjsip_msg_find_hdr_by_name(msg, &str, NULL);
+  }
+
+  /// Returns the value of an unparsed header (one with no specific pjsip
+  /// representation, such as P-Served-User).
+  ///
+  /// @returns             - The header value, or an empty string if there is
+  ///                        no such header.
+  /// @param  msg          - The message to search.
+  /// @param  name         - The header name.
+  static pj_str_t hdr_value(const pjsip_msg* msg, const char* name)
+  {
+    pjsip_generic_string_hdr* hdr = find_hdr<pjsip_generic_string_hdr>(msg, name);
+    return (hdr != NULL) ? hdr->hvalue : empty_str();
+  }
+
+  /// Returns the SIP or SIPS URI underlying a URI, looking through any
+  /// name-addr.
+  ///
+  /// @returns             - The SIP URI, or NULL if it is not a SIP or SIPS
+  ///                        URI.
+  /// @param  uri          - The URI.
+  static pjsip_sip_uri* sip_uri(const pjsip_uri* uri)
+  {
+    if (uri == NULL)
+    {
+      return NULL;
+    }
+
+    pjsip_uri* inner = (pjsip_uri*)pjsip_uri_get_uri(uri);
+    return (PJSIP_URI_SCHEME_IS_SIP(inner) || PJSIP_URI_SCHEME_IS_SIPS(inner)) ?
+           (pjsip_sip_uri*)inner : NULL;
+  }
+
+  /// Returns the user part of a SIP URI, or the number of a Tel URI.
+  ///
+  /// @returns             - The user, or an empty string.
+  /// @param  uri          - The URI.
+  static pj_str_t user(const pjsip_uri* uri)
+  {
+    pjsip_sip_uri* sip = sip_uri(uri);
+
+    if (sip != NULL)
+    {
+      return sip->user;
+    }
+
+    if (uri != NULL)
+    {
+      pjsip_uri* inner = (pjsip_uri*)pjsip_uri_get_uri(uri);
+      if (PJSIP_URI_SCHEME_IS_TEL(inner))
+      {
+        return ((pjsip_tel_uri*)inner)->number;
+      }
+    }
+
+    return empty_str();
+  }
+
+  /// Returns the host part of a SIP URI.
+  ///
+  /// @returns             - The host, or an empty string.
+  /// @param  uri          - The URI.
+  static pj_str_t host(const pjsip_uri* uri)
+  {
+    pjsip_sip_uri* sip = sip_uri(uri);
+    return (sip != NULL) ? sip->host : empty_str();
+  }
+
+  /// Finds a parameter of a SIP URI (other than the parameters pjsip parses
+  /// into dedicated fields, such as transport and lr).
+  ///
+  /// @returns             - true if the parameter is present.
+  /// @param  uri          - The URI.
+  /// @param  name         - The parameter name.
+  /// @param  value        - Set to the parameter value if present.
+  static bool uri_param(const pjsip_uri* uri, const char* name, pj_str_t& value)
+  {
+    pjsip_sip_uri* sip = sip_uri(uri);
+
+    if (sip != NULL)
+    {
+      pj_str_t str = make_str(name);
+      pjsip_param* param = pjsip_param_find(&sip->other_param, &str);
+
+      if (param != NULL)
+      {
+        value = param->value;
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  /// Compares a slice with a string, case-sensitively.
+  static bool equals(const pj_str_t& str, const char* value)
+    {return (pj_strcmp2(&str, value) == 0);}
+
+  /// Compares a slice with a string, ignoring case.
+  static bool iequals(const pj_str_t& str, const char* value)
+    {return (pj_stricmp2(&str, value) == 0);}
+
+  /// Tests whether a slice starts with a prefix.
+  static bool starts_with(const pj_str_t& str, const char* prefix)
+  {
+    size_t len = strlen(prefix);
+    return ((size_t)str.slen >= len) && (memcmp(str.ptr, prefix, len) == 0);
+  }
+
+  /// Sets the user part of a SIP URI.
+  ///
+  /// @returns             - false if the URI is not a SIP URI.
+  /// @param  pool         - The pool of the message containing the URI.
+  /// @param  uri          - The URI.
+  /// @param  user         - The new user part.
+  static bool set_user(pj_pool_t* pool, pjsip_uri* uri, const pj_str_t& user)
+  {
+    pjsip_sip_uri* sip = sip_uri(uri);
+
+    if (sip != NULL)
+    {
+      pj_strdup(pool, &sip->user, &user);
+    }
+
+    return (sip != NULL);
+  }
+
+  /// Sets the host part of a SIP URI.
+  ///
+  /// @returns             - false if the URI is not a SIP URI.
+  /// @param  pool         - The pool of the message containing the URI.
+  /// @param  uri          - The URI.
+  /// @param  host         - The new host part.
+  static bool set_host(pj_pool_t* pool, pjsip_uri* uri, const pj_str_t& host)
+  {
+    pjsip_sip_uri* sip = sip_uri(uri);
+
+    if (sip != NULL)
+    {
+      pj_strdup(pool, &sip->host, &host);
+    }
+
+    return (sip != NULL);
+  }
+
+  /// Sets a parameter on a SIP URI, replacing any existing value.
+  ///
+  /// @returns             - false if the URI is not a SIP URI.
+  /// @param  pool         - The pool of the message containing the URI.
+  /// @param  uri          - The URI.
+  /// @param  name         - The parameter name.
+  /// @param  value        - The parameter value (may be empty).
+  static bool set_uri_param(pj_pool_t* pool,
+                            pjsip_uri* uri,
+                            const char* name,
+                            const pj_str_t& value)
+  {
+    pjsip_sip_uri* sip = sip_uri(uri);
+
+    if (sip == NULL)
+    {
+      return false;
+    }
+
+    pj_str_t str = make_str(name);
+    pjsip_param* param = pjsip_param_find(&sip->other_param, &str);
+
+    if (param == NULL)
+    {
+      param = PJ_POOL_ALLOC_T(pool, pjsip_param);
+      pj_strdup(pool, &param->name, &str);
+      pj_list_push_back(&sip->other_param, param);
+    }
+
+    pj_strdup(pool, &param->value, &value);
+    return true;
+  }
+
+  /// Removes all headers of the specified type from a message.
+  ///
+  /// @returns             - The number of headers removed.
+  /// @param  msg          - The message.
+  /// @param  type         - The header type.
+  static int remove_hdrs(pjsip_msg* msg, pjsip_hdr_e type)
+  {
+    int removed = 0;
+    pjsip_hdr* hdr = (pjsip_hdr*)pjsip_msg_find_hdr(msg, type, NULL);
+
+    while (hdr != NULL)
+    {
+      pjsip_hdr* next = (pjsip_hdr*)pjsip_msg_find_hdr(msg, type, hdr->next);
+      pj_list_erase(hdr);
+      ++removed;
+      hdr = next;
+    }
+
+    return removed;
+  }
+
+private:
+  static pj_str_t make_str(const char* str)
+  {
+    pj_str_t ret;
+    ret.ptr = (char*)str;
+    ret.slen = strlen(str);
+    return ret;
+  }
+
+  static pj_str_t empty_str()
+  {
+    pj_str_t ret;
+    ret.ptr = NULL;
+    ret.slen = 0;
+    return ret;
+  }
+};
+
+#endif
@@ -0,0 +1,371 @@
+/**
+ * @file timer_wheel.h  Hierarchical timer wheel for AppServer timers.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef TIMER_WHEEL_H__
+#define TIMER_WHEEL_H__
+
+#include <stdint.h>
+#include <vector>
+
+#include "appserver.h"
+
+/// The TimerWheel class is a hierarchical timing wheel which can be used to
+/// implement the timer functions of AppServerTsxHelper (schedule_timer,
+/// cancel_timer and timer_running).
+///
+/// The wheel has four levels of 256 slots with a resolution of one
+/// millisecond, covering 2^32ms (about 49 days) before timers are clamped.
+/// Timers are held in a slab indexed by TimerID, so scheduling, cancelling
+/// and restarting a timer are all O(1) and do not allocate once the slab has
+/// grown to the peak number of live timers.
+///
+/// The timers expiring on each tick are dispatched to
+/// AppServerTsx::on_timer_expiry one at a time.  Each timer stops running
+/// just before its own callback, and the others due on the same tick stay
+/// running, and so can be cancelled, until theirs.  This means a callback may
+/// cancel any other timer, including one due on the same tick, and may then
+/// destroy the AppServerTsx it belongs to.
+///
+/// A TimerWheel is not thread-safe.  It is intended that each worker thread
+/// owns a wheel for the transactions it is processing and calls poll from
+/// its event loop.  The owner must cancel any running timers before the
+/// corresponding AppServerTsx is destroyed.
+///
+class TimerWheel
+{
+public:
+  /// Constructor.
+  ///
+  /// @param  now_ms       - The current time in milliseconds.  Any monotonic
+  ///                        clock can be used, provided poll is passed times
+  ///                        from the same clock.
+  /// @param  capacity     - The number of timers to preallocate space for.
+  TimerWheel(uint64_t now_ms = 0, size_t capacity = 0) :
+    _now(now_ms),
+    _count(0),
+    _free(NIL),
+    _timers()
+  {
+    for (int ii = 0; ii < NUM_BUCKETS; ++ii)
+    {
+      _buckets[ii] = NIL;
+    }
+    _timers.reserve(capacity);
+  }
+
+  /// Schedules a timer with the specified identifier and expiry period,
+  /// following the semantics of AppServerTsxHelper::schedule_timer.  If the
+  /// identifier corresponds to a timer that is already running, the timer is
+  /// restarted with the new duration and context, and keeps its identifier.
+  /// Otherwise a new timer is started and its identifier is returned in id.
+  /// The duration is measured from the time passed to the most recent poll,
+  /// or, for timers scheduled from a timer callback, from the time the timer
+  /// being dispatched expired.
+  ///
+  /// @returns             - true/false indicating when the timer is programmed.
+  /// @param  tsx          - The transaction to call back on expiry.
+  /// @param  context      - Context parameter returned on the callback.
+  /// @param  id           - The identifier of the timer.
+  /// @param  duration     - Timer duration in milliseconds.
+  bool schedule(AppServerTsx* tsx, void* context, TimerID& id, int duration)
+  {
+    uint32_t index = find(id);
+
+    if (index == NIL)
+    {
+      index = alloc();
+      id = make_id(index);
+    }
+    else
+    {
+      unlink(index);
+    }
+
+    Timer& timer = _timers[index];
+    timer.expiry = _now + ((duration > 0) ? duration : 0);
+    timer.tsx = tsx;
+    timer.context = context;
+    link(index);
+    return true;
+  }
+
+  /// Cancels the timer with the specified identifier.  This is a no-op if
+  /// there is no timer with this identifier running.
+  ///
+  /// @param  id           - The identifier of the timer.
+  void cancel(TimerID id)
+  {
+    uint32_t index = find(id);
+
+    if (index != NIL)
+    {
+      unlink(index);
+      release(index);
+    }
+  }
+
+  /// Queries the state of a timer.
+  ///
+  /// @returns             - true if the timer is running, false otherwise.
+  /// @param  id           - The identifier of the timer.
+  bool running(TimerID id) const
+  {
+    return (find(id) != NIL);
+  }
+
+  /// Advances the wheel to the specified time, calling on_timer_expiry for
+  /// every timer that has expired, in order of expiry.  Each timer is no
+  /// longer running by the time its callback is made, so the callback may
+  /// safely reschedule it.  Timers due on the same tick that have not yet been
+  /// dispatched are still running, so callbacks may cancel them.  This method
+  /// must not be called from a timer callback.
+  ///
+  /// @returns             - The number of timers that expired.
+  /// @param  now_ms       - The current time in milliseconds.
+  size_t poll(uint64_t now_ms)
+  {
+    size_t expired = 0;
+
+    while ((_now < now_ms) && (_count > 0))
+    {
+      uint64_t tick = _now + 1;
+      uint32_t slot = tick & SLOT_MASK;
+
+      if (slot == 0)
+      {
+        // Moving into a new level 0 rotation, so cascade the timers from
+        // the corresponding slots of the higher levels.
+        for (int level = 1; level < LEVELS; ++level)
+        {
+          uint32_t index = (tick >> (level * SLOT_BITS)) & SLOT_MASK;
+          cascade(level, index);
+
+          if (index != 0)
+          {
+            break;
+          }
+        }
+      }
+
+      // Move the timers in the current slot to the firing bucket, where they
+      // keep running until they are dispatched.  Timers scheduled by the
+      // callbacks are linked relative to this tick, so go into later slots.
+      _now = tick;
+      uint32_t index = _buckets[slot];
+      _buckets[slot] = NIL;
+      _buckets[FIRING] = index;
+
+      for (; index != NIL; index = _timers[index].next)
+      {
+        _timers[index].bucket = FIRING;
+      }
+
+      while (_buckets[FIRING] != NIL)
+      {
+        // Take the timer off the firing bucket before its callback, which
+        // may cancel or reschedule any of the others.
+        index = _buckets[FIRING];
+        Timer& timer = _timers[index];
+        AppServerTsx* tsx = timer.tsx;
+        void* context = timer.context;
+        unlink(index);
+        release(index);
+        ++expired;
+        tsx->on_timer_expiry(context);
+      }
+    }
+
+    if (_now < now_ms)
+    {
+      // No timers are left, so skip straight to the current time.
+      _now = now_ms;
+    }
+
+    return expired;
+  }
+
+  /// Returns the number of running timers.
+  size_t size() const { return _count; }
+
+private:
+  static const int SLOT_BITS = 8;
+  static const int SLOTS = 1 << SLOT_BITS;
+  static const uint32_t SLOT_MASK = SLOTS - 1;
+  static const int LEVELS = 4;
+  static const uint64_t MAX_DELTA = (1ULL << (SLOT_BITS * LEVELS)) - 1;
+  static const uint32_t NIL = 0xFFFFFFFF;
+
+  /// The bucket holding the timers of the tick being dispatched, after the
+  /// buckets of the wheel itself.
+  static const uint32_t FIRING = LEVELS * SLOTS;
+  static const int NUM_BUCKETS = LEVELS * SLOTS + 1;
+
+  /// A timer slot in the slab.  Running timers are linked into the bucket
+  /// they are held in; free timers are linked into the free list using next.
+  struct Timer
+  {
+    uint64_t expiry;
+    AppServerTsx* tsx;
+    void* context;
+    uint32_t prev;
+    uint32_t next;
+    uint32_t bucket;
+    uint32_t generation;
+  };
+
+  /// TimerIDs encode the slab index (offset by one so that zero is never a
+  /// valid identifier) and the generation of the slot, so that identifiers
+  /// of expired or cancelled timers never match a reused slot.
+  TimerID make_id(uint32_t index) const
+  {
+    return (TimerID)(((uint64_t)_timers[index].generation << 32) |
+                     (uint64_t)(index + 1));
+  }
+
+  /// Returns the slab index of a running timer, or NIL if the identifier
+  /// does not correspond to a running timer.
+  uint32_t find(TimerID id) const
+  {
+    uint64_t value = (uint64_t)id;
+    uint32_t index = (uint32_t)(value & 0xFFFFFFFF) - 1;
+
+    if ((index < _timers.size()) &&
+        (_timers[index].generation == (uint32_t)(value >> 32)) &&
+        (_timers[index].bucket != NIL))
+    {
+      return index;
+    }
+
+    return NIL;
+  }
+
+  uint32_t alloc()
+  {
+    uint32_t index = _free;
+
+    if (index != NIL)
+    {
+      _free = _timers[index].next;
+    }
+    else
+    {
+      index = _timers.size();
+      Timer timer = {0, NULL, NULL, NIL, NIL, NIL, 0};
+      _timers.push_back(timer);
+    }
+
+    ++_count;
+    return index;
+  }
+
+  void release(uint32_t index)
+  {
+    Timer& timer = _timers[index];
+    ++timer.generation;
+    timer.tsx = NULL;
+    timer.context = NULL;
+    timer.next = _free;
+    _free = index;
+    --_count;
+  }
+
+  /// Links a timer into the bucket corresponding to its expiry time.
+  void link(uint32_t index)
+  {
+    Timer& timer = _timers[index];
+    uint64_t next_tick = _now + 1;
+    uint64_t expiry = (timer.expiry > next_tick) ? timer.expiry : next_tick;
+    uint64_t delta = expiry - next_tick;
+
+    if (delta > MAX_DELTA)
+    {
+      // Too far in the future for the wheel, so park the timer in the
+      // furthest slot.  It is re-evaluated against its real expiry time when
+      // it is cascaded.
+      expiry = next_tick + MAX_DELTA;
+      delta = MAX_DELTA;
+    }
+
+    int level = 0;
+    while ((level < LEVELS - 1) &&
+           (delta >= (1ULL << ((level + 1) * SLOT_BITS))))
+    {
+      ++level;
+    }
+
+    uint32_t bucket = (level * SLOTS) +
+                      ((expiry >> (level * SLOT_BITS)) & SLOT_MASK);
+    timer.bucket = bucket;
+    timer.prev = NIL;
+    timer.next = _buckets[bucket];
+
+    if (timer.next != NIL)
+    {
+      _timers[timer.next].prev = index;
+    }
+
+    _buckets[bucket] = index;
+  }
+
+  void unlink(uint32_t index)
+  {
+    Timer& timer = _timers[index];
+
+    if (timer.prev != NIL)
+    {
+      _timers[timer.prev].next = timer.next;
+    }
+    else
+    {
+      _buckets[timer.bucket] = timer.next;
+    }
+
+    if (timer.next != NIL)
+    {
+      _timers[timer.next].prev = timer.prev;
+    }
+
+    timer.bucket = NIL;
+  }
+
+  /// Moves all the timers in a slot of a higher level down the wheel.
+  void cascade(int level, uint32_t slot)
+  {
+    uint32_t bucket = (level * SLOTS) + slot;
+    uint32_t index = _buckets[bucket];
+    _buckets[bucket] = NIL;
+
+    while (index != NIL)
+    {
+      uint32_t next = _timers[index].next;
+      link(index);
+      index = next;
+    }
+  }
+
+  /// The last tick processed.
+  uint64_t _now;
+
+  /// The number of running timers.
+  size_t _count;
+
+  /// The head of the free list of timer slots.
+  uint32_t _free;
+
+  /// The heads of the bucket lists, indexed by level * SLOTS + slot, with
+  /// the firing bucket last.
+  uint32_t _buckets[NUM_BUCKETS];
+
+  /// The slab of timers.
+  std::vector<Timer> _timers;
+};
+
+#endif
@@ -0,0 +1,321 @@
+/**
+ * @file tsx_arena.h  Pooled allocation of AppServerTsx objects.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef TSX_ARENA_H__
+#define TSX_ARENA_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+/// Statistics for a TsxArena.
+struct TsxArenaStats
+{
+  /// The number of objects currently allocated from the arena.
+  uint64_t live;
+
+  /// The highest number of objects seen allocated at once.  This is sampled
+  /// whenever a thread refills its cache and whenever the statistics are
+  /// read, so may lag the true peak by up to one batch per thread.
+  uint64_t high_water;
+
+  /// The total number of bytes of memory held by the arena.
+  uint64_t arena_bytes;
+};
+
+
+/// The TsxArena class is a free-list allocator for fixed-size objects of
+/// type T, intended for AppServerTsx subclasses that are created for every
+/// transaction.
+///
+/// Each thread keeps its own cache of free objects, so allocation and
+/// deallocation are normally just a pointer swap with no locking.  Objects
+/// may be freed on a different thread from the one that allocated them:
+/// threads with too many free objects hand a batch back to a shared list,
+/// and threads that run out take a batch from it before growing the arena.
+/// Memory is obtained in chunks and is never returned to the system, so the
+/// arena stays at the size of the peak load.
+///
+/// AppServer subclasses will usually use this through PooledAppServerTsx
+/// rather than directly.
+///
+template <class T>
+class TsxArena
+{
+public:
+  /// Allocates storage for one object.
+  static void* allocate()
+  {
+    LocalCache& local = _local;
+
+    if (local.head == NULL)
+    {
+      refill(local);
+    }
+
+    Block* block = local.head;
+    local.head = block->next;
+    --local.count;
+    local.allocs.store(local.allocs.load(std::memory_order_relaxed) + 1,
+                       std::memory_order_relaxed);
+    return block;
+  }
+
+  /// Returns storage for one object to the arena.
+  static void deallocate(void* ptr)
+  {
+    LocalCache& local = _local;
+    Block* block = static_cast<Block*>(ptr);
+    block->next = local.head;
+    local.head = block;
+    ++local.count;
+    local.frees.store(local.frees.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_relaxed);
+
+    if (local.count > MAX_LOCAL)
+    {
+      spill(local);
+    }
+  }
+
+  /// Returns the current statistics for the arena.
+  static TsxArenaStats stats()
+  {
+    Shared& shared = Shared::get();
+    std::lock_guard<std::mutex> lock(shared.lock);
+    TsxArenaStats stats;
+    stats.live = live(shared);
+    stats.high_water = update_high_water(shared, stats.live);
+    stats.arena_bytes = shared.arena_bytes;
+    return stats;
+  }
+
+private:
+  /// The number of objects allocated at a time when the arena grows.
+  static const size_t CHUNK_OBJECTS = 64;
+
+  /// The number of objects moved between a thread and the shared list.
+  static const size_t BATCH = 64;
+
+  /// The maximum number of free objects a thread may cache.
+  static const size_t MAX_LOCAL = 4 * BATCH;
+
+  /// Storage for one object, or a link in a free list.
+  union Block
+  {
+    Block* next;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+  };
+
+  struct LocalCache;
+
+  /// State shared by all threads.  Everything here is protected by the lock.
+  struct Shared
+  {
+    Shared() : head(NULL), count(0), arena_bytes(0), high_water(0),
+               retired_allocs(0), retired_frees(0), caches() {}
+
+    static Shared& get()
+    {
+      static Shared shared;
+      return shared;
+    }
+
+    std::mutex lock;
+    Block* head;
+    size_t count;
+    uint64_t arena_bytes;
+    uint64_t high_water;
+    uint64_t retired_allocs;
+    uint64_t retired_frees;
+    std::vector<LocalCache*> caches;
+  };
+
+  /// Per-thread cache of free objects.  The allocation counters are only
+  /// written by the owning thread, and are atomic so that stats can read
+  /// them from other threads.
+  struct LocalCache
+  {
+    LocalCache() : head(NULL), count(0), allocs(0), frees(0)
+    {
+      Shared& shared = Shared::get();
+      std::lock_guard<std::mutex> lock(shared.lock);
+      shared.caches.push_back(this);
+    }
+
+    ~LocalCache()
+    {
+      Shared& shared = Shared::get();
+      std::lock_guard<std::mutex> lock(shared.lock);
+
+      while (head != NULL)
+      {
+        Block* block = head;
+        head = block->next;
+        block->next = shared.head;
+        shared.head = block;
+        ++shared.count;
+      }
+
+      shared.retired_allocs += allocs.load(std::memory_order_relaxed);
+      shared.retired_frees += frees.load(std::memory_order_relaxed);
+
+      for (typename std::vector<LocalCache*>::iterator ii = shared.caches.begin();
+           ii != shared.caches.end();
+           ++ii)
+      {
+        if (*ii == this)
+        {
+          shared.caches.erase(ii);
+          break;
+        }
+      }
+    }
+
+    Block* head;
+    size_t count;
+    std::atomic<uint64_t> allocs;
+    std::atomic<uint64_t> frees;
+  };
+
+  /// Fills an empty thread cache, from the shared list if possible, otherwise
+  /// by growing the arena.
+  static void refill(LocalCache& local)
+  {
+    Shared& shared = Shared::get();
+    std::lock_guard<std::mutex> lock(shared.lock);
+
+    // Sample the high water mark, since this thread has just run out of
+    // objects.
+    update_high_water(shared, live(shared));
+
+    if (shared.head == NULL)
+    {
+      Block* chunk = static_cast<Block*>(
+                            ::operator new(CHUNK_OBJECTS * sizeof(Block)));
+      shared.arena_bytes += CHUNK_OBJECTS * sizeof(Block);
+
+      for (size_t ii = 0; ii < CHUNK_OBJECTS; ++ii)
+      {
+        chunk[ii].next = shared.head;
+        shared.head = &chunk[ii];
+      }
+      shared.count += CHUNK_OBJECTS;
+    }
+
+    for (size_t ii = 0; (ii < BATCH) && (shared.head != NULL); ++ii)
+    {
+      Block* block = shared.head;
+      shared.head = block->next;
+      --shared.count;
+      block->next = local.head;
+      local.head = block;
+      ++local.count;
+    }
+  }
+
+  /// Hands a batch of free objects from a thread cache back to the shared
+  /// list.
+  static void spill(LocalCache& local)
+  {
+    Shared& shared = Shared::get();
+    std::lock_guard<std::mutex> lock(shared.lock);
+
+    for (size_t ii = 0; ii < BATCH; ++ii)
+    {
+      Block* block = local.head;
+      local.head = block->next;
+      --local.count;
+      block->next = shared.head;
+      shared.head = block;
+      ++shared.count;
+    }
+  }
+
+  /// Calculates the number of live objects.  Must be called with the shared
+  /// lock held.
+  static uint64_t live(Shared& shared)
+  {
+    uint64_t allocs = shared.retired_allocs;
+    uint64_t frees = shared.retired_frees;
+
+    for (typename std::vector<LocalCache*>::const_iterator ii = shared.caches.begin();
+         ii != shared.caches.end();
+         ++ii)
+    {
+      allocs += (*ii)->allocs.load(std::memory_order_relaxed);
+      frees += (*ii)->frees.load(std::memory_order_relaxed);
+    }
+
+    // Counters from different threads are read at slightly different times,
+    // so don't let a racing free make the total go negative.
+    return (allocs > frees) ? allocs - frees : 0;
+  }
+
+  static uint64_t update_high_water(Shared& shared, uint64_t live)
+  {
+    if (live > shared.high_water)
+    {
+      shared.high_water = live;
+    }
+    return shared.high_water;
+  }
+
+  static thread_local LocalCache _local;
+};
+
+template <class T>
+thread_local typename TsxArena<T>::LocalCache TsxArena<T>::_local;
+
+
+/// Mixin which makes an AppServerTsx subclass allocate from a TsxArena.
+/// Derive from this as well as AppServerTsx, passing the subclass itself as
+/// the template parameter, for example
+///
+///   class MyASTsx : public AppServerTsx, public PooledAppServerTsx<MyASTsx>
+///
+/// and construct transactions with new as usual in get_app_tsx.  When the
+/// infrastructure deletes the transaction at the end of its life, the
+/// memory is handed back to the arena.  Further subclasses of different
+/// sizes fall back to the global allocator.
+///
+template <class T>
+class PooledAppServerTsx
+{
+public:
+  static void* operator new(size_t size)
+  {
+    return (size == sizeof(T)) ? TsxArena<T>::allocate() : ::operator new(size);
+  }
+
+  static void operator delete(void* ptr, size_t size)
+  {
+    if (size == sizeof(T))
+    {
+      TsxArena<T>::deallocate(ptr);
+    }
+    else
+    {
+      ::operator delete(ptr);
+    }
+  }
+
+  /// Returns the statistics for the arena used by this class.
+  static TsxArenaStats arena_stats() { return TsxArena<T>::stats(); }
+
+protected:
+  PooledAppServerTsx() {}
+};
+
+#endif
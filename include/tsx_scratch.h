@@ -0,0 +1,248 @@
+/**
+ * @file tsx_scratch.h  Per-transaction scratch memory for AppServers.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef TSX_SCRATCH_H__
+#define TSX_SCRATCH_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cstddef>
+#include <new>
+#include <string>
+#include <vector>
+
+/// The TsxScratch class is a bump allocator for the scratch data a service
+/// builds while handling a transaction, such as strings, target lists and
+/// parsed parameters.  Each AppServerTsx has one (see AppServerTsx::scratch),
+/// and all its memory is released at once when the transaction is destroyed.
+///
+/// Allocation just advances a pointer within the current block.  Individual
+/// allocations are never freed, and objects allocated from the arena do not
+/// have their destructors called, so it should only hold objects whose
+/// memory is also scratch (for example containers using ScratchAllocator).
+/// Blocks double in size as the arena grows, so a typical transaction's
+/// whole working set fits in one or two contiguous blocks.  No memory is
+/// allocated until the arena is first used.
+///
+/// A TsxScratch is not thread-safe, in the same way as the rest of a
+/// transaction's state.
+///
+class TsxScratch
+{
+public:
+  /// The size of the first block.
+  static const size_t DEFAULT_BLOCK_SIZE = 2048;
+
+  /// Constructor.
+  ///
+  /// @param  block_size   - The size of the first block to allocate.
+  TsxScratch(size_t block_size = DEFAULT_BLOCK_SIZE) :
+    _head(NULL),
+    _ptr(NULL),
+    _end(NULL),
+    _block_size(block_size),
+    _used(0),
+    _high_water(0),
+    _reserved(0)
+  {
+  }
+
+  ~TsxScratch()
+  {
+    release();
+  }
+
+  /// Allocates memory from the arena.
+  ///
+  /// @returns             - The memory, which is never NULL.
+  /// @param  size         - The number of bytes to allocate.
+  /// @param  align        - The alignment required, a power of two.
+  ///
+  /// @throws std::bad_alloc if the memory cannot be allocated.
+  void* allocate(size_t size, size_t align = alignof(std::max_align_t))
+  {
+    char* ptr = align_up(_ptr, align);
+
+    if ((_ptr == NULL) || (ptr > _end) || (size > (size_t)(_end - ptr)))
+    {
+      if (size > SIZE_MAX - align)
+      {
+        throw std::bad_alloc();
+      }
+      grow(size + align);
+      ptr = align_up(_ptr, align);
+    }
+
+    _used += (ptr + size) - _ptr;
+    _ptr = ptr + size;
+
+    if (_used > _high_water)
+    {
+      _high_water = _used;
+    }
+
+    return ptr;
+  }
+
+  /// Allocates an uninitialized array of T.
+  ///
+  /// @throws std::bad_alloc if the array is too big to allocate.
+  template <class T>
+  T* allocate_array(size_t num)
+  {
+    if (num > SIZE_MAX / sizeof(T))
+    {
+      throw std::bad_alloc();
+    }
+    return (T*)allocate(num * sizeof(T), alignof(T));
+  }
+
+  /// Copies a string into the arena.  The copy is null-terminated.
+  ///
+  /// @returns             - The copy.
+  /// @param  str          - The string to copy.
+  /// @param  len          - The length of the string.
+  char* strdup(const char* str, size_t len)
+  {
+    char* copy = (char*)allocate(len + 1, 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+  }
+
+  /// Frees all the memory in the arena.  The high-water mark is kept.
+  void release()
+  {
+    while (_head != NULL)
+    {
+      Block* next = _head->next;
+      free(_head);
+      _head = next;
+    }
+
+    _ptr = NULL;
+    _end = NULL;
+    _used = 0;
+    _reserved = 0;
+  }
+
+  /// Returns the number of bytes currently allocated, including padding.
+  size_t used() const { return _used; }
+
+  /// Returns the most bytes that have been allocated at once.
+  size_t high_water() const { return _high_water; }
+
+  /// Returns the number of bytes of memory held by the arena.
+  size_t reserved() const { return _reserved; }
+
+private:
+  /// Each block starts with this header.
+  struct Block
+  {
+    Block* next;
+  };
+
+  static char* align_up(char* ptr, size_t align)
+    {return (char*)(((uintptr_t)ptr + align - 1) & ~(uintptr_t)(align - 1));}
+
+  /// Allocates a new block with room for at least size bytes.
+  void grow(size_t size)
+  {
+    if (size > SIZE_MAX - sizeof(Block))
+    {
+      throw std::bad_alloc();
+    }
+
+    size_t block_size = (_head == NULL) ? _block_size : _reserved;
+    while (block_size < size + sizeof(Block))
+    {
+      if (block_size > SIZE_MAX / 2)
+      {
+        block_size = size + sizeof(Block);
+        break;
+      }
+      block_size *= 2;
+    }
+
+    Block* block = (Block*)malloc(block_size);
+    if (block == NULL)
+    {
+      throw std::bad_alloc();
+    }
+
+    block->next = _head;
+    _head = block;
+    _ptr = (char*)(block + 1);
+    _end = (char*)block + block_size;
+    _reserved += block_size;
+  }
+
+  TsxScratch(const TsxScratch&);
+  TsxScratch& operator=(const TsxScratch&);
+
+  Block* _head;
+  char* _ptr;
+  char* _end;
+  size_t _block_size;
+  size_t _used;
+  size_t _high_water;
+  size_t _reserved;
+};
+
+
+/// The ScratchAllocator class template adapts a TsxScratch for use as an STL
+/// allocator, for example
+///
+///   TsxScratch& arena = scratch();
+///   ScratchVector<pjsip_uri*> targets(arena);
+///
+/// Deallocation is a no-op: memory is reclaimed when the arena is released,
+/// so containers using it must not outlive the transaction.
+///
+template <class T>
+class ScratchAllocator
+{
+public:
+  typedef T value_type;
+
+  ScratchAllocator(TsxScratch& scratch) : _scratch(&scratch) {}
+
+  template <class U>
+  ScratchAllocator(const ScratchAllocator<U>& other) : _scratch(other.scratch()) {}
+
+  T* allocate(size_t num)
+    {return _scratch->allocate_array<T>(num);}
+
+  void deallocate(T* ptr, size_t num) {}
+
+  TsxScratch* scratch() const { return _scratch; }
+
+  template <class U>
+  bool operator==(const ScratchAllocator<U>& other) const
+    {return _scratch == other.scratch();}
+
+  template <class U>
+  bool operator!=(const ScratchAllocator<U>& other) const
+    {return _scratch != other.scratch();}
+
+private:
+  TsxScratch* _scratch;
+};
+
+/// Containers allocating from a TsxScratch.
+template <class T>
+using ScratchVector = std::vector<T, ScratchAllocator<T> >;
+
+typedef std::basic_string<char, std::char_traits<char>, ScratchAllocator<char> >
+                                                                 ScratchString;
+
+#endif
@@ -0,0 +1,242 @@
+/**
+ * @file admission_control_test.cpp UT for AppServer admission control.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "admission_control.h"
+
+using namespace std;
+
+static const uint64_t MS = 1000000;
+
+
+/// Test that with the default configuration every request is admitted.
+TEST(AdmissionControlTest, Disabled)
+{
+  AppServerStats stats;
+  AdmissionControl admission(stats);
+
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    stats.tsx_created();
+    EXPECT_EQ(AdmissionControl::ADMIT, admission.admit());
+  }
+
+  EXPECT_EQ(-1, admission.limit());
+  EXPECT_EQ(0u, stats.snapshot().counters[AppServerStats::THROTTLED]);
+}
+
+
+/// Test that the token bucket admits a burst and then the configured rate,
+/// and returns the policy for throttled requests.
+TEST(AdmissionControlTest, Rate)
+{
+  AppServerStats stats;
+  AdmissionControl admission(stats);
+  AdmissionControl::Config config;
+  config.rate = 1000;
+  config.burst = 10;
+  config.policy = AdmissionControl::SHED_TO_NEXT_HOP;
+  admission.configure(config);
+
+  uint64_t now = 1000 * MS;
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    EXPECT_EQ(AdmissionControl::ADMIT, admission.admit(now));
+  }
+  EXPECT_EQ(AdmissionControl::SHED_TO_NEXT_HOP, admission.admit(now));
+
+  // A millisecond later there is one more token.
+  now += MS;
+  EXPECT_EQ(AdmissionControl::ADMIT, admission.admit(now));
+  EXPECT_EQ(AdmissionControl::SHED_TO_NEXT_HOP, admission.admit(now));
+
+  // After an idle period the bucket is full again, but no fuller.
+  now += 1000 * MS;
+  int admitted = 0;
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    if (admission.admit(now) == AdmissionControl::ADMIT)
+    {
+      ++admitted;
+    }
+  }
+  EXPECT_EQ(10, admitted);
+  EXPECT_EQ(92u, stats.snapshot().counters[AppServerStats::THROTTLED]);
+}
+
+
+/// Test that requests are throttled once a fixed number of transactions are
+/// in flight, and admitted again when they complete.
+TEST(AdmissionControlTest, MaxInFlight)
+{
+  AppServerStats stats;
+  AdmissionControl admission(stats);
+  AdmissionControl::Config config;
+  config.max_in_flight = 5;
+  config.update_interval_ms = 1;
+  config.policy = AdmissionControl::REJECT_503;
+  config.retry_after_s = 10;
+  admission.configure(config);
+
+  uint64_t now = 1000 * MS;
+  for (int ii = 0; ii < 5; ++ii)
+  {
+    EXPECT_EQ(AdmissionControl::ADMIT, admission.admit(now));
+    stats.tsx_created();
+    now += MS;
+  }
+  EXPECT_EQ(AdmissionControl::REJECT_503, admission.admit(now));
+  EXPECT_EQ(5, admission.limit());
+
+  // The in-flight count is only sampled once per update interval.
+  stats.tsx_destroyed();
+  EXPECT_EQ(AdmissionControl::REJECT_503, admission.admit(now));
+  now += MS;
+  EXPECT_EQ(AdmissionControl::ADMIT, admission.admit(now));
+}
+
+
+/// Test that the in-flight limit is cut while the callback latency is above
+/// the target, and raised again once it recovers.
+TEST(AdmissionControlTest, LatencyTarget)
+{
+  AppServerStats stats;
+  AdmissionControl admission(stats);
+  AdmissionControl::Config config;
+  config.max_in_flight = 1000;
+  config.target_latency_us = 100;
+  config.update_interval_ms = 10;
+  config.policy = AdmissionControl::BYPASS;
+  admission.configure(config);
+
+  for (int ii = 0; ii < 50; ++ii)
+  {
+    stats.tsx_created();
+  }
+
+  // Slow callbacks cut the limit below the number in flight.
+  uint64_t now = 1000 * MS;
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    stats.record_latency(AppServerStats::INITIAL_REQUEST, 1000);
+  }
+  EXPECT_EQ(AdmissionControl::BYPASS, admission.admit(now));
+  EXPECT_EQ(40, admission.limit());
+  EXPECT_EQ(1000u, admission.latency_us());
+
+  // Fast callbacks bring the average down, and the limit back up to the
+  // maximum.
+  for (int update = 0; update < 200; ++update)
+  {
+    now += 10 * MS;
+    for (int ii = 0; ii < 10; ++ii)
+    {
+      stats.record_latency(AppServerStats::RESPONSE, 1);
+    }
+    admission.admit(now);
+  }
+  EXPECT_GT(100u, admission.latency_us());
+  EXPECT_EQ(1000, admission.limit());
+  EXPECT_EQ(AdmissionControl::ADMIT, admission.admit(now));
+}
+
+
+/// Test that the token bucket admits no more than its burst when many
+/// threads race for it.
+TEST(AdmissionControlTest, RateThreads)
+{
+  AppServerStats stats;
+  AdmissionControl admission(stats);
+  AdmissionControl::Config config;
+  config.rate = 1;
+  config.burst = 100;
+  admission.configure(config);
+
+  uint64_t now = 1000 * MS;
+  std::atomic<int> admitted(0);
+  std::vector<std::thread> threads;
+  for (int ii = 0; ii < 8; ++ii)
+  {
+    threads.push_back(std::thread([&]()
+    {
+      for (int jj = 0; jj < 100; ++jj)
+      {
+        if (admission.admit(now) == AdmissionControl::ADMIT)
+        {
+          ++admitted;
+        }
+      }
+    }));
+  }
+  for (size_t ii = 0; ii < threads.size(); ++ii)
+  {
+    threads[ii].join();
+  }
+
+  EXPECT_EQ(100, admitted.load());
+}
+
+
+/// Test that the limit can be adapted by one thread while others admit
+/// requests and read the diagnostics.  This is mainly for the benefit of
+/// thread sanitizer builds.
+TEST(AdmissionControlTest, AdaptThreads)
+{
+  AppServerStats stats;
+  AdmissionControl admission(stats);
+  AdmissionControl::Config config;
+  config.max_in_flight = 1000;
+  config.target_latency_us = 100;
+  config.update_interval_ms = 1;
+  admission.configure(config);
+
+  std::atomic<bool> done(false);
+  std::vector<std::thread> threads;
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    threads.push_back(std::thread([&]()
+    {
+      while (!done.load())
+      {
+        if (admission.admit() == AdmissionControl::ADMIT)
+        {
+          stats.tsx_created();
+          stats.tsx_destroyed();
+        }
+        EXPECT_NE(0, admission.limit());
+        admission.latency_us();
+      }
+    }));
+  }
+
+  // Alternate slow and fast callbacks, so the limit keeps moving.
+  uint64_t now = AdmissionControl::now_ns();
+  for (int update = 0; update < 200; ++update)
+  {
+    now += 2 * MS;
+    stats.record_latency(AppServerStats::INITIAL_REQUEST,
+                         ((update / 20) % 2 == 0) ? 1000 : 1);
+    admission.admit(now);
+  }
+
+  done = true;
+  for (size_t ii = 0; ii < threads.size(); ++ii)
+  {
+    threads[ii].join();
+  }
+
+  EXPECT_LT(0, admission.limit());
+  EXPECT_GE(1000, admission.limit());
+}
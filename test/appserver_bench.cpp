@@ -0,0 +1,463 @@
+/**
+ * @file appserver_bench.cpp Benchmarks for the application server interface.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include "benchmark/benchmark.h"
+
+#include "sip_common.hpp"
+#include "pjutils.h"
+#include "hunt_engine.h"
+#include "request_template.h"
+#include "body_view.h"
+#include "dummyappserver.hpp"
+#include "fakeappserver.hpp"
+
+using namespace std;
+using AS::Message;
+
+/// Count of heap allocations made by the process, for reporting
+/// allocations/op.
+static std::atomic<uint64_t> num_allocs(0);
+
+void* operator new(size_t size)
+{
+  num_allocs.fetch_add(1, std::memory_order_relaxed);
+  void* ptr = malloc(size);
+  if (ptr == NULL)
+  {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+  free(ptr);
+}
+
+
+/// Fixture giving access to the PJSIP set up of SipCommonTest.
+class AppServerBench : public SipCommonTest
+{
+public:
+  void TestBody() {}
+
+  using SipCommonTest::parse_msg;
+  static pj_pool_t* pool() { return _pool; }
+};
+
+static AppServerBench* bench = NULL;
+
+
+/// Drives one AppServerTsx type through an initial request and a number of
+/// responses per iteration.  Each iteration gets fresh copies of the
+/// messages, as the infrastructure would pass in.
+template <class T>
+static void run_tsx(benchmark::State& state, int responses)
+{
+  Message msg;
+  pjsip_msg* req = bench->parse_msg(msg.get_request());
+  pjsip_msg* rsp = bench->parse_msg(msg.get_response());
+  FakeAppServerTsxHelper helper(bench->pool()->factory, false);
+
+  uint64_t allocs = 0;
+  for (auto _ : state)
+  {
+    state.PauseTiming();
+    T tsx;
+    pjsip_msg* tsx_req = helper.start(&tsx, req);
+    std::vector<pjsip_msg*> tsx_rsps(responses);
+    for (int ii = 0; ii < responses; ++ii)
+    {
+      tsx_rsps[ii] = helper.receive(rsp);
+    }
+    uint64_t allocs_before = num_allocs.load(std::memory_order_relaxed);
+    state.ResumeTiming();
+
+    tsx.on_initial_request(tsx_req);
+    for (int ii = 0; ii < responses; ++ii)
+    {
+      tsx.on_response(tsx_rsps[ii], ii);
+    }
+
+    allocs += num_allocs.load(std::memory_order_relaxed) - allocs_before;
+  }
+  helper.finish();
+
+  state.counters["allocs/op"] =
+    benchmark::Counter(allocs, benchmark::Counter::kAvgIterations);
+  state.counters["pool_bytes/op"] =
+    benchmark::Counter(helper.pool_bytes(), benchmark::Counter::kAvgIterations);
+}
+
+
+/// Benchmark the DummyDialogASTsx: add to dialog, forward the request and
+/// forward one response.
+static void BM_DummyDialog(benchmark::State& state)
+{
+  run_tsx<DummyDialogASTsx>(state, 1);
+}
+BENCHMARK(BM_DummyDialog);
+
+
+/// Benchmark the DummyRejectASTsx: create, send and free a response.
+static void BM_DummyReject(benchmark::State& state)
+{
+  run_tsx<DummyRejectASTsx>(state, 0);
+}
+BENCHMARK(BM_DummyReject);
+
+
+/// Benchmark the DummyFastRejectASTsx: reject the request in a single call,
+/// without building a response.
+static void BM_DummyFastReject(benchmark::State& state)
+{
+  run_tsx<DummyFastRejectASTsx>(state, 0);
+}
+BENCHMARK(BM_DummyFastReject);
+
+
+/// Benchmark the DummyRedirectASTsx: redirect the request to two contacts.
+static void BM_DummyRedirect(benchmark::State& state)
+{
+  run_tsx<DummyRedirectASTsx>(state, 0);
+}
+BENCHMARK(BM_DummyRedirect);
+
+
+/// Benchmark the DummyForkASTsx: clone the request twice, send both forks
+/// and forward a response from each.
+static void BM_DummyFork(benchmark::State& state)
+{
+  run_tsx<DummyForkASTsx>(state, 2);
+}
+BENCHMARK(BM_DummyFork);
+
+
+/// Benchmark the DummyLazyForkASTsx, as DummyForkASTsx but using lazy
+/// clones.
+static void BM_DummyLazyFork(benchmark::State& state)
+{
+  run_tsx<DummyLazyForkASTsx>(state, 2);
+}
+BENCHMARK(BM_DummyLazyFork);
+
+
+/// Benchmark the DummyStaticForkASTsx, as DummyForkASTsx but with the helper
+/// bound at compile time.
+static void BM_DummyStaticFork(benchmark::State& state)
+{
+  run_tsx<DummyStaticForkASTsx>(state, 2);
+}
+BENCHMARK(BM_DummyStaticFork);
+
+
+/// Drives a 10-target serial hunt per iteration, where the first nine
+/// targets fail (by returning a busy response, or by timing out) and the
+/// last answers.
+static void run_hunt(benchmark::State& state, bool timeouts)
+{
+  const int NUM_TARGETS = 10;
+  const int TIMEOUT_MS = 1000;
+
+  HuntPlan plan;
+  for (int ii = 0; ii < NUM_TARGETS; ++ii)
+  {
+    std::string uri = "sip:650555" + std::to_string(1000 + ii) + "@homedomain";
+    plan.add_target(PJUtils::uri_from_string(uri, bench->pool()), TIMEOUT_MS);
+  }
+
+  Message msg;
+  msg._method = "INVITE";
+  pjsip_msg* req = bench->parse_msg(msg.get_request());
+  pjsip_msg* ok = bench->parse_msg(msg.get_response());
+  msg._status = "486 Busy Here";
+  pjsip_msg* busy = bench->parse_msg(msg.get_response());
+  FakeAppServerTsxHelper helper(bench->pool()->factory, false);
+  uint64_t now = 0;
+
+  uint64_t allocs = 0;
+  for (auto _ : state)
+  {
+    state.PauseTiming();
+    HuntAppServerTsx tsx(&plan);
+    pjsip_msg* tsx_req = helper.start(&tsx, req);
+    std::vector<pjsip_msg*> tsx_rsps(NUM_TARGETS);
+    for (int ii = 0; ii < NUM_TARGETS; ++ii)
+    {
+      tsx_rsps[ii] = helper.receive((ii < NUM_TARGETS - 1) ? busy : ok);
+    }
+    uint64_t allocs_before = num_allocs.load(std::memory_order_relaxed);
+    state.ResumeTiming();
+
+    tsx.on_initial_request(tsx_req);
+    for (int ii = 0; ii < NUM_TARGETS - 1; ++ii)
+    {
+      if (timeouts)
+      {
+        now += TIMEOUT_MS;
+        helper.advance_time(now);
+      }
+      else
+      {
+        tsx.on_response(tsx_rsps[ii], ii);
+      }
+    }
+    tsx.on_response(tsx_rsps[NUM_TARGETS - 1], NUM_TARGETS - 1);
+
+    allocs += num_allocs.load(std::memory_order_relaxed) - allocs_before;
+
+    state.PauseTiming();
+    if (timeouts)
+    {
+      for (int ii = 0; ii < NUM_TARGETS - 1; ++ii)
+      {
+        helper.free_msg(tsx_rsps[ii]);
+      }
+    }
+    helper.finish();
+    state.ResumeTiming();
+  }
+
+  state.counters["allocs/op"] =
+    benchmark::Counter(allocs, benchmark::Counter::kAvgIterations);
+  state.counters["pool_bytes/op"] =
+    benchmark::Counter(helper.pool_bytes(), benchmark::Counter::kAvgIterations);
+}
+
+
+/// Benchmark a 10-target hunt where each target is busy until the last.
+static void BM_Hunt10Busy(benchmark::State& state)
+{
+  run_hunt(state, false);
+}
+BENCHMARK(BM_Hunt10Busy);
+
+
+/// Benchmark a 10-target hunt where each target times out until the last.
+static void BM_Hunt10Timeout(benchmark::State& state)
+{
+  run_hunt(state, true);
+}
+BENCHMARK(BM_Hunt10Timeout);
+
+
+/// A click-to-dial INVITE, with the parts that change per call as printf
+/// arguments.
+static const char* C2D_INVITE =
+  "INVITE sip:%s@homedomain SIP/2.0\r\n"
+  "Via: SIP/2.0/TCP 10.114.61.213;branch=z9hG4bK0123456789abcdef\r\n"
+  "From: <sip:%s@homedomain>;tag=%s\r\n"
+  "To: <sip:%s@homedomain>\r\n"
+  "Max-Forwards: 70\r\n"
+  "Call-ID: %s\r\n"
+  "CSeq: %d INVITE\r\n"
+  "Contact: <sip:c2d@10.114.61.213:5058;transport=tcp>\r\n"
+  "Allow: INVITE, ACK, CANCEL, BYE, UPDATE, INFO, PRACK\r\n"
+  "Supported: timer, 100rel\r\n"
+  "Session-Expires: 600\r\n"
+  "Content-Length: 0\r\n\r\n";
+
+
+/// Benchmark originating a request by printing and parsing its text.
+static void BM_RequestFromText(benchmark::State& state)
+{
+  pj_pool_t* pool = pj_pool_create(bench->pool()->factory, "bench", 4096, 4096, NULL);
+  char buf[1024];
+
+  for (auto _ : state)
+  {
+    int len = snprintf(buf, sizeof(buf), C2D_INVITE,
+                       "6505551234", "6505550000", "c2d-tag-1",
+                       "6505551234", "c2d-call-1@10.114.61.213", 1);
+    pjsip_msg* msg = pjsip_parse_msg(pool, buf, len, NULL);
+    benchmark::DoNotOptimize(msg);
+    pj_pool_reset(pool);
+  }
+
+  pj_pool_release(pool);
+}
+BENCHMARK(BM_RequestFromText);
+
+
+/// Benchmark originating the same request from a RequestTemplate.
+static void BM_RequestFromTemplate(benchmark::State& state)
+{
+  char text[1024];
+  snprintf(text, sizeof(text), C2D_INVITE,
+           "template", "template", "template", "template", "template", 1);
+  RequestTemplate tmpl(bench->pool()->factory);
+  tmpl.parse(text);
+
+  pj_pool_t* pool = pj_pool_create(bench->pool()->factory, "bench", 4096, 4096, NULL);
+  pjsip_uri* callee = PJUtils::uri_from_string("sip:6505551234@homedomain", bench->pool());
+  pjsip_uri* caller = PJUtils::uri_from_string("sip:6505550000@homedomain", bench->pool());
+
+  for (auto _ : state)
+  {
+    RequestTemplate::Values values;
+    values.request_uri = callee;
+    values.from_uri = caller;
+    values.from_tag = pj_str((char*)"c2d-tag-1");
+    values.to_uri = callee;
+    values.call_id = pj_str((char*)"c2d-call-1@10.114.61.213");
+    values.cseq = 1;
+
+    pjsip_msg* msg = pjsip_msg_create(pool, PJSIP_REQUEST_MSG);
+    tmpl.instantiate(pool, msg, values);
+    benchmark::DoNotOptimize(msg);
+    pj_pool_reset(pool);
+  }
+
+  pj_pool_release(pool);
+}
+BENCHMARK(BM_RequestFromTemplate);
+
+
+/// A typical SDP offer, with a PCMA codec for the media-steering
+/// benchmarks to strip.
+static const char* SDP_OFFER =
+  "v=0\r\n"
+  "o=- 2890844526 2890844526 IN IP4 10.0.0.1\r\n"
+  "s=-\r\n"
+  "c=IN IP4 10.0.0.1\r\n"
+  "t=0 0\r\n"
+  "m=audio 49170 RTP/AVP 0 8 97 101\r\n"
+  "a=rtpmap:0 PCMU/8000\r\n"
+  "a=rtpmap:8 PCMA/8000\r\n"
+  "a=rtpmap:97 AMR/8000\r\n"
+  "a=fmtp:97 mode-set=0,2,5,7; mode-change-period=2\r\n"
+  "a=rtpmap:101 telephone-event/8000\r\n"
+  "a=fmtp:101 0-15\r\n"
+  "a=ptime:20\r\n"
+  "a=sendrecv\r\n";
+
+
+/// Creates a message whose body is a writable copy of SDP_OFFER, with room
+/// to spare.
+static pjsip_msg* sdp_msg(pj_pool_t* pool)
+{
+  pjsip_msg* msg = pjsip_msg_create(pool, PJSIP_REQUEST_MSG);
+  pj_str_t type = pj_str((char*)"application");
+  pj_str_t subtype = pj_str((char*)"sdp");
+  pj_str_t text = pj_str((char*)SDP_OFFER);
+  msg->body = pjsip_msg_body_create(pool, &type, &subtype, &text);
+  msg->body->data = pj_pool_alloc(pool, 2 * text.slen);
+  return msg;
+}
+
+/// Resets the body of a message from sdp_msg.
+static void reset_sdp(pjsip_msg* msg)
+{
+  msg->body->len = strlen(SDP_OFFER);
+  memcpy(msg->body->data, SDP_OFFER, msg->body->len);
+}
+
+
+/// Benchmark stripping the PCMA codec from an SDP body by copying it into a
+/// string, editing that and writing a new body back to the pool.
+static void BM_SdpStripCodecString(benchmark::State& state)
+{
+  pj_pool_t* pool = pj_pool_create(bench->pool()->factory, "bench", 4096, 4096, NULL);
+  pjsip_msg* msg = sdp_msg(pool);
+  pj_pool_t* body_pool = pj_pool_create(bench->pool()->factory, "bench", 4096, 4096, NULL);
+  void* data = msg->body->data;
+
+  for (auto _ : state)
+  {
+    msg->body->data = data;
+    reset_sdp(msg);
+
+    std::string sdp((char*)msg->body->data, msg->body->len);
+    size_t pos = sdp.find("a=rtpmap:8 ");
+    sdp.erase(pos, sdp.find("\r\n", pos) + 2 - pos);
+    pos = sdp.find("m=audio");
+    pos = sdp.find(" 8 ", pos);
+    sdp.erase(pos, 2);
+
+    pj_str_t text = pj_str((char*)sdp.c_str());
+    pj_str_t copy;
+    pj_strdup(body_pool, &copy, &text);
+    msg->body->data = copy.ptr;
+    msg->body->len = copy.slen;
+    benchmark::DoNotOptimize(msg->body->data);
+    pj_pool_reset(body_pool);
+  }
+
+  pj_pool_release(body_pool);
+  pj_pool_release(pool);
+}
+BENCHMARK(BM_SdpStripCodecString);
+
+
+/// Benchmark stripping the PCMA codec from an SDP body in place with
+/// SdpReader and BodyEditor.
+static void BM_SdpStripCodecInPlace(benchmark::State& state)
+{
+  pj_pool_t* pool = pj_pool_create(bench->pool()->factory, "bench", 4096, 4096, NULL);
+  pjsip_msg* msg = sdp_msg(pool);
+
+  for (auto _ : state)
+  {
+    reset_sdp(msg);
+
+    BodyEditor editor(pool, msg);
+    SdpReader sdp(BodyView::body(msg));
+    SdpLine line;
+    while (sdp.next(line))
+    {
+      pj_str_t name;
+      pj_str_t value;
+      if (line.type == 'm')
+      {
+        pj_str_t rest = line.value;
+        pj_str_t token;
+        while (BodyView::next_token(rest, token))
+        {
+          if ((token.slen == 1) && (token.ptr[0] == '8'))
+          {
+            editor.erase(BodyView::slice(token.ptr - 1, 2));
+          }
+        }
+      }
+      else if ((line.attribute(name, value)) &&
+               (value.slen > 2) &&
+               (memcmp(value.ptr, "8 ", 2) == 0))
+      {
+        editor.erase(line.raw);
+      }
+    }
+    editor.apply(true);
+    benchmark::DoNotOptimize(msg->body->data);
+  }
+
+  pj_pool_release(pool);
+}
+BENCHMARK(BM_SdpStripCodecInPlace);
+
+
+int main(int argc, char** argv)
+{
+  AppServerBench::SetUpTestCase();
+  bench = new AppServerBench();
+
+  benchmark::Initialize(&argc, argv);
+  benchmark::RunSpecifiedBenchmarks();
+
+  delete bench; bench = NULL;
+  AppServerBench::TearDownTestCase();
+  return 0;
+}
@@ -0,0 +1,186 @@
+/**
+ * @file appserver_scaling_bench.cpp Benchmarks for AppServer dispatch on
+ * multiple worker threads.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "benchmark/benchmark.h"
+
+#include "sip_common.hpp"
+#include "sip_hdr_view.h"
+#include "appserver.h"
+#include "appserver_worker.h"
+#include "dummyappserver.hpp"
+
+using AS::Message;
+
+/// The number of distinct requests, cycled through by each thread.
+static const int NUM_REQUESTS = 1024;
+
+/// Fixture giving access to the PJSIP set up of SipCommonTest.
+class AppServerScalingBench : public SipCommonTest
+{
+public:
+  void TestBody() {}
+
+  using SipCommonTest::parse_msg;
+};
+
+static std::vector<pjsip_msg*> requests;
+
+
+/// AppServerTsx that does nothing, so only the dispatch is measured.
+class ScalingASTsx : public AppServerTsx
+{
+public:
+  ScalingASTsx() : AppServerTsx() {}
+};
+
+
+/// The state a typical service updates on every request: a count of
+/// requests and a cache keyed by the Request-URI user.
+struct ServiceState
+{
+  ServiceState() : requests(0), users() {}
+
+  void update(pjsip_msg* req)
+  {
+    ++requests;
+    pj_str_t user = SipMsgView::user(req->line.req.uri);
+    ++users[std::string(user.ptr, user.slen)];
+  }
+
+  uint64_t requests;
+  std::unordered_map<std::string, uint64_t> users;
+};
+
+
+/// AppServer that protects its state with a global lock, as services do if
+/// they assume nothing about threading.
+class LockedAppServer : public AppServer
+{
+public:
+  LockedAppServer() : AppServer("locked"), _lock(), _state() {}
+
+  AppServerTsx* get_app_tsx(SproutletHelper* helper,
+                            pjsip_msg* req,
+                            pjsip_sip_uri*& next_hop,
+                            pj_pool_t* pool,
+                            SAS::TrailId trail)
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    _state.update(req);
+    return new ScalingASTsx();
+  }
+
+private:
+  std::mutex _lock;
+  ServiceState _state;
+};
+
+
+/// AppServer that keeps its state per worker, using the threading contract.
+class PerWorkerAppServer : public AppServer
+{
+public:
+  PerWorkerAppServer() : AppServer("perworker"), _state() {}
+
+  AppServerTsx* get_app_tsx_on_worker(SproutletHelper* helper,
+                                      pjsip_msg* req,
+                                      pjsip_sip_uri*& next_hop,
+                                      pj_pool_t* pool,
+                                      SAS::TrailId trail,
+                                      AppServerWorkerContext& worker)
+  {
+    _state.get(worker).update(req);
+    return new ScalingASTsx();
+  }
+
+  AppServerTsx* get_app_tsx(SproutletHelper* helper,
+                            pjsip_msg* req,
+                            pjsip_sip_uri*& next_hop,
+                            pj_pool_t* pool,
+                            SAS::TrailId trail)
+  {
+    return get_app_tsx_on_worker(helper,
+                                 req,
+                                 next_hop,
+                                 pool,
+                                 trail,
+                                 AppServerWorkerContext::current());
+  }
+
+private:
+  AppServerLocal<ServiceState> _state;
+};
+
+
+/// Dispatches requests to an AppServer as the infrastructure would on each
+/// worker thread: get_app_tsx_on_worker with the worker's context, then creating and
+/// destroying the transaction.
+static void run_dispatch(benchmark::State& state, AppServer& app_server)
+{
+  AppServerWorkerContext& worker = AppServerWorkerContext::current();
+  size_t next = worker.index() * 97;
+
+  for (auto _ : state)
+  {
+    pjsip_msg* req = requests[next++ % NUM_REQUESTS];
+    pjsip_sip_uri* next_hop = NULL;
+    AppServerTsx* tsx = app_server.get_app_tsx_on_worker(NULL, req, next_hop, NULL, 0, worker);
+    tsx->set_stats(&app_server.stats());
+    delete tsx;
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+
+
+/// Benchmark dispatch to a service whose state is behind a global lock.
+static void BM_DispatchLocked(benchmark::State& state)
+{
+  static LockedAppServer app_server;
+  run_dispatch(state, app_server);
+}
+BENCHMARK(BM_DispatchLocked)->ThreadRange(1, 64)->UseRealTime();
+
+
+/// Benchmark dispatch to a service whose state is per worker.
+static void BM_DispatchPerWorker(benchmark::State& state)
+{
+  static PerWorkerAppServer app_server;
+  run_dispatch(state, app_server);
+}
+BENCHMARK(BM_DispatchPerWorker)->ThreadRange(1, 64)->UseRealTime();
+
+
+int main(int argc, char** argv)
+{
+  AppServerScalingBench::SetUpTestCase();
+  AppServerScalingBench* bench = new AppServerScalingBench();
+
+  for (int ii = 0; ii < NUM_REQUESTS; ++ii)
+  {
+    Message msg;
+    msg._to = std::to_string(6505550000LL + ii);
+    requests.push_back(bench->parse_msg(msg.get_request()));
+  }
+
+  benchmark::Initialize(&argc, argv);
+  benchmark::RunSpecifiedBenchmarks();
+
+  requests.clear();
+  delete bench; bench = NULL;
+  AppServerScalingBench::TearDownTestCase();
+  return 0;
+}
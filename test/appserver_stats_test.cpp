@@ -0,0 +1,116 @@
+/**
+ * @file appserver_stats_test.cpp UT for per-AppServer statistics.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <cstddef>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "appserver_stats.h"
+
+using namespace std;
+
+
+/// Test that latencies are recorded into the right histogram buckets and
+/// that percentiles are estimated from them.
+TEST(AppServerStatsTest, Latency)
+{
+  AppServerStats stats;
+
+  for (int ii = 0; ii < 90; ++ii)
+  {
+    stats.record_latency(AppServerStats::INITIAL_REQUEST, 3);
+  }
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    stats.record_latency(AppServerStats::INITIAL_REQUEST, 1000);
+  }
+  stats.record_latency(AppServerStats::RESPONSE, 0);
+
+  AppServerStats::Snapshot snap = stats.snapshot();
+  EXPECT_EQ(100u, snap.calls[AppServerStats::INITIAL_REQUEST]);
+  EXPECT_EQ(90u * 3 + 10u * 1000, snap.total_latency_us[AppServerStats::INITIAL_REQUEST]);
+  EXPECT_EQ(90u, snap.latency[AppServerStats::INITIAL_REQUEST][2]);
+  EXPECT_EQ(10u, snap.latency[AppServerStats::INITIAL_REQUEST][10]);
+  EXPECT_EQ(4u, snap.percentile_us(AppServerStats::INITIAL_REQUEST, 50));
+  EXPECT_EQ(1024u, snap.percentile_us(AppServerStats::INITIAL_REQUEST, 99));
+  EXPECT_EQ(1024u, snap.percentile_us(AppServerStats::INITIAL_REQUEST, 100));
+  EXPECT_EQ(1u, snap.percentile_us(AppServerStats::RESPONSE, 50));
+  EXPECT_EQ(0u, snap.percentile_us(AppServerStats::TIMER_EXPIRY, 50));
+}
+
+
+/// Test that the callback timer records a latency.
+TEST(AppServerStatsTest, CallbackTimer)
+{
+  AppServerStats stats;
+  {
+    AppServerStats::CallbackTimer timer(&stats, AppServerStats::TIMER_EXPIRY);
+  }
+  EXPECT_EQ(1u, stats.snapshot().calls[AppServerStats::TIMER_EXPIRY]);
+}
+
+
+/// Test that counters and gauges updated from many threads are summed.
+TEST(AppServerStatsTest, Threads)
+{
+  AppServerStats stats;
+  vector<thread> threads;
+
+  for (int ii = 0; ii < 40; ++ii)
+  {
+    threads.push_back(thread([&stats]() {
+      for (int jj = 0; jj < 1000; ++jj)
+      {
+        stats.increment(AppServerStats::SEND_REQUEST);
+        stats.tsx_created();
+      }
+      for (int jj = 0; jj < 500; ++jj)
+      {
+        stats.tsx_destroyed();
+      }
+    }));
+  }
+
+  for (size_t ii = 0; ii < threads.size(); ++ii)
+  {
+    threads[ii].join();
+  }
+
+  AppServerStats::Snapshot snap = stats.snapshot();
+  EXPECT_EQ(40000u, snap.counters[AppServerStats::SEND_REQUEST]);
+  EXPECT_EQ(0u, snap.counters[AppServerStats::SEND_RESPONSE]);
+  EXPECT_EQ(20000, snap.live_tsxs);
+}
+
+
+/// Test that the statistics have normal alignment, so AppServers holding
+/// them can be created with new, while each shard is still on cache lines of
+/// its own.
+TEST(AppServerStatsTest, Alignment)
+{
+  EXPECT_LE(alignof(AppServerStats), alignof(std::max_align_t));
+
+  CacheAlignedArray<uint64_t> array(3);
+  EXPECT_EQ(3u, array.size());
+  for (size_t ii = 0; ii < array.size(); ++ii)
+  {
+    EXPECT_EQ(0u, (uintptr_t)&array[ii] % CacheAlignedArray<uint64_t>::CACHE_LINE);
+    EXPECT_EQ(0u, array[ii]);
+  }
+  EXPECT_EQ(CacheAlignedArray<uint64_t>::CACHE_LINE,
+            (uintptr_t)&array[1] - (uintptr_t)&array[0]);
+
+  std::unique_ptr<AppServerStats> stats(new AppServerStats());
+  stats->increment(AppServerStats::SEND_REQUEST);
+  EXPECT_EQ(1u, stats->snapshot().counters[AppServerStats::SEND_REQUEST]);
+}
@@ -11,6 +11,7 @@
 
 
 #include <string>
+#include <thread>
 #include "gtest/gtest.h"
 
 #include "sip_common.hpp"
@@ -18,10 +19,14 @@
 #include "pjutils.h"
 #include "analyticslogger.h"
 #include "mockappserver.hpp"
+#include "dummyappserver.hpp"
+#include "fakeappserver.hpp"
+#include "appserver_worker.h"
 
 using namespace std;
 using testing::InSequence;
 using testing::Return;
+using testing::_;
 
 /// Fixture for AppServerTest.
 ///
@@ -29,134 +34,20 @@ using testing::Return;
 class AppServerTest : public SipCommonTest
 {
 public:
-  static void SetUpTestCase()
-  {
-    SipCommonTest::SetUpTestCase();
-    _helper = new MockAppServerTsxHelper();
-  }
-
-  static void TearDownTestCase()
-  {
-    delete _helper; _helper = NULL;
-    SipCommonTest::TearDownTestCase();
-  }
-
   AppServerTest() : SipCommonTest()
   {
+    // Use a fresh helper for each test, so that expectations and state
+    // cannot leak between tests.
+    _helper = new MockAppServerTsxHelper();
   }
 
   ~AppServerTest()
   {
+    delete _helper; _helper = NULL;
   }
 
-  static MockAppServerTsxHelper* _helper;
-};
-MockAppServerTsxHelper* AppServerTest::_helper = NULL;
-
-namespace AS
-{
-class Message
-{
-public:
-  string _method;
-  string _toscheme;
-  string _status;
-  string _from;
-  string _fromdomain;
-  string _to;
-  string _todomain;
-  string _route;
-
-  Message() :
-    _method("OPTIONS"),
-    _toscheme("sip"),
-    _status("200 OK"),
-    _from("6505551000"),
-    _fromdomain("homedomain"),
-    _to("6505551234"),
-    _todomain("homedomain"),
-    _route("")
-  {
-  }
-
-  string get_request();
-  string get_response();
+  MockAppServerTsxHelper* _helper;
 };
-}
-
-string AS::Message::get_request()
-{
-  char buf[16384];
-
-  // The remote target.
-  string target = string(_toscheme).append(":").append(_to);
-  if (!_todomain.empty())
-  {
-    target.append("@").append(_todomain);
-  }
-
-  int n = snprintf(buf, sizeof(buf),
-                   "%1$s sip:%4$s SIP/2.0\r\n"
-                   "Via: SIP/2.0/TCP 10.114.61.213;branch=z9hG4bK0123456789abcdef\r\n"
-                   "From: <sip:%2$s@%3$s>;tag=10.114.61.213+1+8c8b232a+5fb751cf\r\n"
-                   "To: <sip:%4$s>\r\n"
-                   "%5$s"
-                   "Max-Forwards: 68\r\n"
-                   "Call-ID: 0gQAAC8WAAACBAAALxYAAAL8P3UbW8l4mT8YBkKGRKc5SOHaJ1gMRqsUOO4ohntC@10.114.61.213\r\n"
-                   "CSeq: 16567 %1$s\r\n"
-                   "User-Agent: Accession 2.0.0.0\r\n"
-                   "Allow: PRACK, INVITE, ACK, BYE, CANCEL, UPDATE, SUBSCRIBE, NOTIFY, REFER, MESSAGE, OPTIONS\r\n"
-                   "Content-Length: 0\r\n\r\n",
-                   /*  1 */ _method.c_str(),
-                   /*  2 */ _from.c_str(),
-                   /*  3 */ _fromdomain.c_str(),
-                   /*  4 */ target.c_str(),
-                   /*  5 */ _route.empty() ? "" : string(_route).append("\r\n").c_str()
-    );
-
-  EXPECT_LT(n, (int)sizeof(buf));
-
-  string ret(buf, n);
-  return ret;
-}
-
-string AS::Message::get_response()
-{
-  char buf[16384];
-
-  // The remote target.
-  string target = string(_toscheme).append(":").append(_to);
-  if (!_todomain.empty())
-  {
-    target.append("@").append(_todomain);
-  }
-
-  int n = snprintf(buf, sizeof(buf),
-                   "SIP/2.0 %1$s\r\n"
-                   "Via: SIP/2.0/TCP 10.114.61.213;branch=z9hG4bK0123456789abcdef\r\n"
-                   "From: <sip:%2$s@%3$s>;tag=10.114.61.213+1+8c8b232a+5fb751cf\r\n"
-                   "To: <sip:%4$s@%5$s>\r\n"
-                   "%6$s"
-                   "Max-Forwards: 68\r\n"
-                   "Call-ID: 0gQAAC8WAAACBAAALxYAAAL8P3UbW8l4mT8YBkKGRKc5SOHaJ1gMRqsUOO4ohntC@10.114.61.213\r\n"
-                   "CSeq: 16567 %7$s\r\n"
-                   "User-Agent: Accession 2.0.0.0\r\n"
-                   "Allow: PRACK, INVITE, ACK, BYE, CANCEL, UPDATE, SUBSCRIBE, NOTIFY, REFER, MESSAGE, OPTIONS\r\n"
-                   "Content-Length: 0\r\n\r\n",
-                   /*  1 */ _status.c_str(),
-                   /*  2 */ _from.c_str(),
-                   /*  3 */ _fromdomain.c_str(),
-                   /*  4 */ _to.c_str(),
-                   /*  5 */ _todomain.c_str(),
-                   /*  6 */ _route.empty() ? "" : string(_route).append("\r\n").c_str(),
-                   /*  7 */ _method.c_str()
-    );
-
-  EXPECT_LT(n, (int)sizeof(buf));
-
-  string ret(buf, n);
-  return ret;
-}
 
 using AS::Message;
 
@@ -177,63 +68,6 @@ MATCHER_P(ReqUriEquals, uri, "")
 }
 
 
-/// Dummy AppServerTsx that adds itself to the dialog.
-class DummyDialogASTsx : public AppServerTsx
-{
-public:
-  DummyDialogASTsx() :
-    AppServerTsx() {}
-
-  void on_initial_request(pjsip_msg* req)
-  {
-    add_to_dialog();
-    send_request(req);
-  }
-
-  void on_response(pjsip_msg* rsp, int fork_id)
-  {
-    send_response(rsp);
-  }
-};
-
-
-/// Dummy AppServerTsx that rejects the transaction.
-class DummyRejectASTsx : public AppServerTsx
-{
-public:
-  DummyRejectASTsx() :
-    AppServerTsx() {}
-
-  void on_initial_request(pjsip_msg* req)
-  {
-    pjsip_msg* rsp = create_response(req, PJSIP_SC_NOT_FOUND, "Who?");
-    send_response(rsp);
-    free_msg(req);
-  }
-};
-
-
-/// Dummy AppServerTsx that forks the transaction.
-class DummyForkASTsx : public AppServerTsx
-{
-public:
-  DummyForkASTsx() :
-    AppServerTsx() {}
-
-  void on_initial_request(pjsip_msg* req)
-  {
-    pj_pool_t* pool = get_pool(req);
-    pjsip_msg* req1 = clone_request(req);
-    pjsip_msg* req2 = clone_request(req);
-    req1->line.req.uri = PJUtils::uri_from_string("sip:alice@example.com", pool);
-    req2->line.req.uri = PJUtils::uri_from_string("sip:bob@example.com", pool);
-    send_request(req1);
-    send_request(req2);
-    free_msg(req);
-  }
-};
-
-
 /// Test the DummyDialogASTsx by passing a request and a response in.
 TEST_F(AppServerTest, DummyDialogTest)
 {
@@ -274,6 +108,173 @@ TEST_F(AppServerTest, DummyRejectTest)
 }
 
 
+/// Test that by default reject creates, sends and frees a response.
+TEST_F(AppServerTest, DummyFastRejectTest)
+{
+  Message msg;
+  DummyFastRejectASTsx as_tsx;
+  as_tsx.set_helper(_helper);
+
+  pjsip_msg* req = parse_msg(msg.get_request());
+  pjsip_msg rsp1_msg;
+  pjsip_msg* rsp1 = &rsp1_msg;
+  {
+    InSequence seq;
+    EXPECT_CALL(*_helper, create_response(req, PJSIP_SC_NOT_FOUND, "Who?"))
+      .WillOnce(Return(rsp1));
+    EXPECT_CALL(*_helper, send_response(rsp1));
+    EXPECT_CALL(*_helper, free_msg(req));
+  }
+  as_tsx.on_initial_request(req);
+}
+
+
+/// Test that by default redirect sends a response with the contacts.
+TEST_F(AppServerTest, DummyRedirectTest)
+{
+  Message msg;
+  DummyRedirectASTsx as_tsx;
+  as_tsx.set_helper(_helper);
+
+  pjsip_msg* req = parse_msg(msg.get_request());
+  pjsip_msg* rsp1 = pjsip_msg_create(_pool, PJSIP_RESPONSE_MSG);
+  {
+    InSequence seq;
+    EXPECT_CALL(*_helper, get_pool(req))
+      .WillOnce(Return(_pool));
+    EXPECT_CALL(*_helper, create_response(req, PJSIP_SC_MOVED_TEMPORARILY, ""))
+      .WillOnce(Return(rsp1));
+    EXPECT_CALL(*_helper, get_pool(rsp1))
+      .WillOnce(Return(_pool));
+    EXPECT_CALL(*_helper, send_response(rsp1));
+    EXPECT_CALL(*_helper, free_msg(req));
+  }
+  as_tsx.on_initial_request(req);
+
+  pjsip_contact_hdr* contact =
+    (pjsip_contact_hdr*)pjsip_msg_find_hdr(rsp1, PJSIP_H_CONTACT, NULL);
+  ASSERT_TRUE(contact != NULL);
+  EXPECT_EQ("sip:alice@example.com", PJUtils::uri_to_string(PJSIP_URI_IN_REQ_URI, contact->uri));
+  contact = (pjsip_contact_hdr*)pjsip_msg_find_hdr(rsp1, PJSIP_H_CONTACT, contact->next);
+  ASSERT_TRUE(contact != NULL);
+  EXPECT_EQ("sip:bob@example.com", PJUtils::uri_to_string(PJSIP_URI_IN_REQ_URI, contact->uri));
+}
+
+
+/// Test that a helper can reject a request without building a response.
+TEST_F(AppServerTest, FastRejectFakeHelperTest)
+{
+  Message msg;
+  pjsip_msg* req = parse_msg(msg.get_request());
+  FakeAppServerTsxHelper helper(_pool->factory);
+  MockAppServer as;
+  DummyFastRejectASTsx as_tsx;
+  as_tsx.set_stats(&as.stats());
+
+  as_tsx.on_initial_request(helper.start(&as_tsx, req));
+  ASSERT_EQ(1u, helper.sent_rejects().size());
+  EXPECT_EQ(PJSIP_SC_NOT_FOUND, helper.sent_rejects()[0].status_code);
+  EXPECT_EQ("Who?", helper.sent_rejects()[0].status_text);
+  EXPECT_EQ(0u, helper.sent_responses().size());
+
+  // Only the helper's copy and the received request were created.
+  EXPECT_EQ(2u, helper.msgs_created());
+
+  AppServerStats::Snapshot snap = as.stats().snapshot();
+  EXPECT_EQ(1u, snap.counters[AppServerStats::SEND_RESPONSE]);
+  EXPECT_EQ(1u, snap.counters[AppServerStats::FREE_MSG]);
+  helper.finish();
+  EXPECT_EQ(0u, helper.msgs_leaked());
+}
+
+
+/// Test that SAS events are reported in one batch when the transaction is
+/// destroyed, and that DETAIL events are only reported on sampled trails.
+TEST_F(AppServerTest, SasEventBatchTest)
+{
+  Message msg;
+  pjsip_msg* req = parse_msg(msg.get_request());
+  LocalSasSink sink;
+  MockAppServer as;
+  as.sas_config().sink = &sink;
+  as.sas_config().detail_sample_one_in = 2;
+
+  int sampled = 0;
+  for (SAS::TrailId trail = 1; trail <= 20; ++trail)
+  {
+    FakeAppServerTsxHelper helper(_pool->factory);
+    DummySasASTsx* as_tsx = new DummySasASTsx();
+    as_tsx->set_stats(&as.stats());
+    as_tsx->set_sas_config(&as.sas_config());
+
+    as_tsx->on_initial_request(helper.start(as_tsx, req, trail));
+    ASSERT_EQ(1u, helper.sent_requests().size());
+    pjsip_msg* req1 = helper.sent_requests()[0].msg;
+    as_tsx->on_response(helper.create_response(req1, PJSIP_SC_RINGING), 0);
+    as_tsx->on_response(helper.create_response(req1, PJSIP_SC_OK), 0);
+    EXPECT_TRUE(sink.batches().empty());
+
+    delete as_tsx;
+    helper.finish();
+
+    std::vector<size_t> batches = sink.batches();
+    ASSERT_EQ(1u, batches.size());
+    if (batches[0] == 3u)
+    {
+      ++sampled;
+    }
+    else
+    {
+      EXPECT_EQ(1u, batches[0]);
+    }
+    sink.clear();
+  }
+
+  // Roughly half the trails are sampled.
+  EXPECT_LT(3, sampled);
+  EXPECT_GT(17, sampled);
+}
+
+
+/// LocalSasSink that asks to be passed each event as it completes, like
+/// the default sink.
+class UnbatchedSasSink : public LocalSasSink
+{
+public:
+  bool batching() const { return false; }
+};
+
+
+/// Test that, if the sink does not batch, each SAS event is reported before
+/// the message the transaction sends after logging it.
+TEST_F(AppServerTest, SasEventUnbatchedTest)
+{
+  Message msg;
+  pjsip_msg* req = parse_msg(msg.get_request());
+  UnbatchedSasSink sink;
+  MockAppServer as;
+  as.sas_config().sink = &sink;
+
+  FakeAppServerTsxHelper helper(_pool->factory);
+  DummySasASTsx* as_tsx = new DummySasASTsx();
+  as_tsx->set_stats(&as.stats());
+  as_tsx->set_sas_config(&as.sas_config());
+
+  as_tsx->on_initial_request(helper.start(as_tsx, req, 1));
+  EXPECT_EQ(1u, sink.batches().size());
+
+  ASSERT_EQ(1u, helper.sent_requests().size());
+  pjsip_msg* req1 = helper.sent_requests()[0].msg;
+  as_tsx->on_response(helper.create_response(req1, PJSIP_SC_RINGING), 0);
+  as_tsx->on_response(helper.create_response(req1, PJSIP_SC_OK), 0);
+  EXPECT_EQ(3u, sink.batches().size());
+
+  delete as_tsx;
+  helper.finish();
+  EXPECT_EQ(3u, sink.events().size());
+}
+
+
 /// Test the DummyForkASTsx by passing a request in and checking it's forked.
 TEST_F(AppServerTest, DummyForkTest)
 {
@@ -310,3 +311,479 @@ TEST_F(AppServerTest, DummyForkTest)
   EXPECT_CALL(*_helper, send_response(rsp));
   as_tsx.on_response(rsp, 0);
 }
+
+
+/// Test the DummyLazyForkASTsx against a helper that only supports full
+/// clones.
+TEST_F(AppServerTest, DummyLazyForkTest)
+{
+  Message msg;
+  DummyLazyForkASTsx as_tsx;
+  as_tsx.set_helper(_helper);
+
+  pjsip_msg* req = parse_msg(msg.get_request());
+  pjsip_msg req1_msg;
+  pjsip_msg req2_msg;
+  pjsip_msg* req1 = &req1_msg;
+  pjsip_msg* req2 = &req2_msg;
+  {
+    // The default lazy_clone_request falls back to clone_request.
+    InSequence seq;
+    EXPECT_CALL(*_helper, get_pool(req))
+      .WillOnce(Return(_pool));
+    EXPECT_CALL(*_helper, clone_request(req))
+      .WillOnce(Return(req1))
+      .WillOnce(Return(req2));
+    EXPECT_CALL(*_helper, send_request(req1));
+    EXPECT_CALL(*_helper, send_request(req2));
+    EXPECT_CALL(*_helper, free_msg(req));
+  }
+  as_tsx.on_initial_request(req);
+  EXPECT_THAT(req1, ReqUriEquals("sip:alice@example.com"));
+  EXPECT_THAT(req2, ReqUriEquals("sip:bob@example.com"));
+}
+
+
+/// Test that MsgHandles send the forks and free the original request.
+TEST_F(AppServerTest, DummyHandleForkTest)
+{
+  static_assert(!std::is_copy_constructible<MsgHandle>::value,
+                "MsgHandle must not be copyable");
+  static_assert(!std::is_copy_assignable<MsgHandle>::value,
+                "MsgHandle must not be copyable");
+
+  Message msg;
+  DummyHandleForkASTsx as_tsx;
+  as_tsx.set_helper(_helper);
+
+  pjsip_msg* req = parse_msg(msg.get_request());
+  pjsip_msg req1_msg;
+  pjsip_msg req2_msg;
+  pjsip_msg* req1 = &req1_msg;
+  pjsip_msg* req2 = &req2_msg;
+  {
+    // The default MsgHandle methods call the raw pointer methods.
+    InSequence seq;
+    EXPECT_CALL(*_helper, get_pool(req))
+      .WillOnce(Return(_pool));
+    EXPECT_CALL(*_helper, clone_request(req))
+      .WillOnce(Return(req1))
+      .WillOnce(Return(req2));
+    EXPECT_CALL(*_helper, send_request(req1));
+    EXPECT_CALL(*_helper, send_request(req2));
+    EXPECT_CALL(*_helper, free_msg(req));
+  }
+  as_tsx.on_initial_request(req);
+  EXPECT_THAT(req1, ReqUriEquals("sip:alice@example.com"));
+  EXPECT_THAT(req2, ReqUriEquals("sip:bob@example.com"));
+}
+
+
+/// Test that MsgHandles transfer ownership and free what they still own.
+TEST_F(AppServerTest, MsgHandleTest)
+{
+  Message msg;
+  pjsip_msg* req = parse_msg(msg.get_request());
+  pjsip_msg* rsp = parse_msg(msg.get_response());
+  FakeAppServerTsxHelper helper(_pool->factory);
+  DummyHandleForkASTsx as_tsx;
+
+  as_tsx.on_initial_request(helper.start(&as_tsx, req));
+  ASSERT_EQ(2u, helper.sent_requests().size());
+  as_tsx.on_response(helper.receive(rsp), 0);
+  EXPECT_EQ(1u, helper.sent_responses().size());
+
+  {
+    MsgHandle handle(&helper, helper.receive(rsp));
+    EXPECT_TRUE((bool)handle);
+
+    MsgHandle moved(std::move(handle));
+    EXPECT_FALSE((bool)handle);
+    EXPECT_TRUE((bool)moved);
+
+    MsgHandle released(&helper, helper.receive(rsp));
+    pjsip_msg* raw = released.release();
+    EXPECT_FALSE((bool)released);
+    helper.free_msg(raw);
+
+    // Assigning over a handle frees the message it owned.
+    uint64_t freed = helper.msgs_freed();
+    MsgHandle assigned(&helper, helper.receive(rsp));
+    assigned = std::move(moved);
+    EXPECT_EQ(freed + 1, helper.msgs_freed());
+  }
+
+  // Only the helper's copy of the original request and the sent messages
+  // are still live.
+  EXPECT_EQ(4u, helper.msgs_live());
+  helper.finish();
+  EXPECT_EQ(0u, helper.msgs_leaked());
+}
+
+
+/// Test that a lazy clone shares data with the original until written to.
+TEST_F(AppServerTest, LazyMsgCloneTest)
+{
+  Message msg;
+  pjsip_msg* req = parse_msg(msg.get_request());
+  pjsip_msg* clone = LazyMsgClone::clone(_pool, req);
+
+  // Header structures are private to the clone, but their contents are not.
+  pjsip_cid_hdr* cid = PJSIP_MSG_CID_HDR(req);
+  pjsip_cid_hdr* clone_cid = PJSIP_MSG_CID_HDR(clone);
+  EXPECT_NE(cid, clone_cid);
+  EXPECT_EQ(cid->id.ptr, clone_cid->id.ptr);
+  EXPECT_EQ(req->line.req.uri, clone->line.req.uri);
+
+  // Making a header writable deep-copies it without touching the original.
+  pjsip_from_hdr* from = PJSIP_MSG_FROM_HDR(req);
+  pjsip_from_hdr* clone_from =
+    LazyMsgClone::writable_hdr(_pool, PJSIP_MSG_FROM_HDR(clone));
+  EXPECT_EQ(clone_from, PJSIP_MSG_FROM_HDR(clone));
+  EXPECT_NE(from->uri, clone_from->uri);
+  pj_strdup2(_pool, &clone_from->tag, "newtag");
+  EXPECT_EQ(PJUtils::pj_str_to_string(&from->tag),
+            "10.114.61.213+1+8c8b232a+5fb751cf");
+
+  // Replacing the Request-URI of the clone leaves the original alone.
+  clone->line.req.uri = PJUtils::uri_from_string("sip:alice@example.com", _pool);
+  EXPECT_THAT(clone, ReqUriEquals("sip:alice@example.com"));
+  EXPECT_THAT(req, ReqUriEquals("sip:6505551234@homedomain"));
+}
+
+
+/// Test the DummyBatchForkASTsx against the default send_requests, which
+/// falls back to sending each fork individually.
+TEST_F(AppServerTest, DummyBatchForkTest)
+{
+  Message msg;
+  DummyBatchForkASTsx as_tsx;
+  as_tsx.set_helper(_helper);
+
+  pjsip_msg* req = parse_msg(msg.get_request());
+  pjsip_msg req1_msg;
+  pjsip_msg req2_msg;
+  pjsip_msg* req1 = &req1_msg;
+  pjsip_msg* req2 = &req2_msg;
+  pj_list_init(&req1->hdr);
+  pj_list_init(&req2->hdr);
+  EXPECT_CALL(*_helper, get_pool(_))
+    .WillRepeatedly(Return(_pool));
+  {
+    // Use a sequence to ensure this happens in order.
+    InSequence seq;
+    EXPECT_CALL(*_helper, clone_request(req))
+      .WillOnce(Return(req1));
+    EXPECT_CALL(*_helper, send_request(req1))
+      .WillOnce(Return(1));
+    EXPECT_CALL(*_helper, clone_request(req))
+      .WillOnce(Return(req2));
+    EXPECT_CALL(*_helper, send_request(req2))
+      .WillOnce(Return(2));
+    EXPECT_CALL(*_helper, free_msg(req));
+  }
+  as_tsx.on_initial_request(req);
+  EXPECT_THAT(req1, ReqUriEquals("sip:alice@example.com"));
+  EXPECT_THAT(req2, ReqUriEquals("sip:bob@example.com"));
+  ASSERT_EQ(2u, as_tsx._fork_ids.size());
+  EXPECT_EQ(1, as_tsx._fork_ids[0]);
+  EXPECT_EQ(2, as_tsx._fork_ids[1]);
+}
+
+
+/// Test the DummyForkASTsx and DummyRejectASTsx against the in-memory
+/// helper, checking that every message is accounted for.
+TEST_F(AppServerTest, FakeHelperTest)
+{
+  Message msg;
+  pjsip_msg* req = parse_msg(msg.get_request());
+  pjsip_msg* rsp = parse_msg(msg.get_response());
+  FakeAppServerTsxHelper helper(_pool->factory);
+
+  DummyForkASTsx fork_tsx;
+  fork_tsx.on_initial_request(helper.start(&fork_tsx, req));
+  ASSERT_EQ(2u, helper.sent_requests().size());
+  EXPECT_EQ(0, helper.sent_requests()[0].fork_id);
+  EXPECT_EQ(1, helper.sent_requests()[1].fork_id);
+  EXPECT_THAT(helper.sent_requests()[0].msg, ReqUriEquals("sip:alice@example.com"));
+  EXPECT_THAT(helper.sent_requests()[1].msg, ReqUriEquals("sip:bob@example.com"));
+  fork_tsx.on_response(helper.receive(rsp), 0);
+  fork_tsx.on_response(helper.receive(rsp), 1);
+  EXPECT_EQ(2u, helper.sent_responses().size());
+  helper.finish();
+  EXPECT_EQ(0u, helper.msgs_leaked());
+
+  DummyRejectASTsx reject_tsx;
+  reject_tsx.on_initial_request(helper.start(&reject_tsx, req));
+  ASSERT_EQ(1u, helper.sent_responses().size());
+  EXPECT_EQ(PJSIP_SC_NOT_FOUND, helper.sent_responses()[0].msg->line.status.code);
+  EXPECT_EQ(0u, helper.sent_requests().size());
+  helper.finish();
+  EXPECT_EQ(0u, helper.msgs_leaked());
+  EXPECT_EQ(helper.msgs_created(), helper.msgs_freed());
+}
+
+
+/// Test that the DummyAsyncASTsx finishes synchronously if the helper does
+/// not support suspending transactions.
+TEST_F(AppServerTest, DummyAsyncSyncTest)
+{
+  Message msg;
+  DummyAsyncASTsx as_tsx;
+  as_tsx.set_helper(_helper);
+
+  pjsip_msg* req = parse_msg(msg.get_request());
+  EXPECT_CALL(*_helper, send_request(req));
+  as_tsx.on_initial_request(req);
+  EXPECT_FALSE(as_tsx._handle.valid());
+  EXPECT_FALSE(as_tsx._handle.resume());
+}
+
+
+/// Test the DummyAsyncASTsx by suspending it and resuming it from another
+/// thread.
+TEST_F(AppServerTest, DummyAsyncTest)
+{
+  Message msg;
+  pjsip_msg* req = parse_msg(msg.get_request());
+  FakeAppServerTsxHelper helper(_pool->factory);
+
+  DummyAsyncASTsx as_tsx;
+  as_tsx.on_initial_request(helper.start(&as_tsx, req));
+  ASSERT_TRUE(as_tsx._handle.valid());
+  EXPECT_EQ(0u, helper.sent_requests().size());
+  EXPECT_EQ(1u, helper.suspended());
+  EXPECT_EQ(0u, helper.run_resumes());
+
+  // Resume from another thread, as a lookup completion would.
+  AsyncHandle handle = as_tsx._handle;
+  bool resumed = false;
+  std::thread lookup([&handle, &resumed]() { resumed = handle.resume((void*)1); });
+  lookup.join();
+  EXPECT_TRUE(resumed);
+  EXPECT_FALSE(handle.resume());
+
+  // The callback runs on the transaction's thread.
+  EXPECT_EQ(0u, helper.sent_requests().size());
+  EXPECT_EQ(1u, helper.run_resumes());
+  EXPECT_EQ(1u, helper.sent_requests().size());
+  EXPECT_EQ(0u, helper.suspended());
+  helper.finish();
+  EXPECT_EQ(0u, helper.msgs_leaked());
+
+  // Resuming after the transaction has ended has no effect.
+  as_tsx.on_initial_request(helper.start(&as_tsx, req));
+  helper.finish();
+  EXPECT_FALSE(as_tsx._handle.resume());
+}
+
+
+/// Test that a service joining a dialog gets an interned dialog identifier,
+/// shared by later transactions in the same dialog.
+TEST_F(AppServerTest, DialogHandleTest)
+{
+  Message msg;
+  pjsip_msg* req = parse_msg(msg.get_request());
+  FakeAppServerTsxHelper helper(_pool->factory);
+
+  DummyDialogASTsx tsx1;
+  tsx1.on_initial_request(helper.start(&tsx1, req));
+  DialogId id = helper.dialog_handle();
+  ASSERT_TRUE(id.valid());
+  EXPECT_EQ(helper.dialog_id(), DialogIdTable::instance().str(id));
+  EXPECT_EQ(id, DialogIdTable::instance().find(helper.dialog_id()));
+
+  // Hold a reference across the transactions, as the dialog would.
+  std::string dialog_id = helper.dialog_id();
+  EXPECT_TRUE(DialogIdTable::instance().add_ref(id));
+  helper.finish();
+
+  DummyDialogASTsx tsx2;
+  helper.start(&tsx2, req);
+  helper.add_to_dialog_handle(id);
+  EXPECT_EQ(id, helper.dialog_handle());
+  helper.finish();
+
+  DialogIdTable::instance().release(id);
+  EXPECT_FALSE(DialogIdTable::instance().find(dialog_id).valid());
+  EXPECT_EQ("", DialogIdTable::instance().str(id));
+}
+
+
+/// Test that the default dialog_handle interns the dialog identifier once,
+/// and re-interns it only if the identifier changes.
+TEST_F(AppServerTest, DefaultDialogHandleTest)
+{
+  std::string dialog_id = "0gQAAC8WAAACBAAALxYAAAL8P3UbW8l4mT8YBkKGRKc5SOHaJ1gMRqsUOO4ohntC;1234";
+  std::string other_id = dialog_id + "5";
+
+  DialogIdTable& table = DialogIdTable::instance();
+
+  {
+    MockAppServerTsxHelper helper;
+    EXPECT_FALSE(helper.dialog_handle().valid());
+
+    // A dialog joined by an earlier transaction is interned on first use,
+    // and then cached.
+    helper._dialog_id = dialog_id;
+    DialogId id = helper.dialog_handle();
+    ASSERT_TRUE(id.valid());
+    EXPECT_EQ(id, table.find(dialog_id));
+    EXPECT_EQ(dialog_id, table.str(id));
+    helper._dialog_id = other_id;
+    EXPECT_EQ(id, helper.dialog_handle());
+
+    // Joining a dialog by handle caches that handle, taking a reference of
+    // its own, and releases the old one.
+    DialogId other = table.intern(other_id);
+    EXPECT_CALL(helper, add_to_dialog(other_id));
+    helper.add_to_dialog_handle(other);
+    table.release(other);
+    EXPECT_EQ(other, helper.dialog_handle());
+    EXPECT_FALSE(table.find(dialog_id).valid());
+    EXPECT_EQ(other, table.find(other_id));
+  }
+
+  // The helper's reference is dropped when it is destroyed.
+  EXPECT_FALSE(table.find(other_id).valid());
+
+  {
+    // A helper that never joins a dialog never interns anything.
+    MockAppServerTsxHelper helper;
+    EXPECT_FALSE(helper.dialog_handle().valid());
+  }
+}
+
+
+/// Test the DummyStaticForkASTsx through both its static and virtual entry
+/// points.
+TEST_F(AppServerTest, DummyStaticForkTest)
+{
+  Message msg;
+  pjsip_msg* req = parse_msg(msg.get_request());
+  pjsip_msg* rsp = parse_msg(msg.get_response());
+  FakeAppServerTsxHelper helper(_pool->factory);
+
+  DummyStaticForkASTsx as_tsx;
+  as_tsx.dispatch_initial_request(helper.start(&as_tsx, req));
+  ASSERT_EQ(2u, helper.sent_requests().size());
+  EXPECT_THAT(helper.sent_requests()[0].msg, ReqUriEquals("sip:alice@example.com"));
+  EXPECT_THAT(helper.sent_requests()[1].msg, ReqUriEquals("sip:bob@example.com"));
+
+  AppServerTsx* base_tsx = &as_tsx;
+  base_tsx->on_response(helper.receive(rsp), 0);
+  as_tsx.dispatch_response(helper.receive(rsp), 1);
+  EXPECT_EQ(2u, helper.sent_responses().size());
+  helper.finish();
+  EXPECT_EQ(0u, helper.msgs_leaked());
+}
+
+
+/// Test that an AppServerTsx counts its calls into the helper in the stats
+/// of its AppServer.
+TEST_F(AppServerTest, StatsTest)
+{
+  Message msg;
+  pjsip_msg* req = parse_msg(msg.get_request());
+  FakeAppServerTsxHelper helper(_pool->factory);
+  MockAppServer as;
+
+  {
+    DummyForkASTsx as_tsx;
+    as_tsx.set_stats(&as.stats());
+    EXPECT_EQ(1, as.stats().snapshot().live_tsxs);
+
+    as_tsx.on_initial_request(helper.start(&as_tsx, req));
+    AppServerStats::Snapshot snap = as.stats().snapshot();
+    EXPECT_EQ(2u, snap.counters[AppServerStats::SEND_REQUEST]);
+    EXPECT_EQ(1u, snap.counters[AppServerStats::FREE_MSG]);
+    EXPECT_EQ(0u, snap.counters[AppServerStats::SEND_RESPONSE]);
+    helper.finish();
+  }
+
+  EXPECT_EQ(0, as.stats().snapshot().live_tsxs);
+}
+
+
+/// Test that an AppServer's statistics, admission control and SAS settings
+/// are created once, however many threads use them first.
+TEST_F(AppServerTest, InstrumentationCreatedOnce)
+{
+  MockAppServer as;
+  AppServerInstrumentation* seen[4];
+  std::vector<std::thread> threads;
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    threads.push_back(std::thread([&as, &seen, ii]() { seen[ii] = &as.instrumentation(); }));
+  }
+  for (size_t ii = 0; ii < threads.size(); ++ii)
+  {
+    threads[ii].join();
+  }
+
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    EXPECT_EQ(seen[0], seen[ii]);
+  }
+  EXPECT_EQ(&seen[0]->stats, &as.stats());
+  EXPECT_EQ(&seen[0]->admission, &as.admission());
+  EXPECT_EQ(&seen[0]->sas_config, &as.sas_config());
+}
+
+
+/// Test that messages freed by destroying a MsgHandle are counted, and that
+/// freeing an empty handle is not.
+TEST_F(AppServerTest, MsgHandleStatsTest)
+{
+  static_assert(std::is_nothrow_move_constructible<MsgHandle>::value,
+                "MsgHandle moves must not throw");
+  static_assert(std::is_nothrow_move_assignable<MsgHandle>::value,
+                "MsgHandle moves must not throw");
+
+  class FreeingASTsx : public DummyHandleForkASTsx
+  {
+  public:
+    using DummyHandleForkASTsx::free_msg;
+  };
+
+  Message msg;
+  pjsip_msg* req = parse_msg(msg.get_request());
+  FakeAppServerTsxHelper helper(_pool->factory);
+  MockAppServer as;
+
+  {
+    FreeingASTsx as_tsx;
+    as_tsx.set_stats(&as.stats());
+
+    // The original request is freed when its handle goes out of scope.
+    as_tsx.on_initial_request(helper.start(&as_tsx, req));
+    AppServerStats::Snapshot snap = as.stats().snapshot();
+    EXPECT_EQ(2u, snap.counters[AppServerStats::SEND_REQUEST]);
+    EXPECT_EQ(1u, snap.counters[AppServerStats::FREE_MSG]);
+
+    as_tsx.free_msg(MsgHandle());
+    snap = as.stats().snapshot();
+    EXPECT_EQ(1u, snap.counters[AppServerStats::FREE_MSG]);
+    helper.finish();
+  }
+}
+
+
+/// Test that by default get_app_tsx_on_worker calls get_app_tsx.
+TEST_F(AppServerTest, WorkerContextTest)
+{
+  Message msg;
+  pjsip_msg* req = parse_msg(msg.get_request());
+  pjsip_sip_uri* next_hop = NULL;
+  MockAppServer mock_as;
+
+  EXPECT_CALL(mock_as, get_app_tsx(NULL, req, _, _pool, 42))
+    .WillOnce(Return((AppServerTsx*)NULL));
+
+  EXPECT_EQ(NULL, mock_as.get_app_tsx_on_worker(NULL,
+                                                req,
+                                                next_hop,
+                                                _pool,
+                                                42,
+                                                AppServerWorkerContext::current()));
+}
@@ -0,0 +1,210 @@
+/**
+ * @file appserver_worker_test.cpp UT for per-worker AppServer state.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdint.h>
+#include <atomic>
+#include <set>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "appserver_worker.h"
+
+using namespace std;
+
+/// Per-worker state that counts how many instances exist.
+struct Counter
+{
+  Counter() : value(0) { ++instances; }
+  Counter(const Counter& other) : value(other.value) { ++instances; }
+  ~Counter() { --instances; }
+
+  uint64_t value;
+  static std::atomic<int> instances;
+};
+
+std::atomic<int> Counter::instances(0);
+
+
+TEST(AppServerWorkerTest, ContextPerThread)
+{
+  AppServerWorkerContext& context = AppServerWorkerContext::current();
+  EXPECT_EQ(&context, &AppServerWorkerContext::current());
+
+  const int NUM_THREADS = 8;
+  std::vector<int> indexes(NUM_THREADS);
+  std::atomic<int> started(0);
+  std::atomic<bool> stop(false);
+  std::vector<std::thread> threads;
+
+  // Keep all the threads running until they have all taken an index, so
+  // that none is reused.
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    threads.push_back(std::thread([&, ii]() {
+      indexes[ii] = AppServerWorkerContext::current().index();
+      ++started;
+      while (!stop)
+      {
+        std::this_thread::yield();
+      }
+    }));
+  }
+
+  while (started < NUM_THREADS)
+  {
+    std::this_thread::yield();
+  }
+  stop = true;
+
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    threads[ii].join();
+  }
+
+  std::set<int> unique(indexes.begin(), indexes.end());
+  unique.insert(context.index());
+  EXPECT_EQ((size_t)NUM_THREADS + 1, unique.size());
+
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    EXPECT_LT(indexes[ii], (int)AppServerWorkerContext::MAX_WORKERS);
+  }
+}
+
+
+TEST(AppServerWorkerTest, IndexesReused)
+{
+  // Run many more short-lived threads than there are worker indexes.
+  for (int ii = 0; ii < AppServerWorkerContext::MAX_WORKERS * 2; ++ii)
+  {
+    int index = -1;
+    std::thread thread([&]() { index = AppServerWorkerContext::current().index(); });
+    thread.join();
+    EXPECT_GE(index, 0);
+    EXPECT_LT(index, (int)AppServerWorkerContext::MAX_WORKERS);
+  }
+}
+
+
+TEST(AppServerWorkerTest, LocalPerWorker)
+{
+  const int NUM_THREADS = 4;
+  const int NUM_INCREMENTS = 100000;
+
+  {
+    AppServerLocal<Counter> counters;
+    std::vector<std::thread> threads;
+
+    for (int ii = 0; ii < NUM_THREADS; ++ii)
+    {
+      threads.push_back(std::thread([&]() {
+        AppServerWorkerContext& worker = AppServerWorkerContext::current();
+        Counter* first = &counters.get(worker);
+        for (int jj = 0; jj < NUM_INCREMENTS; ++jj)
+        {
+          ++counters.get(worker).value;
+        }
+        EXPECT_EQ(first, &counters.get());
+        EXPECT_EQ(0u, (uintptr_t)first % 64);
+      }));
+    }
+
+    for (int ii = 0; ii < NUM_THREADS; ++ii)
+    {
+      threads[ii].join();
+    }
+
+    uint64_t total = 0;
+    int num = 0;
+    counters.for_each([&](const Counter& counter) {
+      total += counter.value;
+      ++num;
+    });
+
+    // Each thread had its own instance, unless an index was reused by a
+    // thread that started after another exited.
+    EXPECT_EQ((uint64_t)NUM_THREADS * NUM_INCREMENTS, total);
+    EXPECT_LE(num, NUM_THREADS);
+    EXPECT_EQ(num, Counter::instances);
+  }
+
+  EXPECT_EQ(0, Counter::instances);
+}
+
+
+/// Per-worker state that is safe to read while its worker updates it.
+struct AtomicCounter
+{
+  AtomicCounter() : value(1) {}
+  AtomicCounter(const AtomicCounter& other) : value(other.value.load()) {}
+  std::atomic<uint64_t> value;
+};
+
+
+/// Test that for_each can run while workers create their instances, and
+/// only sees instances that have been constructed.
+TEST(AppServerWorkerTest, LocalForEachWhileCreating)
+{
+  const int NUM_THREADS = 8;
+  AppServerLocal<AtomicCounter> counters;
+  std::atomic<bool> done(false);
+
+  std::thread reporter([&]() {
+    while (!done.load())
+    {
+      counters.for_each([&](const AtomicCounter& counter) {
+        EXPECT_LE(1u, counter.value.load());
+      });
+    }
+  });
+
+  std::vector<std::thread> threads;
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    threads.push_back(std::thread([&]() {
+      for (int jj = 0; jj < 1000; ++jj)
+      {
+        ++counters.get().value;
+      }
+    }));
+  }
+
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    threads[ii].join();
+  }
+  done = true;
+  reporter.join();
+
+  uint64_t total = 0;
+  counters.for_each([&](const AtomicCounter& counter) {
+    total += counter.value.load() - 1;
+  });
+  EXPECT_EQ((uint64_t)NUM_THREADS * 1000, total);
+}
+
+
+TEST(AppServerWorkerTest, LocalPrototype)
+{
+  Counter prototype;
+  prototype.value = 7;
+
+  {
+    AppServerLocal<Counter> counters(prototype);
+    EXPECT_EQ(7u, counters.get().value);
+    counters.get().value = 8;
+    EXPECT_EQ(8u, counters.get().value);
+    EXPECT_EQ(7u, prototype.value);
+  }
+
+  EXPECT_EQ(1, Counter::instances);
+}
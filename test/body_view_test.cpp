@@ -0,0 +1,285 @@
+/**
+ * @file body_view_test.cpp UT for non-copying body access and editing.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "sip_common.hpp"
+#include "appserver.h"
+#include "body_view.h"
+
+using namespace std;
+
+/// The SDP of the test INVITE.
+static const char* SDP =
+  "v=0\r\n"
+  "o=- 2890844526 2890844526 IN IP4 10.0.0.1\r\n"
+  "s=-\r\n"
+  "c=IN IP4 10.0.0.1\r\n"
+  "t=0 0\r\n"
+  "m=audio 49170 RTP/AVP 0 8 97\r\n"
+  "a=rtpmap:0 PCMU/8000\r\n"
+  "a=rtpmap:8 PCMA/8000\r\n"
+  "a=rtpmap:97 AMR/8000\r\n"
+  "a=sendrecv\r\n";
+
+/// Fixture for BodyViewTest.
+///
+/// This derives from SipCommonTest to ensure PJSIP is set up correctly.
+class BodyViewTest : public SipCommonTest
+{
+public:
+  /// Parses an INVITE with the specified body.
+  pjsip_msg* invite(const std::string& content_type, const std::string& body)
+  {
+    return parse_msg("INVITE sip:6505551234@homedomain SIP/2.0\r\n"
+                     "Via: SIP/2.0/TCP 10.114.61.213;branch=z9hG4bK0123456789abcdef\r\n"
+                     "From: <sip:6505551000@homedomain>;tag=10.114.61.213+1+8c8b232a+5fb751cf\r\n"
+                     "To: <sip:6505551234@homedomain>\r\n"
+                     "Max-Forwards: 68\r\n"
+                     "Call-ID: 0gQAAC8WAAACBAAALxYAAAL8P3UbW8l4mT8YBkKGRKc5SOHaJ1gMRqsUOO4ohntC@10.114.61.213\r\n"
+                     "CSeq: 16567 INVITE\r\n"
+                     "Content-Type: " + content_type + "\r\n"
+                     "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" +
+                     body);
+  }
+
+  static std::string str(const pj_str_t& str)
+  {
+    return std::string(str.ptr, str.slen);
+  }
+
+  static pj_str_t cstr(const char* str)
+  {
+    return BodyView::slice((char*)str, strlen(str));
+  }
+};
+
+
+/// Test tokenizing SDP into lines, attributes and tokens.
+TEST_F(BodyViewTest, SdpLines)
+{
+  pjsip_msg* msg = invite("application/sdp", SDP);
+  SdpReader sdp(BodyView::body(msg));
+  SdpLine line;
+  std::string types;
+  std::vector<std::string> rtpmaps;
+
+  while (sdp.next(line))
+  {
+    types += line.type;
+    pj_str_t name;
+    pj_str_t value;
+    if ((line.attribute(name, value)) && (str(name) == "rtpmap"))
+    {
+      rtpmaps.push_back(str(value));
+    }
+  }
+
+  EXPECT_EQ("vosctmaaaa", types);
+  ASSERT_EQ(3u, rtpmaps.size());
+  EXPECT_EQ("8 PCMA/8000", rtpmaps[1]);
+
+  // Split the format list of the m= line.
+  SdpReader sdp2(BodyView::body(msg));
+  while ((sdp2.next(line)) && (line.type != 'm'))
+  {
+  }
+  EXPECT_EQ("m=audio 49170 RTP/AVP 0 8 97\r\n", str(line.raw));
+  pj_str_t rest = line.value;
+  pj_str_t token;
+  std::vector<std::string> tokens;
+  while (BodyView::next_token(rest, token))
+  {
+    tokens.push_back(str(token));
+  }
+  ASSERT_EQ(6u, tokens.size());
+  EXPECT_EQ("RTP/AVP", tokens[2]);
+  EXPECT_EQ("97", tokens[5]);
+}
+
+
+/// Test stripping a codec in place, which shrinks the body without
+/// allocating a new one.
+TEST_F(BodyViewTest, StripCodecInPlace)
+{
+  pjsip_msg* msg = invite("application/sdp", SDP);
+  pjsip_msg_body* body = msg->body;
+  void* data = body->data;
+  BodyEditor editor(_pool, msg);
+
+  SdpReader sdp(BodyView::body(msg));
+  SdpLine line;
+  while (sdp.next(line))
+  {
+    pj_str_t name;
+    pj_str_t value;
+    if (line.type == 'm')
+    {
+      // Remove " 8" from the format list.
+      pj_str_t rest = line.value;
+      pj_str_t token;
+      while (BodyView::next_token(rest, token))
+      {
+        if (str(token) == "8")
+        {
+          editor.erase(BodyView::slice(token.ptr - 1, token.slen + 1));
+        }
+      }
+    }
+    else if ((line.attribute(name, value)) &&
+             (str(name) == "rtpmap") &&
+             (value.slen > 2) &&
+             (memcmp(value.ptr, "8 ", 2) == 0))
+    {
+      editor.erase(line.raw);
+    }
+  }
+
+  EXPECT_EQ(2u, editor.size());
+  EXPECT_TRUE(editor.apply(true));
+  EXPECT_EQ(body, msg->body);
+  EXPECT_EQ(data, msg->body->data);
+  EXPECT_EQ("v=0\r\n"
+            "o=- 2890844526 2890844526 IN IP4 10.0.0.1\r\n"
+            "s=-\r\n"
+            "c=IN IP4 10.0.0.1\r\n"
+            "t=0 0\r\n"
+            "m=audio 49170 RTP/AVP 0 97\r\n"
+            "a=rtpmap:0 PCMU/8000\r\n"
+            "a=rtpmap:97 AMR/8000\r\n"
+            "a=sendrecv\r\n",
+            str(BodyView::body(msg)));
+}
+
+
+/// Test that edits that grow the body, or are not allowed in place, build a
+/// new body and leave the original, which a lazy clone may share, alone.
+TEST_F(BodyViewTest, RewriteAddress)
+{
+  pjsip_msg* msg = invite("application/sdp", SDP);
+  pjsip_msg* clone = LazyMsgClone::clone(_pool, msg);
+  std::string original = str(BodyView::body(msg));
+
+  BodyEditor editor(_pool, clone);
+  pj_str_t addr = cstr("192.168.100.200");
+  SdpReader sdp(BodyView::body(clone));
+  SdpLine line;
+  while (sdp.next(line))
+  {
+    if ((line.type == 'c') || (line.type == 'o'))
+    {
+      // Replace the last token, which is the address.
+      pj_str_t rest = line.value;
+      pj_str_t token;
+      pj_str_t last = rest;
+      while (BodyView::next_token(rest, token))
+      {
+        last = token;
+      }
+      editor.replace(last, addr);
+    }
+  }
+
+  EXPECT_TRUE(editor.apply(true));
+  EXPECT_NE(msg->body, clone->body);
+  EXPECT_EQ(original, str(BodyView::body(msg)));
+  std::string rewritten = str(BodyView::body(clone));
+  EXPECT_NE(std::string::npos, rewritten.find("c=IN IP4 192.168.100.200\r\n"));
+  EXPECT_NE(std::string::npos, rewritten.find("IN IP4 192.168.100.200\r\ns=-"));
+  EXPECT_EQ(original.size() + 14, rewritten.size());
+
+  // A shrinking edit is not done in place if that is not allowed.
+  pj_str_t v = BodyView::slice((char*)clone->body->data, 5);
+  editor.erase(v);
+  void* data = clone->body->data;
+  EXPECT_TRUE(editor.apply(false));
+  EXPECT_NE(data, clone->body->data);
+  EXPECT_EQ(rewritten.substr(5), str(BodyView::body(clone)));
+}
+
+
+/// Test that overlapping edits are rejected.
+TEST_F(BodyViewTest, OverlappingEdits)
+{
+  pjsip_msg* msg = invite("application/sdp", SDP);
+  pj_str_t body = BodyView::body(msg);
+  std::string original = str(body);
+
+  BodyEditor editor(_pool, msg);
+  editor.erase(BodyView::slice(body.ptr + 10, 10));
+  editor.replace(BodyView::slice(body.ptr + 15, 10), cstr("x"));
+  EXPECT_FALSE(editor.apply(true));
+  EXPECT_EQ(0u, editor.size());
+  EXPECT_EQ(original, str(BodyView::body(msg)));
+}
+
+
+/// Test splitting a multipart body into its parts.
+TEST_F(BodyViewTest, Multipart)
+{
+  std::string body =
+    "--unique-boundary-1\r\n"
+    "Content-Type: application/sdp\r\n"
+    "\r\n" +
+    std::string(SDP) +
+    "\r\n"
+    "--unique-boundary-1\r\n"
+    "Content-Type: application/pidf+xml\r\n"
+    "Content-ID: <target123@atlanta.example.com>\r\n"
+    "\r\n"
+    "<presence/>\r\n"
+    "--unique-boundary-1--\r\n";
+  pjsip_msg* msg = invite("multipart/mixed;boundary=\"unique-boundary-1\"", body);
+
+  MultipartReader parts(msg);
+  MultipartPart part;
+  pj_str_t value;
+
+  ASSERT_TRUE(parts.next(part));
+  ASSERT_TRUE(part.header("content-type", value));
+  EXPECT_EQ("application/sdp", str(value));
+  EXPECT_FALSE(part.header("Content-ID", value));
+  EXPECT_EQ(SDP, str(part.body));
+
+  ASSERT_TRUE(parts.next(part));
+  ASSERT_TRUE(part.header("Content-Type", value));
+  EXPECT_EQ("application/pidf+xml", str(value));
+  ASSERT_TRUE(part.header("Content-ID", value));
+  EXPECT_EQ("<target123@atlanta.example.com>", str(value));
+  EXPECT_EQ("<presence/>", str(part.body));
+
+  EXPECT_FALSE(parts.next(part));
+
+  // Removing the second part leaves a valid multipart body.
+  MultipartReader parts2(msg);
+  parts2.next(part);
+  parts2.next(part);
+  BodyEditor editor(_pool, msg);
+  editor.erase(part.raw);
+  EXPECT_TRUE(editor.apply(true));
+
+  MultipartReader parts3(msg);
+  EXPECT_TRUE(parts3.next(part));
+  EXPECT_EQ(SDP, str(part.body));
+  EXPECT_FALSE(parts3.next(part));
+}
+
+
+/// Test that a body that is not multipart has no parts.
+TEST_F(BodyViewTest, NotMultipart)
+{
+  pjsip_msg* msg = invite("application/sdp", SDP);
+  MultipartReader parts(msg);
+  MultipartPart part;
+  EXPECT_FALSE(parts.next(part));
+}
@@ -0,0 +1,111 @@
+/**
+ * @file dialog_id_test.cpp UT for interned dialog identifiers.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include <unordered_set>
+#include "gtest/gtest.h"
+
+#include "dialog_id.h"
+#include "dialog_store.h"
+
+using namespace std;
+
+static const string CALL_ID =
+  "0gQAAC8WAAACBAAALxYAAAL8P3UbW8l4mT8YBkKGRKc5SOHaJ1gMRqsUOO4ohntC@10.114.61.213";
+static const string TAG = "10.114.61.213+1+8c8b232a+5fb751cf";
+
+static pj_str_t str(const string& s)
+{
+  pj_str_t ret;
+  ret.ptr = (char*)s.data();
+  ret.slen = s.size();
+  return ret;
+}
+
+/// Fixture for DialogIdTest.
+class DialogIdTest : public ::testing::Test
+{
+public:
+  DialogIdTable _table;
+};
+
+
+/// Test that interning the same identifier gives the same handle, however it
+/// is built, and different identifiers give different handles.
+TEST_F(DialogIdTest, Intern)
+{
+  DialogId id1 = _table.intern(CALL_ID + ";" + TAG);
+  DialogId id2 = _table.intern(str(CALL_ID), str(TAG));
+  DialogId id3 = _table.intern(str(CALL_ID), str("other"));
+
+  EXPECT_TRUE(id1.valid());
+  EXPECT_EQ(id1, id2);
+  EXPECT_NE(id1, id3);
+  EXPECT_EQ(2u, _table.size());
+  EXPECT_EQ(CALL_ID + ";" + TAG, _table.str(id1));
+  EXPECT_EQ(CALL_ID + ";other", _table.str(id3));
+  EXPECT_EQ(id1, _table.find(str(CALL_ID), str(TAG)));
+  EXPECT_EQ(id3, _table.find(CALL_ID + ";other"));
+  EXPECT_FALSE(_table.find(CALL_ID).valid());
+  EXPECT_FALSE(DialogId().valid());
+  EXPECT_EQ("", _table.str(DialogId()));
+}
+
+
+/// Test that identifiers are removed when the last reference is dropped, and
+/// that stale handles never match a new identifier using the same storage.
+TEST_F(DialogIdTest, Release)
+{
+  DialogId id1 = _table.intern(CALL_ID);
+  EXPECT_EQ(id1, _table.intern(CALL_ID));
+  EXPECT_TRUE(_table.add_ref(id1));
+
+  _table.release(id1);
+  _table.release(id1);
+  EXPECT_EQ(id1, _table.find(CALL_ID));
+  _table.release(id1);
+  EXPECT_FALSE(_table.find(CALL_ID).valid());
+  EXPECT_EQ(0u, _table.size());
+  EXPECT_EQ("", _table.str(id1));
+  EXPECT_FALSE(_table.add_ref(id1));
+
+  DialogId id2 = _table.intern(CALL_ID);
+  EXPECT_NE(id1, id2);
+  _table.release(id1);
+  EXPECT_EQ(CALL_ID, _table.str(id2));
+  _table.release(id2);
+}
+
+
+/// Test that handles can key hashed containers and the dialog state store.
+TEST_F(DialogIdTest, Hashing)
+{
+  unordered_set<DialogId> ids;
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    ids.insert(_table.intern(CALL_ID + to_string(ii)));
+  }
+  EXPECT_EQ(1000u, ids.size());
+
+  DialogStore<int, DialogId> store(1000, 60000);
+  DialogId id = _table.find(CALL_ID + "7");
+  EXPECT_TRUE(store.put(id, 7, 1000));
+  int state = 0;
+  EXPECT_TRUE(store.get(id, state, 1000));
+  EXPECT_EQ(7, state);
+  EXPECT_FALSE(store.get(_table.find(CALL_ID + "8"), state, 1000));
+
+  for (unordered_set<DialogId>::iterator ii = ids.begin(); ii != ids.end(); ++ii)
+  {
+    _table.release(*ii);
+  }
+  EXPECT_EQ(0u, _table.size());
+}
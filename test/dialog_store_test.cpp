@@ -0,0 +1,222 @@
+/**
+ * @file dialog_store_test.cpp UT for the AppServer dialog state store.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "dialog_store.h"
+
+using namespace std;
+
+/// Example per-dialog state.
+struct DialogState
+{
+  DialogState() : served_user(), forks(0) {}
+  DialogState(const string& user, int num_forks) :
+    served_user(user), forks(num_forks) {}
+
+  string served_user;
+  int forks;
+};
+
+/// Fixture for DialogStoreTest.
+class DialogStoreTest : public ::testing::Test
+{
+public:
+  DialogStoreTest() : _store(1000, 60000) {}
+
+  static string dialog(int ii)
+  {
+    return "0gQAAC8WAAACBAAALxYAAAL8P3UbW8l4mT8YBkKGRKc5SOHaJ1gMRqs" +
+           to_string(ii) + ";1234";
+  }
+
+  DialogStore<DialogState> _store;
+};
+
+
+/// Test storing, updating and erasing state.
+TEST_F(DialogStoreTest, PutGetErase)
+{
+  DialogState state;
+  EXPECT_FALSE(_store.get(dialog(1), state, 1000));
+
+  EXPECT_TRUE(_store.put(dialog(1), DialogState("6505551234", 1), 1000));
+  EXPECT_TRUE(_store.get(dialog(1), state, 1000));
+  EXPECT_EQ("6505551234", state.served_user);
+  EXPECT_EQ(1, state.forks);
+  EXPECT_FALSE(_store.get(dialog(2), state, 1000));
+
+  EXPECT_TRUE(_store.update(dialog(1), 1000, [](DialogState& s) { s.forks++; }));
+  EXPECT_FALSE(_store.update(dialog(2), 1000, [](DialogState& s) { s.forks++; }));
+  EXPECT_TRUE(_store.get(dialog(1), state, 1000));
+  EXPECT_EQ(2, state.forks);
+  EXPECT_EQ(1u, _store.size());
+
+  EXPECT_TRUE(_store.erase(dialog(1)));
+  EXPECT_FALSE(_store.erase(dialog(1)));
+  EXPECT_FALSE(_store.get(dialog(1), state, 1000));
+  EXPECT_EQ(0u, _store.size());
+}
+
+
+/// Test that entries expire after their TTL, that put and update restart
+/// the TTL, and that expire reclaims expired entries.
+TEST_F(DialogStoreTest, Expiry)
+{
+  DialogState state;
+  _store.put(dialog(1), DialogState("a", 0), 1000);
+  _store.put(dialog(2), DialogState("b", 0), 1000, 500);
+  _store.put(dialog(3), DialogState("c", 0), 1000);
+
+  EXPECT_TRUE(_store.get(dialog(2), state, 1499));
+  EXPECT_FALSE(_store.get(dialog(2), state, 1500));
+  EXPECT_EQ(2u, _store.size());
+
+  EXPECT_TRUE(_store.update(dialog(1), 30000, [](DialogState& s) {}));
+  EXPECT_EQ(1u, _store.expire(61000));
+  EXPECT_TRUE(_store.get(dialog(1), state, 61000));
+  EXPECT_FALSE(_store.get(dialog(3), state, 61000));
+  EXPECT_EQ(1u, _store.size());
+}
+
+
+/// Test that memory is bounded: once full, new dialogs are rejected until
+/// entries expire or are erased.
+TEST_F(DialogStoreTest, Capacity)
+{
+  int stored = 0;
+  for (int ii = 0; ii < 5000; ++ii)
+  {
+    if (_store.put(dialog(ii), DialogState("x", ii), 1000))
+    {
+      ++stored;
+    }
+  }
+
+  // Each shard holds its share of the capacity, rounded up.
+  EXPECT_GE(stored, 1000);
+  EXPECT_LE(stored, 1024);
+  EXPECT_EQ((size_t)stored, _store.size());
+
+  // Existing entries can still be replaced.
+  DialogState state;
+  ASSERT_TRUE(_store.get(dialog(0), state, 1000));
+  EXPECT_TRUE(_store.put(dialog(0), DialogState("y", 0), 1000));
+
+  // Once the entries have expired, new dialogs can be stored again.
+  EXPECT_TRUE(_store.put(dialog(10000), DialogState("z", 0), 61000));
+}
+
+
+/// Test that a full store reclaims expired entries to make room for new
+/// ones, while keeping the unexpired entries.
+TEST_F(DialogStoreTest, FullReclaim)
+{
+  int stored = 0;
+  int short_lived = 0;
+  for (int ii = 0; ii < 5000; ++ii)
+  {
+    if (_store.put(dialog(ii), DialogState("x", ii), 1000, (ii % 2) ? 100 : 0))
+    {
+      ++stored;
+      short_lived += (ii % 2);
+    }
+  }
+  EXPECT_EQ((size_t)stored, _store.size());
+
+  // Nothing has expired yet, so new dialogs are rejected, repeatedly.
+  EXPECT_FALSE(_store.put(dialog(10000), DialogState("y", 0), 1050));
+  EXPECT_FALSE(_store.put(dialog(10000), DialogState("y", 0), 1050));
+
+  // Once the short-lived entries have expired, their space is reused for
+  // new dialogs.
+  int added = 0;
+  for (int ii = 10000; ii < 15000; ++ii)
+  {
+    if (_store.put(dialog(ii), DialogState("y", ii), 1100))
+    {
+      ++added;
+    }
+  }
+  EXPECT_EQ(short_lived, added);
+  EXPECT_EQ((size_t)stored, _store.size());
+
+  DialogState state;
+  for (int ii = 0; ii < 5000; ii += 2)
+  {
+    if (_store.get(dialog(ii), state, 1100))
+    {
+      EXPECT_EQ(ii, state.forks);
+    }
+  }
+  EXPECT_FALSE(_store.get(dialog(1), state, 1100));
+}
+
+
+/// Test that erasing entries keeps every other entry reachable, including
+/// those further along the same probe sequence.
+TEST_F(DialogStoreTest, EraseKeepsOthers)
+{
+  DialogStore<DialogState> store(100000, 60000);
+  for (int ii = 0; ii < 800; ++ii)
+  {
+    ASSERT_TRUE(store.put(dialog(ii), DialogState("x", ii), 1000));
+  }
+
+  for (int ii = 0; ii < 800; ii += 3)
+  {
+    EXPECT_TRUE(store.erase(dialog(ii)));
+  }
+
+  for (int ii = 0; ii < 800; ++ii)
+  {
+    DialogState state;
+    EXPECT_EQ((ii % 3) != 0, store.get(dialog(ii), state, 1000)) << ii;
+    if ((ii % 3) != 0)
+    {
+      EXPECT_EQ(ii, state.forks);
+    }
+  }
+}
+
+
+/// Test concurrent use from several threads.
+TEST_F(DialogStoreTest, Concurrent)
+{
+  DialogStore<DialogState> store(100000, 60000);
+  vector<thread> threads;
+  for (int tt = 0; tt < 4; ++tt)
+  {
+    threads.push_back(thread([&store, tt]()
+    {
+      for (int ii = tt * 200; ii < (tt + 1) * 200; ++ii)
+      {
+        DialogState state;
+        store.put(dialog(ii), DialogState("x", 0), 1000);
+        for (int jj = 0; jj < 10; ++jj)
+        {
+          store.update(dialog(ii), 1000, [](DialogState& s) { s.forks++; });
+        }
+        EXPECT_TRUE(store.get(dialog(ii), state, 1000));
+        EXPECT_EQ(10, state.forks);
+      }
+    }));
+  }
+
+  for (size_t ii = 0; ii < threads.size(); ++ii)
+  {
+    threads[ii].join();
+  }
+  EXPECT_EQ(800u, store.size());
+}
@@ -0,0 +1,393 @@
+/**
+ * @file dummyappserver.hpp  Test messages and dummy Application Servers.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef DUMMYAPPSERVER_H__
+#define DUMMYAPPSERVER_H__
+
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "pjutils.h"
+#include "appserver.h"
+#include "fakeappserver.hpp"
+
+namespace AS
+{
+class Message
+{
+public:
+  std::string _method;
+  std::string _toscheme;
+  std::string _status;
+  std::string _from;
+  std::string _fromdomain;
+  std::string _to;
+  std::string _todomain;
+  std::string _route;
+
+  Message() :
+    _method("OPTIONS"),
+    _toscheme("sip"),
+    _status("200 OK"),
+    _from("6505551000"),
+    _fromdomain("homedomain"),
+    _to("6505551234"),
+    _todomain("homedomain"),
+    _route("")
+  {
+  }
+
+  std::string get_request();
+  std::string get_response();
+};
+}
+
+inline std::string AS::Message::get_request()
+{
+  char buf[16384];
+
+  // The remote target.
+  std::string target = std::string(_toscheme).append(":").append(_to);
+  if (!_todomain.empty())
+  {
+    target.append("@").append(_todomain);
+  }
+
+  int n = snprintf(buf, sizeof(buf),
+                   "%1$s sip:%4$s SIP/2.0\r\n"
+                   "Via: SIP/2.0/TCP 10.114.61.213;branch=z9hG4bK0123456789abcdef\r\n"
+                   "From: <sip:%2$s@%3$s>;tag=10.114.61.213+1+8c8b232a+5fb751cf\r\n"
+                   "To: <sip:%4$s>\r\n"
+                   "%5$s"
+                   "Max-Forwards: 68\r\n"
+                   "Call-ID: 0gQAAC8WAAACBAAALxYAAAL8P3UbW8l4mT8YBkKGRKc5SOHaJ1gMRqsUOO4ohntC@10.114.61.213\r\n"
+                   "CSeq: 16567 %1$s\r\n"
+                   "User-Agent: Accession 2.0.0.0\r\n"
+                   "Allow: PRACK, INVITE, ACK, BYE, CANCEL, UPDATE, SUBSCRIBE, NOTIFY, REFER, MESSAGE, OPTIONS\r\n"
+                   "Content-Length: 0\r\n\r\n",
+                   /*  1 */ _method.c_str(),
+                   /*  2 */ _from.c_str(),
+                   /*  3 */ _fromdomain.c_str(),
+                   /*  4 */ target.c_str(),
+                   /*  5 */ _route.empty() ? "" : std::string(_route).append("\r\n").c_str()
+    );
+
+  EXPECT_LT(n, (int)sizeof(buf));
+
+  std::string ret(buf, n);
+  return ret;
+}
+
+inline std::string AS::Message::get_response()
+{
+  char buf[16384];
+
+  // The remote target.
+  std::string target = std::string(_toscheme).append(":").append(_to);
+  if (!_todomain.empty())
+  {
+    target.append("@").append(_todomain);
+  }
+
+  int n = snprintf(buf, sizeof(buf),
+                   "SIP/2.0 %1$s\r\n"
+                   "Via: SIP/2.0/TCP 10.114.61.213;branch=z9hG4bK0123456789abcdef\r\n"
+                   "From: <sip:%2$s@%3$s>;tag=10.114.61.213+1+8c8b232a+5fb751cf\r\n"
+                   "To: <sip:%4$s@%5$s>\r\n"
+                   "%6$s"
+                   "Max-Forwards: 68\r\n"
+                   "Call-ID: 0gQAAC8WAAACBAAALxYAAAL8P3UbW8l4mT8YBkKGRKc5SOHaJ1gMRqsUOO4ohntC@10.114.61.213\r\n"
+                   "CSeq: 16567 %7$s\r\n"
+                   "User-Agent: Accession 2.0.0.0\r\n"
+                   "Allow: PRACK, INVITE, ACK, BYE, CANCEL, UPDATE, SUBSCRIBE, NOTIFY, REFER, MESSAGE, OPTIONS\r\n"
+                   "Content-Length: 0\r\n\r\n",
+                   /*  1 */ _status.c_str(),
+                   /*  2 */ _from.c_str(),
+                   /*  3 */ _fromdomain.c_str(),
+                   /*  4 */ _to.c_str(),
+                   /*  5 */ _todomain.c_str(),
+                   /*  6 */ _route.empty() ? "" : std::string(_route).append("\r\n").c_str(),
+                   /*  7 */ _method.c_str()
+    );
+
+  EXPECT_LT(n, (int)sizeof(buf));
+
+  std::string ret(buf, n);
+  return ret;
+}
+
+
+/// Dummy AppServerTsx that adds itself to the dialog.
+class DummyDialogASTsx : public AppServerTsx
+{
+public:
+  DummyDialogASTsx() :
+    AppServerTsx() {}
+
+  void on_initial_request(pjsip_msg* req)
+  {
+    add_to_dialog();
+    send_request(req);
+  }
+
+  void on_response(pjsip_msg* rsp, int fork_id)
+  {
+    send_response(rsp);
+  }
+};
+
+
+/// Dummy AppServerTsx that rejects the transaction.
+class DummyRejectASTsx : public AppServerTsx
+{
+public:
+  DummyRejectASTsx() :
+    AppServerTsx() {}
+
+  void on_initial_request(pjsip_msg* req)
+  {
+    pjsip_msg* rsp = create_response(req, PJSIP_SC_NOT_FOUND, "Who?");
+    send_response(rsp);
+    free_msg(req);
+  }
+};
+
+
+/// Dummy AppServerTsx that rejects the transaction using the fast path.
+class DummyFastRejectASTsx : public AppServerTsx
+{
+public:
+  DummyFastRejectASTsx() :
+    AppServerTsx() {}
+
+  void on_initial_request(pjsip_msg* req)
+  {
+    reject(req, PJSIP_SC_NOT_FOUND, "Who?");
+  }
+};
+
+
+/// Dummy AppServerTsx that redirects the transaction to two contacts.
+class DummyRedirectASTsx : public AppServerTsx
+{
+public:
+  DummyRedirectASTsx() :
+    AppServerTsx() {}
+
+  void on_initial_request(pjsip_msg* req)
+  {
+    pj_pool_t* pool = get_pool(req);
+    std::vector<pjsip_uri*> contacts;
+    contacts.push_back(PJUtils::uri_from_string("sip:alice@example.com", pool));
+    contacts.push_back(PJUtils::uri_from_string("sip:bob@example.com", pool));
+    redirect(req, PJSIP_SC_MOVED_TEMPORARILY, contacts);
+  }
+};
+
+
+/// Dummy AppServerTsx that forks the transaction.
+class DummyForkASTsx : public AppServerTsx
+{
+public:
+  DummyForkASTsx() :
+    AppServerTsx() {}
+
+  void on_initial_request(pjsip_msg* req)
+  {
+    pj_pool_t* pool = get_pool(req);
+    pjsip_msg* req1 = clone_request(req);
+    pjsip_msg* req2 = clone_request(req);
+    req1->line.req.uri = PJUtils::uri_from_string("sip:alice@example.com", pool);
+    req2->line.req.uri = PJUtils::uri_from_string("sip:bob@example.com", pool);
+    send_request(req1);
+    send_request(req2);
+    free_msg(req);
+  }
+};
+
+
+/// Dummy AppServerTsx that forks the transaction using lazy clones.
+class DummyLazyForkASTsx : public AppServerTsx
+{
+public:
+  DummyLazyForkASTsx() :
+    AppServerTsx() {}
+
+  void on_initial_request(pjsip_msg* req)
+  {
+    pj_pool_t* pool = get_pool(req);
+    pjsip_msg* req1 = lazy_clone_request(req);
+    pjsip_msg* req2 = lazy_clone_request(req);
+    req1->line.req.uri = PJUtils::uri_from_string("sip:alice@example.com", pool);
+    req2->line.req.uri = PJUtils::uri_from_string("sip:bob@example.com", pool);
+    send_request(req1);
+    send_request(req2);
+    free_msg(req);
+  }
+};
+
+
+/// Dummy AppServerTsx that forks the transaction using lazy clones, managing
+/// the messages with MsgHandles.  The original request is freed when its
+/// handle goes out of scope.
+class DummyHandleForkASTsx : public AppServerTsx
+{
+public:
+  DummyHandleForkASTsx() :
+    AppServerTsx() {}
+
+  void on_initial_request(pjsip_msg* raw_req)
+  {
+    MsgHandle req = own(raw_req);
+    pj_pool_t* pool = get_pool(req.get());
+    MsgHandle req1 = lazy_clone_request(req);
+    MsgHandle req2 = lazy_clone_request(req);
+    req1->line.req.uri = PJUtils::uri_from_string("sip:alice@example.com", pool);
+    req2->line.req.uri = PJUtils::uri_from_string("sip:bob@example.com", pool);
+    send_request(std::move(req1));
+    send_request(std::move(req2));
+  }
+
+  void on_response(pjsip_msg* rsp, int fork_id)
+  {
+    send_response(own(rsp));
+  }
+};
+
+
+/// Dummy AppServerTsx that forks the transaction in a single batch.
+class DummyBatchForkASTsx : public AppServerTsx
+{
+public:
+  DummyBatchForkASTsx() :
+    AppServerTsx() {}
+
+  void on_initial_request(pjsip_msg* req)
+  {
+    pj_pool_t* pool = get_pool(req);
+    std::vector<ForkTarget> targets;
+    targets.push_back(ForkTarget(PJUtils::uri_from_string("sip:alice@example.com", pool)));
+    targets.push_back(ForkTarget(PJUtils::uri_from_string("sip:bob@example.com", pool)));
+    send_requests(req, targets, _fork_ids);
+  }
+
+  std::vector<int> _fork_ids;
+};
+
+
+/// Dummy AppServerTsx that forks the transaction, bound at compile time to
+/// FakeAppServerTsxHelper.
+class DummyStaticForkASTsx :
+  public StaticAppServerTsx<DummyStaticForkASTsx, FakeAppServerTsxHelper>
+{
+public:
+  DummyStaticForkASTsx() :
+    StaticAppServerTsx<DummyStaticForkASTsx, FakeAppServerTsxHelper>() {}
+
+  void on_initial_request(pjsip_msg* req)
+  {
+    pj_pool_t* pool = get_pool(req);
+    pjsip_msg* req1 = clone_request(req);
+    pjsip_msg* req2 = clone_request(req);
+    req1->line.req.uri = PJUtils::uri_from_string("sip:alice@example.com", pool);
+    req2->line.req.uri = PJUtils::uri_from_string("sip:bob@example.com", pool);
+    send_request(req1);
+    send_request(req2);
+    free_msg(req);
+  }
+};
+
+
+/// Dummy AppServerTsx that waits for an asynchronous lookup before
+/// forwarding the request, if the infrastructure supports it, and otherwise
+/// forwards the request immediately.  Whatever does the lookup resumes the
+/// transaction using _handle.
+class DummyAsyncASTsx : public AppServerTsx
+{
+public:
+  DummyAsyncASTsx() :
+    AppServerTsx(), _req(NULL), _handle() {}
+
+  void on_initial_request(pjsip_msg* req)
+  {
+    _handle = suspend();
+
+    if (_handle.valid())
+    {
+      _req = req;
+    }
+    else
+    {
+      send_request(req);
+    }
+  }
+
+  void on_resume(void* context)
+  {
+    send_request(_req);
+  }
+
+  pjsip_msg* _req;
+  AsyncHandle _handle;
+};
+
+
+/// Dummy AppServerTsx that logs a SAS event for the request and a DETAIL
+/// event for each response, and forwards the request.
+class DummySasASTsx : public AppServerTsx
+{
+public:
+  static const uint32_t REQUEST_EVENT = 0x100;
+  static const uint32_t RESPONSE_EVENT = 0x101;
+
+  DummySasASTsx() :
+    AppServerTsx() {}
+
+  void on_initial_request(pjsip_msg* req)
+  {
+    SAS::Event* event = sas_event(REQUEST_EVENT);
+    event->add_static_param(req->line.req.method.id);
+    send_request(req);
+  }
+
+  void on_response(pjsip_msg* rsp, int fork_id)
+  {
+    SAS::Event* event = sas_event(RESPONSE_EVENT, fork_id, SasEventBuffer::DETAIL);
+    if (event != NULL)
+    {
+      event->add_static_param(rsp->line.status.code);
+    }
+    send_response(rsp);
+  }
+};
+
+
+/// Dummy AppServer that handles every request with a new AppServerTsx of
+/// type T.
+template <class T>
+class DummyAppServer : public AppServer
+{
+public:
+  DummyAppServer(const std::string& service_name) :
+    AppServer(service_name) {}
+
+  AppServerTsx* get_app_tsx(SproutletHelper* helper,
+                            pjsip_msg* req,
+                            pjsip_sip_uri*& next_hop,
+                            pj_pool_t* pool,
+                            SAS::TrailId trail)
+  {
+    return new T();
+  }
+};
+
+#endif
@@ -0,0 +1,581 @@
+/**
+ * @file fakeappserver.hpp  Lightweight in-memory AppServerTsxHelper.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef FAKEAPPSERVER_H__
+#define FAKEAPPSERVER_H__
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "appserver.h"
+#include "timer_wheel.h"
+
+/// The FakeAppServerTsxHelper class is a real, in-memory implementation of
+/// AppServerTsxHelper for load testing and profiling services without a full
+/// Sprout stack.  Unlike MockAppServerTsxHelper it does no expectation
+/// matching: messages are really cloned into their own pools, responses are
+/// really built and freed, and sent messages, fork IDs, cancelled forks and
+/// timers are recorded for inspection.  Lazy clones really share memory with
+/// their source, so the pools of the sources of lazy clones, and of the
+/// received request, are kept until the end of the transaction if they are
+/// freed while other messages may still refer to them.
+///
+/// Transactions can be suspended.  Resumes may be requested from any thread,
+/// but are queued until run_resumes is called, as the infrastructure would
+/// queue them to run on the transaction's thread.
+///
+/// Each helper handles one transaction at a time.  Call start to begin a
+/// transaction and finish to end it, after which the helper can be reused.
+/// It is not thread-safe, so use one helper per thread.
+///
+class FakeAppServerTsxHelper : public AppServerTsxHelper
+{
+public:
+  /// A message sent by the AppServerTsx.
+  struct SentMsg
+  {
+    int fork_id;
+    pjsip_msg* msg;
+  };
+
+  /// A response sent by the AppServerTsx using reject or redirect, which is
+  /// recorded without building a message.
+  struct SentReject
+  {
+    int status_code;
+    std::string status_text;
+    size_t num_contacts;
+  };
+
+  /// Constructor.
+  ///
+  /// @param  factory      - The pool factory to create message pools from.
+  /// @param  keep_sent    - Whether to keep sent messages for inspection.  If
+  ///                        false, messages are freed as soon as they are sent.
+  FakeAppServerTsxHelper(pj_pool_factory* factory, bool keep_sent = true) :
+    _factory(factory),
+    _keep_sent(keep_sent),
+    _tsx(NULL),
+    _original(NULL),
+    _pools(),
+    _deferred_msgs(),
+    _deferred_pools(),
+    _dialog_id(),
+    _dialog_handle(),
+    _trail(0),
+    _next_fork_id(0),
+    _sent_requests(),
+    _sent_responses(),
+    _sent_rejects(),
+    _cancelled_forks(),
+    _timers(),
+    _timers_now(0),
+    _resumers(),
+    _msgs_created(0),
+    _msgs_freed(0),
+    _leaked(0),
+    _pool_bytes(0),
+    _max_msg_pool_bytes(0)
+  {
+  }
+
+  ~FakeAppServerTsxHelper()
+  {
+    finish();
+  }
+
+  /// Starts a transaction.  The request is copied into a new message owned
+  /// by the AppServerTsx, which should then be passed to on_initial_request
+  /// or on_in_dialog_request.
+  ///
+  /// @returns             - The received request to pass to the AppServerTsx.
+  /// @param  tsx          - The AppServerTsx handling the transaction.  Its
+  ///                        helper is set to this object.
+  /// @param  req          - The request received for the transaction.
+  /// @param  trail        - The SAS trail for the transaction.
+  pjsip_msg* start(AppServerTsx* tsx, const pjsip_msg* req, SAS::TrailId trail = 0)
+  {
+    finish();
+    _tsx = tsx;
+    _tsx->set_helper(this);
+    _trail = trail;
+    _original = copy(req);
+
+    // The infrastructure keeps the received request for the life of the
+    // transaction, so services may allocate from its pool for use in other
+    // messages even after freeing it.
+    pjsip_msg* rcvd = copy(req);
+    _deferred_msgs.insert(rcvd);
+    return rcvd;
+  }
+
+  /// Creates a copy of a message owned by the AppServerTsx, for example a
+  /// response to pass to on_response.
+  ///
+  /// @returns             - The copy of the message.
+  /// @param  msg          - The message to copy.
+  pjsip_msg* receive(const pjsip_msg* msg) { return copy(msg); }
+
+  /// Finishes the current transaction, freeing any sent messages and
+  /// cancelling any running timers.  Any other messages which have not been
+  /// freed by the AppServerTsx are counted as leaked, and freed.
+  void finish()
+  {
+    _tsx = NULL;
+    clear_sent();
+
+    if (_original != NULL)
+    {
+      release(_original);
+      _original = NULL;
+    }
+
+    _leaked += _pools.size();
+    _deferred_msgs.clear();
+    while (!_pools.empty())
+    {
+      release(_pools.begin()->first);
+    }
+
+    for (size_t ii = 0; ii < _deferred_pools.size(); ++ii)
+    {
+      pj_pool_release(_deferred_pools[ii]);
+    }
+    _deferred_pools.clear();
+
+    if (_timers.size() > 0)
+    {
+      _timers = TimerWheel(_timers_now);
+    }
+
+    for (size_t ii = 0; ii < _resumers.size(); ++ii)
+    {
+      _resumers[ii]->take();
+    }
+    _resumers.clear();
+    _dialog_id.clear();
+    DialogIdTable::instance().release(_dialog_handle);
+    _dialog_handle = DialogId();
+    _cancelled_forks.clear();
+    _next_fork_id = 0;
+  }
+
+  /// Frees all the sent messages recorded so far.
+  void clear_sent()
+  {
+    for (size_t ii = 0; ii < _sent_requests.size(); ++ii)
+    {
+      release(_sent_requests[ii].msg);
+    }
+    _sent_requests.clear();
+
+    for (size_t ii = 0; ii < _sent_responses.size(); ++ii)
+    {
+      release(_sent_responses[ii].msg);
+    }
+    _sent_responses.clear();
+    _sent_rejects.clear();
+  }
+
+  /// Advances time, firing any expired timers on the AppServerTsx.
+  ///
+  /// @returns             - The number of timers that expired.
+  /// @param  now_ms       - The new time in milliseconds.
+  size_t advance_time(uint64_t now_ms)
+  {
+    _timers_now = now_ms;
+    return _timers.poll(now_ms);
+  }
+
+  /// Runs the on_resume callbacks of any suspensions of the AppServerTsx
+  /// that have been resumed.
+  ///
+  /// @returns             - The number of callbacks run.
+  size_t run_resumes()
+  {
+    size_t run = 0;
+
+    // Callbacks may suspend the transaction again, so take the current
+    // suspensions first.
+    std::vector<std::shared_ptr<Resumer> > resumers;
+    resumers.swap(_resumers);
+
+    for (size_t ii = 0; ii < resumers.size(); ++ii)
+    {
+      void* context;
+      if (resumers[ii]->resumed(context))
+      {
+        resumers[ii]->take();
+        _tsx->on_resume(context);
+        ++run;
+      }
+      else
+      {
+        _resumers.push_back(resumers[ii]);
+      }
+    }
+
+    return run;
+  }
+
+  /// Resumes every suspension that has not yet been resumed, as if the
+  /// operations they were waiting for had completed.  The on_resume
+  /// callbacks are run by the next call to run_resumes.
+  ///
+  /// @returns             - The number of suspensions resumed.
+  /// @param  context      - Context parameter passed to on_resume.
+  size_t resume_all(void* context = NULL)
+  {
+    size_t resumed = 0;
+    for (size_t ii = 0; ii < _resumers.size(); ++ii)
+    {
+      if (_resumers[ii]->resume(context))
+      {
+        ++resumed;
+      }
+    }
+    return resumed;
+  }
+
+  /// Returns the number of suspensions that have not yet been resumed and
+  /// run.
+  size_t suspended() const { return _resumers.size(); }
+
+  /// Returns the time in milliseconds passed to the last advance_time.
+  uint64_t now_ms() const { return _timers_now; }
+
+  /// Accessors for the recorded state.
+  const std::vector<SentMsg>& sent_requests() const { return _sent_requests; }
+  const std::vector<SentMsg>& sent_responses() const { return _sent_responses; }
+  const std::vector<SentReject>& sent_rejects() const { return _sent_rejects; }
+  const std::vector<int>& cancelled_forks() const { return _cancelled_forks; }
+  size_t timers_running() const { return _timers.size(); }
+  uint64_t msgs_created() const { return _msgs_created; }
+  uint64_t msgs_freed() const { return _msgs_freed; }
+  uint64_t msgs_live() const { return _pools.size(); }
+  uint64_t msgs_leaked() const { return _leaked; }
+
+  /// Returns the total pool memory used by all messages freed so far.
+  uint64_t pool_bytes() const { return _pool_bytes; }
+
+  /// Returns the largest pool memory used by any one message freed so far.
+  uint64_t max_msg_pool_bytes() const { return _max_msg_pool_bytes; }
+
+  // AppServerTsxHelper methods.
+
+  pjsip_msg* original_request() { return copy(_original); }
+
+  const pjsip_route_hdr* route_hdr() const { return NULL; }
+
+  void add_to_dialog(const std::string& dialog_id)
+  {
+    DialogId handle;
+
+    if (!dialog_id.empty())
+    {
+      handle = DialogIdTable::instance().intern(dialog_id);
+    }
+    else
+    {
+      // Intern a default identifier built from the Call-ID and From tag.
+      pjsip_cid_hdr* cid = PJSIP_MSG_CID_HDR(_original);
+      pjsip_from_hdr* from = PJSIP_MSG_FROM_HDR(_original);
+      handle = DialogIdTable::instance().intern(cid->id, from->tag);
+    }
+
+    set_dialog(handle);
+  }
+
+  void add_to_dialog_handle(DialogId dialog_id)
+  {
+    if (DialogIdTable::instance().add_ref(dialog_id))
+    {
+      set_dialog(dialog_id);
+    }
+  }
+
+  const std::string& dialog_id() const { return _dialog_id; }
+
+  DialogId dialog_handle() const { return _dialog_handle; }
+
+  pjsip_msg* clone_request(pjsip_msg* req) { return copy(req); }
+
+  pjsip_msg* lazy_clone_request(pjsip_msg* req)
+  {
+    pj_pool_t* pool = create_pool();
+    pjsip_msg* clone = LazyMsgClone::clone(pool, req);
+    _pools[clone] = pool;
+    _deferred_msgs.insert(req);
+    return clone;
+  }
+
+  pjsip_msg* clone_msg(pjsip_msg* msg) { return copy(msg); }
+
+  pjsip_msg* create_request(const RequestTemplate& tmpl,
+                            const RequestTemplate::Values& values)
+  {
+    pj_pool_t* pool = create_pool();
+    pjsip_msg* req = pjsip_msg_create(pool, PJSIP_REQUEST_MSG);
+    _pools[req] = pool;
+    tmpl.instantiate(pool, req, values);
+    return req;
+  }
+
+  pjsip_msg* create_response(pjsip_msg* req,
+                             pjsip_status_code status_code,
+                             const std::string& status_text="")
+  {
+    pj_pool_t* pool = create_pool();
+    pjsip_msg* rsp = pjsip_msg_create(pool, PJSIP_RESPONSE_MSG);
+    _pools[rsp] = pool;
+    rsp->line.status.code = status_code;
+
+    if (!status_text.empty())
+    {
+      pj_strdup2(pool, &rsp->line.status.reason, status_text.c_str());
+    }
+    else
+    {
+      rsp->line.status.reason = *pjsip_get_status_text(status_code);
+    }
+
+    for (pjsip_hdr* hdr = req->hdr.next; hdr != &req->hdr; hdr = hdr->next)
+    {
+      if ((hdr->type == PJSIP_H_VIA) ||
+          (hdr->type == PJSIP_H_FROM) ||
+          (hdr->type == PJSIP_H_TO) ||
+          (hdr->type == PJSIP_H_CALL_ID) ||
+          (hdr->type == PJSIP_H_CSEQ))
+      {
+        pjsip_msg_add_hdr(rsp, (pjsip_hdr*)pjsip_hdr_clone(pool, hdr));
+      }
+    }
+
+    return rsp;
+  }
+
+  void cancel_fork(int fork_id, int st_code = 0, std::string reason = "")
+  {
+    _cancelled_forks.push_back(fork_id);
+  }
+
+  int send_request(pjsip_msg*& req)
+  {
+    int fork_id = _next_fork_id++;
+    sent(_sent_requests, fork_id, req);
+    return fork_id;
+  }
+
+  void send_response(pjsip_msg*& rsp)
+  {
+    sent(_sent_responses, -1, rsp);
+  }
+
+  void reject(pjsip_msg*& req,
+              pjsip_status_code status_code,
+              const std::string& status_text="")
+  {
+    sent_reject(status_code, status_text, 0);
+    free_msg(req);
+  }
+
+  void redirect(pjsip_msg*& req,
+                pjsip_status_code status_code,
+                const std::vector<pjsip_uri*>& contacts,
+                const std::string& status_text="")
+  {
+    sent_reject(status_code, status_text, contacts.size());
+    free_msg(req);
+  }
+
+  void free_msg(pjsip_msg*& msg)
+  {
+    release(msg);
+    msg = NULL;
+  }
+
+  pj_pool_t* get_pool(const pjsip_msg* msg)
+  {
+    std::unordered_map<const pjsip_msg*, pj_pool_t*>::const_iterator ii =
+                                                              _pools.find(msg);
+    return (ii != _pools.end()) ? ii->second : NULL;
+  }
+
+  bool schedule_timer(void* context, TimerID& id, int duration)
+  {
+    return _timers.schedule(_tsx, context, id, duration);
+  }
+
+  void cancel_timer(TimerID id) { _timers.cancel(id); }
+
+  bool timer_running(TimerID id) { return _timers.running(id); }
+
+  SAS::TrailId trail() const { return _trail; }
+
+  AsyncHandle suspend()
+  {
+    std::shared_ptr<Resumer> resumer(new Resumer());
+    _resumers.push_back(resumer);
+    return AsyncHandle(resumer);
+  }
+
+private:
+  /// Records a resume of a suspension, which may come from any thread.
+  class Resumer : public AsyncResumer
+  {
+  public:
+    Resumer() : _lock(), _state(SUSPENDED), _context(NULL) {}
+
+    bool resume(void* context)
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      if (_state != SUSPENDED)
+      {
+        return false;
+      }
+
+      _state = RESUMED;
+      _context = context;
+      return true;
+    }
+
+    /// Returns true, with the context, if the suspension has been resumed.
+    bool resumed(void*& context)
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      context = _context;
+      return (_state == RESUMED);
+    }
+
+    /// Marks the suspension as finished, so later resumes have no effect.
+    void take()
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      _state = FINISHED;
+    }
+
+  private:
+    enum State {SUSPENDED, RESUMED, FINISHED};
+
+    std::mutex _lock;
+    State _state;
+    void* _context;
+  };
+
+  pj_pool_t* create_pool()
+  {
+    ++_msgs_created;
+    return pj_pool_create(_factory, "fakeas", 1024, 1024, NULL);
+  }
+
+  /// Sets the dialog of the transaction, taking over a reference to the
+  /// interned identifier.
+  void set_dialog(DialogId handle)
+  {
+    DialogIdTable::instance().release(_dialog_handle);
+    _dialog_handle = handle;
+    _dialog_id = DialogIdTable::instance().str(handle);
+  }
+
+  /// Copies a message into a new pool, tracking the pool.
+  pjsip_msg* copy(const pjsip_msg* msg)
+  {
+    pj_pool_t* pool = create_pool();
+    pjsip_msg* clone = pjsip_msg_clone(pool, msg);
+    _pools[clone] = pool;
+    return clone;
+  }
+
+  /// Releases the pool of a message.
+  void release(const pjsip_msg* msg)
+  {
+    std::unordered_map<const pjsip_msg*, pj_pool_t*>::iterator ii =
+                                                              _pools.find(msg);
+    if (ii != _pools.end())
+    {
+      pj_pool_t* pool = ii->second;
+      _pools.erase(ii);
+      ++_msgs_freed;
+      uint64_t used = pj_pool_get_used_size(pool);
+      _pool_bytes += used;
+      if (used > _max_msg_pool_bytes)
+      {
+        _max_msg_pool_bytes = used;
+      }
+
+      if (_deferred_msgs.erase(msg) > 0)
+      {
+        // Other messages may still refer to this message, so keep its
+        // memory until the end of the transaction.
+        _deferred_pools.push_back(pool);
+      }
+      else
+      {
+        pj_pool_release(pool);
+      }
+    }
+  }
+
+  /// Records a sent message, taking ownership of it.
+  void sent(std::vector<SentMsg>& record, int fork_id, pjsip_msg*& msg)
+  {
+    if (_keep_sent)
+    {
+      SentMsg sent = {fork_id, msg};
+      record.push_back(sent);
+    }
+    else
+    {
+      release(msg);
+    }
+    msg = NULL;
+  }
+
+  /// Records a response sent by reject or redirect.
+  void sent_reject(int status_code, const std::string& status_text, size_t num_contacts)
+  {
+    if (_keep_sent)
+    {
+      SentReject sent = {status_code, status_text, num_contacts};
+      _sent_rejects.push_back(sent);
+    }
+  }
+
+  pj_pool_factory* _factory;
+  bool _keep_sent;
+  AppServerTsx* _tsx;
+  pjsip_msg* _original;
+  std::unordered_map<const pjsip_msg*, pj_pool_t*> _pools;
+  std::unordered_set<const pjsip_msg*> _deferred_msgs;
+  std::vector<pj_pool_t*> _deferred_pools;
+  std::string _dialog_id;
+  DialogId _dialog_handle;
+  SAS::TrailId _trail;
+  int _next_fork_id;
+  std::vector<SentMsg> _sent_requests;
+  std::vector<SentMsg> _sent_responses;
+  std::vector<SentReject> _sent_rejects;
+  std::vector<int> _cancelled_forks;
+  TimerWheel _timers;
+  uint64_t _timers_now;
+  std::vector<std::shared_ptr<Resumer> > _resumers;
+  uint64_t _msgs_created;
+  uint64_t _msgs_freed;
+  uint64_t _leaked;
+  uint64_t _pool_bytes;
+  uint64_t _max_msg_pool_bytes;
+};
+
+#endif
@@ -0,0 +1,216 @@
+/**
+ * @file fork_aggregator_test.cpp UT for fork response aggregation.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "sip_common.hpp"
+#include "pjutils.h"
+#include "fork_aggregator.h"
+#include "dummyappserver.hpp"
+#include "fakeappserver.hpp"
+
+using namespace std;
+using AS::Message;
+
+/// AppServerTsx that forks the request to three targets and aggregates the
+/// responses.
+class AggregatingForkASTsx : public ForkAggregatorTsx
+{
+public:
+  AggregatingForkASTsx(const ResponseSelector* selector = NULL) :
+    ForkAggregatorTsx(selector) {}
+
+  void on_initial_request(pjsip_msg* req)
+  {
+    pj_pool_t* pool = get_pool(req);
+    std::vector<ForkTarget> targets;
+    targets.push_back(ForkTarget(PJUtils::uri_from_string("sip:alice@example.com", pool)));
+    targets.push_back(ForkTarget(PJUtils::uri_from_string("sip:bob@example.com", pool)));
+    targets.push_back(ForkTarget(PJUtils::uri_from_string("sip:carol@example.com", pool)));
+    std::vector<int> fork_ids;
+    fork_requests(req, targets, fork_ids);
+  }
+
+  void cancel_all() { cancel_pending_forks(); }
+
+  using ForkAggregatorTsx::terminated;
+};
+
+/// Fixture for ForkAggregatorTest.
+class ForkAggregatorTest : public SipCommonTest
+{
+public:
+  ForkAggregatorTest() :
+    SipCommonTest(),
+    _helper(_pool->factory)
+  {
+  }
+
+  /// Starts a transaction on the helper.
+  void start(AppServerTsx* tsx)
+  {
+    Message msg;
+    msg._method = "INVITE";
+    tsx->on_initial_request(_helper.start(tsx, parse_msg(msg.get_request())));
+    ASSERT_EQ(3u, _helper.sent_requests().size());
+  }
+
+  /// Passes a response with the specified status to the AppServerTsx.
+  void respond(AppServerTsx* tsx, const string& status, int fork_id)
+  {
+    Message msg;
+    msg._method = "INVITE";
+    msg._status = status;
+    tsx->on_response(_helper.receive(parse_msg(msg.get_response())), fork_id);
+  }
+
+  int sent_status(size_t index)
+  {
+    return _helper.sent_responses()[index].msg->line.status.code;
+  }
+
+  FakeAppServerTsxHelper _helper;
+};
+
+
+/// Test the default policy chooses the best response once all forks have
+/// failed, without keeping the others.
+TEST_F(ForkAggregatorTest, BestResponse)
+{
+  AggregatingForkASTsx tsx;
+  start(&tsx);
+
+  respond(&tsx, "100 Trying", 0);
+  respond(&tsx, "180 Ringing", 1);
+  ASSERT_EQ(1u, _helper.sent_responses().size());
+  EXPECT_EQ(180, sent_status(0));
+
+  respond(&tsx, "480 Temporarily Unavailable", 1);
+  respond(&tsx, "503 Service Unavailable", 0);
+  EXPECT_EQ(1u, _helper.sent_responses().size());
+
+  respond(&tsx, "486 Busy Here", 2);
+  ASSERT_EQ(2u, _helper.sent_responses().size());
+  EXPECT_EQ(480, sent_status(1));
+  EXPECT_TRUE(_helper.cancelled_forks().empty());
+
+  _helper.finish();
+  EXPECT_EQ(0u, _helper.msgs_leaked());
+}
+
+
+/// Test that a preference selector changes the response chosen.
+TEST_F(ForkAggregatorTest, PreferenceSelector)
+{
+  std::vector<int> preferred;
+  preferred.push_back(PJSIP_SC_BUSY_HERE);
+  PreferenceSelector selector(preferred);
+  AggregatingForkASTsx tsx(&selector);
+  start(&tsx);
+
+  respond(&tsx, "480 Temporarily Unavailable", 0);
+  respond(&tsx, "486 Busy Here", 1);
+  respond(&tsx, "404 Not Found", 2);
+  ASSERT_EQ(1u, _helper.sent_responses().size());
+  EXPECT_EQ(486, sent_status(0));
+
+  _helper.finish();
+  EXPECT_EQ(0u, _helper.msgs_leaked());
+}
+
+
+/// Test that a 2xx is forwarded immediately and the other pending forks
+/// are cancelled in one batch, and their later responses absorbed.
+TEST_F(ForkAggregatorTest, Terminate)
+{
+  AggregatingForkASTsx tsx;
+  start(&tsx);
+
+  respond(&tsx, "486 Busy Here", 0);
+  respond(&tsx, "200 OK", 1);
+  ASSERT_EQ(1u, _helper.sent_responses().size());
+  EXPECT_EQ(200, sent_status(0));
+  ASSERT_EQ(1u, _helper.cancelled_forks().size());
+  EXPECT_EQ(2, _helper.cancelled_forks()[0]);
+
+  respond(&tsx, "487 Request Terminated", 2);
+  EXPECT_EQ(1u, _helper.sent_responses().size());
+
+  _helper.finish();
+  EXPECT_EQ(0u, _helper.msgs_leaked());
+}
+
+
+/// Test that a 2xx on a fork that answers after another fork has answered
+/// is still forwarded, so the caller can ACK and release that callee too.
+TEST_F(ForkAggregatorTest, MultipleAnswers)
+{
+  AggregatingForkASTsx tsx;
+  start(&tsx);
+
+  respond(&tsx, "200 OK", 0);
+  ASSERT_EQ(1u, _helper.sent_responses().size());
+  EXPECT_EQ(2u, _helper.cancelled_forks().size());
+
+  // The CANCEL crosses with a 200 OK from a second fork, which must be
+  // forwarded rather than absorbed.
+  respond(&tsx, "200 OK", 1);
+  ASSERT_EQ(2u, _helper.sent_responses().size());
+  EXPECT_EQ(200, sent_status(1));
+
+  // Failure responses on the cancelled forks are still absorbed.
+  respond(&tsx, "487 Request Terminated", 2);
+  EXPECT_EQ(2u, _helper.sent_responses().size());
+
+  _helper.finish();
+  EXPECT_EQ(0u, _helper.msgs_leaked());
+}
+
+
+/// Test that a 2xx on a fork that the service cancelled before the
+/// transaction was answered is forwarded, and answers the transaction.
+TEST_F(ForkAggregatorTest, AnswerAfterCancel)
+{
+  AggregatingForkASTsx tsx;
+  start(&tsx);
+
+  tsx.cancel_all();
+  EXPECT_EQ(3u, _helper.cancelled_forks().size());
+
+  respond(&tsx, "487 Request Terminated", 0);
+  respond(&tsx, "200 OK", 1);
+  ASSERT_EQ(1u, _helper.sent_responses().size());
+  EXPECT_EQ(200, sent_status(0));
+  EXPECT_TRUE(tsx.terminated());
+
+  respond(&tsx, "487 Request Terminated", 2);
+  EXPECT_EQ(1u, _helper.sent_responses().size());
+
+  _helper.finish();
+  EXPECT_EQ(0u, _helper.msgs_leaked());
+}
+
+
+/// Test the default selection policy.
+TEST(ResponseSelectorTest, Default)
+{
+  ResponseSelector selector;
+  EXPECT_TRUE(selector.terminates(200));
+  EXPECT_TRUE(selector.terminates(603));
+  EXPECT_FALSE(selector.terminates(486));
+  EXPECT_TRUE(selector.better(302, 404));
+  EXPECT_TRUE(selector.better(404, 486));
+  EXPECT_TRUE(selector.better(486, 503));
+  EXPECT_FALSE(selector.better(503, 480));
+  EXPECT_TRUE(selector.better(603, 302));
+}
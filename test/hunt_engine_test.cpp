@@ -0,0 +1,248 @@
+/**
+ * @file hunt_engine_test.cpp UT for serial hunting.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "sip_common.hpp"
+#include "pjutils.h"
+#include "hunt_engine.h"
+#include "dummyappserver.hpp"
+#include "fakeappserver.hpp"
+
+using namespace std;
+using AS::Message;
+
+/// Fixture for HuntEngineTest.
+class HuntEngineTest : public SipCommonTest
+{
+public:
+  HuntEngineTest() :
+    SipCommonTest(),
+    _helper(_pool->factory),
+    _now(0)
+  {
+  }
+
+  /// Builds a plan of targets with the specified timeouts.
+  void add_targets(HuntPlan& plan, int timeout_ms, int weight = 1)
+  {
+    plan.add_target(PJUtils::uri_from_string("sip:alice@example.com", _pool), timeout_ms, weight);
+    plan.add_target(PJUtils::uri_from_string("sip:bob@example.com", _pool), timeout_ms, weight);
+    plan.add_target(PJUtils::uri_from_string("sip:carol@example.com", _pool), timeout_ms, weight);
+  }
+
+  void start(AppServerTsx* tsx)
+  {
+    Message msg;
+    msg._method = "INVITE";
+    tsx->on_initial_request(_helper.start(tsx, parse_msg(msg.get_request())));
+  }
+
+  void respond(AppServerTsx* tsx, const string& status, int fork_id)
+  {
+    Message msg;
+    msg._method = "INVITE";
+    msg._status = status;
+    tsx->on_response(_helper.receive(parse_msg(msg.get_response())), fork_id);
+  }
+
+  void advance(int ms)
+  {
+    _now += ms;
+    _helper.advance_time(_now);
+  }
+
+  string target(size_t index)
+  {
+    return PJUtils::uri_to_string(PJSIP_URI_IN_REQ_URI,
+                                  _helper.sent_requests()[index].msg->line.req.uri);
+  }
+
+  int sent_status()
+  {
+    EXPECT_EQ(1u, _helper.sent_responses().size());
+    return _helper.sent_responses().back().msg->line.status.code;
+  }
+
+  FakeAppServerTsxHelper _helper;
+  uint64_t _now;
+};
+
+
+/// Test a hunt that moves on after a busy response and a timeout, and is
+/// answered by the last target.
+TEST_F(HuntEngineTest, Answered)
+{
+  HuntPlan plan;
+  add_targets(plan, 1000);
+  HuntAppServerTsx tsx(&plan);
+  start(&tsx);
+
+  ASSERT_EQ(1u, _helper.sent_requests().size());
+  EXPECT_EQ("sip:alice@example.com", target(0));
+  EXPECT_EQ(1u, _helper.timers_running());
+
+  respond(&tsx, "486 Busy Here", 0);
+  ASSERT_EQ(2u, _helper.sent_requests().size());
+  EXPECT_EQ("sip:bob@example.com", target(1));
+
+  advance(999);
+  EXPECT_EQ(2u, _helper.sent_requests().size());
+  advance(1);
+  ASSERT_EQ(3u, _helper.sent_requests().size());
+  EXPECT_EQ("sip:carol@example.com", target(2));
+  ASSERT_EQ(1u, _helper.cancelled_forks().size());
+  EXPECT_EQ(1, _helper.cancelled_forks()[0]);
+
+  // The response to the cancelled fork is absorbed.
+  respond(&tsx, "487 Request Terminated", 1);
+  EXPECT_EQ(0u, _helper.sent_responses().size());
+
+  respond(&tsx, "200 OK", 2);
+  EXPECT_EQ(200, sent_status());
+  EXPECT_EQ(0u, _helper.timers_running());
+
+  _helper.finish();
+  EXPECT_EQ(0u, _helper.msgs_leaked());
+}
+
+
+/// Test that a target that answers just after its timeout has expired is
+/// connected, rather than its 200 OK being dropped while the hunt rings the
+/// next target.
+TEST_F(HuntEngineTest, AnswerRacesTimeout)
+{
+  HuntPlan plan;
+  add_targets(plan, 1000);
+  HuntAppServerTsx tsx(&plan);
+  start(&tsx);
+
+  advance(1000);
+  ASSERT_EQ(2u, _helper.sent_requests().size());
+  ASSERT_EQ(1u, _helper.cancelled_forks().size());
+  EXPECT_EQ(0, _helper.cancelled_forks()[0]);
+  EXPECT_EQ(1u, _helper.timers_running());
+
+  // The first target's 200 OK crosses with the CANCEL.
+  respond(&tsx, "200 OK", 0);
+  EXPECT_EQ(200, sent_status());
+  ASSERT_EQ(2u, _helper.cancelled_forks().size());
+  EXPECT_EQ(1, _helper.cancelled_forks()[1]);
+  EXPECT_EQ(0u, _helper.timers_running());
+
+  // The hunt is over, so the second target's response is absorbed and no
+  // more targets are tried.
+  respond(&tsx, "487 Request Terminated", 1);
+  advance(1000);
+  EXPECT_EQ(1u, _helper.sent_responses().size());
+  EXPECT_EQ(2u, _helper.sent_requests().size());
+
+  _helper.finish();
+  EXPECT_EQ(0u, _helper.msgs_leaked());
+}
+
+
+/// Test that the best response is forwarded if every target fails.
+TEST_F(HuntEngineTest, AllFailed)
+{
+  HuntPlan plan;
+  add_targets(plan, 0);
+  HuntAppServerTsx tsx(&plan);
+  start(&tsx);
+
+  respond(&tsx, "486 Busy Here", 0);
+  respond(&tsx, "404 Not Found", 1);
+  respond(&tsx, "503 Service Unavailable", 2);
+  EXPECT_EQ(3u, _helper.sent_requests().size());
+  EXPECT_EQ(404, sent_status());
+
+  _helper.finish();
+  EXPECT_EQ(0u, _helper.msgs_leaked());
+}
+
+
+/// Test that a 480 is sent if every target times out.
+TEST_F(HuntEngineTest, AllTimedOut)
+{
+  HuntPlan plan;
+  add_targets(plan, 500);
+  HuntAppServerTsx tsx(&plan);
+  start(&tsx);
+
+  advance(500);
+  advance(500);
+  EXPECT_EQ(0u, _helper.sent_responses().size());
+  advance(500);
+  EXPECT_EQ(3u, _helper.sent_requests().size());
+  EXPECT_EQ(3u, _helper.cancelled_forks().size());
+  EXPECT_EQ(480, sent_status());
+
+  _helper.finish();
+  EXPECT_EQ(0u, _helper.msgs_leaked());
+}
+
+
+/// Test that a weighted plan never tries a zero-weight target before a
+/// weighted one, and tries every target.
+TEST_F(HuntEngineTest, Weighted)
+{
+  HuntPlan plan(true);
+  plan.add_target(PJUtils::uri_from_string("sip:alice@example.com", _pool), 0, 0);
+  plan.add_target(PJUtils::uri_from_string("sip:bob@example.com", _pool), 0, 1);
+  HuntAppServerTsx tsx(&plan);
+  start(&tsx);
+
+  ASSERT_EQ(1u, _helper.sent_requests().size());
+  EXPECT_EQ("sip:bob@example.com", target(0));
+  respond(&tsx, "486 Busy Here", 0);
+  ASSERT_EQ(2u, _helper.sent_requests().size());
+  EXPECT_EQ("sip:alice@example.com", target(1));
+  respond(&tsx, "486 Busy Here", 1);
+  EXPECT_EQ(486, sent_status());
+
+  _helper.finish();
+  EXPECT_EQ(0u, _helper.msgs_leaked());
+}
+
+
+/// Test that a weighted plan can order more targets than fit in 16 bits.
+TEST_F(HuntEngineTest, WeightedLargePlan)
+{
+  const int NUM_TARGETS = 70000;
+  HuntPlan plan(true);
+  pjsip_uri* alice = PJUtils::uri_from_string("sip:alice@example.com", _pool);
+  for (int ii = 0; ii < NUM_TARGETS - 1; ++ii)
+  {
+    plan.add_target(alice, 0, 0);
+  }
+  plan.add_target(PJUtils::uri_from_string("sip:bob@example.com", _pool), 0, 1);
+  HuntAppServerTsx tsx(&plan);
+  start(&tsx);
+
+  ASSERT_EQ(1u, _helper.sent_requests().size());
+  EXPECT_EQ("sip:bob@example.com", target(0));
+  respond(&tsx, "200 OK", 0);
+  EXPECT_EQ(200, sent_status());
+
+  _helper.finish();
+  EXPECT_EQ(0u, _helper.msgs_leaked());
+}
+
+
+/// Test that targets with negative weights are rejected.
+TEST_F(HuntEngineTest, NegativeWeight)
+{
+  HuntPlan plan(true);
+  EXPECT_THROW(plan.add_target(PJUtils::uri_from_string("sip:alice@example.com", _pool), 0, -1),
+               std::invalid_argument);
+  EXPECT_EQ(0u, plan.size());
+}
@@ -34,6 +34,7 @@ public:
   MOCK_METHOD1(add_to_dialog, void(const std::string&));
   MOCK_METHOD1(clone_request, pjsip_msg*(pjsip_msg*));
   MOCK_METHOD1(clone_msg, pjsip_msg*(pjsip_msg*));
+  MOCK_METHOD2(create_request, pjsip_msg*(const RequestTemplate&, const RequestTemplate::Values&));
   MOCK_METHOD3(create_response, pjsip_msg*(pjsip_msg*, pjsip_status_code, const std::string&));
   MOCK_METHOD1(send_request, int(pjsip_msg*&));
   MOCK_METHOD1(send_response, void(pjsip_msg*&));
@@ -0,0 +1,222 @@
+/**
+ * @file request_template_test.cpp UT for request templates.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "sip_common.hpp"
+#include "pjutils.h"
+#include "dummyappserver.hpp"
+#include "fakeappserver.hpp"
+#include "request_template.h"
+
+using namespace std;
+using AS::Message;
+
+/// The template of a click-to-dial INVITE.
+static const char* C2D_TEMPLATE =
+  "INVITE sip:callee@homedomain SIP/2.0\r\n"
+  "Via: SIP/2.0/TCP 10.114.61.213;branch=z9hG4bK0123456789abcdef\r\n"
+  "From: <sip:caller@homedomain>;tag=template\r\n"
+  "To: <sip:callee@homedomain>\r\n"
+  "Max-Forwards: 70\r\n"
+  "Call-ID: template\r\n"
+  "CSeq: 1 INVITE\r\n"
+  "Contact: <sip:c2d@10.114.61.213:5058;transport=tcp>\r\n"
+  "Content-Length: 0\r\n\r\n";
+
+/// Fixture for RequestTemplateTest.
+///
+/// This derives from SipCommonTest to ensure PJSIP is set up correctly.
+class RequestTemplateTest : public SipCommonTest
+{
+public:
+  RequestTemplateTest() :
+    SipCommonTest(),
+    _tmpl(_pool->factory)
+  {
+    EXPECT_TRUE(_tmpl.parse(C2D_TEMPLATE));
+  }
+
+  static std::string uri(pjsip_uri* uri)
+  {
+    return PJUtils::uri_to_string(PJSIP_URI_IN_REQ_URI, uri);
+  }
+
+  RequestTemplate _tmpl;
+};
+
+
+/// AppServerTsx that originates a request from a template to the user in
+/// the Request-URI of the request it receives, and answers the received
+/// request.
+class C2DASTsx : public AppServerTsx
+{
+public:
+  C2DASTsx(const RequestTemplate& tmpl) : AppServerTsx(), _tmpl(tmpl) {}
+
+  void on_initial_request(pjsip_msg* req)
+  {
+    RequestTemplate::Values values;
+    values.request_uri = req->line.req.uri;
+    values.to_uri = req->line.req.uri;
+    values.call_id = pj_str((char*)"c2d-1");
+    values.cseq = 7;
+    pjsip_msg* c2d = create_request(_tmpl, values);
+    send_request(c2d);
+
+    pjsip_msg* rsp = create_response(req, PJSIP_SC_OK);
+    send_response(rsp);
+    free_msg(req);
+  }
+
+  const RequestTemplate& _tmpl;
+};
+
+
+/// Test that the slots are filled in and the rest of the request comes from
+/// the template, which is left unchanged.
+TEST_F(RequestTemplateTest, Instantiate)
+{
+  pjsip_uri* callee = PJUtils::uri_from_string("sip:6505551234@homedomain", _pool);
+  pjsip_uri* caller = PJUtils::uri_from_string("sip:6505550000@homedomain", _pool);
+
+  RequestTemplate::Values values;
+  values.request_uri = callee;
+  values.from_uri = caller;
+  values.from_tag = pj_str((char*)"tag-1");
+  values.to_uri = callee;
+  values.call_id = pj_str((char*)"call-1");
+  values.cseq = 42;
+
+  pjsip_msg* req = pjsip_msg_create(_pool, PJSIP_REQUEST_MSG);
+  _tmpl.instantiate(_pool, req, values);
+
+  EXPECT_EQ(PJSIP_INVITE_METHOD, req->line.req.method.id);
+  EXPECT_EQ("sip:6505551234@homedomain", uri(req->line.req.uri));
+  EXPECT_EQ("sip:6505550000@homedomain", uri(PJSIP_MSG_FROM_HDR(req)->uri));
+  EXPECT_EQ("tag-1", PJUtils::pj_str_to_string(&PJSIP_MSG_FROM_HDR(req)->tag));
+  EXPECT_EQ("sip:6505551234@homedomain", uri(PJSIP_MSG_TO_HDR(req)->uri));
+  EXPECT_EQ(0, PJSIP_MSG_TO_HDR(req)->tag.slen);
+  EXPECT_EQ("call-1", PJUtils::pj_str_to_string(&PJSIP_MSG_CID_HDR(req)->id));
+  EXPECT_EQ(42, PJSIP_MSG_CSEQ_HDR(req)->cseq);
+
+  // The other headers are shallow copies of the template's.
+  pjsip_contact_hdr* contact =
+    (pjsip_contact_hdr*)pjsip_msg_find_hdr(req, PJSIP_H_CONTACT, NULL);
+  const pjsip_contact_hdr* tmpl_contact =
+    (const pjsip_contact_hdr*)pjsip_msg_find_hdr(_tmpl.msg(), PJSIP_H_CONTACT, NULL);
+  ASSERT_TRUE(contact != NULL);
+  EXPECT_NE(tmpl_contact, contact);
+  EXPECT_EQ(tmpl_contact->uri, contact->uri);
+  EXPECT_TRUE(pjsip_msg_find_hdr(req, PJSIP_H_MAX_FORWARDS, NULL) != NULL);
+
+  // The template is unchanged.
+  const pjsip_msg* tmpl = _tmpl.msg();
+  EXPECT_EQ("sip:callee@homedomain", uri(tmpl->line.req.uri));
+  EXPECT_EQ("template", PJUtils::pj_str_to_string(&PJSIP_MSG_FROM_HDR(tmpl)->tag));
+  EXPECT_EQ("template", PJUtils::pj_str_to_string(&PJSIP_MSG_CID_HDR(tmpl)->id));
+  EXPECT_EQ(1, PJSIP_MSG_CSEQ_HDR(tmpl)->cseq);
+}
+
+
+/// Test that each request gets its own body structure, sharing the text of
+/// the template's body, and that editing the body does not change the
+/// template.
+TEST_F(RequestTemplateTest, Body)
+{
+  RequestTemplate tmpl(_pool->factory);
+  ASSERT_TRUE(tmpl.parse("MESSAGE sip:callee@homedomain SIP/2.0\r\n"
+                         "From: <sip:caller@homedomain>;tag=template\r\n"
+                         "To: <sip:callee@homedomain>\r\n"
+                         "Call-ID: template\r\n"
+                         "CSeq: 1 MESSAGE\r\n"
+                         "Content-Type: text/plain\r\n"
+                         "Content-Length: 5\r\n\r\n"
+                         "hello"));
+  const pjsip_msg_body* tmpl_body = tmpl.msg()->body;
+  ASSERT_TRUE(tmpl_body != NULL);
+
+  RequestTemplate::Values values;
+  pjsip_msg* req1 = pjsip_msg_create(_pool, PJSIP_REQUEST_MSG);
+  tmpl.instantiate(_pool, req1, values);
+  pjsip_msg* req2 = pjsip_msg_create(_pool, PJSIP_REQUEST_MSG);
+  tmpl.instantiate(_pool, req2, values);
+
+  ASSERT_TRUE(req1->body != NULL);
+  EXPECT_NE(tmpl_body, req1->body);
+  EXPECT_NE(req1->body, req2->body);
+  EXPECT_EQ(tmpl_body->data, req1->body->data);
+  EXPECT_EQ(5u, req1->body->len);
+
+  BodyEditor editor(_pool, req1);
+  editor.replace(BodyView::slice((char*)req1->body->data, 5),
+                 pj_str((char*)"bye"));
+  EXPECT_TRUE(editor.apply(false));
+  EXPECT_EQ("bye", std::string((char*)req1->body->data, req1->body->len));
+  EXPECT_EQ("hello", std::string((char*)tmpl_body->data, tmpl_body->len));
+  EXPECT_EQ(5u, req2->body->len);
+}
+
+
+/// Test that slots that are not set keep the template's values.
+TEST_F(RequestTemplateTest, Defaults)
+{
+  RequestTemplate::Values values;
+  values.call_id = pj_str((char*)"call-2");
+
+  pjsip_msg* req = pjsip_msg_create(_pool, PJSIP_REQUEST_MSG);
+  _tmpl.instantiate(_pool, req, values);
+
+  EXPECT_EQ("sip:callee@homedomain", uri(req->line.req.uri));
+  EXPECT_EQ("sip:caller@homedomain", uri(PJSIP_MSG_FROM_HDR(req)->uri));
+  EXPECT_EQ("template", PJUtils::pj_str_to_string(&PJSIP_MSG_FROM_HDR(req)->tag));
+  EXPECT_EQ("call-2", PJUtils::pj_str_to_string(&PJSIP_MSG_CID_HDR(req)->id));
+  EXPECT_EQ(1, PJSIP_MSG_CSEQ_HDR(req)->cseq);
+}
+
+
+/// Test that templates that are not complete requests are rejected.
+TEST_F(RequestTemplateTest, ParseErrors)
+{
+  Message msg;
+  RequestTemplate tmpl(_pool->factory);
+  EXPECT_FALSE(tmpl.parse(msg.get_response()));
+  EXPECT_FALSE(tmpl.parse("INVITE sip:callee@homedomain SIP/2.0\r\n"
+                          "Content-Length: 0\r\n\r\n"));
+  EXPECT_FALSE(tmpl.parse("not SIP"));
+  EXPECT_TRUE(tmpl.msg() == NULL);
+
+  EXPECT_TRUE(tmpl.parse(msg.get_request()));
+  EXPECT_TRUE(tmpl.msg() != NULL);
+}
+
+
+/// Test that a service can send a request created from a template through
+/// the helper.
+TEST_F(RequestTemplateTest, CreateRequest)
+{
+  Message msg;
+  pjsip_msg* req = parse_msg(msg.get_request());
+  FakeAppServerTsxHelper helper(_pool->factory);
+  C2DASTsx as_tsx(_tmpl);
+
+  as_tsx.on_initial_request(helper.start(&as_tsx, req));
+  ASSERT_EQ(1u, helper.sent_requests().size());
+  pjsip_msg* c2d = helper.sent_requests()[0].msg;
+  EXPECT_EQ(uri(req->line.req.uri), uri(c2d->line.req.uri));
+  EXPECT_EQ("c2d-1", PJUtils::pj_str_to_string(&PJSIP_MSG_CID_HDR(c2d)->id));
+  EXPECT_EQ(7, PJSIP_MSG_CSEQ_HDR(c2d)->cseq);
+  EXPECT_EQ("sip:caller@homedomain", uri(PJSIP_MSG_FROM_HDR(c2d)->uri));
+
+  helper.finish();
+  EXPECT_EQ(0u, helper.msgs_leaked());
+}
@@ -0,0 +1,77 @@
+/**
+ * @file route_classifier_bench.cpp Benchmarks for compiled request routing
+ * rules.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include <vector>
+#include "benchmark/benchmark.h"
+
+#include "route_classifier.h"
+
+/// The number of users to look up, cycled through by each benchmark.
+static const int NUM_USERS = 4096;
+
+/// Builds a number-range table of the specified size, with prefixes of 4 to
+/// 8 digits, and a set of 10 digit users to look up.
+static void build_table(int num_rules,
+                        std::vector<RouteRule>& rules,
+                        std::vector<std::string>& users)
+{
+  uint32_t seed = 1;
+
+  for (int ii = 0; ii < num_rules; ++ii)
+  {
+    seed = seed * 1103515245 + 12345;
+    std::string prefix = std::to_string(10000000 + seed % 90000000);
+    prefix.resize(4 + (seed >> 24) % 5);
+    rules.push_back(RouteRule((ii % 10 == 0) ? "MESSAGE" : "", prefix, ii));
+  }
+
+  for (int ii = 0; ii < NUM_USERS; ++ii)
+  {
+    seed = seed * 1103515245 + 12345;
+    users.push_back(std::to_string(1000000000 + seed % 9000000000ULL));
+  }
+}
+
+
+/// Classify INVITEs against number-range tables of increasing size.
+static void BM_Classify(benchmark::State& state)
+{
+  std::vector<RouteRule> rules;
+  std::vector<std::string> users;
+  build_table(state.range(0), rules, users);
+  RouteClassifier classifier(rules);
+
+  pj_str_t method;
+  method.ptr = (char*)"INVITE";
+  method.slen = 6;
+
+  std::vector<pj_str_t> user_strs(NUM_USERS);
+  for (int ii = 0; ii < NUM_USERS; ++ii)
+  {
+    user_strs[ii].ptr = (char*)users[ii].data();
+    user_strs[ii].slen = users[ii].size();
+  }
+
+  int ii = 0;
+  for (auto _ : state)
+  {
+    benchmark::DoNotOptimize(classifier.classify(method, user_strs[ii]));
+    ii = (ii + 1) % NUM_USERS;
+  }
+
+  state.counters["table_bytes"] = classifier.memory_bytes();
+}
+BENCHMARK(BM_Classify)->Arg(100)->Arg(10000)->Arg(100000)->Arg(1000000);
+
+
+BENCHMARK_MAIN();
@@ -0,0 +1,119 @@
+/**
+ * @file route_classifier_test.cpp UT for compiled request routing rules.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "route_classifier.h"
+
+using namespace std;
+
+static pj_str_t str(const string& s)
+{
+  pj_str_t ret;
+  ret.ptr = (char*)s.data();
+  ret.slen = s.size();
+  return ret;
+}
+
+static int classify(const RouteClassifier& classifier,
+                    const string& method,
+                    const string& user)
+{
+  return classifier.classify(str(method), str(user));
+}
+
+
+/// Test that the longest matching prefix wins.
+TEST(RouteClassifierTest, LongestPrefix)
+{
+  vector<RouteRule> rules;
+  rules.push_back(RouteRule("", "650", 1));
+  rules.push_back(RouteRule("", "6505551", 2));
+  rules.push_back(RouteRule("", "+1650", 3));
+  RouteClassifier classifier(rules);
+
+  EXPECT_EQ(1, classify(classifier, "INVITE", "6505550000"));
+  EXPECT_EQ(2, classify(classifier, "INVITE", "6505551234"));
+  EXPECT_EQ(2, classify(classifier, "INVITE", "6505551"));
+  EXPECT_EQ(1, classify(classifier, "INVITE", "650555"));
+  EXPECT_EQ(3, classify(classifier, "INVITE", "+16505551234"));
+  EXPECT_EQ(RouteClassifier::NO_MATCH, classify(classifier, "INVITE", "65"));
+  EXPECT_EQ(RouteClassifier::NO_MATCH, classify(classifier, "INVITE", "alice"));
+  EXPECT_EQ(RouteClassifier::NO_MATCH, classify(classifier, "INVITE", ""));
+}
+
+
+/// Test method-specific rules, and their precedence over rules for any
+/// method.
+TEST(RouteClassifierTest, Methods)
+{
+  vector<RouteRule> rules;
+  rules.push_back(RouteRule("", "", 0));
+  rules.push_back(RouteRule("", "650", 1));
+  rules.push_back(RouteRule("MESSAGE", "650", 2));
+  rules.push_back(RouteRule("MESSAGE", "", 3));
+  rules.push_back(RouteRule("INVITE", "6505551", 4));
+  rules.push_back(RouteRule("INVITE", "6505551", 5));
+  RouteClassifier classifier(rules);
+
+  EXPECT_EQ(0, classify(classifier, "OPTIONS", "alice"));
+  EXPECT_EQ(1, classify(classifier, "OPTIONS", "6505551234"));
+  EXPECT_EQ(2, classify(classifier, "MESSAGE", "6505551234"));
+  EXPECT_EQ(3, classify(classifier, "MESSAGE", "alice"));
+  EXPECT_EQ(4, classify(classifier, "INVITE", "6505551234"));
+  EXPECT_EQ(1, classify(classifier, "INVITE", "6505550000"));
+  EXPECT_EQ(0, classify(classifier, "INVITE", "alice"));
+  EXPECT_EQ(1, classify(classifier, "INVITES", "6505551234"));
+}
+
+
+/// Test a large number-range table against a brute-force search.
+TEST(RouteClassifierTest, NumberRanges)
+{
+  vector<RouteRule> rules;
+  uint32_t seed = 1;
+  for (int ii = 0; ii < 100000; ++ii)
+  {
+    seed = seed * 1103515245 + 12345;
+    string prefix = to_string(seed % 100000000);
+    prefix.resize(4 + (seed >> 24) % 5);
+    rules.push_back(RouteRule("", prefix, ii));
+  }
+  RouteClassifier classifier(rules);
+
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    seed = seed * 1103515245 + 12345;
+    string user = to_string(1000000000 + seed % 1000000000);
+    if (ii % 2 == 0)
+    {
+      // Make sure some lookups match.
+      user = rules[seed % rules.size()].user_prefix + "1234";
+    }
+
+    int expected = RouteClassifier::NO_MATCH;
+    size_t expected_len = 0;
+    for (size_t jj = 0; jj < rules.size(); ++jj)
+    {
+      const string& prefix = rules[jj].user_prefix;
+      if ((user.compare(0, prefix.size(), prefix) == 0) &&
+          ((expected == RouteClassifier::NO_MATCH) || (prefix.size() > expected_len)))
+      {
+        expected = rules[jj].action;
+        expected_len = prefix.size();
+      }
+    }
+
+    EXPECT_EQ(expected, classify(classifier, "INVITE", user)) << user;
+  }
+}
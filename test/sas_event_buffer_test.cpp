@@ -0,0 +1,252 @@
+/**
+ * @file sas_event_buffer_test.cpp UT for batched SAS event reporting.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "sas_event_buffer.h"
+
+using namespace std;
+
+
+/// Test that events are held until the buffer is flushed or destroyed.
+TEST(SasEventBufferTest, FlushOnDestroy)
+{
+  LocalSasSink sink;
+  SasEventBuffer::Config config;
+  config.sink = &sink;
+
+  {
+    SasEventBuffer buffer(1, &config);
+    ASSERT_TRUE(buffer.event(10) != NULL);
+    buffer.event(11)->add_static_param(42);
+    EXPECT_EQ(2u, buffer.size());
+    EXPECT_TRUE(sink.batches().empty());
+
+    buffer.flush();
+    EXPECT_EQ(0u, buffer.size());
+    ASSERT_EQ(1u, sink.batches().size());
+    EXPECT_EQ(2u, sink.batches()[0]);
+
+    buffer.event(12);
+  }
+
+  ASSERT_EQ(2u, sink.batches().size());
+  EXPECT_EQ(1u, sink.batches()[1]);
+  EXPECT_EQ(3u, sink.events().size());
+}
+
+
+/// Test that a full buffer is flushed before the next event is added.
+TEST(SasEventBufferTest, Capacity)
+{
+  LocalSasSink sink;
+  SasEventBuffer::Config config;
+  config.sink = &sink;
+  config.capacity = 4;
+
+  {
+    SasEventBuffer buffer(1, &config);
+    for (uint32_t ii = 0; ii < 10; ++ii)
+    {
+      buffer.event(ii);
+    }
+    EXPECT_EQ(2u, buffer.size());
+  }
+
+  std::vector<size_t> batches = sink.batches();
+  ASSERT_EQ(3u, batches.size());
+  EXPECT_EQ(4u, batches[0]);
+  EXPECT_EQ(4u, batches[1]);
+  EXPECT_EQ(2u, batches[2]);
+}
+
+
+/// LocalSasSink that asks to be passed each event as it completes, like
+/// the default sink.
+class UnbatchedSasSink : public LocalSasSink
+{
+public:
+  bool batching() const { return false; }
+};
+
+
+/// Test that a sink that does not batch is passed each event once it is
+/// complete, whatever the configured capacity.
+TEST(SasEventBufferTest, Unbatched)
+{
+  UnbatchedSasSink sink;
+  SasEventBuffer::Config config;
+  config.sink = &sink;
+  config.capacity = 4;
+
+  {
+    SasEventBuffer buffer(1, &config);
+    buffer.event(10)->add_static_param(42);
+    EXPECT_EQ(1u, buffer.size());
+    EXPECT_TRUE(sink.batches().empty());
+
+    buffer.event(11);
+    EXPECT_EQ(1u, buffer.size());
+    ASSERT_EQ(1u, sink.batches().size());
+
+    buffer.flush_unbatched();
+    EXPECT_EQ(0u, buffer.size());
+    EXPECT_EQ(2u, sink.batches().size());
+
+    buffer.event(12);
+  }
+
+  std::vector<size_t> batches = sink.batches();
+  ASSERT_EQ(3u, batches.size());
+  EXPECT_EQ(1u, batches[0]);
+  EXPECT_EQ(1u, batches[1]);
+  EXPECT_EQ(1u, batches[2]);
+}
+
+
+/// LocalSasSink that counts the events passed to it one at a time.
+class CountingSasSink : public UnbatchedSasSink
+{
+public:
+  CountingSasSink() : _reported(0) {}
+
+  void report_event(SAS::Event& event)
+  {
+    ++_reported;
+    UnbatchedSasSink::report_event(event);
+  }
+
+  size_t reported() const { return _reported; }
+
+private:
+  size_t _reported;
+};
+
+
+/// Test that an event built by the caller goes straight to a sink that does
+/// not batch, after any event being built in the buffer.
+TEST(SasEventBufferTest, ReportUnbatched)
+{
+  CountingSasSink sink;
+  SasEventBuffer::Config config;
+  config.sink = &sink;
+
+  SasEventBuffer buffer(1, &config);
+  buffer.event(10);
+  SAS::Event event(1, 11, 0);
+  buffer.report(event);
+  EXPECT_EQ(0u, buffer.size());
+  EXPECT_EQ(1u, sink.reported());
+  EXPECT_EQ(2u, sink.batches().size());
+
+  buffer.report(event);
+  EXPECT_EQ(0u, buffer.size());
+  EXPECT_EQ(2u, sink.reported());
+  EXPECT_EQ(3u, sink.events().size());
+}
+
+
+/// Test that an event built by the caller is batched with the others when
+/// the sink batches, and dropped if it is an unsampled DETAIL event.
+TEST(SasEventBufferTest, ReportBatched)
+{
+  LocalSasSink sink;
+  SasEventBuffer::Config config;
+  config.sink = &sink;
+  config.capacity = 2;
+  config.detail_sample_one_in = 0;
+
+  {
+    SasEventBuffer buffer(1, &config);
+    SAS::Event event(1, 10, 0);
+    buffer.report(event);
+    buffer.report(event, SasEventBuffer::DETAIL);
+    buffer.event(11);
+    EXPECT_EQ(2u, buffer.size());
+    EXPECT_TRUE(sink.batches().empty());
+
+    buffer.report(event);
+    EXPECT_EQ(1u, buffer.size());
+  }
+
+  std::vector<size_t> batches = sink.batches();
+  ASSERT_EQ(2u, batches.size());
+  EXPECT_EQ(2u, batches[0]);
+  EXPECT_EQ(1u, batches[1]);
+}
+
+
+/// Test that flush_unbatched leaves batched events in the buffer.
+TEST(SasEventBufferTest, FlushUnbatchedWhenBatching)
+{
+  LocalSasSink sink;
+  SasEventBuffer::Config config;
+  config.sink = &sink;
+
+  SasEventBuffer buffer(1, &config);
+  buffer.event(10);
+  buffer.flush_unbatched();
+  EXPECT_EQ(1u, buffer.size());
+  EXPECT_TRUE(sink.batches().empty());
+}
+
+
+/// Test that an empty buffer reports nothing.
+TEST(SasEventBufferTest, Empty)
+{
+  LocalSasSink sink;
+  SasEventBuffer::Config config;
+  config.sink = &sink;
+
+  {
+    SasEventBuffer buffer(1, &config);
+    buffer.flush();
+  }
+
+  EXPECT_TRUE(sink.batches().empty());
+}
+
+
+/// Test that DETAIL events can be turned off, and are sampled consistently
+/// per trail.
+TEST(SasEventBufferTest, DetailSampling)
+{
+  LocalSasSink sink;
+  SasEventBuffer::Config config;
+  config.sink = &sink;
+  config.detail_sample_one_in = 0;
+
+  {
+    SasEventBuffer buffer(1, &config);
+    EXPECT_FALSE(buffer.enabled(SasEventBuffer::DETAIL));
+    EXPECT_TRUE(buffer.enabled(SasEventBuffer::NORMAL));
+    EXPECT_TRUE(buffer.event(10, 0, SasEventBuffer::DETAIL) == NULL);
+    EXPECT_TRUE(buffer.event(11, 0, SasEventBuffer::NORMAL) != NULL);
+  }
+  EXPECT_EQ(1u, sink.events().size());
+
+  config.detail_sample_one_in = 10;
+  int sampled = 0;
+  for (SAS::TrailId trail = 1; trail <= 10000; ++trail)
+  {
+    SasEventBuffer buffer(trail, &config);
+    SasEventBuffer again(trail, &config);
+    EXPECT_EQ(buffer.enabled(SasEventBuffer::DETAIL),
+              again.enabled(SasEventBuffer::DETAIL));
+    if (buffer.enabled(SasEventBuffer::DETAIL))
+    {
+      ++sampled;
+    }
+  }
+  EXPECT_LT(800, sampled);
+  EXPECT_GT(1200, sampled);
+}
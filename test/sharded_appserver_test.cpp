@@ -0,0 +1,242 @@
+/**
+ * @file sharded_appserver_test.cpp UT for per-worker AppServer replicas.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "sharded_appserver.h"
+
+using namespace std;
+
+/// Replica that counts its requests and records the threads it is used on.
+class CountingAppServer : public AppServer
+{
+public:
+  CountingAppServer(int index, int limit) :
+    AppServer("counting"),
+    _index(index),
+    _limit(limit),
+    _requests(0),
+    _thread(std::this_thread::get_id()),
+    _wrong_thread(false)
+  {
+  }
+
+  AppServerTsx* get_app_tsx(SproutletHelper* helper,
+                            pjsip_msg* req,
+                            pjsip_sip_uri*& next_hop,
+                            pj_pool_t* pool,
+                            SAS::TrailId trail)
+  {
+    check_thread();
+    ++_requests;
+    return NULL;
+  }
+
+  void set_limit(int limit)
+  {
+    check_thread();
+    _limit = limit;
+  }
+
+  void check_thread()
+  {
+    if (std::this_thread::get_id() != _thread)
+    {
+      _wrong_thread = true;
+    }
+  }
+
+  int _index;
+  int _limit;
+  int _requests;
+  std::thread::id _thread;
+  bool _wrong_thread;
+};
+
+/// Fixture for ShardedAppServerTest.
+class ShardedAppServerTest : public ::testing::Test
+{
+public:
+  ShardedAppServerTest() :
+    _limit(10),
+    _created(0),
+    _as("sharded", [this](int index) {
+      ++_created;
+      return new CountingAppServer(index, _limit);
+    })
+  {
+  }
+
+  /// Dispatches a request on the calling thread.
+  void dispatch()
+  {
+    pjsip_sip_uri* next_hop = NULL;
+    _as.get_app_tsx_on_worker(NULL, NULL, next_hop, NULL, 0, AppServerWorkerContext::current());
+  }
+
+  std::atomic<int> _limit;
+  std::atomic<int> _created;
+  ShardedAppServer<CountingAppServer> _as;
+};
+
+
+TEST_F(ShardedAppServerTest, ReplicaPerWorker)
+{
+  const int NUM_THREADS = 4;
+  const int NUM_REQUESTS = 1000;
+  std::vector<std::thread> threads;
+  std::vector<CountingAppServer*> replicas(NUM_THREADS);
+  std::atomic<int> done(0);
+  std::atomic<bool> stop(false);
+
+  // Keep the threads running until all have finished, so that none reuses
+  // another's worker index.
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    threads.push_back(std::thread([&, ii]() {
+      for (int jj = 0; jj < NUM_REQUESTS; ++jj)
+      {
+        dispatch();
+      }
+      AppServerWorkerContext& worker = AppServerWorkerContext::current();
+      replicas[ii] = &_as.local(worker);
+      ++done;
+      while (!stop)
+      {
+        std::this_thread::yield();
+      }
+    }));
+  }
+
+  while (done < NUM_THREADS)
+  {
+    std::this_thread::yield();
+  }
+  stop = true;
+
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    threads[ii].join();
+  }
+
+  EXPECT_EQ(NUM_THREADS, _created);
+  EXPECT_EQ((size_t)NUM_THREADS, _as.replicas());
+
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    EXPECT_EQ(NUM_REQUESTS, replicas[ii]->_requests);
+    EXPECT_FALSE(replicas[ii]->_wrong_thread);
+    for (int jj = 0; jj < ii; ++jj)
+    {
+      EXPECT_NE(replicas[ii], replicas[jj]);
+    }
+  }
+}
+
+
+TEST_F(ShardedAppServerTest, Broadcast)
+{
+  // There are no replicas to broadcast to yet.
+  EXPECT_EQ(0u, _as.broadcast([](CountingAppServer& replica) { replica.set_limit(0); }));
+
+  std::atomic<int> phase(0);
+  std::atomic<bool> ready(false);
+  std::atomic<bool> dispatched(false);
+  CountingAppServer* replica = NULL;
+
+  std::thread worker_thread([&]() {
+    dispatch();
+    replica = &_as.local(AppServerWorkerContext::current());
+    ready = true;
+
+    // Wait for the broadcast, which must not be run until this thread
+    // next calls into the service.
+    while (phase < 1)
+    {
+      std::this_thread::yield();
+    }
+    EXPECT_EQ(10, replica->_limit);
+    dispatch();
+    EXPECT_EQ(20, replica->_limit);
+    dispatched = true;
+
+    while (phase < 2)
+    {
+      std::this_thread::yield();
+    }
+    _as.process_broadcasts(AppServerWorkerContext::current());
+    EXPECT_EQ(40, replica->_limit);
+  });
+
+  while (!ready)
+  {
+    std::this_thread::yield();
+  }
+
+  EXPECT_EQ(1u, _as.broadcast([](CountingAppServer& r) { r.set_limit(20); }));
+  phase = 1;
+
+  while (!dispatched)
+  {
+    std::this_thread::yield();
+  }
+
+  // Broadcasts are run in order.
+  _as.broadcast([](CountingAppServer& r) { r.set_limit(30); });
+  _as.broadcast([](CountingAppServer& r) { r.set_limit(r._limit + 10); });
+  phase = 2;
+  worker_thread.join();
+
+  EXPECT_FALSE(replica->_wrong_thread);
+}
+
+
+TEST_F(ShardedAppServerTest, NewReplicaUsesCurrentConfig)
+{
+  _limit = 50;
+  std::thread worker_thread([&]() {
+    dispatch();
+    EXPECT_EQ(50, _as.local(AppServerWorkerContext::current())._limit);
+  });
+  worker_thread.join();
+}
+
+
+/// Test that the replicas share the ShardedAppServer's statistics and
+/// admission control, so the service is counted as a whole.
+TEST_F(ShardedAppServerTest, SharedInstrumentation)
+{
+  const int NUM_THREADS = 2;
+  std::vector<std::thread> threads;
+  std::vector<CountingAppServer*> replicas(NUM_THREADS);
+
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    threads.push_back(std::thread([&, ii]() {
+      CountingAppServer& replica = _as.local(AppServerWorkerContext::current());
+      replica.stats().increment(AppServerStats::THROTTLED);
+      replicas[ii] = &replica;
+    }));
+    threads[ii].join();
+  }
+
+  EXPECT_EQ(2u, _as.stats().snapshot().counters[AppServerStats::THROTTLED]);
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    EXPECT_EQ(&_as.stats(), &replicas[ii]->stats());
+    EXPECT_EQ(&_as.admission(), &replicas[ii]->admission());
+    EXPECT_EQ(&_as.sas_config(), &replicas[ii]->sas_config());
+  }
+}
@@ -0,0 +1,108 @@
+/**
+ * @file sip_hdr_view_test.cpp UT for non-allocating header and URI access.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "sip_common.hpp"
+#include "pjutils.h"
+#include "sip_hdr_view.h"
+
+using namespace std;
+
+/// Fixture for SipHdrViewTest.
+///
+/// This derives from SipCommonTest to ensure PJSIP is set up correctly.
+class SipHdrViewTest : public SipCommonTest
+{
+public:
+  SipHdrViewTest() : SipCommonTest()
+  {
+    _req = parse_msg("INVITE sip:6505551234@homedomain;npdi;rn=6505550000 SIP/2.0\r\n"
+                     "Via: SIP/2.0/TCP 10.114.61.213;branch=z9hG4bK0123456789abcdef\r\n"
+                     "From: <sip:6505551000@homedomain>;tag=10.114.61.213+1+8c8b232a+5fb751cf\r\n"
+                     "To: <tel:+16505551234>\r\n"
+                     "Route: <sip:as1.homedomain;lr>\r\n"
+                     "Route: <sip:scscf.homedomain;lr;orig>\r\n"
+                     "P-Served-User: <sip:6505551000@homedomain>;sescase=orig\r\n"
+                     "Max-Forwards: 68\r\n"
+                     "Call-ID: 0gQAAC8WAAACBAAALxYAAAL8P3UbW8l4mT8YBkKGRKc5SOHaJ1gMRqsUOO4ohntC@10.114.61.213\r\n"
+                     "CSeq: 16567 INVITE\r\n"
+                     "Content-Length: 0\r\n\r\n");
+  }
+
+  pjsip_msg* _req;
+};
+
+
+/// Test reading URI parts and parameters without copying.
+TEST_F(SipHdrViewTest, ReadUri)
+{
+  pjsip_uri* ruri = _req->line.req.uri;
+  EXPECT_TRUE(SipMsgView::equals(SipMsgView::user(ruri), "6505551234"));
+  EXPECT_TRUE(SipMsgView::iequals(SipMsgView::host(ruri), "HOMEDOMAIN"));
+  EXPECT_TRUE(SipMsgView::starts_with(SipMsgView::user(ruri), "650555"));
+
+  pj_str_t value;
+  EXPECT_TRUE(SipMsgView::uri_param(ruri, "rn", value));
+  EXPECT_TRUE(SipMsgView::equals(value, "6505550000"));
+  EXPECT_FALSE(SipMsgView::uri_param(ruri, "cic", value));
+
+  // The user of a Tel URI is its number, and it has no SIP host.
+  pjsip_to_hdr* to = SipMsgView::find_hdr<pjsip_to_hdr>(_req, PJSIP_H_TO);
+  ASSERT_TRUE(to != NULL);
+  EXPECT_TRUE(SipMsgView::equals(SipMsgView::user(to->uri), "+16505551234"));
+  EXPECT_EQ(0, SipMsgView::host(to->uri).slen);
+
+  EXPECT_TRUE(SipMsgView::starts_with(SipMsgView::hdr_value(_req, "P-Served-User"),
+                                      "<sip:6505551000@homedomain>"));
+  EXPECT_EQ(0, SipMsgView::hdr_value(_req, "P-Asserted-Identity").slen);
+}
+
+
+/// Test iterating over repeated headers.
+TEST_F(SipHdrViewTest, IterateHeaders)
+{
+  HdrRange<pjsip_route_hdr> routes(_req, PJSIP_H_ROUTE);
+  int count = 0;
+  for (HdrRange<pjsip_route_hdr>::iterator ii = routes.begin();
+       ii != routes.end();
+       ++ii)
+  {
+    pj_str_t host = SipMsgView::host((pjsip_uri*)&ii->name_addr);
+    EXPECT_TRUE(SipMsgView::equals(host, (count == 0) ? "as1.homedomain" :
+                                                        "scscf.homedomain"));
+    ++count;
+  }
+  EXPECT_EQ(2, count);
+
+  pj_str_t name = pj_str((char*)"Max-Forwards");
+  EXPECT_FALSE(HdrRange<>(_req, &name).empty());
+  EXPECT_TRUE(HdrRange<>(_req, PJSIP_H_CONTACT).empty());
+}
+
+
+/// Test modifying URIs and headers in place.
+TEST_F(SipHdrViewTest, Modify)
+{
+  pjsip_uri* ruri = _req->line.req.uri;
+  pj_str_t user = pj_str((char*)"6505559999");
+  pj_str_t rn = pj_str((char*)"6505551111");
+  pj_str_t empty = pj_str((char*)"");
+  EXPECT_TRUE(SipMsgView::set_user(_pool, ruri, user));
+  EXPECT_TRUE(SipMsgView::set_uri_param(_pool, ruri, "rn", rn));
+  EXPECT_TRUE(SipMsgView::set_uri_param(_pool, ruri, "cic", empty));
+  EXPECT_EQ("sip:6505559999@homedomain;npdi;rn=6505551111;cic",
+            PJUtils::uri_to_string(PJSIP_URI_IN_REQ_URI, ruri));
+
+  EXPECT_EQ(2, SipMsgView::remove_hdrs(_req, PJSIP_H_ROUTE));
+  EXPECT_TRUE(HdrRange<>(_req, PJSIP_H_ROUTE).empty());
+}
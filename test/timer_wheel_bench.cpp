@@ -0,0 +1,126 @@
+/**
+ * @file timer_wheel_bench.cpp Benchmarks for the AppServer timer wheel.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <vector>
+#include "benchmark/benchmark.h"
+
+#include "timer_wheel.h"
+
+/// The number of live timers to hold on the wheel.
+static const int NUM_TIMERS = 1000000;
+
+/// AppServerTsx that ignores timer expiries.
+class NullTimerASTsx : public AppServerTsx
+{
+public:
+  void on_timer_expiry(void* context) {}
+};
+
+/// Returns a pseudo-random no-answer/session style duration in the range
+/// 1s to 180s.
+static int timer_duration(uint32_t& seed)
+{
+  seed = seed * 1103515245 + 12345;
+  return 1000 + (seed >> 8) % 179000;
+}
+
+
+/// Schedule 1M timers, then cancel them all.
+static void BM_ScheduleCancel(benchmark::State& state)
+{
+  NullTimerASTsx tsx;
+  TimerWheel wheel(0, NUM_TIMERS);
+  std::vector<TimerID> ids(NUM_TIMERS, 0);
+  uint32_t seed = 1;
+
+  for (auto _ : state)
+  {
+    for (int ii = 0; ii < NUM_TIMERS; ++ii)
+    {
+      wheel.schedule(&tsx, NULL, ids[ii], timer_duration(seed));
+    }
+
+    for (int ii = 0; ii < NUM_TIMERS; ++ii)
+    {
+      wheel.cancel(ids[ii]);
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * NUM_TIMERS * 2);
+}
+BENCHMARK(BM_ScheduleCancel)->Unit(benchmark::kMillisecond);
+
+
+/// With 1M timers running, repeatedly restart one and cancel and replace
+/// another, while time advances.  This is the steady-state churn of a busy
+/// node where nearly every timer is cancelled before it expires.
+static void BM_Churn(benchmark::State& state)
+{
+  NullTimerASTsx tsx;
+  TimerWheel wheel(0, NUM_TIMERS);
+  std::vector<TimerID> ids(NUM_TIMERS, 0);
+  uint32_t seed = 1;
+  uint64_t now = 0;
+
+  for (int ii = 0; ii < NUM_TIMERS; ++ii)
+  {
+    wheel.schedule(&tsx, NULL, ids[ii], timer_duration(seed));
+  }
+
+  int next = 0;
+  for (auto _ : state)
+  {
+    // Restart one timer, cancel and replace another.
+    wheel.schedule(&tsx, NULL, ids[next], timer_duration(seed));
+    next = (next + 1) % NUM_TIMERS;
+    wheel.cancel(ids[next]);
+    wheel.schedule(&tsx, NULL, ids[next], timer_duration(seed));
+    next = (next + 1) % NUM_TIMERS;
+
+    if ((next & 0xFF) == 0)
+    {
+      wheel.poll(++now);
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * 3);
+}
+BENCHMARK(BM_Churn);
+
+
+/// Schedule 1M timers and let them all expire.
+static void BM_Expiry(benchmark::State& state)
+{
+  NullTimerASTsx tsx;
+  TimerWheel wheel(0, NUM_TIMERS);
+  uint64_t now = 0;
+  uint32_t seed = 1;
+
+  for (auto _ : state)
+  {
+    for (int ii = 0; ii < NUM_TIMERS; ++ii)
+    {
+      TimerID id = 0;
+      wheel.schedule(&tsx, NULL, id, timer_duration(seed));
+    }
+
+    while (wheel.size() > 0)
+    {
+      now += 10;
+      wheel.poll(now);
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * NUM_TIMERS);
+}
+BENCHMARK(BM_Expiry)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
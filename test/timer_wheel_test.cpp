@@ -0,0 +1,185 @@
+/**
+ * @file timer_wheel_test.cpp UT for the AppServer timer wheel.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "timer_wheel.h"
+
+using namespace std;
+
+/// AppServerTsx that records the contexts of the timers that expire on it.
+class TimerRecordingASTsx : public AppServerTsx
+{
+public:
+  TimerRecordingASTsx() : AppServerTsx() {}
+
+  void on_timer_expiry(void* context)
+  {
+    _expired.push_back((intptr_t)context);
+  }
+
+  vector<intptr_t> _expired;
+};
+
+/// Fixture for TimerWheelTest.
+class TimerWheelTest : public ::testing::Test
+{
+public:
+  TimerWheelTest() : _wheel(1000) {}
+
+  TimerWheel _wheel;
+  TimerRecordingASTsx _tsx;
+};
+
+
+/// Test that a timer fires at its expiry time and not before.
+TEST_F(TimerWheelTest, Expiry)
+{
+  TimerID id = 0;
+  EXPECT_TRUE(_wheel.schedule(&_tsx, (void*)1, id, 100));
+  EXPECT_TRUE(_wheel.running(id));
+
+  EXPECT_EQ(0u, _wheel.poll(1099));
+  EXPECT_TRUE(_tsx._expired.empty());
+
+  EXPECT_EQ(1u, _wheel.poll(1100));
+  ASSERT_EQ(1u, _tsx._expired.size());
+  EXPECT_EQ(1, _tsx._expired[0]);
+  EXPECT_FALSE(_wheel.running(id));
+  EXPECT_EQ(0u, _wheel.size());
+}
+
+
+/// Test that cancelled timers do not fire, and cancelling twice is harmless.
+TEST_F(TimerWheelTest, Cancel)
+{
+  TimerID id1 = 0;
+  TimerID id2 = 0;
+  _wheel.schedule(&_tsx, (void*)1, id1, 100);
+  _wheel.schedule(&_tsx, (void*)2, id2, 100);
+  _wheel.cancel(id1);
+  _wheel.cancel(id1);
+  EXPECT_FALSE(_wheel.running(id1));
+  EXPECT_TRUE(_wheel.running(id2));
+
+  EXPECT_EQ(1u, _wheel.poll(2000));
+  ASSERT_EQ(1u, _tsx._expired.size());
+  EXPECT_EQ(2, _tsx._expired[0]);
+}
+
+
+/// Test that rescheduling a running timer restarts it with the new duration
+/// and context, and that a stale identifier starts a new timer.
+TEST_F(TimerWheelTest, Restart)
+{
+  TimerID id = 0;
+  _wheel.schedule(&_tsx, (void*)1, id, 100);
+  TimerID orig_id = id;
+  _wheel.schedule(&_tsx, (void*)2, id, 500);
+  EXPECT_EQ(orig_id, id);
+  EXPECT_EQ(1u, _wheel.size());
+
+  EXPECT_EQ(0u, _wheel.poll(1200));
+  EXPECT_EQ(1u, _wheel.poll(1500));
+  ASSERT_EQ(1u, _tsx._expired.size());
+  EXPECT_EQ(2, _tsx._expired[0]);
+
+  // The slot is reused, but the old identifier must not match it.
+  _wheel.schedule(&_tsx, (void*)3, id, 100);
+  EXPECT_NE(orig_id, id);
+  EXPECT_FALSE(_wheel.running(orig_id));
+  EXPECT_TRUE(_wheel.running(id));
+}
+
+
+/// Test that long timers cascade down through the levels of the wheel and
+/// fire at exactly the right time, in batches.
+TEST_F(TimerWheelTest, Cascade)
+{
+  const int durations[] = {255, 256, 65535, 65536, 3600000, 16777300};
+  const int num_timers = sizeof(durations) / sizeof(durations[0]);
+  vector<TimerID> ids(num_timers, 0);
+
+  for (int ii = 0; ii < num_timers; ++ii)
+  {
+    _wheel.schedule(&_tsx, (void*)(intptr_t)ii, ids[ii], durations[ii]);
+  }
+
+  for (int ii = 0; ii < num_timers; ++ii)
+  {
+    _wheel.poll(1000 + durations[ii] - 1);
+    EXPECT_EQ((size_t)ii, _tsx._expired.size());
+    _wheel.poll(1000 + durations[ii]);
+    ASSERT_EQ((size_t)ii + 1, _tsx._expired.size());
+    EXPECT_EQ(ii, _tsx._expired[ii]);
+  }
+
+  // Timers expiring together are delivered in one batch.
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    TimerID id = 0;
+    _wheel.schedule(&_tsx, NULL, id, 50);
+  }
+  EXPECT_EQ(10u, _wheel.poll(1000 + 16777300 + 50));
+}
+
+
+/// AppServerTsx that, when its timer fires, cancels the timer of another
+/// transaction and destroys it, as a service might when one leg of a call
+/// times out.
+class PeerDestroyingASTsx : public AppServerTsx
+{
+public:
+  PeerDestroyingASTsx(TimerWheel& wheel, bool& alive) :
+    AppServerTsx(), _wheel(wheel), _alive(alive), _peer(NULL), _timer(0)
+  {
+    _alive = true;
+  }
+
+  ~PeerDestroyingASTsx()
+  {
+    _alive = false;
+  }
+
+  void on_timer_expiry(void* context)
+  {
+    _wheel.cancel(_peer->_timer);
+    delete _peer;
+    _peer = NULL;
+  }
+
+  TimerWheel& _wheel;
+  bool& _alive;
+  PeerDestroyingASTsx* _peer;
+  TimerID _timer;
+};
+
+
+/// Test that a callback can cancel a timer due on the same tick and destroy
+/// its transaction, without that transaction being called back.
+TEST_F(TimerWheelTest, DestroyInBatch)
+{
+  bool alive1;
+  bool alive2;
+  PeerDestroyingASTsx* tsx1 = new PeerDestroyingASTsx(_wheel, alive1);
+  PeerDestroyingASTsx* tsx2 = new PeerDestroyingASTsx(_wheel, alive2);
+  tsx1->_peer = tsx2;
+  tsx2->_peer = tsx1;
+  _wheel.schedule(tsx1, NULL, tsx1->_timer, 100);
+  _wheel.schedule(tsx2, NULL, tsx2->_timer, 100);
+
+  // Whichever fires first destroys the other, whose timer never fires.
+  EXPECT_EQ(1u, _wheel.poll(1100));
+  EXPECT_NE(alive1, alive2);
+  EXPECT_EQ(0u, _wheel.size());
+  delete (alive1 ? tsx1 : tsx2);
+}
@@ -0,0 +1,232 @@
+/**
+ * @file trace_replay.cpp  Replays a captured SIP trace through a dummy
+ * application server and reports throughput and latency.
+ *
+ * Usage: trace_replay <trace file> [--service <name>] [--threads <n>]
+ *                                  [--iterations <n>] [--status <code>]
+ *                                  [--rate <n>] [--max-in-flight <n>]
+ *                                  [--target-latency <us>]
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <string>
+
+#include "sip_common.hpp"
+#include "dummyappserver.hpp"
+#include "trace_replay.hpp"
+
+using namespace std;
+
+/// Fixture giving access to the PJSIP set up of SipCommonTest.
+class TraceReplayMain : public SipCommonTest
+{
+public:
+  void TestBody() {}
+
+  static pj_pool_t* pool() { return _pool; }
+};
+
+
+/// Replays a trace through a dummy service and prints the results.
+template <class T>
+static void replay(const std::string& service,
+                   const TraceFile& trace,
+                   int threads,
+                   int iterations,
+                   pjsip_status_code status,
+                   const AdmissionControl::Config& admission)
+{
+  DummyAppServer<T> app_server(service);
+  app_server.admission().configure(admission);
+  TraceReplayer replayer(TraceReplayMain::pool()->factory, trace, status);
+  TraceReplayer::Result result = replayer.replay(app_server, threads, iterations);
+  AppServerStats::Snapshot stats = app_server.stats().snapshot();
+
+  printf("Handled %lu transactions (%lu declined, %lu throttled) on %d threads in %lu us\n",
+         (unsigned long)result.tsxs,
+         (unsigned long)result.declined,
+         (unsigned long)result.throttled,
+         threads,
+         (unsigned long)result.elapsed_us);
+  printf("Throughput: %.0f transactions/s\n", result.tsxs_per_sec());
+  printf("Transaction latency (ns): p50 %lu  p90 %lu  p99 %lu  p99.9 %lu  max %lu\n",
+         (unsigned long)result.p50_ns,
+         (unsigned long)result.p90_ns,
+         (unsigned long)result.p99_ns,
+         (unsigned long)result.p999_ns,
+         (unsigned long)result.max_ns);
+  printf("Initial request callback latency (us): p50 <%lu  p99 <%lu\n",
+         (unsigned long)stats.percentile_us(AppServerStats::INITIAL_REQUEST, 50.0),
+         (unsigned long)stats.percentile_us(AppServerStats::INITIAL_REQUEST, 99.0));
+  printf("Response callback latency (us): p50 <%lu  p99 <%lu\n",
+         (unsigned long)stats.percentile_us(AppServerStats::RESPONSE, 50.0),
+         (unsigned long)stats.percentile_us(AppServerStats::RESPONSE, 99.0));
+  printf("Messages leaked: %lu\n", (unsigned long)result.msgs_leaked);
+}
+
+
+/// Replays a trace through one of the dummy services by name.
+///
+/// @returns             - false if there is no such service.
+static bool replay(const std::string& service,
+                   const TraceFile& trace,
+                   int threads,
+                   int iterations,
+                   pjsip_status_code status,
+                   const AdmissionControl::Config& admission)
+{
+  if (service == "dialog")
+  {
+    replay<DummyDialogASTsx>(service, trace, threads, iterations, status, admission);
+  }
+  else if (service == "reject")
+  {
+    replay<DummyRejectASTsx>(service, trace, threads, iterations, status, admission);
+  }
+  else if (service == "fastreject")
+  {
+    replay<DummyFastRejectASTsx>(service, trace, threads, iterations, status, admission);
+  }
+  else if (service == "redirect")
+  {
+    replay<DummyRedirectASTsx>(service, trace, threads, iterations, status, admission);
+  }
+  else if (service == "fork")
+  {
+    replay<DummyForkASTsx>(service, trace, threads, iterations, status, admission);
+  }
+  else if (service == "lazyfork")
+  {
+    replay<DummyLazyForkASTsx>(service, trace, threads, iterations, status, admission);
+  }
+  else if (service == "batchfork")
+  {
+    replay<DummyBatchForkASTsx>(service, trace, threads, iterations, status, admission);
+  }
+  else
+  {
+    return false;
+  }
+
+  return true;
+}
+
+
+static void usage()
+{
+  fprintf(stderr,
+          "Usage: trace_replay <trace file> [--service <name>] [--threads <n>]\n"
+          "                                 [--iterations <n>] [--status <code>]\n"
+          "                                 [--rate <n>] [--max-in-flight <n>]\n"
+          "                                 [--target-latency <us>]\n"
+          "  --service     dialog (default), reject, fastreject, redirect, fork,\n"
+          "                lazyfork or batchfork\n"
+          "  --threads     number of worker threads (default 1)\n"
+          "  --iterations  times to replay each transaction (default 1)\n"
+          "  --status      status code of responses to requests sent downstream,\n"
+          "                where the trace has none (default 200)\n"
+          "  --rate        admission control rate limit, per second (default none)\n"
+          "  --max-in-flight\n"
+          "                admission control limit on transactions in flight\n"
+          "                (default none)\n"
+          "  --target-latency\n"
+          "                admission control target callback latency, in\n"
+          "                microseconds (default none)\n");
+}
+
+
+int main(int argc, char** argv)
+{
+  std::string path;
+  std::string service = "dialog";
+  int threads = 1;
+  int iterations = 1;
+  int status = PJSIP_SC_OK;
+  AdmissionControl::Config admission;
+
+  for (int ii = 1; ii < argc; ++ii)
+  {
+    std::string arg = argv[ii];
+    bool has_value = (ii + 1 < argc);
+
+    if ((arg == "--service") && (has_value))
+    {
+      service = argv[++ii];
+    }
+    else if ((arg == "--threads") && (has_value))
+    {
+      threads = atoi(argv[++ii]);
+    }
+    else if ((arg == "--iterations") && (has_value))
+    {
+      iterations = atoi(argv[++ii]);
+    }
+    else if ((arg == "--status") && (has_value))
+    {
+      status = atoi(argv[++ii]);
+    }
+    else if ((arg == "--rate") && (has_value))
+    {
+      admission.rate = atof(argv[++ii]);
+      admission.burst = std::max(admission.rate / 100, 1.0);
+    }
+    else if ((arg == "--max-in-flight") && (has_value))
+    {
+      admission.max_in_flight = atoll(argv[++ii]);
+    }
+    else if ((arg == "--target-latency") && (has_value))
+    {
+      admission.target_latency_us = atoll(argv[++ii]);
+    }
+    else if ((path.empty()) && (arg[0] != '-'))
+    {
+      path = arg;
+    }
+    else
+    {
+      usage();
+      return 1;
+    }
+  }
+
+  if ((path.empty()) || (threads < 1) || (iterations < 1))
+  {
+    usage();
+    return 1;
+  }
+
+  TraceReplayMain::SetUpTestCase();
+  int rc = 0;
+
+  {
+    TraceFile trace(TraceReplayMain::pool()->factory);
+    if (!trace.load(path))
+    {
+      fprintf(stderr, "Failed to read %s\n", path.c_str());
+      rc = 1;
+    }
+    else
+    {
+      printf("Loaded %zu messages in %zu transactions (%zu unparseable)\n",
+             trace.num_msgs(), trace.transactions().size(), trace.errors());
+
+      if (!replay(service, trace, threads, iterations, (pjsip_status_code)status, admission))
+      {
+        usage();
+        rc = 1;
+      }
+    }
+  }
+
+  TraceReplayMain::TearDownTestCase();
+  return rc;
+}
@@ -0,0 +1,616 @@
+/**
+ * @file trace_replay.hpp  Replays captured SIP traces through AppServers.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef TRACE_REPLAY_H__
+#define TRACE_REPLAY_H__
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "appserver.h"
+#include "appserver_worker.h"
+#include "fakeappserver.hpp"
+
+/// A read-only memory mapping of a whole file.
+class MappedFile
+{
+public:
+  MappedFile() : _data(NULL), _size(0) {}
+
+  ~MappedFile()
+  {
+    close();
+  }
+
+  /// Maps a file.
+  ///
+  /// @returns             - false if the file could not be opened or mapped.
+  /// @param  path         - The path of the file.
+  bool open(const std::string& path)
+  {
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+      return false;
+    }
+
+    struct stat st;
+    bool ok = (fstat(fd, &st) == 0);
+    if ((ok) && (st.st_size > 0))
+    {
+      void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED)
+      {
+        _data = (const char*)data;
+        _size = st.st_size;
+      }
+      else
+      {
+        ok = false;
+      }
+    }
+
+    ::close(fd);
+    return ok;
+  }
+
+  /// Unmaps the file.
+  void close()
+  {
+    if (_data != NULL)
+    {
+      munmap((void*)_data, _size);
+      _data = NULL;
+      _size = 0;
+    }
+  }
+
+  const char* data() const { return _data; }
+  size_t size() const { return _size; }
+
+private:
+  MappedFile(const MappedFile&);
+  MappedFile& operator=(const MappedFile&);
+
+  const char* _data;
+  size_t _size;
+};
+
+
+/// The TraceFile class holds a captured SIP trace, parsed once into
+/// messages that can be replayed any number of times.
+///
+/// A trace is a sequence of SIP messages as they appeared on the wire, as
+/// written by a packet capture export or by concatenating Sprout's message
+/// logs, optionally separated by blank lines.  Each message must have a
+/// Content-Length header if it has a body.  Messages are grouped into
+/// transactions: each request starts a transaction, and each response is
+/// added to the transaction of the latest request with the same Call-ID and
+/// CSeq.  When replayed, a transaction's responses are returned on each
+/// request the service sends downstream, and responses without a request
+/// are ignored.
+///
+/// The parsed messages are shared by all replay threads, so must only be
+/// read (as AppServer::get_app_tsx should treat the request) or copied.
+///
+class TraceFile
+{
+public:
+  /// A transaction in the trace.
+  struct Transaction
+  {
+    pjsip_msg* req;
+    std::vector<pjsip_msg*> rsps;
+  };
+
+  /// Constructor.
+  ///
+  /// @param  factory      - The pool factory to parse the messages into.
+  TraceFile(pj_pool_factory* factory) :
+    _pool(pj_pool_create(factory, "trace", 65536, 65536, NULL)),
+    _tsxs(),
+    _num_msgs(0),
+    _errors(0)
+  {
+  }
+
+  ~TraceFile()
+  {
+    pj_pool_release(_pool);
+  }
+
+  /// Loads and parses a trace file, adding its transactions to those
+  /// already loaded.
+  ///
+  /// @returns             - false if the file could not be read.
+  /// @param  path         - The path of the trace file.
+  bool load(const std::string& path)
+  {
+    MappedFile file;
+    if (!file.open(path))
+    {
+      return false;
+    }
+
+    parse(file.data(), file.size());
+    return true;
+  }
+
+  /// Parses a trace held in memory, adding its transactions to those
+  /// already loaded.  The data is copied, so need not outlive the trace.
+  ///
+  /// @param  data         - The trace.
+  /// @param  size         - The size of the trace.
+  void parse(const char* data, size_t size)
+  {
+    std::unordered_map<std::string, size_t> open_tsxs;
+    const char* end = data + size;
+
+    while (data < end)
+    {
+      // Skip the blank lines between messages.
+      while ((data < end) && ((*data == '\r') || (*data == '\n')))
+      {
+        ++data;
+      }
+
+      if (data == end)
+      {
+        break;
+      }
+
+      pj_size_t msg_size;
+      if (pjsip_find_msg(data, end - data, PJ_FALSE, &msg_size) != PJ_SUCCESS)
+      {
+        // The rest of the trace is truncated or malformed, so there is no
+        // way of finding the start of the next message.
+        ++_errors;
+        break;
+      }
+
+      // The parser needs a null-terminated buffer, and the parsed message
+      // refers into it, so copy the message into the trace's pool.
+      char* buf = (char*)pj_pool_alloc(_pool, msg_size + 1);
+      memcpy(buf, data, msg_size);
+      buf[msg_size] = '\0';
+      data += msg_size;
+
+      pjsip_msg* msg = pjsip_parse_msg(_pool, buf, msg_size, NULL);
+      if (msg == NULL)
+      {
+        ++_errors;
+        continue;
+      }
+
+      ++_num_msgs;
+      add(msg, open_tsxs);
+    }
+  }
+
+  /// Returns the transactions in the trace, in the order their requests
+  /// appear.
+  const std::vector<Transaction>& transactions() const { return _tsxs; }
+
+  /// Returns the number of messages parsed.
+  size_t num_msgs() const { return _num_msgs; }
+
+  /// Returns the number of messages that could not be parsed.
+  size_t errors() const { return _errors; }
+
+private:
+  TraceFile(const TraceFile&);
+  TraceFile& operator=(const TraceFile&);
+
+  /// Adds a message to a new or existing transaction.
+  void add(pjsip_msg* msg, std::unordered_map<std::string, size_t>& open_tsxs)
+  {
+    pjsip_cid_hdr* cid = PJSIP_MSG_CID_HDR(msg);
+    pjsip_cseq_hdr* cseq = PJSIP_MSG_CSEQ_HDR(msg);
+    std::string key;
+
+    if ((cid != NULL) && (cseq != NULL))
+    {
+      key.assign(cid->id.ptr, cid->id.slen)
+         .append(" ")
+         .append(std::to_string(cseq->cseq))
+         .append(" ")
+         .append(cseq->method.name.ptr, cseq->method.name.slen);
+    }
+
+    if (msg->type == PJSIP_REQUEST_MSG)
+    {
+      Transaction tsx;
+      tsx.req = msg;
+      _tsxs.push_back(tsx);
+
+      if (!key.empty())
+      {
+        open_tsxs[key] = _tsxs.size() - 1;
+      }
+    }
+    else
+    {
+      std::unordered_map<std::string, size_t>::const_iterator ii =
+                                                          open_tsxs.find(key);
+      if (ii != open_tsxs.end())
+      {
+        _tsxs[ii->second].rsps.push_back(msg);
+      }
+    }
+  }
+
+  pj_pool_t* _pool;
+  std::vector<Transaction> _tsxs;
+  size_t _num_msgs;
+  size_t _errors;
+};
+
+
+/// The TraceReplayer class drives the transactions of a TraceFile through
+/// an AppServer on a number of worker threads, as the infrastructure would,
+/// and measures how long each transaction takes.
+///
+/// Each worker has its own FakeAppServerTsxHelper, and takes transactions
+/// from the trace in turn until every transaction has been replayed the
+/// requested number of times.  For each transaction it checks
+/// AppServer::admit for initial requests, then calls
+/// AppServer::get_app_tsx_on_worker with the worker's context and, if that
+/// returns an AppServerTsx, passes it a copy of the request and then, for
+/// each request the service sends downstream, copies of the responses from
+/// the trace, or a single response with the default status code if the
+/// trace has none.
+///
+/// The transaction is then driven until it has nothing left to do.  The
+/// replay has no asynchronous operations of its own, so suspensions that no
+/// other thread has resumed by then are resumed with a NULL context, and
+/// the helper's clock is advanced in steps to fire any running timers, up to
+/// MAX_TSX_TIME_MS.  The transaction is destroyed once it is idle.
+///
+/// The request, response and resume callbacks are timed into the
+/// AppServer's statistics.  The time from get_app_tsx until the AppServerTsx
+/// is destroyed is recorded for each transaction the AppServer handles;
+/// throttled and declined transactions are only counted.
+///
+class TraceReplayer
+{
+public:
+  /// The results of a replay.
+  struct Result
+  {
+    /// The number of transactions the AppServer handled, whose latencies
+    /// are measured.
+    uint64_t tsxs;
+
+    /// The number of transactions the AppServer declined to handle.
+    uint64_t declined;
+
+    /// The number of transactions the AppServer's admission control
+    /// throttled, which are not passed to get_app_tsx.
+    uint64_t throttled;
+
+    /// The number of messages the services failed to free.
+    uint64_t msgs_leaked;
+
+    /// The wall clock time taken by the replay.
+    uint64_t elapsed_us;
+
+    /// The transaction latency percentiles, in nanoseconds.
+    uint64_t p50_ns;
+    uint64_t p90_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+    uint64_t max_ns;
+
+    /// Returns the throughput of handled transactions, in transactions per
+    /// second.
+    double tsxs_per_sec() const
+    {
+      return (elapsed_us > 0) ? (tsxs * 1000000.0 / elapsed_us) : 0.0;
+    }
+  };
+
+  /// Constructor.
+  ///
+  /// @param  factory      - The pool factory for the workers' messages.
+  /// @param  trace        - The trace to replay.
+  /// @param  default_status - The status code of the responses to requests
+  ///                        sent downstream, for transactions that have no
+  ///                        responses in the trace.
+  TraceReplayer(pj_pool_factory* factory,
+                const TraceFile& trace,
+                pjsip_status_code default_status = PJSIP_SC_OK) :
+    _factory(factory),
+    _trace(trace),
+    _default_status(default_status)
+  {
+  }
+
+  /// Replays the trace through an AppServer.
+  ///
+  /// @returns             - The results of the replay.
+  /// @param  app_server   - The AppServer.
+  /// @param  threads      - The number of worker threads.
+  /// @param  iterations   - The number of times to replay each transaction.
+  Result replay(AppServer& app_server, int threads, int iterations = 1)
+  {
+    const std::vector<TraceFile::Transaction>& tsxs = _trace.transactions();
+    uint64_t total = (uint64_t)tsxs.size() * iterations;
+    std::atomic<uint64_t> next(0);
+    std::vector<Worker> workers(threads);
+    std::vector<std::thread> worker_threads;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    for (int ii = 0; ii < threads; ++ii)
+    {
+      worker_threads.push_back(std::thread(&TraceReplayer::run,
+                                           this,
+                                           std::ref(app_server),
+                                           std::ref(workers[ii]),
+                                           std::ref(next),
+                                           total));
+    }
+
+    for (int ii = 0; ii < threads; ++ii)
+    {
+      worker_threads[ii].join();
+    }
+
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+    Result result = Result();
+    result.elapsed_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+
+    std::vector<uint64_t> latencies;
+    latencies.reserve(total);
+    for (int ii = 0; ii < threads; ++ii)
+    {
+      result.declined += workers[ii].declined;
+      result.throttled += workers[ii].throttled;
+      result.msgs_leaked += workers[ii].msgs_leaked;
+      latencies.insert(latencies.end(),
+                       workers[ii].latencies.begin(),
+                       workers[ii].latencies.end());
+    }
+    result.tsxs = latencies.size();
+
+    if (!latencies.empty())
+    {
+      std::sort(latencies.begin(), latencies.end());
+      result.p50_ns = percentile(latencies, 50.0);
+      result.p90_ns = percentile(latencies, 90.0);
+      result.p99_ns = percentile(latencies, 99.0);
+      result.p999_ns = percentile(latencies, 99.9);
+      result.max_ns = latencies.back();
+    }
+
+    return result;
+  }
+
+private:
+  /// The maximum number of requests a transaction may send downstream
+  /// before the replay stops answering them, in case a service keeps
+  /// retrying.
+  static const size_t MAX_REQUESTS_PER_TSX = 64;
+
+  /// The maximum number of times a transaction is resumed, in case a
+  /// service keeps suspending itself.
+  static const size_t MAX_RESUMES_PER_TSX = 64;
+
+  /// The interval by which the helper's clock is advanced while a
+  /// transaction has timers running, and the longest a transaction may run
+  /// for on that clock.
+  static const uint64_t TIMER_STEP_MS = 10;
+  static const uint64_t MAX_TSX_TIME_MS = 300000;
+
+  /// The results collected by each worker thread.
+  struct Worker
+  {
+    Worker() : latencies(), declined(0), throttled(0), msgs_leaked(0) {}
+    std::vector<uint64_t> latencies;
+    uint64_t declined;
+    uint64_t throttled;
+    uint64_t msgs_leaked;
+  };
+
+  /// Returns a percentile of a sorted list of values.
+  static uint64_t percentile(const std::vector<uint64_t>& sorted, double percentile)
+  {
+    size_t index = (size_t)(sorted.size() * percentile / 100.0);
+    return sorted[std::min(index, sorted.size() - 1)];
+  }
+
+  /// The body of a worker thread.
+  void run(AppServer& app_server,
+           Worker& worker,
+           std::atomic<uint64_t>& next,
+           uint64_t total)
+  {
+    pj_thread_desc desc;
+    pj_thread_t* thread;
+    memset(desc, 0, sizeof(desc));
+    pj_thread_register("replay", desc, &thread);
+
+    const std::vector<TraceFile::Transaction>& tsxs = _trace.transactions();
+    AppServerWorkerContext& context = AppServerWorkerContext::current();
+    FakeAppServerTsxHelper helper(_factory);
+    pj_pool_t* pool = pj_pool_create(_factory, "replay", 1024, 1024, NULL);
+
+    for (uint64_t ii = next++; ii < total; ii = next++)
+    {
+      const TraceFile::Transaction& trace_tsx = tsxs[ii % tsxs.size()];
+
+      if (!admit(app_server, trace_tsx.req))
+      {
+        ++worker.throttled;
+      }
+      else
+      {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        if (replay_tsx(app_server, context, helper, pool, trace_tsx, ii + 1))
+        {
+          std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+          worker.latencies.push_back(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+        }
+        else
+        {
+          ++worker.declined;
+        }
+      }
+
+      pj_pool_reset(pool);
+    }
+
+    worker.msgs_leaked = helper.msgs_leaked();
+    pj_pool_release(pool);
+  }
+
+  /// Checks the AppServer's admission control, as the infrastructure does
+  /// for initial requests.
+  ///
+  /// @returns             - false if the request is throttled.
+  static bool admit(AppServer& app_server, pjsip_msg* req)
+  {
+    pjsip_to_hdr* to = PJSIP_MSG_TO_HDR(req);
+    if ((to != NULL) && (to->tag.slen > 0))
+    {
+      return true;
+    }
+
+    return (app_server.admit() == AdmissionControl::ADMIT);
+  }
+
+  /// Replays one transaction.
+  ///
+  /// @returns             - false if the AppServer declined the transaction.
+  bool replay_tsx(AppServer& app_server,
+                  AppServerWorkerContext& context,
+                  FakeAppServerTsxHelper& helper,
+                  pj_pool_t* pool,
+                  const TraceFile::Transaction& trace_tsx,
+                  SAS::TrailId trail)
+  {
+    pjsip_sip_uri* next_hop = NULL;
+    AppServerTsx* tsx = app_server.get_app_tsx_on_worker(NULL,
+                                                         trace_tsx.req,
+                                                         next_hop,
+                                                         pool,
+                                                         trail,
+                                                         context);
+    if (tsx == NULL)
+    {
+      return false;
+    }
+
+    AppServerStats* stats = &app_server.stats();
+    tsx->set_stats(stats);
+    tsx->set_sas_config(&app_server.sas_config());
+    pjsip_msg* req = helper.start(tsx, trace_tsx.req, trail);
+    pjsip_to_hdr* to = PJSIP_MSG_TO_HDR(req);
+
+    if ((to != NULL) && (to->tag.slen > 0))
+    {
+      AppServerStats::CallbackTimer timer(stats, AppServerStats::IN_DIALOG_REQUEST);
+      tsx->on_in_dialog_request(req);
+    }
+    else
+    {
+      AppServerStats::CallbackTimer timer(stats, AppServerStats::INITIAL_REQUEST);
+      tsx->on_initial_request(req);
+    }
+
+    // Drive the transaction until it is idle.  Answer each request the
+    // service sends downstream, including any it sends while handling
+    // responses, resumes and timers, then complete any suspensions, then
+    // fire any timers.
+    size_t answered = 0;
+    size_t resumes = 0;
+    uint64_t deadline_ms = helper.now_ms() + MAX_TSX_TIME_MS;
+
+    while (true)
+    {
+      if ((answered < helper.sent_requests().size()) &&
+          (answered < MAX_REQUESTS_PER_TSX))
+      {
+        FakeAppServerTsxHelper::SentMsg sent = helper.sent_requests()[answered];
+        ++answered;
+        answer(helper, stats, tsx, trace_tsx, sent.msg, sent.fork_id);
+      }
+      else if ((helper.suspended() > 0) && (resumes < MAX_RESUMES_PER_TSX))
+      {
+        ++resumes;
+        helper.resume_all();
+        AppServerStats::CallbackTimer timer(stats, AppServerStats::RESUME);
+        helper.run_resumes();
+      }
+      else if ((helper.timers_running() > 0) && (helper.now_ms() < deadline_ms))
+      {
+        helper.advance_time(helper.now_ms() + TIMER_STEP_MS);
+      }
+      else
+      {
+        break;
+      }
+    }
+
+    delete tsx;
+    helper.finish();
+    return true;
+  }
+
+  /// Passes the responses to a request the service sent downstream to the
+  /// AppServerTsx.
+  void answer(FakeAppServerTsxHelper& helper,
+              AppServerStats* stats,
+              AppServerTsx* tsx,
+              const TraceFile::Transaction& trace_tsx,
+              pjsip_msg* req,
+              int fork_id)
+  {
+    if (trace_tsx.rsps.empty())
+    {
+      pjsip_msg* rsp = helper.create_response(req, _default_status);
+      AppServerStats::CallbackTimer timer(stats, AppServerStats::RESPONSE);
+      tsx->on_response(rsp, fork_id);
+    }
+    else
+    {
+      for (size_t ii = 0; ii < trace_tsx.rsps.size(); ++ii)
+      {
+        pjsip_msg* rsp = helper.receive(trace_tsx.rsps[ii]);
+        AppServerStats::CallbackTimer timer(stats, AppServerStats::RESPONSE);
+        tsx->on_response(rsp, fork_id);
+      }
+    }
+  }
+
+  pj_pool_factory* _factory;
+  const TraceFile& _trace;
+  pjsip_status_code _default_status;
+};
+
+#endif
@@ -0,0 +1,232 @@
+/**
+ * @file trace_replay_test.cpp UT for the SIP trace replay harness.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string>
+#include "gtest/gtest.h"
+
+#include "sip_common.hpp"
+#include "dummyappserver.hpp"
+#include "trace_replay.hpp"
+
+using namespace std;
+using AS::Message;
+
+/// Fixture for TraceReplayTest.
+class TraceReplayTest : public SipCommonTest
+{
+public:
+  /// Builds a trace of an INVITE with a 180 and 200 response, followed by a
+  /// MESSAGE with no responses, with blank lines between some messages.
+  static std::string build_trace()
+  {
+    Message msg;
+    msg._method = "INVITE";
+    std::string trace = msg.get_request();
+    msg._status = "180 Ringing";
+    trace.append("\r\n").append(msg.get_response());
+    msg._status = "200 OK";
+    trace.append(msg.get_response());
+
+    msg._method = "MESSAGE";
+    trace.append("\r\n\r\n").append(msg.get_request());
+    return trace;
+  }
+};
+
+
+/// AppServer that declines every request.
+class DecliningAppServer : public AppServer
+{
+public:
+  DecliningAppServer() : AppServer("declining") {}
+
+  AppServerTsx* get_app_tsx(SproutletHelper* helper,
+                            pjsip_msg* req,
+                            pjsip_sip_uri*& next_hop,
+                            pj_pool_t* pool,
+                            SAS::TrailId trail)
+  {
+    return NULL;
+  }
+};
+
+
+/// AppServerTsx that waits for a timer before forwarding the request.
+class DelayASTsx : public AppServerTsx
+{
+public:
+  DelayASTsx() : AppServerTsx(), _req(NULL), _timer(0) {}
+
+  void on_initial_request(pjsip_msg* req)
+  {
+    _req = req;
+    schedule_timer(NULL, _timer, 1000);
+  }
+
+  void on_timer_expiry(void* context)
+  {
+    send_request(_req);
+  }
+
+  pjsip_msg* _req;
+  TimerID _timer;
+};
+
+
+TEST_F(TraceReplayTest, ParseGroupsTransactions)
+{
+  std::string data = build_trace();
+  TraceFile trace(_pool->factory);
+  trace.parse(data.data(), data.size());
+
+  EXPECT_EQ(4u, trace.num_msgs());
+  EXPECT_EQ(0u, trace.errors());
+  ASSERT_EQ(2u, trace.transactions().size());
+
+  const TraceFile::Transaction& invite = trace.transactions()[0];
+  EXPECT_EQ(PJSIP_REQUEST_MSG, invite.req->type);
+  ASSERT_EQ(2u, invite.rsps.size());
+  EXPECT_EQ(180, invite.rsps[0]->line.status.code);
+  EXPECT_EQ(200, invite.rsps[1]->line.status.code);
+
+  EXPECT_EQ(0u, trace.transactions()[1].rsps.size());
+}
+
+
+TEST_F(TraceReplayTest, LoadFile)
+{
+  char path[] = "/tmp/trace_replay_test.XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  std::string data = build_trace();
+  ASSERT_EQ((ssize_t)data.size(), write(fd, data.data(), data.size()));
+  close(fd);
+
+  TraceFile trace(_pool->factory);
+  EXPECT_TRUE(trace.load(path));
+  EXPECT_EQ(4u, trace.num_msgs());
+  EXPECT_EQ(2u, trace.transactions().size());
+  unlink(path);
+
+  EXPECT_FALSE(trace.load(path));
+}
+
+
+TEST_F(TraceReplayTest, TruncatedTrace)
+{
+  std::string data = build_trace();
+  data.resize(data.size() - 10);
+  TraceFile trace(_pool->factory);
+  trace.parse(data.data(), data.size());
+
+  EXPECT_EQ(3u, trace.num_msgs());
+  EXPECT_EQ(1u, trace.errors());
+}
+
+
+TEST_F(TraceReplayTest, Replay)
+{
+  std::string data = build_trace();
+  TraceFile trace(_pool->factory);
+  trace.parse(data.data(), data.size());
+
+  DummyAppServer<DummyDialogASTsx> app_server("dialog");
+  TraceReplayer replayer(_pool->factory, trace);
+  TraceReplayer::Result result = replayer.replay(app_server, 2, 50);
+
+  EXPECT_EQ(100u, result.tsxs);
+  EXPECT_EQ(0u, result.declined);
+  EXPECT_EQ(0u, result.msgs_leaked);
+  EXPECT_LE(result.p50_ns, result.p99_ns);
+  EXPECT_LE(result.p99_ns, result.max_ns);
+
+  // Each INVITE gets the two responses from the trace, and each MESSAGE a
+  // generated one.
+  AppServerStats::Snapshot stats = app_server.stats().snapshot();
+  EXPECT_EQ(100u, stats.calls[AppServerStats::INITIAL_REQUEST]);
+  EXPECT_EQ(150u, stats.calls[AppServerStats::RESPONSE]);
+  EXPECT_EQ(150u, stats.counters[AppServerStats::SEND_RESPONSE]);
+  EXPECT_EQ(0, stats.live_tsxs);
+}
+
+
+TEST_F(TraceReplayTest, ReplayDeclined)
+{
+  std::string data = build_trace();
+  TraceFile trace(_pool->factory);
+  trace.parse(data.data(), data.size());
+
+  DecliningAppServer app_server;
+  TraceReplayer replayer(_pool->factory, trace);
+  TraceReplayer::Result result = replayer.replay(app_server, 1, 3);
+
+  EXPECT_EQ(0u, result.tsxs);
+  EXPECT_EQ(6u, result.declined);
+  EXPECT_EQ(0u, result.max_ns);
+}
+
+
+TEST_F(TraceReplayTest, ReplayThrottled)
+{
+  std::string data = build_trace();
+  TraceFile trace(_pool->factory);
+  trace.parse(data.data(), data.size());
+
+  // Admit a burst of 4 requests, and then hardly any more.
+  DummyAppServer<DummyDialogASTsx> app_server("dialog");
+  AdmissionControl::Config config;
+  config.rate = 0.001;
+  config.burst = 4;
+  app_server.admission().configure(config);
+
+  TraceReplayer replayer(_pool->factory, trace);
+  TraceReplayer::Result result = replayer.replay(app_server, 2, 5);
+
+  EXPECT_EQ(4u, result.tsxs);
+  EXPECT_EQ(6u, result.throttled);
+  EXPECT_EQ(0u, result.declined);
+  EXPECT_EQ(6u, app_server.stats().snapshot().counters[AppServerStats::THROTTLED]);
+  EXPECT_EQ(4u, app_server.stats().snapshot().calls[AppServerStats::INITIAL_REQUEST]);
+}
+
+
+/// Test that transactions that suspend themselves are resumed, and those
+/// that wait for timers have them fired, so that they complete.
+TEST_F(TraceReplayTest, ReplayAsyncAndTimers)
+{
+  std::string data = build_trace();
+  TraceFile trace(_pool->factory);
+  trace.parse(data.data(), data.size());
+
+  DummyAppServer<DummyAsyncASTsx> async_server("async");
+  TraceReplayer replayer(_pool->factory, trace);
+  TraceReplayer::Result result = replayer.replay(async_server, 2, 5);
+
+  EXPECT_EQ(10u, result.tsxs);
+  EXPECT_EQ(0u, result.msgs_leaked);
+  AppServerStats::Snapshot stats = async_server.stats().snapshot();
+  EXPECT_EQ(10u, stats.calls[AppServerStats::RESUME]);
+  EXPECT_EQ(10u, stats.counters[AppServerStats::SEND_REQUEST]);
+  EXPECT_EQ(15u, stats.calls[AppServerStats::RESPONSE]);
+
+  DummyAppServer<DelayASTsx> delay_server("delay");
+  result = replayer.replay(delay_server, 2, 5);
+
+  EXPECT_EQ(10u, result.tsxs);
+  EXPECT_EQ(0u, result.msgs_leaked);
+  stats = delay_server.stats().snapshot();
+  EXPECT_EQ(10u, stats.counters[AppServerStats::SCHEDULE_TIMER]);
+  EXPECT_EQ(10u, stats.counters[AppServerStats::SEND_REQUEST]);
+  EXPECT_EQ(15u, stats.calls[AppServerStats::RESPONSE]);
+}
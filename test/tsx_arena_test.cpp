@@ -0,0 +1,102 @@
+/**
+ * @file tsx_arena_test.cpp UT for pooled AppServerTsx allocation.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "appserver.h"
+#include "tsx_arena.h"
+
+using namespace std;
+
+/// Pooled AppServerTsx used by the tests.
+class PooledASTsx : public AppServerTsx, public PooledAppServerTsx<PooledASTsx>
+{
+public:
+  PooledASTsx(int value) : AppServerTsx(), _value(value) {}
+  int _value;
+};
+
+/// Subclass of a pooled AppServerTsx with a different size.
+class BiggerPooledASTsx : public PooledASTsx
+{
+public:
+  BiggerPooledASTsx() : PooledASTsx(0) {}
+  char _padding[64];
+};
+
+
+/// Test that objects are recycled through the arena when deleted through
+/// the AppServerTsx base class, and that the statistics track them.
+TEST(TsxArenaTest, Recycle)
+{
+  TsxArenaStats before = PooledASTsx::arena_stats();
+
+  AppServerTsx* tsx1 = new PooledASTsx(1);
+  EXPECT_EQ(before.live + 1, PooledASTsx::arena_stats().live);
+  delete tsx1;
+
+  AppServerTsx* tsx2 = new PooledASTsx(2);
+  EXPECT_EQ(tsx1, tsx2);
+  EXPECT_EQ(2, ((PooledASTsx*)tsx2)->_value);
+  delete tsx2;
+
+  TsxArenaStats after = PooledASTsx::arena_stats();
+  EXPECT_EQ(before.live, after.live);
+  EXPECT_GE(after.high_water, before.live + 1);
+  EXPECT_GE(after.arena_bytes, sizeof(PooledASTsx));
+}
+
+
+/// Test that subclasses of a different size do not use the arena.
+TEST(TsxArenaTest, Subclass)
+{
+  TsxArenaStats before = PooledASTsx::arena_stats();
+  AppServerTsx* tsx = new BiggerPooledASTsx();
+  EXPECT_EQ(before.live, PooledASTsx::arena_stats().live);
+  delete tsx;
+}
+
+
+/// Test that objects may be freed on a different thread from the one that
+/// allocated them, and that the arena does not grow without bound when they
+/// are.
+TEST(TsxArenaTest, CrossThread)
+{
+  const int num_tsxs = 10000;
+  vector<AppServerTsx*> tsxs(num_tsxs);
+
+  for (int round = 0; round < 5; ++round)
+  {
+    thread allocator([&]() {
+      for (int ii = 0; ii < num_tsxs; ++ii)
+      {
+        tsxs[ii] = new PooledASTsx(ii);
+      }
+    });
+    allocator.join();
+
+    thread deallocator([&]() {
+      for (int ii = 0; ii < num_tsxs; ++ii)
+      {
+        delete tsxs[ii];
+      }
+    });
+    deallocator.join();
+  }
+
+  TsxArenaStats stats = PooledASTsx::arena_stats();
+  EXPECT_EQ(0u, stats.live);
+  // The high water mark is sampled, so may miss the last batch allocated.
+  EXPECT_GE(stats.high_water, (uint64_t)num_tsxs - 64);
+  EXPECT_LT(stats.arena_bytes, 2 * num_tsxs * sizeof(PooledASTsx) + 4096);
+}
@@ -0,0 +1,124 @@
+/**
+ * @file tsx_scratch_test.cpp UT for per-transaction scratch memory.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "appserver.h"
+#include "tsx_scratch.h"
+
+using namespace std;
+
+/// AppServerTsx that builds some scratch data for each request.
+class ScratchASTsx : public AppServerTsx
+{
+public:
+  ScratchASTsx() : AppServerTsx() {}
+
+  void build_targets(int num)
+  {
+    TsxScratch& arena = scratch();
+    ScratchVector<ScratchString> targets(arena);
+    for (int ii = 0; ii < num; ++ii)
+    {
+      ScratchString target("sip:", arena);
+      target.append(to_string(6505550000 + ii).c_str()).append("@homedomain;transport=TCP");
+      targets.push_back(target);
+    }
+    EXPECT_EQ("sip:6505550001@homedomain;transport=TCP", targets[1]);
+  }
+};
+
+
+/// Test that allocations are aligned, distinct and counted.
+TEST(TsxScratchTest, Allocate)
+{
+  TsxScratch scratch(256);
+  EXPECT_EQ(0u, scratch.reserved());
+
+  char* c = (char*)scratch.allocate(1, 1);
+  uint64_t* u = scratch.allocate_array<uint64_t>(4);
+  EXPECT_EQ(0u, (uintptr_t)u % alignof(uint64_t));
+  EXPECT_GE((char*)u, c + 1);
+  EXPECT_EQ(256u, scratch.reserved());
+  EXPECT_GE(scratch.used(), 33u);
+
+  const char* str = scratch.strdup("6505551234", 4);
+  EXPECT_STREQ("6505", str);
+
+  // A large allocation grows the arena.
+  void* big = scratch.allocate(1000);
+  memset(big, 0, 1000);
+  EXPECT_GE(scratch.reserved(), 1256u);
+  size_t high_water = scratch.high_water();
+  EXPECT_GE(high_water, 1038u);
+
+  scratch.release();
+  EXPECT_EQ(0u, scratch.used());
+  EXPECT_EQ(0u, scratch.reserved());
+  EXPECT_EQ(high_water, scratch.high_water());
+
+  // The arena can be reused after being released.
+  EXPECT_STREQ("abc", scratch.strdup("abc", 3));
+}
+
+
+/// Test that blocks grow geometrically, so the working set stays in a few
+/// contiguous blocks.
+TEST(TsxScratchTest, Growth)
+{
+  TsxScratch scratch(1024);
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    scratch.allocate(100);
+  }
+  EXPECT_GE(scratch.high_water(), 100000u);
+  EXPECT_LT(scratch.reserved(), 4 * scratch.high_water());
+}
+
+
+/// Test that requests too big to represent fail rather than allocating a
+/// truncated size.
+TEST(TsxScratchTest, Overflow)
+{
+  TsxScratch scratch;
+  EXPECT_THROW(scratch.allocate_array<uint64_t>(SIZE_MAX / 4), std::bad_alloc);
+  EXPECT_THROW(scratch.allocate(SIZE_MAX - 4), std::bad_alloc);
+  EXPECT_EQ(0u, scratch.used());
+  EXPECT_TRUE(scratch.allocate_array<uint64_t>(4) != NULL);
+}
+
+
+/// Test using the arena for STL containers within a transaction, and that
+/// its high-water mark is reported in the AppServer's statistics.
+TEST(TsxScratchTest, AppServerTsx)
+{
+  AppServerStats stats;
+  {
+    ScratchASTsx tsx;
+    tsx.set_stats(&stats);
+    tsx.build_targets(10);
+  }
+  {
+    ScratchASTsx tsx;
+    tsx.set_stats(&stats);
+  }
+
+  AppServerStats::Snapshot snap = stats.snapshot();
+  uint64_t recorded = 0;
+  for (int ii = 0; ii < AppServerStats::NUM_BUCKETS; ++ii)
+  {
+    recorded += snap.scratch_bytes[ii];
+  }
+  EXPECT_EQ(1u, recorded);
+  EXPECT_GT(snap.max_scratch_bytes, 400u);
+  EXPECT_EQ(0, snap.live_tsxs);
+}